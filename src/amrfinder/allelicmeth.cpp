@@ -27,6 +27,7 @@
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
+#include <memory>
 
 #include <cmath>
 #include <sstream>
@@ -38,6 +39,8 @@
 #include "MSite.hpp"
 
 #include "Epiread.hpp"
+#include "GenomeIndex.hpp"
+#include "MappedFasta.hpp"
 
 using std::string;
 using std::vector;
@@ -49,6 +52,7 @@ using std::unordered_set;
 using std::max;
 using std::min;
 using std::runtime_error;
+using std::unique_ptr;
 
 static inline double
 log_sum_log(const double p, const double q) {
@@ -168,6 +172,18 @@ convert_coordinates(const string &chrom, vector<MSite> &sites) {
 }
 
 
+// same as above, but the CpG positions are from a genome index
+static void
+convert_coordinates(const GenomeIndex::chrom_view &chrom,
+                    vector<MSite> &sites) {
+  for (size_t i = 0; i < sites.size(); ++i) {
+    if (sites[i].pos >= chrom.n_cpgs())
+      throw runtime_error("failed converting site:\n" + sites[i].tostring());
+    sites[i].pos = chrom.cpg_select(sites[i].pos);
+  }
+}
+
+
 template <typename T>
 void
 add_cytosine(const string &chrom_name, const size_t start_cpg,
@@ -193,6 +209,15 @@ process_chrom(const string &chrom_name, const vector<epiread> &epireads,
 }
 
 
+static size_t
+count_cpgs(const string &chrom) {
+  size_t cpg_count = 0;
+  for (size_t j = 0; j + 1 < chrom.size(); ++j)
+    cpg_count += (chrom[j] == 'C' && chrom[j+1] == 'G');
+  return cpg_count;
+}
+
+
 static void
 update_chroms_seen(const string &chrom_name,
                    unordered_set<string> &chroms_seen) {
@@ -230,8 +255,8 @@ main_allelicmeth(int argc, const char **argv) {
     OptionParser opt_parse(strip_path(argv[0]), description, "<epireads>");
     opt_parse.add_opt("output", 'o', "output file name (default: stdout)",
                       false, outfile);
-    opt_parse.add_opt("chrom", 'c', "genome sequence file/directory",
-                      true, chroms_dir);
+    opt_parse.add_opt("chrom", 'c', "genome sequence file/directory "
+                      "or genome index", true, chroms_dir);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -255,28 +280,34 @@ main_allelicmeth(int argc, const char **argv) {
     const string epi_file(leftover_args.front());
     /****************** END COMMAND LINE OPTIONS *****************/
 
+    // with a genome index the chroms are not loaded, and with a plain
+    // FASTA file each one is copied from the mapped file when needed
+    unique_ptr<GenomeIndex> index;
+    unique_ptr<MappedFasta> fasta;
     vector<string> chrom_names;
     vector<string> chroms;
-    read_fasta_file_short_names(chroms_dir, chrom_names, chroms);
-    for (auto &&i: chroms)
-      transform(begin(i), end(i), begin(i),
-                [](const char c) { return std::toupper(c); });
+    if (GenomeIndex::is_genome_index(chroms_dir)) {
+      index.reset(new GenomeIndex(chroms_dir));
+      chrom_names = index->chrom_names();
+    }
+    else if (MappedFasta::can_map(chroms_dir)) {
+      fasta.reset(new MappedFasta(chroms_dir));
+      chrom_names = fasta->chrom_names();
+    }
+    else {
+      read_fasta_file_short_names(chroms_dir, chrom_names, chroms);
+      for (auto &&i: chroms)
+        transform(begin(i), end(i), begin(i),
+                  [](const char c) { return std::toupper(c); });
+    }
 
     // lookup to map chrom names to chrom sequences
     unordered_map<string, size_t> chrom_lookup;
     for (size_t i = 0; i < chrom_names.size(); ++i)
       chrom_lookup.insert(make_pair(chrom_names[i], i));
 
-    unordered_map<string, size_t> chrom_sizes;
-    for (size_t i = 0; i < chrom_names.size(); ++i) {
-      size_t cpg_count = 0;
-      for (size_t j = 0; j < chroms[i].size() - 1; ++j)
-        cpg_count += (chroms[i][j] == 'C' && chroms[i][j+1] == 'G');
-      chrom_sizes.insert(make_pair(chrom_names[i], cpg_count));
-    }
-
     if (VERBOSE)
-      cerr << "number of chromosomes: " << chrom_sizes.size() << endl;
+      cerr << "number of chromosomes: " << chrom_names.size() << endl;
 
     std::ifstream in(epi_file);
     if (!in)
@@ -290,6 +321,29 @@ main_allelicmeth(int argc, const char **argv) {
     string chrom;
     epiread er;
     vector<epiread> epireads;
+
+    string chrom_seq; // the current chrom if from a mapped FASTA file
+    const auto process_and_write = [&](const string &chrom_name) {
+      const size_t chrom_idx = chrom_lookup[chrom_name];
+      if (fasta)
+        fasta->get_sequence(chrom_idx, chrom_seq);
+      const string &seq = (fasta || index) ? chrom_seq : chroms[chrom_idx];
+      const size_t n_cpgs =
+        index ? index->chrom(chrom_idx).n_cpgs() : count_cpgs(seq);
+      vector<PairStateCounter<uint32_t>> counts(n_cpgs - 1);
+      vector<MSite> cytosines;
+      process_chrom(chrom_name, epireads, cytosines, counts);
+      if (index)
+        convert_coordinates(index->chrom(chrom_idx), cytosines);
+      else
+        convert_coordinates(seq, cytosines);
+      for (size_t i = 0; i < cytosines.size() - 1; ++i) {
+        out << cytosines[i].chrom << "\t"
+            << cytosines[i].pos << "\t+\tCpG\t"
+            << cytosines[i].context << endl;
+      }
+    };
+
     while (in >> er) {
       if (er.chr != chrom) {
         update_chroms_seen(er.chr, chroms_seen);
@@ -298,35 +352,15 @@ main_allelicmeth(int argc, const char **argv) {
         if (VERBOSE)
           cerr << "[processing " << er.chr << "]" << endl;
 
-        if (!chrom.empty()) {
-          vector<PairStateCounter<uint32_t>> counts(chrom_sizes[chrom] - 1);
-          vector<MSite> cytosines;
-          process_chrom(chrom, epireads, cytosines, counts);
-          const size_t chrom_idx = chrom_lookup[chrom];
-          convert_coordinates(chroms[chrom_idx], cytosines);
-          for (size_t i = 0; i < cytosines.size()-1; ++i) {
-            out << cytosines[i].chrom << "\t"
-                << cytosines[i].pos << "\t+\tCpG\t"
-                << cytosines[i].context << endl;
-          }
-        }
+        if (!chrom.empty())
+          process_and_write(chrom);
         epireads.clear();
       }
       epireads.push_back(er);
       chrom.swap(er.chr);
     }
-    if (!chrom.empty()) {
-      vector<PairStateCounter<uint32_t>> counts(chrom_sizes[chrom] - 1);
-      vector<MSite> cytosines;
-      process_chrom(chrom, epireads, cytosines, counts);
-      const size_t chrom_idx = chrom_lookup[chrom];
-      convert_coordinates(chroms[chrom_idx], cytosines);
-      for (size_t i = 0; i < cytosines.size() - 1; ++i) {
-        out << cytosines[i].chrom << "\t"
-            << cytosines[i].pos << "\t+\tCpG\t"
-            << cytosines[i].context << endl;
-      }
-    }
+    if (!chrom.empty())
+      process_and_write(chrom);
   }
   catch (const runtime_error &e) {
     cerr << e.what() << endl;
@@ -336,5 +370,9 @@ main_allelicmeth(int argc, const char **argv) {
     cerr << "ERROR: could not allocate memory" << endl;
     return EXIT_FAILURE;
   }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
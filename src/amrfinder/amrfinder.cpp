@@ -28,6 +28,8 @@
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "EpireadStats.hpp"
+#include "GenomeIndex.hpp"
+#include "MappedFasta.hpp"
 #include "GenomicRegion.hpp"
 
 using std::string;
@@ -205,10 +207,64 @@ get_chrom(const string &chrom_name,
   chrom_region.set_chrom(chrom_name);
 }
 
+// the CpG positions are from a genome index, so no chrom is loaded
+static void
+convert_coordinates(const bool VERBOSE, const GenomeIndex &index,
+                    vector<GenomicRegion> &amrs) {
+  string chrom_name;
+  for (size_t i = 0; i < amrs.size(); ++i) {
+    if (amrs[i].get_chrom() != chrom_name) {
+      chrom_name = amrs[i].get_chrom();
+      if (VERBOSE)
+        cerr << "CONVERTING: " << chrom_name << endl;
+    }
+    const auto chrom = index.chrom(chrom_name);
+    if (amrs[i].get_start() >= chrom.n_cpgs() ||
+        amrs[i].get_end() >= chrom.n_cpgs())
+      throw runtime_error("could not convert:\n" + amrs[i].tostring());
+    amrs[i].set_start(chrom.cpg_select(amrs[i].get_start()));
+    amrs[i].set_end(chrom.cpg_select(amrs[i].get_end()));
+  }
+}
+
+
+// the chroms are copied one at a time from the mapped FASTA file
+static void
+convert_coordinates(const bool VERBOSE, const MappedFasta &fasta,
+                    vector<GenomicRegion> &amrs) {
+  unordered_map<size_t, size_t> cpgs;
+  string chrom_name, chrom;
+  for (size_t i = 0; i < amrs.size(); ++i) {
+    if (amrs[i].get_chrom() != chrom_name) {
+      chrom_name = amrs[i].get_chrom();
+      fasta.get_sequence(fasta.chrom_idx(chrom_name), chrom);
+      cpgs.clear();
+      collect_cpgs(chrom, cpgs);
+      if (VERBOSE)
+        cerr << "CONVERTING: " << chrom_name << endl;
+    }
+    convert_coordinates(cpgs, amrs[i]);
+  }
+}
+
+
 static void
 convert_coordinates(const bool VERBOSE, const string chroms_dir,
                     const string fasta_suffix, vector<GenomicRegion> &amrs) {
 
+  if (GenomeIndex::is_genome_index(chroms_dir)) {
+    const GenomeIndex index(chroms_dir);
+    convert_coordinates(VERBOSE, index, amrs);
+    return;
+  }
+
+  // ADS: a single FASTA file is not parsed again for each chrom
+  if (MappedFasta::can_map(chroms_dir)) {
+    const MappedFasta fasta(chroms_dir);
+    convert_coordinates(VERBOSE, fasta, amrs);
+    return;
+  }
+
   unordered_map<string, string> chrom_files;
   identify_and_read_chromosomes(chroms_dir, fasta_suffix, chrom_files);
   if (VERBOSE)
@@ -373,8 +429,8 @@ main_amrfinder(int argc, const char **argv) {
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), description, "<epireads>");
     opt_parse.add_opt("output", 'o', "output file", true, outfile);
-    opt_parse.add_opt("chrom", 'c', "genome sequence file/directory",
-                      true, chroms_dir);
+    opt_parse.add_opt("chrom", 'c', "genome sequence file/directory "
+                      "or genome index", true, chroms_dir);
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_itr);
     opt_parse.add_opt("window", 'w', "size of sliding window (in CpGs)",
                       false, window_size);
@@ -553,5 +609,9 @@ main_amrfinder(int argc, const char **argv) {
     cerr << "ERROR: could not allocate memory" << endl;
     return EXIT_FAILURE;
   }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
@@ -24,6 +24,7 @@
 #include <vector>
 #include <iostream>
 #include <stdexcept>
+#include <memory>
 
 #include <OptionParser.hpp>
 #include <smithlab_utils.hpp>
@@ -32,6 +33,7 @@
 
 #include "Epiread.hpp"
 #include "EpireadStats.hpp"
+#include "GenomeIndex.hpp"
 
 using std::streampos;
 using std::string;
@@ -41,6 +43,7 @@ using std::cerr;
 using std::endl;
 using std::unordered_map;
 using std::runtime_error;
+using std::unique_ptr;
 using std::begin;
 using std::end;
 
@@ -212,8 +215,8 @@ main_amrtester(int argc, const char **argv) {
     OptionParser opt_parse(strip_path(argv[0]), "resolve epi-alleles",
                            "<bed-regions> <mapped-reads>");
     opt_parse.add_opt("output", 'o', "output file", false, outfile);
-    opt_parse.add_opt("chrom", 'c', "genome sequence file/directory",
-                      true, chrom_file);
+    opt_parse.add_opt("chrom", 'c', "genome sequence file/directory "
+                      "or genome index", true, chrom_file);
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_itr);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     opt_parse.add_opt("progress", 'P', "print progress info", false, PROGRESS);
@@ -246,8 +249,13 @@ main_amrtester(int argc, const char **argv) {
     if (!validate_epiread_file(reads_file_name))
       throw runtime_error("invalid states file: " + reads_file_name);
 
+    // with a genome index the CpGs are taken from the index and no
+    // chromosome sequences are loaded
+    unique_ptr<GenomeIndex> index;
     vector<string> chrom_files;
-    if (isdir(chrom_file.c_str()))
+    if (GenomeIndex::is_genome_index(chrom_file))
+      index.reset(new GenomeIndex(chrom_file));
+    else if (isdir(chrom_file.c_str()))
       read_dir(chrom_file, fasta_suffix, chrom_files);
     else chrom_files.push_back(chrom_file);
 
@@ -308,10 +316,13 @@ main_amrtester(int argc, const char **argv) {
         if (VERBOSE)
           cerr << "processing " << chrom_name << endl;
 
-        get_chrom(chrom_name, all_chroms, chrom_lookup, chrom);
-
         cpg_positions.clear();
-        collect_cpgs(chrom, cpg_positions);
+        if (index)
+          index->chrom(chrom_name).get_cpgs(cpg_positions);
+        else {
+          get_chrom(chrom_name, all_chroms, chrom_lookup, chrom);
+          collect_cpgs(chrom, cpg_positions);
+        }
       }
 
       GenomicRegion converted_region(regions[i]);
@@ -343,5 +354,9 @@ main_amrtester(int argc, const char **argv) {
     cerr << "ERROR: could not allocate memory" << endl;
     return EXIT_FAILURE;
   }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
@@ -18,9 +18,9 @@
  */
 
 #include <algorithm>
-#include <fstream>
+#include <atomic>
 #include <iostream>
-#include <numeric>
+#include <limits>
 #include <stdexcept>
 #include <string>
 #include <unordered_set>
@@ -28,17 +28,20 @@
 
 #include "OptionParser.hpp"
 #include "bam_record_utils.hpp"
+#include "bsrate_tally.hpp"
 #include "bsutils.hpp"
 #include "dnmt_error.hpp"
+#include "indexed_reader.hpp"
+#include "read_stream.hpp"
+#include "stream_steps.hpp"
 #include "smithlab_utils.hpp"
 
 #include <bamxx.hpp>
 
-using std::accumulate;
+#include <htslib/sam.h>
+
 using std::cerr;
-using std::cout;
 using std::endl;
-using std::max;
 using std::numeric_limits;
 using std::runtime_error;
 using std::string;
@@ -48,191 +51,233 @@ using std::vector;
 
 using bamxx::bam_rec;
 
+// with a sample size, how many reads between checks for convergence
+static const size_t reads_per_check = 1 << 16;
+
+/* Count conversion at each position in the reads from "in" into the
+   tally. If "sample_size" is not zero, stop once at least that many
+   reads are counted and the conversion rate is within "precision".
+   The reads sampled are then the first in the file, so for sorted
+   input they are from the start of the genome only. */
 static void
-count_states_pos(const bool INCLUDE_CPGS, const string &chrom,
-                 const bam_rec &aln, vector<size_t> &unconv,
-                 vector<size_t> &conv, vector<size_t> &err, size_t &hanging) {
-  /* iterate through reference, query/read and fragment */
-  const auto seq = bam_get_seq(aln);
-  const auto beg_cig = bam_get_cigar(aln);
-  const auto end_cig = beg_cig + get_n_cigar(aln);
-  auto rpos = get_pos(aln);
-  auto qpos = 0;
-  auto fpos = 0;
-
-  const decltype(rpos) chrom_lim = chrom.size() - 1;
-
-  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
-    const auto op = bam_cigar_op(*c_itr);
-    const auto n = bam_cigar_oplen(*c_itr);
-    if (cigar_eats_ref(op) && cigar_eats_query(op)) {
-      const decltype(qpos) end_qpos = qpos + n;
-      for (; qpos < end_qpos; ++qpos, ++rpos, ++fpos) {
-        if (rpos > chrom_lim) ++hanging;
-        if (is_cytosine(chrom[rpos]) &&
-            (rpos >= chrom_lim || !is_guanine(chrom[rpos + 1]) ||
-             INCLUDE_CPGS)) {
-          const auto qc = seq_nt16_str[bam_seqi(seq, qpos)];
-          if (qc == 'C')
-            ++unconv[fpos];
-          else if (qc == 'T')
-            ++conv[fpos];
-          else if (qc != 'N')
-            ++err[fpos];
-        }
-      }
+tally_reads(const bool VERBOSE, const bool INCLUDE_CPGS,
+            const bool reads_are_a_rich, const string &seq_to_use,
+            const vector<string> &names, const vector<string> &chroms,
+            const bamxx::bam_header &hdr, read_source &in,
+            const size_t sample_size, const double precision,
+            bsrate_tally &tally) {
+  // map the bam header index for each "target" to a sequence in the
+  // reference genome
+  unordered_map<int32_t, size_t> chrom_lookup;
+  size_t chrom_idx_to_use = numeric_limits<size_t>::max();
+  for (size_t i = 0; i < chroms.size(); ++i) {
+    if (names[i] == seq_to_use) chrom_idx_to_use = i;
+    chrom_lookup.insert({sam_hdr_name2tid(hdr.h, names[i].data()), i});
+  }
+
+  int32_t current_tid = -1;
+  size_t chrom_idx = numeric_limits<size_t>::max();
+
+  bool use_this_chrom = seq_to_use.empty();
+
+  bam_rec aln;
+  unordered_set<int32_t> chroms_seen;
+
+  while (in.read(aln)) {
+
+    if (reads_are_a_rich) flip_conversion(aln);
+
+    // get the correct chrom if it has changed
+    if (get_tid(aln) != current_tid) {
+      const int32_t the_tid = get_tid(aln);
+
+      // make sure all reads from same chrom are contiguous in the file
+      if (chroms_seen.find(the_tid) != end(chroms_seen))
+        throw runtime_error("chroms out of order in mapped reads file");
+
+      current_tid = the_tid;
+
+      chroms_seen.insert(the_tid);
+
+      auto chrom_itr = chrom_lookup.find(the_tid);
+      if (chrom_itr == end(chrom_lookup))
+        throw runtime_error("could not find chrom: " + the_tid);
+
+      chrom_idx = chrom_itr->second;
+
+      if (VERBOSE) cerr << "processing " << names[chrom_idx] << endl;
+
+      use_this_chrom = seq_to_use.empty() || chrom_idx == chrom_idx_to_use;
     }
-    else {
-      if (cigar_eats_query(op)) qpos += n;
-      if (cigar_eats_ref(op)) rpos += n;
-      if (cigar_eats_frag(op)) fpos += n;
+
+    if (use_this_chrom) {
+      // do the work for this mapped read
+      tally.add(INCLUDE_CPGS, fasta_chrom(chroms[chrom_idx]), aln);
+      if (sample_size > 0 && tally.n_reads >= sample_size &&
+          tally.n_reads % reads_per_check == 0 && tally.converged(precision))
+        break;
     }
   }
+}
 
-  assert(qpos == get_l_qseq(aln));
+/* Count conversion at each position in the reads from "in", and
+   write the bsrate output. This is the part of bsrate that can also be
+   done on reads in memory (see pipeline.cpp). The chroms must be
+   upper case. */
+void
+bsrate_stream(const bool VERBOSE, const bool INCLUDE_CPGS,
+              const bool reads_are_a_rich, const string &seq_to_use,
+              const vector<string> &names, const vector<string> &chroms,
+              const bamxx::bam_header &hdr, read_source &in,
+              const string &outfile) {
+  bsrate_tally tally;
+  tally_reads(VERBOSE, INCLUDE_CPGS, reads_are_a_rich, seq_to_use, names,
+              chroms, hdr, in, 0, 0.0, tally);
+  tally.write(outfile);
+  tally.warn_hanging();
 }
 
+/* Count the reads that start in [beg, end) on chromosome "tid",
+   getting them through the index. Reads starting before "beg" belong
+   to the region before, so no read is counted twice. */
 static void
-count_states_neg(const bool INCLUDE_CPGS, const string &chrom,
-                 const bam_rec &aln, vector<size_t> &unconv,
-                 vector<size_t> &conv, vector<size_t> &err, size_t &hanging) {
-  /* iterate backward over query/read positions but forward over
-     reference and fragment positions */
-  const auto seq = bam_get_seq(aln);
-  const auto beg_cig = bam_get_cigar(aln);
-  const auto end_cig = beg_cig + get_n_cigar(aln);
-  auto rpos = get_pos(aln);
-  auto qpos = get_l_qseq(aln);
-  auto fpos = 0;
-
-  const decltype(rpos) chrom_lim = chrom.size() - 1;
-
-  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
-    const auto op = bam_cigar_op(*c_itr);
-    const auto n = bam_cigar_oplen(*c_itr);
-    if (cigar_eats_ref(op) && cigar_eats_query(op)) {
-      const decltype(qpos) end_qpos = qpos - n;
-      for (; qpos > end_qpos; --qpos, ++rpos, ++fpos) {
-        if (rpos > chrom_lim) ++hanging;
-        if (is_guanine(chrom[rpos]) &&
-            (rpos == 0 || !is_cytosine(chrom[rpos - 1]) || INCLUDE_CPGS)) {
-          const auto qc = seq_nt16_str[bam_seqi(seq, qpos - 1)];
-          if (qc == 'C')
-            ++unconv[fpos];
-          else if (qc == 'T')
-            ++conv[fpos];
-          else if (qc != 'N')
-            ++err[fpos];
-        }
-      }
-    }
-    else {
-      if (cigar_eats_query(op)) qpos -= n;
-      if (cigar_eats_ref(op)) rpos += n;
-      if (cigar_eats_frag(op)) fpos += n;
-    }
+tally_region_from_index(const bool INCLUDE_CPGS, const bool reads_are_a_rich,
+                        indexed_reader &in, const int32_t tid,
+                        const hts_pos_t beg, const hts_pos_t end,
+                        const string &chrom, bsrate_tally &tally) {
+  index_query reads(in, tid, beg, end);
+  bam_rec aln;
+  while (reads.next(aln)) {
+    if (get_pos(aln) < beg) continue;
+    if (reads_are_a_rich) flip_conversion(aln);
+    tally.add(INCLUDE_CPGS, fasta_chrom(chrom), aln);
+  }
+}
+
+/* The order to count regions when sampling, so that the regions
+   counted before stopping are spread over the whole genome instead of
+   being the first ones. Region i is put at the position given by
+   reversing the bits of i, so any number of regions from the start of
+   this order have about the same gaps between them. */
+template<class T> static void
+interleave(vector<T> &regions) {
+  size_t n_bits = 0;
+  while ((static_cast<size_t>(1) << n_bits) < regions.size()) ++n_bits;
+  vector<std::pair<size_t, size_t>> order;
+  for (size_t i = 0; i < regions.size(); ++i) {
+    size_t rev = 0;
+    for (size_t j = 0; j < n_bits; ++j)
+      rev |= ((i >> j) & 1) << (n_bits - 1 - j);
+    order.emplace_back(rev, i);
   }
-  assert(qpos == 0);
+  std::sort(begin(order), end(order));
+  vector<T> tmp;
+  for (auto &&i : order) tmp.push_back(regions[i.second]);
+  regions.swap(tmp);
 }
 
+/* This version gives each thread regions of the genome through the
+   index of the input BAM file. The tally for each region is added to
+   the total in the order of the regions, so the output is the same as
+   without threads, and with a sample size it stops after the same
+   region for any number of threads. With a sample size the regions
+   are in the order from "interleave", so the sample is not only from
+   the first chromosomes. */
 static void
-write_output(const string &outfile, const vector<size_t> &ucvt_count_p,
-             const vector<size_t> &cvt_count_p,
-             const vector<size_t> &ucvt_count_n,
-             const vector<size_t> &cvt_count_n, const vector<size_t> &err_p,
-             const vector<size_t> &err_n) {
-  // Get some totals first
-  const size_t pos_cvt = accumulate(begin(cvt_count_p), end(cvt_count_p), 0ul);
-  const size_t neg_cvt = accumulate(begin(cvt_count_n), end(cvt_count_n), 0ul);
-  const size_t total_cvt = pos_cvt + neg_cvt;
-
-  const size_t pos_ucvt =
-    accumulate(begin(ucvt_count_p), end(ucvt_count_p), 0ul);
-  const size_t neg_ucvt =
-    accumulate(begin(ucvt_count_n), end(ucvt_count_n), 0ul);
-  const size_t total_ucvt = pos_ucvt + neg_ucvt;
-
-  std::ofstream of;
-  if (!outfile.empty()) of.open(outfile.c_str());
-  std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
-  if (!out) throw dnmt_error("failed to open output file");
-
-  out << "OVERALL CONVERSION RATE = "
-      << static_cast<double>(total_cvt) / (total_cvt + total_ucvt) << endl
-      << "POS CONVERSION RATE = "
-      << static_cast<double>(pos_cvt) / (pos_cvt + pos_ucvt) << '\t'
-      << std::fixed << static_cast<size_t>(pos_cvt + pos_ucvt) << endl
-      << "NEG CONVERSION RATE = "
-      << static_cast<double>(neg_cvt) / (neg_cvt + neg_ucvt) << '\t'
-      << std::fixed << static_cast<size_t>(neg_cvt + neg_ucvt) << endl;
-
-  // clang-format off
-  out << "BASE" << '\t'
-      << "PTOT" << '\t'
-      << "PCONV" << '\t'
-      << "PRATE" << '\t'
-      << "NTOT" << '\t'
-      << "NCONV" << '\t'
-      << "NRATE" << '\t'
-      << "BTHTOT" << '\t'
-      << "BTHCONV" << '\t'
-      << "BTHRATE" << '\t'
-      << "ERR" << '\t'
-      << "ALL" << '\t'
-      << "ERRRATE"  << endl;
-  // clang-format on
-
-  // Figure out how many positions to print in the output, capped at 1000
-  size_t output_len = (ucvt_count_p.size() > 1000) ? 1000 : ucvt_count_p.size();
-
-  while (output_len > 0 &&
-         (ucvt_count_p[output_len - 1] + cvt_count_p[output_len - 1] +
-            ucvt_count_n[output_len - 1] + cvt_count_n[output_len - 1] ==
-          0))
-    --output_len;
-
-  // Now actually output the results
-  static const size_t precision_val = 5;
-  for (size_t i = 0; i < output_len; ++i) {
-    const size_t total_p = ucvt_count_p[i] + cvt_count_p[i];
-    const size_t total_n = ucvt_count_n[i] + cvt_count_n[i];
-    const size_t total_valid = total_p + total_n;
-    out << (i + 1) << "\t";
-
-    out.precision(precision_val);
-    out << total_p << '\t' << cvt_count_p[i] << '\t'
-        << static_cast<double>(cvt_count_p[i]) / max(size_t(1ul), total_p)
-        << '\t';
-
-    out.precision(precision_val);
-    out << total_n << '\t' << cvt_count_n[i] << '\t'
-        << static_cast<double>(cvt_count_n[i]) / max(size_t(1ul), total_n)
-        << '\t';
-
-    const double total_cvt = cvt_count_p[i] + cvt_count_n[i];
-    out.precision(precision_val);
-    out << static_cast<size_t>(total_valid) << '\t'
-        << cvt_count_p[i] + cvt_count_n[i] << '\t'
-        << total_cvt / max(1ul, total_valid) << '\t';
-
-    const double total_err = err_p[i] + err_n[i];
-    out.precision(precision_val);
-    const size_t total = total_valid + err_p[i] + err_n[i];
-    out << err_p[i] + err_n[i] << '\t' << static_cast<size_t>(total) << '\t'
-        << total_err / max(1ul, total) << endl;
+bsrate_by_region(const bool VERBOSE, const bool INCLUDE_CPGS,
+                 const bool reads_are_a_rich, const string &seq_to_use,
+                 const vector<string> &names, const vector<string> &chroms,
+                 const size_t n_threads, const string &infile,
+                 const size_t sample_size, const double precision,
+                 const string &outfile) {
+  // ADS: regions much smaller than a chromosome so the threads finish
+  // about the same time, and sampling can stop early
+  static const hts_pos_t region_size = 1 << 24;
+
+  bamxx::bam_in hts(infile);
+  if (!hts) throw dnmt_error("failed to open input file: " + infile);
+  bamxx::bam_header hdr(hts);
+  if (!hdr) throw dnmt_error("failed to read header");
+  indexed_reader::check_index(infile);
+
+  struct region {
+    int32_t tid;
+    size_t chrom_idx;
+    hts_pos_t beg;
+    hts_pos_t end;
+  };
+  vector<region> regions;
+  for (size_t i = 0; i < chroms.size(); ++i) {
+    if (!seq_to_use.empty() && names[i] != seq_to_use) continue;
+    const int32_t tid = sam_hdr_name2tid(hdr.h, names[i].data());
+    if (tid < 0) continue;  // no reads can map to this chrom
+    const hts_pos_t chrom_size = chroms[i].size();
+    for (hts_pos_t beg = 0; beg < chrom_size; beg += region_size)
+      regions.push_back({tid, i, beg, std::min(beg + region_size,
+                                               chrom_size)});
   }
+  std::sort(begin(regions), end(regions),
+            [](const region &a, const region &b) {
+              return a.tid < b.tid || (a.tid == b.tid && a.beg < b.beg);
+            });
+  if (sample_size > 0) interleave(regions);
+
+  bsrate_tally tally;
+  std::atomic<bool> done{false};
+
+  first_error errors;
+
+#pragma omp parallel num_threads(n_threads)
+  {
+    indexed_reader in(infile);
+    if (!in) errors.set("failed to load index: " + infile);
+
+#pragma omp for ordered schedule(dynamic, 1)
+    for (size_t i = 0; i < regions.size(); ++i) {
+      const region &r = regions[i];
+      bsrate_tally region_tally;
+      if (in && !done && !errors.failed()) {
+        try {
+          tally_region_from_index(INCLUDE_CPGS, reads_are_a_rich, in, r.tid,
+                                  r.beg, r.end, chroms[r.chrom_idx],
+                                  region_tally);
+        }
+        catch (const std::exception &e) {
+          errors.set(e.what());
+        }
+      }
+#pragma omp ordered
+      {
+        if (!done) {
+          if (VERBOSE && (r.beg == 0 || sample_size > 0))
+            cerr << "processing " << names[r.chrom_idx] << ":" << r.beg
+                 << "-" << r.end << endl;
+          tally += region_tally;
+          if (sample_size > 0 && tally.n_reads >= sample_size &&
+              tally.converged(precision))
+            done = true;
+        }
+      }
+    }
+  }
+  errors.check();
+
+  if (VERBOSE && sample_size > 0)
+    cerr << "[reads counted: " << tally.n_reads << "]" << endl;
+  tally.write(outfile);
+  tally.warn_hanging();
 }
 
 int
 main_bsrate(int argc, const char **argv) {
   try {
-    // ASSUMED MAXIMUM LENGTH OF A FRAGMENT
-    static const size_t output_size = 10000;
-
     bool VERBOSE = false;
     bool INCLUDE_CPGS = false;
     bool reads_are_a_rich = false;
+    bool by_region = false;
     size_t n_threads = 1;
+    size_t sample_size = 0;
+    double precision = 1e-4;
 
     string chroms_file;
     string outfile;
@@ -255,6 +300,13 @@ main_bsrate(int argc, const char **argv) {
     opt_parse.add_opt("a-rich", 'A', "reads are A-rich", false,
                       reads_are_a_rich);
     opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
+    opt_parse.add_opt("by-region", '\0', "process regions in parallel "
+                      "(requires indexed BAM input)", false, by_region);
+    opt_parse.add_opt("sample", '\0', "stop after at least this many reads "
+                      "once the rate is within the precision", false,
+                      sample_size);
+    opt_parse.add_opt("precision", '\0', "half width of 95% confidence "
+                      "interval for the rate when sampling", false, precision);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -275,6 +327,10 @@ main_bsrate(int argc, const char **argv) {
       cerr << opt_parse.help_message() << endl;
       return EXIT_SUCCESS;
     }
+    if (precision <= 0.0) {
+      cerr << "precision must be positive" << endl;
+      return EXIT_FAILURE;
+    }
     const string bam_file = leftover_args.front();
     /****************** END COMMAND LINE OPTIONS *****************/
 
@@ -288,6 +344,13 @@ main_bsrate(int argc, const char **argv) {
     if (VERBOSE)
       cerr << "[n chroms in reference: " << chroms.size() << "]" << endl;
 
+    if (by_region) {
+      bsrate_by_region(VERBOSE, INCLUDE_CPGS, reads_are_a_rich, seq_to_use,
+                       names, chroms, n_threads, bam_file, sample_size,
+                       precision, outfile);
+      return EXIT_SUCCESS;
+    }
+
     bamxx::bam_tpool tp(n_threads);
 
     bamxx::bam_in hts(bam_file);
@@ -298,79 +361,16 @@ main_bsrate(int argc, const char **argv) {
     if (n_threads > 1)
       tp.set_io(hts);
 
-    // map the bam header index for each "target" to a sequence in the
-    // reference genome
-    unordered_map<int32_t, size_t> chrom_lookup;
-    size_t chrom_idx_to_use = numeric_limits<size_t>::max();
-    for (size_t i = 0; i < chroms.size(); ++i) {
-      if (names[i] == seq_to_use) chrom_idx_to_use = i;
-      chrom_lookup.insert({sam_hdr_name2tid(hdr.h, names[i].data()), i});
-    }
-
-    vector<size_t> unconv_count_pos(output_size, 0ul);
-    vector<size_t> conv_count_pos(output_size, 0ul);
-    vector<size_t> unconv_count_neg(output_size, 0ul);
-    vector<size_t> conv_count_neg(output_size, 0ul);
-    vector<size_t> err_pos(output_size, 0ul);
-    vector<size_t> err_neg(output_size, 0ul);
-
-    int32_t current_tid = -1;
-    size_t chrom_idx = numeric_limits<size_t>::max();
-    size_t hanging = 0;
-
-    bool use_this_chrom = seq_to_use.empty();
-
-    bam_rec aln;
-    unordered_set<int32_t> chroms_seen;
-
-    while (hts.read(hdr, aln)) {
-
-      if (reads_are_a_rich) flip_conversion(aln);
-
-      // get the correct chrom if it has changed
-      if (get_tid(aln) != current_tid) {
-        const int32_t the_tid = get_tid(aln);
-
-        // make sure all reads from same chrom are contiguous in the file
-        if (chroms_seen.find(the_tid) != end(chroms_seen))
-          throw runtime_error("chroms out of order in mapped reads file");
-
-        current_tid = the_tid;
-
-        chroms_seen.insert(the_tid);
-
-        auto chrom_itr = chrom_lookup.find(the_tid);
-        if (chrom_itr == end(chrom_lookup))
-          throw runtime_error("could not find chrom: " + the_tid);
-
-        chrom_idx = chrom_itr->second;
-
-        if (VERBOSE) cerr << "processing " << names[chrom_idx] << endl;
-
-        use_this_chrom = seq_to_use.empty() || chrom_idx == chrom_idx_to_use;
-      }
-
-      if (use_this_chrom) {
-        // do the work for this mapped read
-        if (bam_is_rev(aln))
-          count_states_neg(INCLUDE_CPGS, chroms[chrom_idx], aln,
-                           unconv_count_neg, conv_count_neg, err_neg, hanging);
-        else
-          count_states_pos(INCLUDE_CPGS, chroms[chrom_idx], aln,
-                           unconv_count_pos, conv_count_pos, err_pos, hanging);
-      }
-    }
-    write_output(outfile, unconv_count_pos, conv_count_pos, unconv_count_neg,
-                 conv_count_neg, err_pos, err_neg);
-
-    if (hanging > 0)  // some overhanging reads
-      cerr << "Warning: hanging reads detected at chrom ends "
-           << "(N=" << hanging << ")" << endl
-           << "High numbers of hanging reads suggest mismatch "
-           << "between assembly provided here and that used for mapping"
-           << endl;
+    bam_file_source reads_in(hts, hdr);
+    bsrate_tally tally;
+    tally_reads(VERBOSE, INCLUDE_CPGS, reads_are_a_rich, seq_to_use, names,
+                chroms, hdr, reads_in, sample_size, precision, tally);
+    if (VERBOSE && sample_size > 0)
+      cerr << "[reads counted: " << tally.n_reads << "]" << endl;
+    tally.write(outfile);
+    tally.warn_hanging();
   }
-  catch (const runtime_error &e) {
+  catch (const std::exception &e) {
     cerr << e.what() << endl;
     return EXIT_FAILURE;
   }
@@ -30,7 +30,9 @@
 #include "OptionParser.hpp"
 
 #include "TwoStateHMM.hpp"
+#include "sample_segments.hpp"
 #include "MSite.hpp"
+#include "SiteTable.hpp"
 
 using std::string;
 using std::vector;
@@ -47,11 +49,9 @@ using std::to_string;
 using std::begin;
 using std::end;
 
-using bamxx::bgzf_file;
-
 static GenomicRegion
-as_gen_rgn(const MSite &s) {
-  return GenomicRegion(s.chrom, s.pos, s.pos + 1);
+as_gen_rgn(const SiteTable &s, const size_t i) {
+  return GenomicRegion(s.chrom(i), s.pos[i], s.pos[i] + 1);
 }
 
 static double
@@ -105,7 +105,7 @@ get_domain_scores_rep(const vector<bool> &state_ids,
 
 static void
 build_domains(const bool VERBOSE,
-              const vector<MSite> &cpgs,
+              const SiteTable &cpgs,
               const vector<double> &post_scores,
               const vector<size_t> &reset_points,
               const vector<bool> &state_ids,
@@ -128,7 +128,7 @@ build_domains(const bool VERBOSE,
     if (state_ids[i]) {
       if (!in_domain) {
         in_domain = true;
-        domains.push_back(as_gen_rgn(cpgs[i]));
+        domains.push_back(as_gen_rgn(cpgs, i));
         domains.back().set_name("HYPO" + to_string(n_domains++));
       }
       ++n_cpgs;
@@ -141,7 +141,7 @@ build_domains(const bool VERBOSE,
       n_cpgs = 0;
       score = 0;
     }
-    prev_end = cpgs[i].pos + 1;
+    prev_end = cpgs.pos[i] + 1;
   }
 }
 
@@ -150,7 +150,7 @@ template <class T, class U>
 static void
 separate_regions(const bool VERBOSE,
                  const size_t desert_size,
-                 vector<MSite> &cpgs,
+                 SiteTable &cpgs,
                  vector<vector<T> > &meth,
                  vector<vector<U> > &reads,
                  vector<size_t> &reset_points) {
@@ -160,14 +160,18 @@ separate_regions(const bool VERBOSE,
   // eliminate the zero-read cpg sites if no coverage in any replicates
   const size_t n_reps = meth.size();
 
-  size_t j = 0;
-  for (size_t i = 0; i < cpgs.size(); ++i) {
-    bool has_data = true;
+  const auto has_data = [&](const size_t i) {
+    bool r = true;
     for (size_t rep_idx = 0; rep_idx < n_reps; ++rep_idx)
-      has_data = (has_data && reads[rep_idx][i] > 0);
+      r = (r && reads[rep_idx][i] > 0);
+    return r;
+  };
 
-    if (has_data) {
-      cpgs[j] = cpgs[i];
+  cpgs.filter(has_data);
+  size_t j = 0;
+  const size_t n_sites = reads.empty() ? 0 : reads.front().size();
+  for (size_t i = 0; i < n_sites; ++i) {
+    if (has_data(i)) {
       for (size_t r = 0; r < n_reps; ++r) {
         meth[r][j] = meth[r][i];
         reads[r][j] = reads[r][i];
@@ -176,20 +180,18 @@ separate_regions(const bool VERBOSE,
     }
   }
 
-  cpgs.erase(begin(cpgs) + j, end(cpgs));
   for (size_t r = 0; r < n_reps; ++r) {
     meth[r].erase(begin(meth[r]) + j, end(meth[r]));
     reads[r].erase(begin(reads[r]) + j, end(reads[r]));
   }
 
   // segregate cpgs
-  size_t prev_cpg = 0;
-  for (size_t i = 0; i < cpgs.size(); ++i) {
-    const size_t dist = (i > 0 && cpgs[i].chrom == cpgs[i - 1].chrom) ?
-      cpgs[i].pos - prev_cpg : numeric_limits<size_t>::max();
-    if (dist > desert_size)
-      reset_points.push_back(i);
-    prev_cpg = cpgs[i].pos;
+  for (size_t r = 0; r < cpgs.n_runs(); ++r) {
+    // the first CpG on each chrom starts a new region
+    reset_points.push_back(cpgs.run_begin(r));
+    for (size_t i = cpgs.run_begin(r) + 1; i < cpgs.run_end(r); ++i)
+      if (cpgs.pos[i] - cpgs.pos[i - 1] > desert_size)
+        reset_points.push_back(i);
   }
   reset_points.push_back(cpgs.size());
 
@@ -296,26 +298,19 @@ write_params_file(const string &outfile,
 }
 
 static void
-load_cpgs(const string &cpgs_file, vector<MSite> &cpgs,
+load_cpgs(const string &cpgs_file, SiteTable &cpgs,
           vector<pair<double, double> > &meth,
           vector<uint32_t> &reads) {
-
-  bgzf_file in(cpgs_file, "r");
-  if (!in) throw runtime_error("failed opening file: " + cpgs_file);
-
-  MSite the_site;
-  while (read_site(in, the_site)) {
-    cpgs.push_back(the_site);
-    reads.push_back(the_site.n_reads);
-    meth.push_back(make_pair(the_site.n_meth(), the_site.n_unmeth()));
-  }
+  load_site_table(cpgs_file, cpgs);
+  cpgs.get_meth(meth);
+  cpgs.get_reads(reads);
 }
 
 static void
 check_consistent_sites(const string &expected_filename,
-                       const vector<MSite> &expected,
+                       const SiteTable &expected,
                        const string &observed_filename,
-                       const vector<MSite> &observed) {
+                       const SiteTable &observed) {
   if (expected.size() != observed.size()) {
     std::ostringstream err_msg;
     err_msg << "inconsistent number of sites" << endl
@@ -354,10 +349,14 @@ main_hmr_rep(int argc, const char **argv) {
 
     size_t desert_size = 1000;
     size_t max_iterations = 10;
+    size_t n_threads = 1;
     size_t rng_seed = 408;
+    size_t train_sites = 0;
 
     // run mode flags
     bool VERBOSE = false;
+    bool SCALED = false;
+    bool ACCELERATE = false;
 
     const double tolerance = 1e-10; // corrections for small values
 
@@ -379,7 +378,12 @@ main_hmr_rep(int argc, const char **argv) {
     opt_parse.add_opt("desert", 'd', "max dist btwn cpgs with reads in HMR",
                       false, desert_size);
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_iterations);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    opt_parse.add_opt("scaled", '\0', "scaled probabilities in the HMM "
+                      "instead of logs (faster)", false, SCALED);
+    opt_parse.add_opt("accelerate", '\0', "accelerate training with "
+                      "SQUAREM (fewer iterations)", false, ACCELERATE);
     opt_parse.add_opt("post-hypo", '\0', "output file for single-CpG posteiror "
                       "hypomethylation probability (default: NULL)",
                       false, hypo_post_outfile);
@@ -392,6 +396,9 @@ main_hmr_rep(int argc, const char **argv) {
     opt_parse.add_opt("params-out", 'p', "write HMM parameters to this file",
                       false, params_out_file);
     opt_parse.add_opt("seed", 's', "specify random seed", false, rng_seed);
+    opt_parse.add_opt("train-sites", '\0', "train on random parts of the "
+                      "genome with at least this many CpGs, then decode "
+                      "all (default: all)", false, train_sites);
     opt_parse.set_show_defaults();
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -423,7 +430,7 @@ main_hmr_rep(int argc, const char **argv) {
 
     const size_t n_reps = cpgs_files.size();
 
-    vector<MSite> cpgs;
+    SiteTable cpgs;
     vector<vector<pair<double, double> > > meth(n_reps);
     vector<vector<uint32_t> > reads(n_reps);
 
@@ -432,7 +439,7 @@ main_hmr_rep(int argc, const char **argv) {
     for (size_t i = 0; i < n_reps; ++i) {
       if (VERBOSE)
         cerr << "[filename=" << cpgs_files[i] << "]" << endl;
-      vector<MSite> curr_rep;
+      SiteTable curr_rep;
       load_cpgs(cpgs_files[i], curr_rep, meth[i], reads[i]);
       if (VERBOSE)
         cerr << "[total_cpgs=" << curr_rep.size() << "]" << endl
@@ -440,7 +447,7 @@ main_hmr_rep(int argc, const char **argv) {
              << get_mean(begin(reads[i]), end(reads[i])) << "]" << endl;
       if (i > 0)
         check_consistent_sites(cpgs_files[0], cpgs, cpgs_files[i], curr_rep);
-      else swap(cpgs, curr_rep);
+      else cpgs = std::move(curr_rep);
     }
 
     // separate the regions by chrom and by desert, and eliminate
@@ -449,7 +456,8 @@ main_hmr_rep(int argc, const char **argv) {
     separate_regions(VERBOSE, desert_size, cpgs, meth, reads, reset_points);
 
     /****************** initalize params *****************/
-    const TwoStateHMM hmm(tolerance, max_iterations, VERBOSE);
+    const TwoStateHMM hmm(tolerance, max_iterations, VERBOSE, n_threads,
+                          SCALED, ACCELERATE);
     vector<double> fg_alpha(n_reps), fg_beta(n_reps);
     vector<double> bg_alpha(n_reps), bg_beta(n_reps);
     double fdr_cutoff = std::numeric_limits<double>::max();
@@ -477,7 +485,21 @@ main_hmr_rep(int argc, const char **argv) {
       }
     }
 
-    if (max_iterations > 0)
+    if (max_iterations > 0 && train_sites > 0 &&
+        train_sites < meth.front().size()) {
+      vector<size_t> train_idx, train_reset_points;
+      sample_segments(reset_points, train_sites, rng_seed,
+                      train_idx, train_reset_points);
+      vector<vector<pair<double, double> > > train_meth(n_reps);
+      for (size_t i = 0; i < n_reps; ++i)
+        select_sites(train_idx, meth[i], train_meth[i]);
+      if (VERBOSE)
+        cerr << "[training_cpgs=" << train_idx.size() << "]" << endl;
+      hmm.BaumWelchTraining(train_meth, train_reset_points,
+                            f_to_b_trans, b_to_f_trans,
+                            fg_alpha, fg_beta, bg_alpha, bg_beta);
+    }
+    else if (max_iterations > 0)
       hmm.BaumWelchTraining(meth, reset_points, f_to_b_trans, b_to_f_trans,
                             fg_alpha, fg_beta, bg_alpha, bg_beta);
 
@@ -531,7 +553,7 @@ main_hmr_rep(int argc, const char **argv) {
           m_reads += meth[j][i].first;
           u_reads += meth[j][i].second;
         }
-        GenomicRegion cpg(as_gen_rgn(cpgs[i]));
+        GenomicRegion cpg(as_gen_rgn(cpgs, i));
         cpg.set_name("CpG:" + to_string(m_reads) + ":" + to_string(u_reads));
         cpg.set_score(posteriors[i]);
         out << cpg << '\n';
@@ -548,7 +570,7 @@ main_hmr_rep(int argc, const char **argv) {
           m_reads += meth[j][i].first;
           u_reads += meth[j][i].second;
         }
-        GenomicRegion cpg(as_gen_rgn(cpgs[i]));
+        GenomicRegion cpg(as_gen_rgn(cpgs, i));
         cpg.set_name("CpG:" + to_string(m_reads) + ":" + to_string(u_reads));
         cpg.set_score(1.0 - posteriors[i]);
         out << cpg << '\n';
@@ -32,7 +32,9 @@
 #include "OptionParser.hpp"
 
 #include "TwoStateHMM.hpp"
+#include "sample_segments.hpp"
 #include "MSite.hpp"
+#include "SiteTable.hpp"
 
 using std::string;
 using std::vector;
@@ -48,11 +50,9 @@ using std::runtime_error;
 using std::to_string;
 using std::unordered_set;
 
-using bamxx::bgzf_file;
-
 static GenomicRegion
-as_gen_rgn(const MSite &s) {
-  return GenomicRegion(s.chrom, s.pos, s.pos + 1);
+as_gen_rgn(const SiteTable &s, const size_t i) {
+  return GenomicRegion(s.chrom(i), s.pos[i], s.pos[i] + 1);
 }
 
 static string
@@ -111,7 +111,7 @@ get_domain_scores(const vector<bool> &state_ids,
 
 static void
 build_domains(const bool VERBOSE,
-              const vector<MSite> &cpgs,
+              const SiteTable &cpgs,
               const vector<double> &post_scores,
               const vector<size_t> &reset_points,
               const vector<bool> &state_ids,
@@ -134,7 +134,7 @@ build_domains(const bool VERBOSE,
     if (state_ids[i]) { // currently in an hmr
       if (!in_domain) {
         in_domain = true;
-        domains.push_back(as_gen_rgn(cpgs[i]));
+        domains.push_back(as_gen_rgn(cpgs, i));
         domains.back().set_name("HYPO" + to_string(domains.size()));
       }
       ++n_cpgs;
@@ -147,7 +147,7 @@ build_domains(const bool VERBOSE,
       n_cpgs = 0;
       score = 0;
     }
-    prev_end = cpgs[i].pos + 1;
+    prev_end = cpgs.pos[i] + 1;
   }
   if (in_domain) {
     domains.back().set_end(prev_end);
@@ -160,40 +160,37 @@ template <class T, class U>
 static void
 separate_regions(const bool VERBOSE,
                  const size_t desert_size,
-                 vector<MSite> &cpgs,
+                 SiteTable &cpgs,
                  vector<T> &meth, vector<U> &reads,
                  vector<size_t> &reset_points) {
   if (VERBOSE)
     cerr << "[separating by cpg desert]" << endl;
   // eliminate the zero-read cpgs
+  cpgs.filter([&](const size_t i) {return reads[i] > 0;});
   size_t j = 0;
-  for (size_t i = 0; i < cpgs.size(); ++i)
+  for (size_t i = 0; i < reads.size(); ++i)
     if (reads[i] > 0) {
-      cpgs[j] = cpgs[i];
       meth[j] = meth[i];
       reads[j] = reads[i];
       ++j;
     }
-  cpgs.erase(begin(cpgs) + j, end(cpgs));
   meth.erase(begin(meth) + j, end(meth));
   reads.erase(begin(reads) + j, end(reads));
 
   double total_bases = 0;
   double bases_in_deserts = 0;
   // segregate cpgs
-  size_t prev_pos = 0;
-  for (size_t i = 0; i < cpgs.size(); ++i) {
-    const size_t dist = (i > 0 && cpgs[i].chrom == cpgs[i - 1].chrom) ?
-      cpgs[i].pos - prev_pos : numeric_limits<size_t>::max();
-    if (dist > desert_size) {
-      reset_points.push_back(i);
-      if (dist < numeric_limits<size_t>::max())
+  for (size_t r = 0; r < cpgs.n_runs(); ++r) {
+    // the first CpG on each chrom starts a new region
+    reset_points.push_back(cpgs.run_begin(r));
+    for (size_t i = cpgs.run_begin(r) + 1; i < cpgs.run_end(r); ++i) {
+      const size_t dist = cpgs.pos[i] - cpgs.pos[i - 1];
+      if (dist > desert_size) {
+        reset_points.push_back(i);
         bases_in_deserts += dist;
-    }
-    if (dist<numeric_limits<size_t>::max())
+      }
       total_bases += dist;
-
-    prev_pos = cpgs[i].pos;
+    }
   }
   reset_points.push_back(cpgs.size());
 
@@ -307,22 +304,25 @@ write_params_file(const string &outfile,
 }
 
 static void
-load_cpgs(const string &cpgs_file, vector<MSite> &cpgs,
+load_cpgs(const string &cpgs_file, SiteTable &cpgs,
           vector<pair<double, double> > &meth,
           vector<uint32_t> &reads) {
 
-  bgzf_file in(cpgs_file, "r");
-  if (!in) throw runtime_error("failed opening file: " + cpgs_file);
-
-  MSite prev_site, the_site;
-  while (read_site(in, the_site)) {
-    if (!the_site.is_cpg() || distance(prev_site, the_site) < 2)
-      throw runtime_error("error: input is not symmetric-CpGs: " + cpgs_file);
-    cpgs.push_back(the_site);
-    reads.push_back(the_site.n_reads);
-    meth.push_back(make_pair(the_site.n_meth(), the_site.n_unmeth()));
-    prev_site = the_site;
-  }
+  load_site_table(cpgs_file, cpgs);
+
+  for (size_t r = 0; r < cpgs.n_runs(); ++r)
+    for (size_t i = cpgs.run_begin(r); i < cpgs.run_end(r); ++i) {
+      bool too_close = false;
+      if (i > cpgs.run_begin(r)) {
+        const size_t a = cpgs.pos[i - 1], b = cpgs.pos[i];
+        too_close = max(a, b) - min(a, b) < 2;
+      }
+      if (cpgs.context[i] != msite_context::cpg || too_close)
+        throw runtime_error("error: input is not symmetric-CpGs: " + cpgs_file);
+    }
+
+  cpgs.get_meth(meth);
+  cpgs.get_reads(reads);
 }
 
 template <class InputIterator> static double
@@ -330,39 +330,25 @@ get_mean(InputIterator first, InputIterator last) {
   return accumulate(first, last, 0.0)/std::distance(first, last);
 }
 
-template<class T> static void
-check_sorted_within_chroms(T first, const T last) {
-
-  // empty, or a single element
-  if (first == last || first + 1 == last) return;
-
-  unordered_set<string> chroms_seen;
-  string cur_chrom = "";
-
-  for (auto fast = first + 1; fast != last; ++fast, ++first) {
-    if (fast->chrom != cur_chrom) {
-      if (chroms_seen.find(fast->chrom) != end(chroms_seen)) {
-        throw runtime_error(
-          "input not grouped by chromosomes. "
-          "Error in the following line:\n" +
-          fast->tostring()
-        );
-
-      }
-      cur_chrom = fast->chrom;
-      chroms_seen.insert(cur_chrom);
-      // don't check ordering if chroms have changed
-    }
-    else { // first and fast are in the same chrom
-      if (first->pos >= fast->pos) {
+static void
+check_sorted_within_chroms(const SiteTable &cpgs) {
+  unordered_set<uint32_t> chroms_seen;
+  for (size_t r = 0; r < cpgs.n_runs(); ++r) {
+    if (chroms_seen.find(cpgs.run_chrom_id(r)) != end(chroms_seen))
+      throw runtime_error(
+        "input not grouped by chromosomes. "
+        "Error in the following line:\n" +
+        cpgs.get_site(cpgs.run_begin(r)).tostring()
+      );
+    chroms_seen.insert(cpgs.run_chrom_id(r));
+    for (size_t i = cpgs.run_begin(r) + 1; i < cpgs.run_end(r); ++i)
+      if (cpgs.pos[i - 1] >= cpgs.pos[i])
         throw runtime_error(
           "input file not sorted properly. "
           "Error in the following lines:\n" +
-          first->tostring() + "\n" +
-          fast->tostring()
+          cpgs.get_site(i - 1).tostring() + "\n" +
+          cpgs.get_site(i).tostring()
         );
-      }
-    }
   }
 }
 
@@ -377,10 +363,14 @@ main_hmr(int argc, const char **argv) {
 
     size_t desert_size = 1000;
     size_t max_iterations = 10;
+    size_t n_threads = 1;
     size_t rng_seed = 408;
+    size_t train_sites = 0;
 
     // run mode flags
     bool VERBOSE = false;
+    bool SCALED = false;
+    bool ACCELERATE = false;
     bool PARTIAL_METH = false;
 
     // corrections for small values
@@ -405,7 +395,12 @@ main_hmr(int argc, const char **argv) {
     opt_parse.add_opt("desert", 'd', "max dist btwn covered cpgs in HMR",
                       false, desert_size);
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_iterations);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    opt_parse.add_opt("scaled", '\0', "scaled probabilities in the HMM "
+                      "instead of logs (faster)", false, SCALED);
+    opt_parse.add_opt("accelerate", '\0', "accelerate training with "
+                      "SQUAREM (fewer iterations)", false, ACCELERATE);
     opt_parse.add_opt("partial", '\0', "identify PMRs instead of HMRs",
                       false, PARTIAL_METH);
     opt_parse.add_opt("post-hypo", '\0', "output file for single-CpG posterior "
@@ -419,6 +414,9 @@ main_hmr(int argc, const char **argv) {
     opt_parse.add_opt("params-out", 'p', "write HMM parameters to this "
                       "file (default: none)", false, params_out_file);
     opt_parse.add_opt("seed", 's', "specify random seed", false, rng_seed);
+    opt_parse.add_opt("train-sites", '\0', "train on random parts of the "
+                      "genome with at least this many CpGs, then decode "
+                      "all (default: all)", false, train_sites);
     opt_parse.set_show_defaults();
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -443,7 +441,7 @@ main_hmr(int argc, const char **argv) {
     /****************** END COMMAND LINE OPTIONS *****************/
 
     // separate the regions by chrom and by desert
-    vector<MSite> cpgs;
+    SiteTable cpgs;
     vector<pair<double, double> > meth;
     vector<uint32_t> reads;
     if (VERBOSE)
@@ -452,7 +450,7 @@ main_hmr(int argc, const char **argv) {
 
     if (VERBOSE)
       cerr << "[checking if input is properly formatted]" << endl;
-    check_sorted_within_chroms(begin(cpgs), end(cpgs));
+    check_sorted_within_chroms(cpgs);
     if (PARTIAL_METH)
       make_partial_meth(reads, meth);
 
@@ -466,7 +464,8 @@ main_hmr(int argc, const char **argv) {
     vector<size_t> reset_points;
     separate_regions(VERBOSE, desert_size, cpgs, meth, reads, reset_points);
 
-    const TwoStateHMM hmm(tolerance, max_iterations, VERBOSE);
+    const TwoStateHMM hmm(tolerance, max_iterations, VERBOSE, n_threads,
+                          SCALED, ACCELERATE);
 
     double p_fb = 0.25;
     double p_bf = 0.25;
@@ -489,7 +488,18 @@ main_hmr(int argc, const char **argv) {
       bg_beta = 0.33*n_reads;
     }
 
-    if (max_iterations > 0)
+    if (max_iterations > 0 && train_sites > 0 && train_sites < meth.size()) {
+      vector<size_t> train_idx, train_reset_points;
+      sample_segments(reset_points, train_sites, rng_seed,
+                      train_idx, train_reset_points);
+      vector<pair<double, double> > train_meth;
+      select_sites(train_idx, meth, train_meth);
+      if (VERBOSE)
+        cerr << "[training_cpgs=" << train_meth.size() << "]" << endl;
+      hmm.BaumWelchTraining(train_meth, train_reset_points, p_fb, p_bf,
+                            fg_alpha, fg_beta, bg_alpha, bg_beta);
+    }
+    else if (max_iterations > 0)
       hmm.BaumWelchTraining(meth, reset_points, p_fb, p_bf,
                             fg_alpha, fg_beta, bg_alpha, bg_beta);
 
@@ -536,7 +546,7 @@ main_hmr(int argc, const char **argv) {
         cerr << "[writing=" << hypo_post_outfile << "]" << endl;
       std::ofstream out(hypo_post_outfile);
       for (size_t i = 0; i < cpgs.size(); ++i) {
-        GenomicRegion cpg(as_gen_rgn(cpgs[i]));
+        GenomicRegion cpg(as_gen_rgn(cpgs, i));
         cpg.set_name(format_cpg_meth_tag(meth[i]));
         cpg.set_score(posteriors[i]);
         out << cpg << '\n';
@@ -548,7 +558,7 @@ main_hmr(int argc, const char **argv) {
       if (VERBOSE)
         cerr << "[writing=" << meth_post_outfile << "]" << endl;
       for (size_t i = 0; i < cpgs.size(); ++i) {
-        GenomicRegion cpg(as_gen_rgn(cpgs[i]));
+        GenomicRegion cpg(as_gen_rgn(cpgs, i));
         cpg.set_name(format_cpg_meth_tag(meth[i]));
         cpg.set_score(1.0 - posteriors[i]);
         out << cpg << '\n';
@@ -30,7 +30,9 @@
 #include "GenomicRegion.hpp"
 #include "MSite.hpp"
 #include "OptionParser.hpp"
+#include "SiteTable.hpp"
 #include "ThreeStateHMM.hpp"
+#include "sample_segments.hpp"
 #include "smithlab_os.hpp"
 #include "smithlab_utils.hpp"
 
@@ -54,54 +56,41 @@ using std::ofstream;
 using std::ostream_iterator;
 
 static GenomicRegion
-as_gen_rgn(const MSite &s) {
-  return GenomicRegion(s.chrom, s.pos, s.pos + 1);
+as_gen_rgn(const SiteTable &s, const size_t i) {
+  return GenomicRegion(s.chrom(i), s.pos[i], s.pos[i] + 1);
 }
 
 static void
-load_cpgs(const string &cpgs_file, vector<MSite> &cpgs,
+load_cpgs(const string &cpgs_file, SiteTable &cpgs,
           vector<pair<double, double>> &meth) {
-  bamxx::bgzf_file in(cpgs_file, "r");
-  if (!in) throw runtime_error("failed opening file: " + cpgs_file);
-
-  MSite the_site;
-  string line;
-  while (getline(in, line)) cpgs.push_back(MSite(line));
-
-  meth.resize(cpgs.size());
-  for (size_t i = 0; i < cpgs.size(); ++i)
-    meth[i] = make_pair(cpgs[i].n_meth(), cpgs[i].n_unmeth());
+  load_site_table(cpgs_file, cpgs);
+  cpgs.get_meth(meth);
 }
 
 template<class T> static void
-separate_regions(const size_t desert_size, vector<MSite> &cpgs, vector<T> &meth,
+separate_regions(const size_t desert_size, SiteTable &cpgs, vector<T> &meth,
                  vector<size_t> &reset_points, size_t &total_bases,
                  size_t &bases_in_deserts) {
   // eliminate the zero-read cpgs
   size_t j = 0;
   for (size_t i = 0; i < cpgs.size(); ++i)
-    if (cpgs[i].n_reads > 0) {
-      cpgs[j] = cpgs[i];
-      meth[j] = meth[i];
-      ++j;
-    }
-  cpgs.erase(begin(cpgs) + j, end(cpgs));
+    if (cpgs.n_reads(i) > 0) meth[j++] = meth[i];
   meth.erase(begin(meth) + j, end(meth));
+  cpgs.filter([&](const size_t i) {return cpgs.n_reads(i) > 0;});
 
   total_bases = 0;
   bases_in_deserts = 0;
-  size_t prev_pos = 0;
-  for (size_t i = 0; i < cpgs.size(); ++i) {
-    const size_t dist = (i > 0 && cpgs[i].chrom == cpgs[i - 1].chrom)
-                          ? cpgs[i].pos - prev_pos
-                          : numeric_limits<size_t>::max();
-    if (dist > desert_size) {
-      reset_points.push_back(i);
-      if (dist < numeric_limits<size_t>::max()) bases_in_deserts += dist;
+  for (size_t r = 0; r < cpgs.n_runs(); ++r) {
+    // the first CpG on each chrom starts a new region
+    reset_points.push_back(cpgs.run_begin(r));
+    for (size_t i = cpgs.run_begin(r) + 1; i < cpgs.run_end(r); ++i) {
+      const size_t dist = cpgs.pos[i] - cpgs.pos[i - 1];
+      if (dist > desert_size) {
+        reset_points.push_back(i);
+        bases_in_deserts += dist;
+      }
+      total_bases += dist;
     }
-    if (dist < numeric_limits<size_t>::max()) total_bases += dist;
-
-    prev_pos = cpgs[i].pos;
   }
   reset_points.push_back(cpgs.size());
 }
@@ -142,7 +131,7 @@ write_params_file(const string &params_file, const betabin &hypo_emission,
 }
 
 static void
-build_domains(const bool VERBOSE, const vector<MSite> &cpgs,
+build_domains(const bool VERBOSE, const SiteTable &cpgs,
               const vector<pair<double, double>> &meth,
               const vector<size_t> &reset_points,
               const vector<STATE_LABELS> &classes,
@@ -153,7 +142,7 @@ build_domains(const bool VERBOSE, const vector<MSite> &cpgs,
     const size_t start = reset_points[i];
     const size_t end = reset_points[i + 1];
 
-    GenomicRegion domain(as_gen_rgn(cpgs[start]));
+    GenomicRegion domain(as_gen_rgn(cpgs, start));
     STATE_LABELS prev_state = classes[start];
     size_t n = 1;
     double meth_sum =
@@ -166,7 +155,7 @@ build_domains(const bool VERBOSE, const vector<MSite> &cpgs,
         meth_sum += meth[j].first / (meth[j].first + meth[j].second);
       }
       else {
-        domain.set_end(cpgs[j - 1].pos + 1);
+        domain.set_end(cpgs.pos[j - 1] + 1);
         const string label = (prev_state == hypo ? "hypo" : "hyper");
         domain.set_name(label + ":" + std::to_string(n));
         domain.set_score(meth_sum);
@@ -174,13 +163,13 @@ build_domains(const bool VERBOSE, const vector<MSite> &cpgs,
         if (prev_state == HYPER || prev_state == HYPO)
           domains.push_back(domain);
 
-        domain = GenomicRegion(as_gen_rgn(cpgs[j]));
+        domain = GenomicRegion(as_gen_rgn(cpgs, j));
         n = 1;
         prev_state = classes[j];
         meth_sum = meth[j].first / (meth[j].first + meth[j].second);
       }
     }
-    domain.set_end(cpgs[end - 1].pos + 1);
+    domain.set_end(cpgs.pos[end - 1] + 1);
     const string label = (prev_state == hypo ? "hypo" : "hyper");
     domain.set_name(label + ":" + std::to_string(n));
     domain.set_score(meth_sum);
@@ -223,9 +212,12 @@ main_hypermr(int argc, const char **argv) {
 
     size_t desert_size = 1000;
     size_t max_iterations = 10;
+    size_t train_sites = 0;
+    size_t rng_seed = 408;
 
     // run mode flags
     bool VERBOSE = false;
+    bool ACCELERATE = false;
 
     // corrections for small values (not parameters):
     double tolerance = 1e-10;
@@ -245,6 +237,8 @@ main_hypermr(int argc, const char **argv) {
                       tolerance);
     opt_parse.add_opt("desert", 'd', "desert size", false, desert_size);
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_iterations);
+    opt_parse.add_opt("accelerate", '\0', "accelerate training with "
+                      "SQUAREM (fewer iterations)", false, ACCELERATE);
     opt_parse.add_opt("viterbi", 'V', "Use Viterbi decoding", false,
                       USE_VITERBI_DECODING);
     opt_parse.add_opt("min-meth", 'M',
@@ -255,6 +249,11 @@ main_hypermr(int argc, const char **argv) {
                       params_in_file);
     opt_parse.add_opt("params-out", 'p', "parameters ouptut file", false,
                       params_out_file);
+    opt_parse.add_opt("train-sites", '\0', "train on random parts of the "
+                      "genome with at least this many CpGs, then decode "
+                      "all (default: all)", false, train_sites);
+    opt_parse.add_opt("seed", '\0', "random seed for picking the parts "
+                      "to train on", false, rng_seed);
     opt_parse.set_show_defaults();
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -279,13 +278,13 @@ main_hypermr(int argc, const char **argv) {
     /****************** END COMMAND LINE OPTIONS *****************/
 
     if (VERBOSE) cerr << "[loading_data]" << endl;
-    vector<MSite> cpgs;
+    SiteTable cpgs;
     vector<pair<double, double>> meth;
     load_cpgs(cpgs_file, cpgs, meth);
     const size_t n_sites = cpgs.size();
 
     double mean_cov = 0.0;
-    for (auto &&c : cpgs) mean_cov += c.n_reads;
+    for (size_t i = 0; i < n_sites; ++i) mean_cov += cpgs.n_reads(i);
     mean_cov /= n_sites;
 
     if (VERBOSE)
@@ -306,8 +305,6 @@ main_hypermr(int argc, const char **argv) {
            << "[remaining_genome_fraction=" << 1.0 - des_frac << "]" << endl;
     }
 
-    ThreeStateHMM hmm(meth, reset_points, tolerance, max_iterations, VERBOSE);
-
     vector<vector<double>> trans;
     initialize_transitions(trans);
 
@@ -328,6 +325,27 @@ main_hypermr(int argc, const char **argv) {
       HYPO_emission = hypo_emission;
     }
 
+    if (max_iterations > 0 && train_sites > 0 && train_sites < meth.size()) {
+      // ADS: the model for training is gone before the full one is made
+      vector<size_t> train_idx, train_reset_points;
+      sample_segments(reset_points, train_sites, rng_seed,
+                      train_idx, train_reset_points);
+      vector<pair<double, double>> train_meth;
+      select_sites(train_idx, meth, train_meth);
+      if (VERBOSE)
+        cerr << "[training_sites=" << train_meth.size() << "]" << endl;
+      ThreeStateHMM train_hmm(train_meth, train_reset_points, tolerance,
+                              max_iterations, VERBOSE, ACCELERATE);
+      train_hmm.set_parameters(hypo_emission, HYPER_emission, HYPO_emission,
+                               trans);
+      train_hmm.BaumWelchTraining();
+      train_hmm.get_parameters(hypo_emission, HYPER_emission, HYPO_emission,
+                               trans);
+      max_iterations = 0;
+    }
+
+    ThreeStateHMM hmm(meth, reset_points, tolerance, max_iterations, VERBOSE,
+                      ACCELERATE);
     hmm.set_parameters(hypo_emission, HYPER_emission, HYPO_emission, trans);
     if (max_iterations > 0) hmm.BaumWelchTraining();
     hmm.get_parameters(hypo_emission, HYPER_emission, HYPO_emission, trans);
@@ -364,7 +382,7 @@ main_hypermr(int argc, const char **argv) {
       hmm.get_state_posteriors(scores);
       ofstream score_out(scores_file);
       for (size_t i = 0; i < cpgs.size(); ++i) {
-        score_out << cpgs[i] << "\t";
+        score_out << cpgs.get_site(i) << "\t";
         if (classes[i] == hypo)
           score_out << "hypo\n" << scores[i].hypo << endl;
         else if (classes[i] == HYPER)
@@ -20,22 +20,36 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <fstream>
 #include <numeric>
 #include <sstream>
 #include <stdexcept>
 #include <unordered_set>
+#include <map>
+#include <memory>
+#include <limits>
 #include <cstdint> // for [u]int[0-9]+_t
 
 #include "OptionParser.hpp"
+#include "smithlab_os.hpp"
 // #include "GenomicRegion.hpp"
 /* ADS: This code writes MSite objects to files, but does not use
    MSite to do it. Possiby dangerous, but currently much faster. If
    MSite has a way to serialize into a char[] directly, then we should
    use it. */
-// #include "MSite.hpp"
+#include "MSite.hpp"
+#include "LevelsCounter.hpp"
 #include "bsutils.hpp"
 #include "dnmt_error.hpp"
 #include "bam_record_utils.hpp"
+#include "GenomeIndex.hpp"
+#include "MappedFasta.hpp"
+#include "line_buffer.hpp"
+#include "BinaryMethylome.hpp"
+#include "read_stream.hpp"
+#include "stream_steps.hpp"
+#include "bsrate_tally.hpp"
+#include "indexed_reader.hpp"
 
 /* HTSlib */
 #include <htslib/sam.h>
@@ -46,34 +60,17 @@ using std::cerr;
 using std::endl;
 using std::unordered_set;
 using std::unordered_map;
+using std::map;
 
 using bamxx::bam_rec;
 
-struct quick_buf : public std::ostringstream,
-                   public std::basic_stringbuf<char> {
-  // ADS: By user ecatmur on SO; very fast. Seems to work...
-  quick_buf() {
-    // ...but this seems to depend on data layout
-    static_cast<std::basic_ios<char>&>(*this).rdbuf(this);
-  }
-  void clear() {
-    // reset buffer pointers (member functions)
-    setp(pbase(), pbase());
-  }
-  char const* c_str() {
-    /* between c_str and insertion make sure to clear() */
-    *pptr() = '\0';
-    return pbase();
-  }
-};
 
-
-// ADS: we should never have to worry about coverage over > 32767 in
-// any downstream analysis, so using "int16_t" here would allow to
-// detect wrap around and report it as some kind of weird thing, maybe
-// zeroing it and flagging the output. As it is now, if we really need
-// >65535-fold coverage, we can make the change here.
-typedef uint16_t count_type;
+// ADS: the counts kept for every position are 8-bit so most sites take
+// little memory. When one of these is about to wrap, its value is
+// carried into a sparse table of full width counts for that site (see
+// CountWindow below), so very deep coverage is still counted exactly.
+typedef uint8_t count_type;
+static const count_type max_count = std::numeric_limits<count_type>::max();
 
 
 static inline bool
@@ -84,104 +81,48 @@ static inline bool
 eats_query(const uint32_t c) {return bam_cigar_type(bam_cigar_op(c)) & 1;}
 
 
-/* The three functions below here should probably be moved into
-   bsutils.hpp. I am not sure if the DDG function is needed, but it
-   seems like if one considers strand, and the CHH is not symmetric,
-   then one needs this. Also, Qiang should be consulted on this
-   because he spent much time thinking about it in the context of
-   plants. */
-static bool
-is_chh(const std::string &s, size_t i) {
-  return (i < (s.length() - 2)) &&
-    is_cytosine(s[i]) &&
-    !is_guanine(s[i + 1]) &&
-    !is_guanine(s[i + 2]);
-}
-
-
-static bool
-is_ddg(const std::string &s, size_t i) {
-  return (i < (s.length() - 2)) &&
-    !is_cytosine(s[i]) &&
-    !is_cytosine(s[i + 1]) &&
-    is_guanine(s[i + 2]);
-}
-
+/* CountSet is the compact set of counts stored for each position as
+   reads are processed. Only the counters are here; the counting and
+   everything computed from the counts goes through SiteCounts. */
+struct CountSet {
+  count_type pA{0}, pC{0}, pG{0}, pT{0};
+  count_type nA{0}, nC{0}, nG{0}, nT{0};
+  // count_type N; /* this wasn't used and breaks alignment */
+};
 
-static bool
-is_c_at_g(const std::string &s, size_t i) {
-  return (i < (s.length() - 2)) &&
-    is_cytosine(s[i]) &&
-    !is_cytosine(s[i + 1]) &&
-    !is_guanine(s[i + 1]) &&
-    is_guanine(s[i + 2]);
-}
 
+/* SiteCounts has the full counts for a site: the compact counts plus
+   anything that was carried into the overflow table. */
+struct SiteCounts {
+  SiteCounts() {}
+  explicit SiteCounts(const CountSet &cs) :
+    pA{cs.pA}, pC{cs.pC}, pG{cs.pG}, pT{cs.pT},
+    nA{cs.nA}, nC{cs.nC}, nG{cs.nG}, nT{cs.nT} {}
 
-/* Right now the CountSet objects below are much larger than they need
-   to be, for the things we are computing. However, it's not clear
-   that the minimum information would really put the memory
-   requirement of the program into a more reasonable range, so keeping
-   all the information seems reasonable. */
-struct CountSet {
+  SiteCounts &operator+=(const SiteCounts &rhs) {
+    pA += rhs.pA; pC += rhs.pC; pG += rhs.pG; pT += rhs.pT;
+    nA += rhs.nA; nC += rhs.nC; nG += rhs.nG; nT += rhs.nT;
+    return *this;
+  }
 
   string tostring() const {
     std::ostringstream oss;
     oss << pA << '\t' << pC << '\t' << pG << '\t' << pT << '\t'
         << nA << '\t' << nC << '\t' << nG << '\t' << nT;
-    // << '\t' << N; /* not used */
     return oss.str();
   }
-  void add_count_pos(const char x) {
-    if (x == 'T') ++pT; // conditions ordered for efficiency
-    else if (x == 'C') ++pC;
-    else if (x == 'G') ++pG;
-    else if (x == 'A') ++pA;
-    // else ++N; /* not used */
-  }
-  void add_count_neg(const char x) {
-    if (x == 'T') ++nT; // conditions ordered for efficiency(??)
-    else if (x == 'C') ++nC;
-    else if (x == 'G') ++nG;
-    else if (x == 'A') ++nA;
-    // else ++N; /* not used */
-  }
-  count_type pos_total() const {return pA + pC + pG + pT;}
-  count_type neg_total() const {return nA + nC + nG + nT;}
-
-  count_type unconverted_cytosine() const {return pC;}
-  count_type converted_cytosine() const {return pT;}
-  count_type unconverted_guanine() const {return nC;}
-  count_type converted_guanine() const {return nT;}
 
-  count_type pA{0}, pC{0}, pG{0}, pT{0};
-  count_type nA{0}, nC{0}, nG{0}, nT{0};
-  // count_type N; /* this wasn't used and breaks alignment */
-};
+  uint32_t pos_total() const {return pA + pC + pG + pT;}
+  uint32_t neg_total() const {return nA + nC + nG + nT;}
 
+  uint32_t unconverted_cytosine() const {return pC;}
+  uint32_t converted_cytosine() const {return pT;}
+  uint32_t unconverted_guanine() const {return nC;}
+  uint32_t converted_guanine() const {return nT;}
 
-/* The "tag" returned by this function should be exclusive, so that
- * the order of checking conditions doesn't matter. There is also a
- * bit of a hack in that the unsigned "pos" could wrap, but this still
- * works as long as the chromosome size is not the maximum size of a
- * size_t.
- */
-static uint32_t
-get_tag_from_genome(const string &s, const size_t pos) {
-  if (is_cytosine(s[pos])) {
-    if (is_cpg(s, pos)) return 0;
-    else if (is_chh(s, pos)) return 1;
-    else if (is_c_at_g(s, pos)) return 2;
-    else return 3;
-  }
-  if (is_guanine(s[pos])) {
-    if (is_cpg(s, pos - 1)) return 0;
-    else if (is_ddg(s, pos - 2)) return 1;
-    else if (is_c_at_g(s, pos - 2)) return 2;
-    else return 3;
-  }
-  return 4; // shouldn't be used for anything
-}
+  uint32_t pA{0}, pC{0}, pG{0}, pT{0};
+  uint32_t nA{0}, nC{0}, nG{0}, nT{0};
+};
 
 
 /* This "has_mutated" function looks on the opposite strand to see
@@ -189,9 +130,9 @@ get_tag_from_genome(const string &s, const size_t pos) {
  * DNA because of a mutation or SNP.
  */
 static bool
-has_mutated(const char base, const CountSet &cs) {
+has_mutated(const bool is_c, const SiteCounts &cs) {
   static const double MUTATION_DEFINING_FRACTION = 0.5;
-  return is_cytosine(base) ?
+  return is_c ?
     (cs.nG < MUTATION_DEFINING_FRACTION*(cs.neg_total())) :
     (cs.pG < MUTATION_DEFINING_FRACTION*(cs.pos_total()));
 }
@@ -238,42 +179,342 @@ tag_with_mut(const uint32_t tag, const bool mut) {
 }
 
 
-static void
-write_output(const bamxx::bam_header &hdr, bamxx::bgzf_file &out,
-             const int32_t tid, const string &chrom,
-             const vector<CountSet> &counts, bool CPG_ONLY) {
+/* The chroms are given to the code below by a "chrom source" through
+   get(idx), which returns a fasta_chrom or chrom_view. With chrom_list
+   all chroms are already in memory, as from a genome index or a FASTA
+   file read at once. With lazy_chroms only one chrom is in memory: it
+   is copied from the mapped FASTA file when asked for and replaced by
+   the next one, so a chrom from get(idx) is only good until get is
+   used for another chrom. Each thread must use its own copy. */
+template<class C> struct chrom_list {
+  explicit chrom_list(const vector<C> &chroms) : chroms{&chroms} {}
+  const C &get(const size_t idx) {return (*chroms)[idx];}
+  const vector<C> *chroms;
+};
+
+
+struct lazy_chroms {
+  explicit lazy_chroms(const MappedFasta &fasta) : fasta{&fasta} {}
+  fasta_chrom get(const size_t idx) {
+    if (idx != curr) {
+      fasta->get_sequence(idx, seq);
+      curr = idx;
+    }
+    return fasta_chrom(seq);
+  }
+  const MappedFasta *fasta;
+  string seq;
+  size_t curr{std::numeric_limits<size_t>::max()};
+};
+
+
+/* extra_outputs are made from the same sites as the counts output, so
+   they need no more passes over the data: the symmetric CpG sites as
+   from "sym" and the summary from "levels". Each site is read back
+   from its line of text, exactly as those commands would read it from
+   the counts file, so the results are the same. The conversion rate
+   as from "bsrate" is made from the reads, as they are counted. */
+struct extra_outputs {
+  extra_outputs(const string &sym_file, const string &levels_file,
+                const string &bsrate_file) :
+    levels_file{levels_file}, bsrate_file{bsrate_file},
+    cytosines("cytosines"), cpg("cpg"),
+    cpg_symmetric("cpg_symmetric"), chh("chh"), ccg("ccg"), cxg("cxg") {
+    if (!sym_file.empty()) {
+      sym.reset(new bamxx::bgzf_file(sym_file,
+                                     has_gz_ext(sym_file) ? "w" : "wu"));
+      if (!*sym) throw dnmt_error("error opening output file: " + sym_file);
+    }
+    if (!bsrate_file.empty())
+      bsrate.reset(new bsrate_tally);
+  }
+
+  // same as bsrate without "-all"; reads from counts are T-rich
+  template<class C> void
+  add_read(const C &chrom, const bam_rec &aln) {
+    if (bsrate) bsrate->add(false, chrom, aln);
+  }
+
+  // true if the sites are needed, not only the reads
+  bool uses_sites() const {return sym || !levels_file.empty();}
+
+  void add(const char *line, const char *line_end) {
+    if (!site.initialize(line, line_end))
+      throw dnmt_error("bad site: " + string(line, line_end));
+    if (sym) add_symmetric();
+    if (!levels_file.empty()) add_levels();
+  }
+
+  // same as process_sites in symmetric-cpgs
+  void add_symmetric() {
+    if (site.is_cpg()) {
+      if (sym_prev_is_cpg && site.is_mate_of(sym_prev)) {
+        sym_prev.add(site);
+        write_site(*sym, sym_prev);
+      }
+      sym_prev_is_cpg = true;
+    }
+    else sym_prev_is_cpg = false;
+    sym_prev = site;
+  }
+
+  // same as the loop in levels; this changes "site"
+  void add_levels() {
+    cytosines.update(site);
+    if (site.is_cpg()) {
+      cpg.update(site);
+      if (site.is_mate_of(levels_prev)) {
+        site.add(levels_prev);
+        cpg_symmetric.update(site);
+      }
+    }
+    else if (site.is_chh()) chh.update(site);
+    else if (site.is_ccg()) ccg.update(site);
+    else if (site.is_cxg()) cxg.update(site);
+    else throw dnmt_error("bad site context: " + site.context);
+    levels_prev = site;
+  }
+
+  // write the levels summary and the conversion rate; the symmetric
+  // sites are already written
+  void close() {
+    if (bsrate) {
+      bsrate->write(bsrate_file);
+      bsrate->warn_hanging();
+    }
+    if (levels_file.empty()) return;
+    std::ofstream out(levels_file);
+    if (!out) throw dnmt_error("bad output file: " + levels_file);
+    out << cytosines << endl
+        << cpg << endl
+        << cpg_symmetric << endl
+        << chh << endl
+        << ccg << endl
+        << cxg << endl;
+  }
+
+  std::unique_ptr<bamxx::bgzf_file> sym;
+  string levels_file;
+  string bsrate_file;
+  std::unique_ptr<bsrate_tally> bsrate;
+
+  MSite site;
+  MSite sym_prev;
+  bool sym_prev_is_cpg{false};
+  MSite levels_prev;
+  LevelsCounter cytosines, cpg, cpg_symmetric, chh, ccg, cxg;
+};
+
+
+/* site_output is where the sites go: lines of text in a file that
+   might be compressed, or records in a binary methylome, and also to
+   any extra outputs. */
+struct site_output {
+  site_output(const string &outfile, const bool compress_output,
+              const bool binary_output) {
+    if (binary_output)
+      binary.reset(new BinaryMethylomeWriter(outfile));
+    else {
+      text.reset(new bamxx::bgzf_file(outfile, compress_output ? "w" : "wu"));
+      if (!*text) throw dnmt_error("error opening output file: " + outfile);
+    }
+  }
+  void close() {if (binary) binary->close();}
+
+  std::unique_ptr<bamxx::bgzf_file> text;
+  std::unique_ptr<BinaryMethylomeWriter> binary;
+  extra_outputs *extra{nullptr};
+};
+
 
-  quick_buf buf; // keep underlying buffer space?
+/* Write output for positions [start, stop) in the chromosome; the
+   "counts" can be anything that gives the SiteCounts for a position
+   in the chromosome, and "chrom" is a fasta_chrom or chrom_view. */
+template<class T, class C> static void
+write_output(const bamxx::bam_header &hdr, site_output &out,
+             const int32_t tid, const C &chrom, const T &counts,
+             const size_t start, const size_t stop, bool CPG_ONLY) {
 
-  for (size_t i = 0; i < counts.size(); ++i) {
-    const char base = chrom[i];
-    if (is_cytosine(base) || is_guanine(base)) {
+  line_buffer buf;
+  const string chrom_name(out.binary ? sam_hdr_tid2name(hdr, tid) : "");
+  extra_outputs *extra = out.extra && out.extra->uses_sites() ?
+    out.extra : nullptr;
 
-      const uint32_t the_tag = get_tag_from_genome(chrom, i);
+  for (size_t i = start; i < stop; ++i) {
+    const bool is_c = chrom.is_c(i);
+    if (is_c || chrom.is_g(i)) {
+
+      const uint32_t the_tag = chrom.tag(i);
       if (CPG_ONLY && the_tag != 0) continue;
 
-      const bool is_c = is_cytosine(base);
+      const SiteCounts cs(counts.site(i));
       const double unconverted = is_c ?
-        counts[i].unconverted_cytosine() : counts[i].unconverted_guanine();
+        cs.unconverted_cytosine() : cs.unconverted_guanine();
       const double converted = is_c ?
-        counts[i].converted_cytosine() : counts[i].converted_guanine();
-      const bool mut = has_mutated(base, counts[i]);
+        cs.converted_cytosine() : cs.converted_guanine();
+      const bool mut = has_mutated(is_c, cs);
       const size_t n_reads = unconverted + converted;
-      buf.clear();
+      if (out.binary) {
+        // ADS: the tags are in the same order as msite_context
+        out.binary->write(chrom_name, i, is_c ? '+' : '-',
+                          static_cast<msite_context>(the_tag), mut,
+                          unconverted, converted);
+        if (!extra) continue;
+      }
       // ADS: here is where we make an MSite, but not using MSite
+      const size_t line_start = buf.size();
       buf << sam_hdr_tid2name(hdr, tid) << '\t'
           << i << '\t'
           << (is_c ? '+' : '-') << '\t'
           << tag_values[tag_with_mut(the_tag, mut)] << '\t'
           << (n_reads > 0 ? unconverted/n_reads : 0.0) << '\t'
           << n_reads << '\n';
-      if (!out.write(buf.c_str(), buf.tellp()))
-        throw dnmt_error("error writing output");
+      if (extra)
+        extra->add(buf.data() + line_start, buf.data() + buf.size() - 1);
+      // the line was only needed for the extra outputs
+      if (out.binary) buf.clear();
+      else if (buf.full()) {
+        if (!out.text->write(buf.data(), buf.size()))
+          throw dnmt_error("error writing output");
+        buf.clear();
+      }
     }
   }
+  if (!buf.empty() && !out.text->write(buf.data(), buf.size()))
+    throw dnmt_error("error writing output");
 }
 
 
+/* CountWindow holds CountSet objects only for the positions of a
+   chromosome that might still receive counts from reads. Since reads
+   are sorted by start position, once a read starts at "pos" no other
+   read will add counts before "pos", so those can be written and their
+   slots reused. The size is a power of 2 so positions map to slots by
+   masking, and it grows if a read spans more than the current size,
+   which makes memory depend on read length and not chromosome size.
+   Any compact counter that would wrap is carried into "overflow",
+   keyed by position, which is empty except for very deep sites. */
+struct CountWindow {
+  explicit CountWindow(const size_t initial_size) {
+    size_t n = 1;
+    while (n < initial_size) n <<= 1;
+    buf.resize(n);
+    mask = n - 1;
+  }
+
+  CountSet &operator[](const size_t pos) {return buf[pos & mask];}
+  const CountSet &operator[](const size_t pos) const {return buf[pos & mask];}
+
+  /* hold all "n" positions of a chromosome in a buffer of exactly
+     that size, indexed directly instead of as a ring; counts at
+     positions from "n" on, for reads hanging off the end, are
+     dropped */
+  void hold_all(const size_t n) {
+    vector<CountSet>(n).swap(buf);
+    overflow.clear();
+    mask = std::numeric_limits<size_t>::max();
+    offset = 0;
+    limit = n;
+  }
+
+  // start over at the beginning of a chromosome
+  void reset() {
+    std::fill(begin(buf), end(buf), CountSet());
+    overflow.clear();
+    offset = 0;
+  }
+
+  // the full counts at a position, including any overflow
+  SiteCounts site(const size_t pos) const {
+    SiteCounts cs((*this)[pos]);
+    if (!overflow.empty()) {
+      const auto itr = overflow.find(pos);
+      if (itr != end(overflow)) cs += itr->second;
+    }
+    return cs;
+  }
+
+  // "code" is a base_code; only A, C, G and T are counted
+  void add_count_pos(const size_t pos, const uint8_t code) {
+    static count_type CountSet::*const fields[] = {
+      &CountSet::pA, &CountSet::pC, &CountSet::pG, &CountSet::pT
+    };
+    static uint32_t SiteCounts::*const site_fields[] = {
+      &SiteCounts::pA, &SiteCounts::pC, &SiteCounts::pG, &SiteCounts::pT
+    };
+    if (code > base_t || pos >= limit) return;
+    increment(pos, (*this)[pos].*fields[code], site_fields[code]);
+  }
+
+  void add_count_neg(const size_t pos, const uint8_t code) {
+    static count_type CountSet::*const fields[] = {
+      &CountSet::nA, &CountSet::nC, &CountSet::nG, &CountSet::nT
+    };
+    static uint32_t SiteCounts::*const site_fields[] = {
+      &SiteCounts::nA, &SiteCounts::nC, &SiteCounts::nG, &SiteCounts::nT
+    };
+    if (code > base_t || pos >= limit) return;
+    increment(pos, (*this)[pos].*fields[code], site_fields[code]);
+  }
+
+  // "c" is the compact counter and "field" the same one in SiteCounts
+  void increment(const size_t pos, count_type &c,
+                 uint32_t SiteCounts::*field) {
+    if (c == max_count) {
+      overflow[pos].*field += max_count;
+      c = 0;
+    }
+    ++c;
+  }
+
+  // make sure positions up to "stop" can be held without overwriting
+  // positions that have not yet been written
+  void reserve(const size_t stop) {
+    if (stop - offset <= buf.size()) return;
+    size_t n = buf.size();
+    while (n < stop - offset) n <<= 1;
+    vector<CountSet> tmp(n);
+    for (size_t i = offset; i < offset + buf.size(); ++i)
+      tmp[i & (n - 1)] = (*this)[i];
+    std::swap(buf, tmp);
+    mask = n - 1;
+  }
+
+  // write all positions before "stop" and release their slots
+  template<class C> void
+  flush(const bamxx::bam_header &hdr, site_output &out,
+        const int32_t tid, const C &chrom, const size_t stop,
+        const bool CPG_ONLY) {
+    if (stop <= offset) return;
+    const size_t lim = std::min(stop, offset + buf.size());
+    write_output(hdr, out, tid, chrom, *this, offset,
+                 std::min(lim, chrom.size()), CPG_ONLY);
+    release(stop);
+    // positions past the window have no counts, and now all slots
+    // are empty, so these can be written from the same buffer
+    if (lim < stop)
+      write_output(hdr, out, tid, chrom, *this, lim,
+                   std::min(stop, chrom.size()), CPG_ONLY);
+  }
+
+  // empty the slots for all positions before "stop" without writing
+  void release(const size_t stop) {
+    if (stop <= offset) return;
+    const size_t lim = std::min(stop, offset + buf.size());
+    for (size_t i = offset; i < lim; ++i)
+      (*this)[i] = CountSet();
+    overflow.erase(begin(overflow), overflow.lower_bound(lim));
+    offset = stop;
+  }
+
+  vector<CountSet> buf;
+  map<size_t, SiteCounts> overflow;
+  size_t mask{};
+  size_t offset{}; // first position in chrom not yet written
+  size_t limit{std::numeric_limits<size_t>::max()}; // see hold_all
+};
+
+
 /* ADS: was tempted to use these until I passed in a "b++"... */
 // #define get_tid(b) ((b)->core.tid)
 // #define get_rlen(b) (bam_cigar2rlen((b)->core.n_cigar, bam_get_cigar(b)))
@@ -286,8 +527,8 @@ write_output(const bamxx::bam_header &hdr, bamxx::bgzf_file &out,
 
 
 
-static void
-count_states_pos(const bam_rec &aln, vector<CountSet> &counts) {
+template<class T> static void
+count_states_pos(const bam_rec &aln, T &counts) {
   /* Move through cigar, reference and read positions without
      inflating cigar or read sequence */
   const auto seq = bam_get_seq(aln);
@@ -299,13 +540,11 @@ count_states_pos(const bam_rec &aln, vector<CountSet> &counts) {
     const char op = bam_cigar_op(*c_itr);
     const uint32_t n = bam_cigar_oplen(*c_itr);
     if (eats_ref(op) && eats_query(op)) {
-      const decltype(qpos) end_qpos = qpos + n;
-      for (; qpos < end_qpos; ++qpos) {
-        // ADS: beware!!! bam_seqi is a macro, so no "qpos++" inside
-        // its arguments! Why macros?!?! Just make sure the compiler
-        // inliens it properly ffs!
-        counts[rpos++].add_count_pos(seq_nt16_str[bam_seqi(seq, qpos)]);
-      }
+      // ADS: the whole run is decoded together, not base by base
+      for_each_base(seq, qpos, n, [&](const uint8_t code) {
+        counts.add_count_pos(rpos++, code);
+      });
+      qpos += n;
     }
     else if (eats_query(op)) {
       qpos += n;
@@ -322,8 +561,8 @@ count_states_pos(const bam_rec &aln, vector<CountSet> &counts) {
 }
 
 
-static void
-count_states_neg(const bam_rec &aln, vector<CountSet> &counts) {
+template<class T> static void
+count_states_neg(const bam_rec &aln, T &counts) {
   /* Move through cigar, reference and (*backward*) through read
      positions without inflating cigar or read sequence */
   const auto seq = bam_get_seq(aln);
@@ -335,9 +574,10 @@ count_states_neg(const bam_rec &aln, vector<CountSet> &counts) {
     const char op = bam_cigar_op(*c_itr);
     const uint32_t n = bam_cigar_oplen(*c_itr);
     if (eats_ref(op) && eats_query(op)) {
-      const size_t end_qpos = qpos - n; // to match type with qpos
-      for (; qpos > end_qpos; --qpos) // beware ++ in macro below!!!
-        counts[rpos++].add_count_neg(seq_nt16_str[bam_seqi(seq, qpos-1)]);
+      for_each_base_rev(seq, qpos, n, [&](const uint8_t code) {
+        counts.add_count_neg(rpos++, code);
+      });
+      qpos -= n;
     }
     else if (eats_query(op)) {
       qpos -= n;
@@ -352,35 +592,129 @@ count_states_neg(const bam_rec &aln, vector<CountSet> &counts) {
 }
 
 
-static void
-process_reads(const bool VERBOSE,
-              const bool compress_output, const size_t n_threads,
-              const string &infile, const string &outfile,
-              const string &chroms_file, const bool CPG_ONLY) {
+/* Get all the reads mapping to chromosome "tid" through the index and
+   accumulate their counts, and their conversion if "bsrate" is not
+   null. Returns false if no reads mapped to this chromosome, so no
+   output should be written for it. */
+template<class C> static bool
+count_chrom_from_index(indexed_reader &in, const int32_t tid, const C &chrom,
+                       CountWindow &counts, bsrate_tally *bsrate) {
+  const size_t chrom_size = chrom.size();
+  index_query reads(in, tid, 0, chrom_size);
+  counts.hold_all(chrom_size);
+  bool found_reads = false;
+  bam_rec aln;
+  while (reads.next(aln)) {
+    found_reads = true;
+    if (bam_is_rev(aln))
+      count_states_neg(aln, counts);
+    else
+      count_states_pos(aln, counts);
+    if (bsrate) bsrate->add(false, chrom, aln);
+  }
+  return found_reads;
+}
 
-  vector<string> chroms, names;
-  read_fasta_file_short_names(chroms_file, names, chroms);
-  for (auto &&i: chroms)
-    transform(begin(i), end(i), begin(i),
-              [](const char c){return std::toupper(c);});
-  if (VERBOSE)
-    cerr << "[n chroms in reference: " << chroms.size() << "]" << endl;
+
+/* This version of process_reads gives each thread whole chromosomes,
+   using the index of the input BAM file, and writes the output for
+   each chromosome in the order of the header, which should be the
+   same order as for the sorted reads. The output is the same as for
+   process_reads. Memory is one chromosome of CountSet per thread. */
+template<class G> static void
+process_reads_by_chrom(const bool VERBOSE, const bool compress_output,
+                       const bool binary_output,
+                       const size_t n_threads, const string &infile,
+                       const string &outfile, extra_outputs *extra,
+                       const vector<string> &names,
+                       const G &chroms, const bool CPG_ONLY) {
 
   unordered_map<string, size_t> name_to_idx;
-  vector<size_t> chrom_sizes(chroms.size(), 0);
-  for (size_t i = 0; i < chroms.size(); ++i) {
+  for (size_t i = 0; i < names.size(); ++i)
     name_to_idx[names[i]] = i;
-    chrom_sizes[i] = chroms[i].size();
-  }
-
-  bamxx::bam_tpool tp(n_threads); // Must be destroyed after hts
 
-  // open the hts SAM/BAM input file and get the header
+  // ADS: this header is only used for names and for the output
   bamxx::bam_in hts(infile);
   if (!hts) throw dnmt_error("failed to open input file");
-  // load the input file's header
   bamxx::bam_header hdr(hts);
   if (!hdr) throw dnmt_error("failed to read header");
+  indexed_reader::check_index(infile);
+
+  const int32_t n_targets = get_n_targets(hdr);
+  vector<size_t> tid_to_idx(n_targets);
+  for (int32_t i = 0; i < n_targets; ++i) {
+    const string curr_name(hdr.h->target_name[i]);
+    const auto name_itr(name_to_idx.find(curr_name));
+    if (name_itr == end(name_to_idx))
+      throw dnmt_error("failed to find chrom: " + curr_name);
+    tid_to_idx[i] = name_itr->second;
+  }
+
+  bamxx::bam_tpool tp(n_threads); // for output compression only
+
+  site_output out(outfile, compress_output, binary_output);
+  out.extra = extra;
+  if (n_threads > 1 && out.text)
+    tp.set_io(*out.text);
+
+  first_error errors;
+
+#pragma omp parallel num_threads(n_threads)
+  {
+    G thread_chroms(chroms); // one chrom in memory for each thread
+    indexed_reader in(infile);
+    if (!in) errors.set("failed to load index: " + infile);
+
+#pragma omp for ordered schedule(dynamic, 1)
+    for (int32_t tid = 0; tid < n_targets; ++tid) {
+      // ADS: whole chrom in the window; released after each chrom
+      CountWindow counts(0);
+      std::unique_ptr<bsrate_tally> bsrate;
+      if (extra && extra->bsrate) bsrate.reset(new bsrate_tally);
+      bool has_reads = false;
+      if (in && !errors.failed()) {
+        try {
+          has_reads = count_chrom_from_index(in, tid,
+                                             thread_chroms.get(tid_to_idx[tid]),
+                                             counts, bsrate.get());
+        }
+        catch (const std::exception &e) {
+          errors.set(e.what());
+        }
+      }
+#pragma omp ordered
+      {
+        if (has_reads && !errors.failed()) {
+          if (VERBOSE)
+            cerr << "processing " << sam_hdr_tid2name(hdr, tid) << endl;
+          if (bsrate) *extra->bsrate += *bsrate;
+          try {
+            const auto &chrom = thread_chroms.get(tid_to_idx[tid]);
+            counts.flush(hdr, out, tid, chrom, chrom.size(), CPG_ONLY);
+          }
+          catch (const std::exception &e) {
+            errors.set(e.what());
+          }
+        }
+      }
+    }
+  }
+  errors.check();
+  out.close();
+}
+
+
+// initial number of positions in the CountWindow; grows if needed
+static const size_t window_size = 1 << 16;
+
+
+/* Map each target in the header to its chrom in "names", so reads
+   can be matched to the sequences loaded from the genome file. */
+static unordered_map<int32_t, size_t>
+get_tid_to_idx(const bamxx::bam_header &hdr, const vector<string> &names) {
+  unordered_map<string, size_t> name_to_idx;
+  for (size_t i = 0; i < names.size(); ++i)
+    name_to_idx[names[i]] = i;
 
   unordered_map<int32_t, size_t> tid_to_idx;
   for (int32_t i = 0; i < hdr.h->n_targets; ++i) {
@@ -393,37 +727,38 @@ process_reads(const bool VERBOSE,
     tid_to_idx[i] = name_itr->second;
   }
   //// ADS: really should cross-check the chromosome sizes
+  return tid_to_idx;
+}
 
-  // open the output file
-  const string output_mode = compress_output ? "w" : "wu";
-  bamxx::bgzf_file out(outfile, output_mode);
-  if (!out) throw dnmt_error("error opening output file: " + outfile);
-
-  /* set the threads for the input file decompression */
-  if (n_threads > 1) {
-    tp.set_io(hts);
-    tp.set_io(out);
-  }
 
+/* Count the reads from "in", which must be sorted, and write the
+   sites to "out" as soon as no more reads can cover them. */
+template<class G> static void
+count_reads(const bool VERBOSE, const bamxx::bam_header &hdr,
+            read_source &in, site_output &out,
+            const unordered_map<int32_t, size_t> &tid_to_idx,
+            G &chroms, const bool CPG_ONLY) {
   /* now iterate over the reads, switching chromosomes and writing
      output as needed */
   bam_rec aln;
   int32_t prev_tid = -1;
 
-  // this is where all the counts are accumulated
-  vector<CountSet> counts;
+  // this is where counts are accumulated until they are written
+  CountWindow counts(window_size);
 
   unordered_set<int32_t> chroms_seen;
-  vector<string>::const_iterator chrom_itr;
-  while (hts.read(hdr, aln)) {
+  size_t chrom_idx = 0;
+  while (in.read(aln)) {
 
     // if chrom changes, output results, get the next one
     const int32_t tid = get_tid(aln);
     if (tid != prev_tid) {
 
-      // write output if there is any; should fail only once
-      if (!counts.empty())
-        write_output(hdr, out, prev_tid, *chrom_itr, counts, CPG_ONLY);
+      // write remaining output for the previous chrom if any
+      if (prev_tid != -1) {
+        const auto &chrom = chroms.get(chrom_idx);
+        counts.flush(hdr, out, prev_tid, chrom, chrom.size(), CPG_ONLY);
+      }
 
       // make sure all reads from same chrom are consecutive
       if (chroms_seen.find(tid) != end(chroms_seen))
@@ -431,8 +766,8 @@ process_reads(const bool VERBOSE,
       chroms_seen.insert(tid);
 
       // get the next chrom to process
-      auto chrom_idx(tid_to_idx.find(tid));
-      if (chrom_idx == end(tid_to_idx))
+      auto idx_itr(tid_to_idx.find(tid));
+      if (idx_itr == end(tid_to_idx))
         throw dnmt_error("chromosome not found: " +
                          string(sam_hdr_tid2name(hdr, tid)));
 
@@ -440,22 +775,391 @@ process_reads(const bool VERBOSE,
         cerr << "processing " << sam_hdr_tid2name(hdr, tid) << endl;
 
       prev_tid = tid;
-      chrom_itr = begin(chroms) + chrom_idx->second;
+      chrom_idx = idx_itr->second;
 
       // reset the counts
-      counts.clear();
-      counts.resize(chrom_sizes[chrom_idx->second]);
+      counts.reset();
     }
 
+    // no later read can cover positions before this one starts
+    const size_t read_start = get_pos(aln);
+    if (read_start < counts.offset)
+      throw dnmt_error("reads in SAM file not sorted");
+    const auto &chrom = chroms.get(chrom_idx);
+    counts.flush(hdr, out, tid, chrom, read_start, CPG_ONLY);
+    counts.reserve(read_start + rlen_from_cigar(aln));
+
     // do the work for this mapped read, depending on strand
     if (bam_is_rev(aln))
       count_states_neg(aln, counts);
     else
       count_states_pos(aln, counts);
+    if (out.extra) out.extra->add_read(chrom, aln);
+  }
+  if (prev_tid != -1) {
+    const auto &chrom = chroms.get(chrom_idx);
+    counts.flush(hdr, out, prev_tid, chrom, chrom.size(), CPG_ONLY);
+  }
+}
+
+
+template<class G> static void
+process_reads(const bool VERBOSE,
+              const bool compress_output, const bool binary_output,
+              const size_t n_threads,
+              const string &infile, const string &outfile,
+              extra_outputs *extra,
+              const vector<string> &names, G &chroms,
+              const bool CPG_ONLY) {
+
+  bamxx::bam_tpool tp(n_threads); // Must be destroyed after hts
+
+  // open the hts SAM/BAM input file and get the header
+  bamxx::bam_in hts(infile);
+  if (!hts) throw dnmt_error("failed to open input file");
+  // load the input file's header
+  bamxx::bam_header hdr(hts);
+  if (!hdr) throw dnmt_error("failed to read header");
+
+  const auto tid_to_idx = get_tid_to_idx(hdr, names);
+
+  // open the output file
+  site_output out(outfile, compress_output, binary_output);
+  out.extra = extra;
+
+  /* set the threads for the input file decompression */
+  if (n_threads > 1) {
+    tp.set_io(hts);
+    if (out.text) tp.set_io(*out.text);
+  }
+
+  bam_file_source reads(hts, hdr);
+  count_reads(VERBOSE, hdr, reads, out, tid_to_idx, chroms, CPG_ONLY);
+  out.close();
+}
+
+
+/* Count the reads from "in", which must be sorted, and write the
+   sites as text to "outfile". This is the part of counts that can
+   also be done on reads in memory (see pipeline.cpp). The seqs must
+   be upper case, as from a FASTA file after conversion. */
+void
+counts_stream(const bool VERBOSE, const bool compress_output,
+              const bool CPG_ONLY, const vector<string> &names,
+              const vector<string> &seqs, const bamxx::bam_header &hdr,
+              read_source &in, const string &outfile) {
+  const auto tid_to_idx = get_tid_to_idx(hdr, names);
+  const vector<fasta_chrom> chrom_seqs(begin(seqs), end(seqs));
+  chrom_list<fasta_chrom> chroms(chrom_seqs);
+  site_output out(outfile, compress_output, false);
+  count_reads(VERBOSE, hdr, in, out, tid_to_idx, chroms, CPG_ONLY);
+  out.close();
+}
+
+
+/* Write the rows of the table for positions [start, stop) in the
+   chromosome, in the format of "merge -t": the row name is
+   chrom:pos:strand:context, without the mark for mutated sites, then
+   the number of reads and of methylated reads for each sample. */
+template<class C> static void
+write_table_rows(bamxx::bgzf_file &out, const string &chrom_name,
+                 const C &chrom, const vector<CountWindow*> &counts,
+                 const size_t start, const size_t stop, bool CPG_ONLY) {
+
+  line_buffer buf;
+  for (size_t i = start; i < stop; ++i) {
+    const bool is_c = chrom.is_c(i);
+    if (is_c || chrom.is_g(i)) {
+
+      const uint32_t the_tag = chrom.tag(i);
+      if (CPG_ONLY && the_tag != 0) continue;
+
+      buf << chrom_name << ':' << i << ':' << (is_c ? '+' : '-') << ':'
+          << tag_values[the_tag];
+      for (auto c : counts) {
+        const SiteCounts cs(c->site(i));
+        const uint32_t unconverted = is_c ?
+          cs.unconverted_cytosine() : cs.unconverted_guanine();
+        const uint32_t converted = is_c ?
+          cs.converted_cytosine() : cs.converted_guanine();
+        buf << '\t' << unconverted + converted << '\t' << unconverted;
+      }
+      buf << '\n';
+      if (buf.full()) {
+        if (!out.write(buf.data(), buf.size()))
+          throw dnmt_error("error writing output");
+        buf.clear();
+      }
+    }
+  }
+  if (!buf.empty() && !out.write(buf.data(), buf.size()))
+    throw dnmt_error("error writing output");
+}
+
+
+/* Write the table rows for all positions before "stop" and release
+   them in the window of every sample. All windows have the same
+   offset, but they can differ in size, so this goes in steps that fit
+   in the smallest one. */
+template<class C> static void
+flush_table(bamxx::bgzf_file &out, const string &chrom_name, const C &chrom,
+            const vector<CountWindow*> &counts, const size_t stop,
+            const bool CPG_ONLY) {
+  size_t offset = counts.front()->offset;
+  while (offset < stop) {
+    size_t lim = stop;
+    for (auto c : counts)
+      lim = std::min(lim, c->offset + c->buf.size());
+    write_table_rows(out, chrom_name, chrom, counts, offset,
+                     std::min(lim, chrom.size()), CPG_ONLY);
+    for (auto c : counts)
+      c->release(lim);
+    offset = lim;
+  }
+}
+
+
+/* sample_reads is one of several input files counted together. It
+   keeps the next read from its file, so reads from all samples can be
+   taken in order of position, and it has its own window of counts. */
+struct sample_reads {
+  explicit sample_reads(const string &infile) :
+    hts(infile), counts(window_size) {
+    if (!hts) throw dnmt_error("failed to open input file: " + infile);
+    hdr.reset(new bamxx::bam_header(hts));
+    if (!*hdr) throw dnmt_error("failed to read header: " + infile);
+  }
+
+  // get the next mapped read; false if there are no more
+  bool next() {
+    has_read = hts.read(*hdr, aln) && get_tid(aln) >= 0;
+    return has_read;
   }
-  if (!counts.empty())
-    write_output(hdr, out, prev_tid, *chrom_itr, counts, CPG_ONLY);
 
+  bamxx::bam_in hts;
+  std::unique_ptr<bamxx::bam_header> hdr;
+  bam_rec aln;
+  bool has_read{false};
+  bool on_chrom{false}; // had reads on the current chrom
+  CountWindow counts;
+};
+
+
+static inline bool
+precedes_read(const bam_rec &a, const bam_rec &b) {
+  return get_tid(a) < get_tid(b) ||
+    (get_tid(a) == get_tid(b) && get_pos(a) < get_pos(b));
+}
+
+
+/* process_samples counts reads from several input files together. The
+   reads in each file must be sorted, and the headers must have the
+   same chroms in the same order. Reads are taken from all files in
+   order of position, so every sample is on the same chrom and the
+   counts before the current read are final in all of them. There is
+   one pass over the reads of each file and memory is one CountWindow
+   for each sample. The output is either a counts file for each
+   sample, the same as from counting each file alone, or if "tabular"
+   a single table with one row for each site and two columns for each
+   sample. */
+template<class G> static void
+process_samples(const bool VERBOSE, const bool compress_output,
+                const bool binary_output, const size_t n_threads,
+                const vector<string> &infiles, const vector<string> &outfiles,
+                const bool tabular, const string &table_header,
+                const vector<string> &names, G &chroms,
+                const bool CPG_ONLY) {
+
+  unordered_map<string, size_t> name_to_idx;
+  for (size_t i = 0; i < names.size(); ++i)
+    name_to_idx[names[i]] = i;
+
+  bamxx::bam_tpool tp(n_threads); // Must be destroyed after hts
+
+  vector<std::unique_ptr<sample_reads>> samples;
+  for (auto &&i : infiles)
+    samples.emplace_back(new sample_reads(i));
+
+  const bamxx::bam_header &hdr = *samples.front()->hdr;
+  const int32_t n_targets = get_n_targets(hdr);
+  vector<size_t> tid_to_idx(n_targets);
+  for (int32_t i = 0; i < n_targets; ++i) {
+    const string curr_name(hdr.h->target_name[i]);
+    const auto name_itr(name_to_idx.find(curr_name));
+    if (name_itr == end(name_to_idx))
+      throw dnmt_error("failed to find chrom: " + curr_name);
+    tid_to_idx[i] = name_itr->second;
+  }
+  // the same tid must be the same chrom in every file
+  for (size_t i = 1; i < samples.size(); ++i) {
+    const bamxx::bam_header &h = *samples[i]->hdr;
+    bool same = get_n_targets(h) == get_n_targets(hdr);
+    for (int32_t j = 0; j < n_targets && same; ++j)
+      same = sam_hdr_tid2name(h, j) == sam_hdr_tid2name(hdr, j);
+    if (!same)
+      throw dnmt_error("chroms in header differ from first input: " +
+                       infiles[i]);
+  }
+
+  std::unique_ptr<bamxx::bgzf_file> table;
+  vector<std::unique_ptr<site_output>> outs;
+  if (tabular) {
+    const string &outfile = outfiles.front();
+    table.reset(new bamxx::bgzf_file(outfile, compress_output ? "w" : "wu"));
+    if (!*table) throw dnmt_error("error opening output file: " + outfile);
+    if (!table->write(table_header.data(), table_header.size()))
+      throw dnmt_error("error writing output");
+  }
+  else
+    for (auto &&i : outfiles)
+      outs.emplace_back(new site_output(i, compress_output, binary_output));
+
+  if (n_threads > 1) {
+    for (auto &&s : samples) tp.set_io(s->hts);
+    if (table) tp.set_io(*table);
+    for (auto &&o : outs)
+      if (o->text) tp.set_io(*o->text);
+  }
+
+  vector<CountWindow*> windows;
+  for (auto &&s : samples)
+    windows.push_back(&s->counts);
+
+  int32_t tid = -1;
+  size_t chrom_idx = 0;
+  string chrom_name;
+
+  // write remaining output for the current chrom
+  const auto finish_chrom = [&]() {
+    const auto &chrom = chroms.get(chrom_idx);
+    if (tabular)
+      flush_table(*table, chrom_name, chrom, windows, chrom.size(),
+                  CPG_ONLY);
+    else
+      for (size_t i = 0; i < samples.size(); ++i)
+        if (samples[i]->on_chrom)
+          samples[i]->counts.flush(hdr, *outs[i], tid, chrom,
+                                   chrom.size(), CPG_ONLY);
+  };
+
+  for (auto &&s : samples)
+    s->next();
+
+  while (true) {
+    // the sample with the next read by position
+    sample_reads *s = nullptr;
+    for (auto &&i : samples)
+      if (i->has_read && (!s || precedes_read(i->aln, s->aln)))
+        s = i.get();
+    if (!s) break;
+
+    if (get_tid(s->aln) != tid) {
+      if (tid != -1)
+        finish_chrom();
+      tid = get_tid(s->aln);
+      chrom_idx = tid_to_idx[tid];
+      chrom_name = sam_hdr_tid2name(hdr, tid);
+      if (VERBOSE)
+        cerr << "processing " << chrom_name << endl;
+      for (auto &&i : samples) {
+        i->counts.reset();
+        i->on_chrom = false;
+      }
+    }
+
+    // no later read in any sample can cover positions before this one
+    // starts; a sample with no reads yet on this chrom might have none
+    // at all, so its output waits, as it would for that sample alone
+    const size_t read_start = get_pos(s->aln);
+    s->on_chrom = true;
+    const auto &chrom = chroms.get(chrom_idx);
+    if (tabular)
+      flush_table(*table, chrom_name, chrom, windows, read_start, CPG_ONLY);
+    else
+      for (size_t i = 0; i < samples.size(); ++i)
+        if (samples[i]->on_chrom)
+          samples[i]->counts.flush(hdr, *outs[i], tid, chrom, read_start,
+                                   CPG_ONLY);
+    s->counts.reserve(read_start + rlen_from_cigar(s->aln));
+
+    if (bam_is_rev(s->aln))
+      count_states_neg(s->aln, s->counts);
+    else
+      count_states_pos(s->aln, s->counts);
+
+    // a read before this one means the file is not sorted
+    if (s->next() && (get_tid(s->aln) < tid ||
+                      (get_tid(s->aln) == tid &&
+                       static_cast<size_t>(get_pos(s->aln)) < read_start)))
+      throw dnmt_error("reads in SAM file not sorted");
+  }
+  if (tid != -1)
+    finish_chrom();
+  for (auto &&o : outs)
+    o->close();
+}
+
+
+template<class G> static void
+count_methylation(const bool VERBOSE, const bool compress_output,
+                  const bool binary_output,
+                  const bool by_chrom, const size_t n_threads,
+                  const vector<string> &infiles,
+                  const vector<string> &outfiles,
+                  const bool tabular, const string &table_header,
+                  extra_outputs *extra,
+                  const vector<string> &names, G &chroms,
+                  const bool CPG_ONLY) {
+  if (infiles.size() > 1 || tabular)
+    process_samples(VERBOSE, compress_output, binary_output, n_threads,
+                    infiles, outfiles, tabular, table_header, names, chroms,
+                    CPG_ONLY);
+  else if (by_chrom)
+    process_reads_by_chrom(VERBOSE, compress_output, binary_output,
+                           n_threads, infiles.front(), outfiles.front(),
+                           extra, names, chroms, CPG_ONLY);
+  else
+    process_reads(VERBOSE, compress_output, binary_output, n_threads,
+                  infiles.front(), outfiles.front(), extra, names, chroms,
+                  CPG_ONLY);
+}
+
+
+static string
+join(const vector<string> &v) {
+  std::ostringstream oss;
+  copy(begin(v), end(v), std::ostream_iterator<string>(oss, ","));
+  string s(oss.str());
+  if (!s.empty()) s.pop_back();
+  return s;
+}
+
+
+static string
+remove_extension(const string &filename) {
+  const size_t last_dot = filename.find_last_of(".");
+  if (last_dot == string::npos) return filename;
+  else return filename.substr(0, last_dot);
+}
+
+
+/* The header for tabular output is the same as from "merge -t": the
+   column names are the input filenames without path or extension,
+   with the two suffixes for reads and methylated reads unless the
+   header is for radmeth, which has just one name for each sample. */
+static string
+get_table_header(const vector<string> &infiles, const bool radmeth_format,
+                 const string &column_name_suffix) {
+  string header;
+  for (auto &&i : infiles) {
+    const string name(remove_extension(strip_path(i)));
+    if (radmeth_format)
+      header += name + '\t';
+    else
+      header += name + "_" + column_name_suffix[0] + '\t' +
+        name + "_" + column_name_suffix[1] + '\t';
+  }
+  return header + '\n';
 }
 
 
@@ -467,7 +1171,15 @@ main_counts(int argc, const char **argv) {
     bool VERBOSE = false;
     bool CPG_ONLY = false;
     bool compress_output = false;
-
+    bool binary_output = false;
+    bool by_chrom = false;
+    bool tabular = false;
+    bool radmeth_format = false;
+
+    string column_name_suffix = "RM";
+    string sym_file;
+    string levels_file;
+    string bsrate_file;
     string chroms_file;
     string outfile;
     int n_threads = 1;
@@ -476,16 +1188,35 @@ main_counts(int argc, const char **argv) {
     OptionParser opt_parse(strip_path(argv[0]),
                            "get methylation levels from "
                            "mapped bisulfite sequencing reads",
-                           "-c <chroms> <mapped-reads>");
+                           "-c <chroms> <mapped-reads> [more-mapped-reads]");
     opt_parse.add_opt("threads", 't', "threads to use (few needed)",
                       false, n_threads);
     opt_parse.add_opt("output", 'o', "output file name (default: stdout)",
                       false, outfile);
-    opt_parse.add_opt("chrom", 'c', "reference genome file (FASTA format)",
+    opt_parse.add_opt("chrom", 'c', "reference genome file (FASTA format "
+                      "or from genome-index)",
                       true , chroms_file);
+    opt_parse.add_opt("sym", '\0', "also write symmetric CpG sites, "
+                      "as from sym, to this file", false, sym_file);
+    opt_parse.add_opt("levels", '\0', "also write the summary of "
+                      "methylation levels, as from levels, to this file",
+                      false, levels_file);
+    opt_parse.add_opt("bsrate", '\0', "also write the conversion rate, "
+                      "as from bsrate, to this file", false, bsrate_file);
     opt_parse.add_opt("cpg-only", 'n', "print only CpG context cytosines",
                       false, CPG_ONLY);
     opt_parse.add_opt("zip", 'z', "output gzip format", false, compress_output);
+    opt_parse.add_opt("binary", 'B', "output binary methylome format "
+                      "(requires -o)", false, binary_output);
+    opt_parse.add_opt("by-chrom", '\0', "process chromosomes in parallel "
+                      "(requires indexed BAM input)", false, by_chrom);
+    opt_parse.add_opt("tabular", '\0', "for several inputs, output one table "
+                      "as from merge -t", false, tabular);
+    opt_parse.add_opt("radmeth", '\0', "format table header for radmeth "
+                      "(assumes -tabular)", false, radmeth_format);
+    opt_parse.add_opt("suff", '\0', "table column name suffixes, one for "
+                      "total reads and one for methylated reads",
+                      false, column_name_suffix);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -499,31 +1230,110 @@ main_counts(int argc, const char **argv) {
       cerr << opt_parse.option_missing_message() << endl;
       return EXIT_SUCCESS;
     }
-    const string mapped_reads_file = leftover_args.front();
+    const vector<string> mapped_reads_files(leftover_args);
     /****************** END COMMAND LINE OPTIONS *****************/
 
     if (n_threads < 0)
       throw dnmt_error("thread count cannot be negative");
+    if (binary_output && outfile.empty())
+      throw dnmt_error("binary output requires an output file");
+    if (radmeth_format)
+      tabular = true;
+    if (tabular && binary_output)
+      throw dnmt_error("tabular output cannot be binary");
+    if (column_name_suffix.size() != 2)
+      throw dnmt_error("column name suffix must be 2 letters");
+    if (mapped_reads_files.size() > 1 && by_chrom)
+      throw dnmt_error("parallel by chrom requires a single input file");
+
+    if ((!sym_file.empty() || !levels_file.empty() || !bsrate_file.empty()) &&
+        (mapped_reads_files.size() > 1 || tabular))
+      throw dnmt_error("sym, levels and bsrate output require a single "
+                       "input file");
+
+    // ADS: without a table, each input has its own output file
+    vector<string> outfiles(1, outfile);
+    if (mapped_reads_files.size() > 1 && !tabular) {
+      outfiles = smithlab::split(outfile, ",", false);
+      if (outfiles.size() != mapped_reads_files.size())
+        throw dnmt_error("several inputs require one output file for "
+                         "each, separated by commas, or -tabular");
+    }
 
     std::ostringstream cmd;
     copy(argv, argv + argc, std::ostream_iterator<const char*>(cmd, " "));
 
     // file types from HTSlib use "-" for the filename to go to stdout
-    if (outfile.empty())
-      outfile = "-";
+    if (outfiles.front().empty())
+      outfiles.front() = "-";
+
+    const string table_header = tabular ?
+      get_table_header(mapped_reads_files, radmeth_format,
+                       column_name_suffix) : string();
 
     if (VERBOSE)
-      cerr << "[input BAM/SAM file: " << mapped_reads_file << "]" << endl
-           << "[output file: " << outfile << "]" << endl
+      cerr << "[input BAM/SAM files: " << join(mapped_reads_files) << "]"
+           << endl
+           << "[output files: " << join(outfiles) << "]" << endl
            << "[output format: "
-           << (compress_output ? "bgzf" : "text") << "]" << endl
+           << (tabular ? "table" : (binary_output ? "binary" : "text"))
+           << (compress_output ? " (bgzf)" : "") << "]" << endl
            << "[genome file: " << chroms_file << "]" << endl
            << "[threads requested: " << n_threads << "]" << endl
            << "[CpG only mode: " << (CPG_ONLY ? "yes" : "no") << "]" << endl
+           << "[parallel by chrom: " << (by_chrom ? "yes" : "no") << "]" << endl
            << "[command line: \"" << cmd.str() << "\"]" << endl;
 
-    process_reads(VERBOSE, compress_output, n_threads, mapped_reads_file,
-                  outfile, chroms_file, CPG_ONLY);
+    std::unique_ptr<extra_outputs> extra;
+    if (!sym_file.empty() || !levels_file.empty() || !bsrate_file.empty())
+      extra.reset(new extra_outputs(sym_file, levels_file, bsrate_file));
+
+    if (GenomeIndex::is_genome_index(chroms_file)) {
+      const GenomeIndex index(chroms_file);
+      if (VERBOSE)
+        cerr << "[n chroms in genome index: " << index.n_chroms() << "]"
+             << endl;
+      vector<GenomeIndex::chrom_view> views;
+      for (size_t i = 0; i < index.n_chroms(); ++i)
+        views.push_back(index.chrom(i));
+      chrom_list<GenomeIndex::chrom_view> chroms(views);
+      count_methylation(VERBOSE, compress_output, binary_output,
+                        by_chrom, n_threads,
+                        mapped_reads_files, outfiles, tabular, table_header,
+                        extra.get(),
+                        index.chrom_names(), chroms, CPG_ONLY);
+    }
+    else if (MappedFasta::can_map(chroms_file)) {
+      // ADS: chroms are loaded as they are needed
+      const MappedFasta fasta(chroms_file);
+      if (VERBOSE)
+        cerr << "[n chroms in reference: " << fasta.n_chroms() << "]"
+             << endl;
+      lazy_chroms chroms(fasta);
+      count_methylation(VERBOSE, compress_output, binary_output,
+                        by_chrom, n_threads,
+                        mapped_reads_files, outfiles, tabular, table_header,
+                        extra.get(),
+                        fasta.chrom_names(), chroms, CPG_ONLY);
+    }
+    else {
+      vector<string> names, seqs;
+      read_fasta_file_short_names(chroms_file, names, seqs);
+      for (auto &&i: seqs)
+        transform(begin(i), end(i), begin(i),
+                  [](const char c){return std::toupper(c);});
+      if (VERBOSE)
+        cerr << "[n chroms in reference: " << seqs.size() << "]" << endl;
+      const vector<fasta_chrom> chrom_seqs(begin(seqs), end(seqs));
+      chrom_list<fasta_chrom> chroms(chrom_seqs);
+      count_methylation(VERBOSE, compress_output, binary_output,
+                        by_chrom, n_threads,
+                        mapped_reads_files, outfiles, tabular, table_header,
+                        extra.get(),
+                        names, chroms, CPG_ONLY);
+    }
+    if (extra)
+      extra->close();
   }
   catch (const std::exception &e) {
     cerr << e.what() << endl;
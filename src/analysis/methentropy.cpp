@@ -17,11 +17,13 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <memory>
 
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "OptionParser.hpp"
+#include "GenomeIndex.hpp"
 
 
 using std::string;
@@ -31,6 +33,7 @@ using std::cout;
 using std::endl;
 using std::unordered_map;
 using std::runtime_error;
+using std::unique_ptr;
 
 
 ////////////////////////////////////////////////////////////////////////
@@ -70,6 +73,15 @@ build_coordinate_converter(const unordered_map<string, string> &chrom_files,
 }
 
 
+static void
+build_coordinate_converter(const GenomeIndex &index, const string &chrom,
+                           unordered_map<size_t, size_t> &cpg_lookup) {
+  const auto chrom_view = index.chrom(chrom);
+  for (size_t i = 0; i < chrom_view.n_cpgs(); ++i)
+    cpg_lookup[i] = chrom_view.cpg_select(i);
+}
+
+
 
 static size_t
 convert_coordinates(const unordered_map<size_t, size_t> &cpgs,
@@ -326,7 +338,7 @@ main_methentropy(int argc, const char **argv) {
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]),
                            "compute methylation entropy in sliding window",
-                           "<chroms> <epireads-file>");
+                           "<chroms|genome-index> <epireads-file>");
     opt_parse.add_opt("window", 'w', "number of CpGs in sliding window",
                       false, cpg_window);
     opt_parse.add_opt("flip", 'F', "flip read majority state to meth",
@@ -361,8 +373,13 @@ main_methentropy(int argc, const char **argv) {
     if (!in)
       throw runtime_error("cannot open input file: " + epi_file);
 
+    // a genome index has the CpGs for all chroms, so no files are read
+    unique_ptr<GenomeIndex> index;
     unordered_map<string, string> chrom_files;
-    identify_chromosomes(chroms_dir, fasta_suffix, chrom_files);
+    if (GenomeIndex::is_genome_index(chroms_dir))
+      index.reset(new GenomeIndex(chroms_dir));
+    else
+      identify_chromosomes(chroms_dir, fasta_suffix, chrom_files);
 
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
@@ -373,8 +390,11 @@ main_methentropy(int argc, const char **argv) {
     while (in >> tmp_er) {
       if (!epireads.empty() && tmp_er.chr != epireads.back().chr) {
         unordered_map<size_t, size_t> cpg_lookup;
-        build_coordinate_converter(chrom_files,
-                                   epireads.back().chr, cpg_lookup);
+        if (index)
+          build_coordinate_converter(*index, epireads.back().chr, cpg_lookup);
+        else
+          build_coordinate_converter(chrom_files,
+                                     epireads.back().chr, cpg_lookup);
         process_chrom(VERBOSE, cpg_window, epireads, cpg_lookup, out);
         epireads.clear();
       }
@@ -384,7 +404,11 @@ main_methentropy(int argc, const char **argv) {
     }
     if (!epireads.empty()) {
       unordered_map<size_t, size_t> cpg_lookup;
-      build_coordinate_converter(chrom_files, epireads.back().chr, cpg_lookup);
+      if (index)
+        build_coordinate_converter(*index, epireads.back().chr, cpg_lookup);
+      else
+        build_coordinate_converter(chrom_files, epireads.back().chr,
+                                   cpg_lookup);
       process_chrom(VERBOSE, cpg_window, epireads, cpg_lookup, out);
     }
   }
@@ -396,5 +420,9 @@ main_methentropy(int argc, const char **argv) {
     cerr << "ERROR: could not allocate memory" << endl;
     return EXIT_FAILURE;
   }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
@@ -24,6 +24,7 @@
 #include <numeric>
 #include <stdexcept>
 #include <unordered_set>
+#include <memory>
 
 #include "OptionParser.hpp"
 #include "smithlab_utils.hpp"
@@ -34,6 +35,8 @@
 #include "dnmt_error.hpp"
 
 #include "bam_record_utils.hpp"
+#include "GenomeIndex.hpp"
+#include "MappedFasta.hpp"
 
 using std::string;
 using std::vector;
@@ -44,17 +47,50 @@ using std::unordered_map;
 using std::unordered_set;
 using std::runtime_error;
 using std::lower_bound;
+using std::unique_ptr;
 
 using bamxx::bam_rec;
 
-static const char b2c[] = "TNGNNNCNNNNNNNNNNNNA";
+/* Get the code of the read base at each reference position the read
+   covers, with base_n for deletions and skips. Bases of reads on the
+   negative strand are taken backward, as in counts, so the codes are
+   for the T-rich read, not its reverse complement. */
+static void
+get_ref_codes(const bam_rec &aln, vector<uint8_t> &codes) {
+  const bool rev = bam_is_rev(aln);
+  const auto seq = bam_get_seq(aln);
+  const auto beg_cig = bam_get_cigar(aln);
+  const auto end_cig = beg_cig + get_n_cigar(aln);
+  const size_t qlen = get_l_qseq(aln);
+  size_t qpos = rev ? qlen : 0;
+  size_t n_query = 0;
+  codes.clear();
+  const auto add_code = [&codes](const uint8_t code) {codes.push_back(code);};
+  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
+    const auto op = bam_cigar_op(*c_itr);
+    const auto n = bam_cigar_oplen(*c_itr);
+    if (cigar_eats_query(op)) {
+      // sum of total M/I/S/=/X operations must equal length of seq
+      n_query += n;
+      if (n_query > qlen)
+        throw runtime_error("inconsistent number of qseq ops in cigar");
+    }
+    if (cigar_eats_ref(op) && cigar_eats_query(op)) {
+      if (rev) for_each_base_rev(seq, qpos, n, add_code);
+      else for_each_base(seq, qpos, n, add_code);
+    }
+    else if (cigar_eats_ref(op))
+      codes.resize(codes.size() + n, base_n);
+    if (cigar_eats_query(op))
+      qpos = rev ? qpos - n : qpos + n;
+  }
+  if (n_query != qlen)
+    throw runtime_error("inconsistent number of qseq ops in cigar");
+}
 
-template<class BidirIt, class OutputIt>
-// constexpr // since C++20
-OutputIt revcomp_copy(BidirIt first, BidirIt last, OutputIt d_first) {
-  for (; first != last; ++d_first)
-    *d_first = b2c[*(--last) - 'A'];
-  return d_first;
+static inline char
+state_from_code(const uint8_t code) {
+  return code == base_c ? 'C' : (code == base_t ? 'T' : 'N');
 }
 
 inline static bool
@@ -85,11 +121,10 @@ convert_meth_states_pos(const vector<size_t> &cpgs,
   const size_t width = rlen_from_cigar(aln);
   const size_t seq_end = seq_start + width;
 
-  string seq_str;
-  get_seq_str(aln, seq_str);
-  apply_cigar(aln, seq_str, 'N');
+  vector<uint8_t> codes;
+  get_ref_codes(aln, codes);
 
-  if (seq_str.size() != width) {
+  if (codes.size() != width) {
     throw runtime_error("bad sam record format: " + to_string(hdr, aln));
   }
 
@@ -101,8 +136,7 @@ convert_meth_states_pos(const vector<size_t> &cpgs,
     return false;
   } else {
     for (; cpg_itr != end(cpgs) && *cpg_itr < seq_end; cpg_itr++) {
-      const char x = seq_str[*cpg_itr - seq_start];
-      states += (x == 'C') ? 'C' : ((x == 'T') ? 'T' : 'N');
+      states += state_from_code(codes[*cpg_itr - seq_start]);
       if (first_cpg_itr == end(cpgs))
         first_cpg_itr = cpg_itr;
     }
@@ -121,12 +155,9 @@ convert_meth_states_neg(const vector<size_t> &cpgs,
                         const bamxx::bam_header &hdr,
                         const bam_rec &aln,
                         size_t &first_cpg_index, string &states) {
-  /* ADS: the "revcomp" on the read sequence is needed for the cigar
-     to be applied, since the cigar is relative to the genome
-     coordinates and not the read's sequence. But the read sequence
-     may is assumed to have been T-rich to begin with, so it becomes
-     A-rich. And the position of the C in the CpG becomes the G
-     position.
+  /* ADS: the read is assumed to have been T-rich to begin with, and
+     its bases are taken backward in genome coordinates without the
+     complement, so the state for a CpG is at the position of its G.
    */
 
   states.clear();
@@ -135,15 +166,10 @@ convert_meth_states_neg(const vector<size_t> &cpgs,
   const size_t width = rlen_from_cigar(aln);
   const size_t seq_end = seq_start + width;
 
-  string orig_seq;
-  get_seq_str(aln, orig_seq);
-
-  string seq_str;
-  seq_str.resize(orig_seq.size());
-  revcomp_copy(begin(orig_seq), end(orig_seq), begin(seq_str));
-  apply_cigar(aln, seq_str, 'N');
+  vector<uint8_t> codes;
+  get_ref_codes(aln, codes);
 
-  if (seq_str.size() != width) {
+  if (codes.size() != width) {
     throw runtime_error("bad sam record format: " + to_string(hdr, aln));
   }
 
@@ -158,8 +184,7 @@ convert_meth_states_neg(const vector<size_t> &cpgs,
     return false;
   } else {
     for (; cpg_itr != end(cpgs) && *cpg_itr < seq_end - 1; cpg_itr++) {
-      const char x = seq_str[*cpg_itr - seq_start + 1];
-      states += (x == 'G') ? 'C' : ((x == 'A') ? 'T' : 'N');
+      states += state_from_code(codes[*cpg_itr - seq_start + 1]);
       if (first_cpg_itr == end(cpgs))
         first_cpg_itr = cpg_itr;
     }
@@ -211,8 +236,8 @@ main_methstates(int argc, const char **argv) {
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(argv[0], description, "<sam-file>");
     opt_parse.add_opt("output", 'o', "output file name", false, outfile);
-    opt_parse.add_opt("chrom", 'c', "fasta format reference genome file",
-                      true , chrom_file);
+    opt_parse.add_opt("chrom", 'c', "fasta format reference genome file "
+                      "or genome index", true , chrom_file);
     opt_parse.add_opt("threads", 't', "threads to use for reading input",
                       false, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
@@ -244,19 +269,32 @@ main_methstates(int argc, const char **argv) {
 
     /* first load in all the chromosome sequences and names, and make
        a map from chromosome name to the location of the chromosome
-       itself */
+       itself; with a genome index only the CpG positions are needed
+       and those are taken from the index for each chrom, and with a
+       plain FASTA file each chrom is copied from the mapped file when
+       its reads start */
+    unique_ptr<GenomeIndex> index;
+    unique_ptr<MappedFasta> fasta;
     vector<string> all_chroms, chrom_names;
-    read_fasta_file_short_names(chrom_file, chrom_names, all_chroms);
-    for (auto &&i: all_chroms)
-      transform(begin(i), end(i), begin(i),
-                [](const char c) { return std::toupper(c); });
+    if (GenomeIndex::is_genome_index(chrom_file))
+      index.reset(new GenomeIndex(chrom_file));
+    else if (MappedFasta::can_map(chrom_file))
+      fasta.reset(new MappedFasta(chrom_file));
+    else {
+      read_fasta_file_short_names(chrom_file, chrom_names, all_chroms);
+      for (auto &&i: all_chroms)
+        transform(begin(i), end(i), begin(i),
+                  [](const char c) { return std::toupper(c); });
+    }
 
     unordered_map<string, size_t> chrom_lookup;
     for (size_t i = 0; i < chrom_names.size(); ++i)
       chrom_lookup[chrom_names[i]] = i;
 
     if (VERBOSE)
-      cerr << "n_chroms: " << all_chroms.size() << endl;
+      cerr << "n_chroms: "
+           << (index ? index->n_chroms() :
+               (fasta ? fasta->n_chroms() : all_chroms.size())) << endl;
 
     bamxx::bam_tpool tp(n_threads);  // declared first; destroyed last
 
@@ -298,8 +336,16 @@ main_methstates(int argc, const char **argv) {
         if (VERBOSE)
           cerr << "processing " << chrom_name << endl;
 
-        get_chrom(chrom_name, all_chroms, chrom_lookup, chrom);
-        collect_cpgs(chrom, cpgs);
+        if (index)
+          index->chrom(chrom_name).get_cpgs(cpgs);
+        else if (fasta) {
+          fasta->get_sequence(fasta->chrom_idx(chrom_name), chrom);
+          collect_cpgs(chrom, cpgs);
+        }
+        else {
+          get_chrom(chrom_name, all_chroms, chrom_lookup, chrom);
+          collect_cpgs(chrom, cpgs);
+        }
       }
 
       size_t first_cpg_index = std::numeric_limits<size_t>::max();
@@ -24,6 +24,7 @@
 #include <numeric>
 #include <utility>
 #include <stdexcept>
+#include <memory>
 
 #include <bamxx.hpp>
 
@@ -33,6 +34,7 @@
 #include "GenomicRegion.hpp"
 
 #include "MSite.hpp"
+#include "BinaryMethylome.hpp"
 
 #include "bsutils.hpp"
 
@@ -507,6 +509,97 @@ process_with_cpgs_on_disk(const bool PRINT_NUMERIC_ONLY,
 ////////////////////////////////////////////////////////////////////////
 
 
+// the sample name for a binary methylome: its file name without the
+// path or the extension
+static string
+sample_name(const string &filename) {
+  const string name(strip_path(filename));
+  const size_t dot = name.find_last_of('.');
+  return dot == 0 || dot == string::npos ? name : name.substr(0, dot);
+}
+
+
+/* With binary methylomes there is one file for each sample instead
+   of a table, and the index of each is used to find the sites in a
+   region. The number of sites in a region is the most in any sample,
+   which is the same for all samples made on the same genome. */
+static void
+process_binary_methylomes(const bool PRINT_NUMERIC_ONLY,
+                          const bool report_more_information,
+                          const char level_code,
+                          const vector<string> &cpgs_files,
+                          const vector<GenomicRegion> &regions,
+                          std::ostream &out) {
+
+  vector<std::unique_ptr<BinaryMethylome> > cpgs;
+  for (auto &&i: cpgs_files)
+    cpgs.emplace_back(new BinaryMethylome(i));
+  const size_t n_samples = cpgs.size();
+
+  // write header as first column
+  for (size_t i = 0; i < n_samples; ++i)
+    out << '\t' << sample_name(cpgs_files[i]);
+  out << '\n';
+
+  vector<size_t> total_meth(n_samples, 0);
+  vector<size_t> total_reads(n_samples, 0);
+  vector<size_t> cpgs_with_reads(n_samples, 0);
+  vector<size_t> called_total(n_samples, 0);
+  vector<size_t> called_meth(n_samples, 0);
+  vector<double> weighted_mean_meth(n_samples, 0);
+  vector<double> fractional_meth(n_samples, 0);
+  vector<double> unweighted_mean_meth(n_samples, 0);
+  vector<double> score(n_samples, 0.0);
+
+  for (size_t i = 0; i < regions.size(); ++i) {
+    size_t total_cpgs = 0;
+    for (size_t j = 0; j < n_samples; ++j) {
+      total_meth[j] = total_reads[j] = cpgs_with_reads[j] =
+        called_total[j] = called_meth[j] = 0;
+      double mean_meth = 0.0;
+      size_t n_sites = 0;
+
+      auto sites = cpgs[j]->query(regions[i].get_chrom(),
+                                  regions[i].get_start(),
+                                  regions[i].get_end());
+      const BinaryMethylome::site_record *cpg = nullptr, *cpgs_end = nullptr;
+      while (sites.next(cpg, cpgs_end))
+        for (; cpg != cpgs_end; ++cpg) {
+          ++n_sites;
+          if (cpg->n_reads() > 0) {
+            total_meth[j] += cpg->n_meth;
+            total_reads[j] += cpg->n_reads();
+            ++cpgs_with_reads[j];
+
+            const auto calls = meth_unmeth_calls(cpg->n_meth, cpg->n_unmeth);
+            called_total[j] += (calls.first || calls.second);
+            called_meth[j] += calls.first;
+
+            mean_meth += cpg->n_meth/static_cast<double>(cpg->n_reads());
+          }
+        }
+      total_cpgs = std::max(total_cpgs, n_sites);
+
+      fractional_meth[j] = static_cast<double>(called_meth[j])/called_total[j];
+      weighted_mean_meth[j] = static_cast<double>(total_meth[j])/total_reads[j];
+      unweighted_mean_meth[j] = mean_meth/cpgs_with_reads[j];
+
+      score[j] = (level_code == 'w' ? weighted_mean_meth[j] :
+                  (level_code == 'u' ? unweighted_mean_meth[j] :
+                   fractional_meth[j]));
+    }
+
+    if (!PRINT_NUMERIC_ONLY || all_is_finite(score))
+      out << format_output_line(report_more_information, regions[i], score,
+                                weighted_mean_meth, unweighted_mean_meth,
+                                fractional_meth,
+                                total_cpgs, cpgs_with_reads,
+                                total_meth, total_reads)
+          << endl;
+  }
+}
+
+
 static size_t
 check_bed_format(const string &regions_file) {
 
@@ -547,7 +640,8 @@ main_multimethstat(int argc, const char **argv) {
     /****************** COMMAND LINE OPTIONS ********************/
     OptionParser opt_parse(strip_path(argv[0]), "Compute average CpG "
                            "methylation in each of a set of genomic intervals",
-                           "<intervals-bed> <methylation-file>");
+                           "<intervals-bed> <methylation-file> "
+                           "(or several binary methylomes)");
     opt_parse.set_show_defaults();
     opt_parse.add_opt("output", 'o', "Name of output file (default: stdout)",
                       false, outfile);
@@ -577,7 +671,7 @@ main_multimethstat(int argc, const char **argv) {
       cerr << opt_parse.option_missing_message() << endl;
       return EXIT_SUCCESS;
     }
-    if (leftover_args.size() != 2) {
+    if (leftover_args.size() < 2) {
       cerr << opt_parse.help_message() << endl;
       return EXIT_SUCCESS;
     }
@@ -590,7 +684,16 @@ main_multimethstat(int argc, const char **argv) {
       return EXIT_SUCCESS;
     }
     const string regions_file = leftover_args.front();
-    const string cpgs_file = leftover_args.back();
+    const vector<string> cpgs_files(begin(leftover_args) + 1,
+                                    end(leftover_args));
+    const string cpgs_file = cpgs_files.front();
+    // ADS: a table has all samples in one file; binary methylomes
+    // have one sample each
+    const bool is_binary = BinaryMethylome::is_binary_methylome(cpgs_file);
+    for (auto &&i: cpgs_files)
+      if (BinaryMethylome::is_binary_methylome(i) != is_binary ||
+          (!is_binary && cpgs_files.size() > 1))
+        throw runtime_error("give one table or only binary methylomes: " + i);
     /****************** END COMMAND LINE OPTIONS *****************/
 
     if (VERBOSE)
@@ -624,7 +727,12 @@ main_multimethstat(int argc, const char **argv) {
     if (!outfile.empty()) of.open(outfile);
     std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
 
-    if (load_entire_file)
+    if (is_binary)
+      process_binary_methylomes(PRINT_NUMERIC_ONLY,
+                                report_more_information,
+                                level_code[0],
+                                cpgs_files, regions, out);
+    else if (load_entire_file)
       process_with_cpgs_loaded(VERBOSE, sort_data_if_needed,
                                PRINT_NUMERIC_ONLY,
                                report_more_information,
@@ -636,13 +744,13 @@ main_multimethstat(int argc, const char **argv) {
                                 level_code[0],
                                 cpgs_file, regions, out);
   }
-  catch (const runtime_error &e) {
-    cerr << e.what() << endl;
-    return EXIT_FAILURE;
-  }
   catch (std::bad_alloc &ba) {
     cerr << "ERROR: could not allocate memory" << endl;
     return EXIT_FAILURE;
   }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
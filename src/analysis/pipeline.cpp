@@ -0,0 +1,261 @@
+/* pipeline: run format, sorting, uniq, bsrate and counts in one
+ * process, with the reads going between the steps in memory
+ *
+ * Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+#include "OptionParser.hpp"
+#include "smithlab_os.hpp"
+#include "smithlab_utils.hpp"
+#include "bam_record_utils.hpp"
+#include "dnmt_error.hpp"
+#include "read_sorter.hpp"
+#include "read_stream.hpp"
+#include "stream_steps.hpp"
+
+#include <bamxx.hpp>
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+/* Each step runs in its own thread. If one fails, its queues are
+   closed so the others finish, and the first error is kept: any error
+   in another step because of the first one happens after it. */
+struct step_errors {
+  template<class F> std::thread
+  run(F f) {
+    return std::thread([this, f]() {
+      try {
+        f();
+      }
+      catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (msg.empty()) msg = e.what();
+      }
+    });
+  }
+  string msg;
+  std::mutex mtx;
+};
+
+
+int
+main_pipeline(int argc, const char **argv) {
+  try {
+    size_t n_reads_to_check = 1000000;
+
+    string input_format;
+    string outfile;
+    string chroms_file;
+    string statfile;
+    string histfile;
+    string bsrate_file;
+    int32_t max_frag_len = 10000;
+    size_t suff_len = 0;
+    bool single_end = false;
+    bool force = false;
+    // ADS: same seed as uniq, so the same reads are kept
+    size_t the_seed = 408;
+    size_t sort_mem_mb = read_sorter::default_max_mem >> 20;
+    string tmp_prefix;
+    bool CPG_ONLY = false;
+    bool compress_output = false;
+    bool VERBOSE = false;
+    size_t n_threads = 1;
+
+    const string description =
+      "run format, uniq, bsrate and counts on mapped reads "
+      "in one process, without writing the reads in between";
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), description,
+                           "-c <chroms> -o <counts-file> <sam/bam-file>", 1);
+    opt_parse.add_opt("output", 'o', "counts output file", true, outfile);
+    opt_parse.add_opt("chrom", 'c', "reference genome file (FASTA format)",
+                      true, chroms_file);
+    opt_parse.add_opt("format", 'f', "input format {abismal, bsmap, bismark}",
+                      false, input_format);
+    opt_parse.add_opt("suff", 's', "read name suffix length", false, suff_len);
+    opt_parse.add_opt("single-end", '\0',
+                      "assume single-end [do not use with -suff]", false,
+                      single_end);
+    opt_parse.add_opt("max-frag", 'L', "max allowed insert size", false,
+                      max_frag_len);
+    opt_parse.add_opt("check", '\0',
+                      "check this many reads to validate read name suffix",
+                      false, n_reads_to_check);
+    opt_parse.add_opt("force", 'F',
+                      "force formatting for mixed single and paired reads",
+                      false, force);
+    opt_parse.add_opt("stats", 'S', "uniq statistics output file", false,
+                      statfile);
+    opt_parse.add_opt("hist", '\0',
+                      "uniq histogram output file for library"
+                      " complexity analysis", false, histfile);
+    opt_parse.add_opt("seed", '\0', "random seed for uniq", false, the_seed);
+    opt_parse.add_opt("bsrate", '\0', "bsrate output file", false,
+                      bsrate_file);
+    opt_parse.add_opt("sort-mem", '\0', "memory for reads in MB when sorting "
+                      "before using temporary files", false, sort_mem_mb);
+    opt_parse.add_opt("tmp", 'T', "prefix for temporary files when sorting "
+                      "(default: output file)", false, tmp_prefix);
+    opt_parse.add_opt("cpg-only", 'n', "print only CpG context cytosines",
+                      false, CPG_ONLY);
+    opt_parse.add_opt("zip", 'z', "output gzip format", false,
+                      compress_output);
+    opt_parse.add_opt("threads", 't', "threads for reading and formatting "
+                      "the input", false, n_threads);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    opt_parse.set_show_defaults();
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_FAILURE;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_FAILURE;
+    }
+    if (suff_len != 0 && single_end) {
+      cerr << "incompatible arguments specified" << endl
+           << opt_parse.help_message() << endl;
+      return EXIT_FAILURE;
+    }
+    if (max_frag_len <= 0) {
+      cerr << "specified maximum fragment size: " << max_frag_len << endl
+           << opt_parse.help_message() << endl;
+      return EXIT_FAILURE;
+    }
+    if (sort_mem_mb == 0) {
+      cerr << "memory for sorting must be positive" << endl;
+      return EXIT_FAILURE;
+    }
+    const string infile(leftover_args.front());
+    if (tmp_prefix.empty())
+      tmp_prefix = outfile;
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    if (VERBOSE)
+      cerr << "[input file: " << infile << "]" << endl
+           << "[mapper: " << input_format << "]" << endl
+           << "[configuration: " << (single_end ? "SE" : "PE") << "]" << endl
+           << "[counts output file: " << outfile << "]" << endl
+           << "[bsrate output file: "
+           << (bsrate_file.empty() ? "none" : bsrate_file) << "]" << endl
+           << "[genome file: " << chroms_file << "]" << endl
+           << "[random number seed: " << the_seed << "]" << endl
+           << "[threads requested: " << n_threads << "]" << endl;
+
+    check_format_input(VERBOSE, input_format, infile);
+    if (!single_end && !force)
+      suff_len = get_read_name_suff_len(VERBOSE, infile, suff_len,
+                                        n_reads_to_check);
+    if (VERBOSE && !single_end)
+      cerr << "[readname suffix length: " << suff_len << "]" << endl;
+
+    // ADS: the genome is loaded once, for both bsrate and counts
+    vector<string> names, seqs;
+    read_fasta_file_short_names(chroms_file, names, seqs);
+    for (auto &&i : seqs)
+      transform(begin(i), end(i), begin(i),
+                [](const char c) { return std::toupper(c); });
+    if (VERBOSE)
+      cerr << "[n chroms in reference: " << seqs.size() << "]" << endl;
+
+    bamxx::bam_tpool tp(n_threads);  // must be destroyed after hts
+
+    bamxx::bam_in hts(infile);
+    if (!hts) throw dnmt_error("failed to open input file: " + infile);
+    bamxx::bam_header hdr(hts);
+    if (!hdr) throw dnmt_error("failed to read header");
+    if (n_threads > 1)
+      tp.set_io(hts);
+
+    // ADS: htslib header functions are not all safe to use from
+    // several threads, so each step that needs the header has its own
+    const bamxx::bam_header bsrate_hdr(hdr);
+    const bamxx::bam_header counts_hdr(hdr);
+    if (!bsrate_hdr || !counts_hdr) throw dnmt_error("failed to copy header");
+    const size_t n_targets = get_n_targets(hdr);
+
+    read_queue sorted, to_bsrate, to_counts;
+    const bool do_bsrate = !bsrate_file.empty();
+
+    step_errors errors;
+    vector<std::thread> steps;
+    // ADS: the sorted reads are not ready until all have been
+    // formatted, so the sort is done in the same thread as format
+    steps.push_back(errors.run([&]() {
+      bam_file_source in(hts, hdr);
+      queue_sink out(sorted);
+      read_sorter sorter(hdr, tmp_prefix, sort_mem_mb << 20);
+      format_stream(in, sorter, input_format, suff_len, max_frag_len,
+                    n_threads);
+      sorter.finish(out);
+    }));
+    steps.push_back(errors.run([&]() {
+      queue_source in(sorted);
+      queue_sink counts_out(to_counts);
+      queue_sink bsrate_out(to_bsrate);
+      read_tee both(counts_out, bsrate_out);
+      uniq_stream(the_seed, false, n_targets, in, do_bsrate ?
+                  static_cast<read_sink &>(both) : counts_out,
+                  statfile, histfile);
+    }));
+    if (do_bsrate)
+      steps.push_back(errors.run([&]() {
+        queue_source in(to_bsrate);
+        bsrate_stream(VERBOSE, false, false, "", names, seqs, bsrate_hdr, in,
+                      bsrate_file);
+      }));
+    steps.push_back(errors.run([&]() {
+      queue_source in(to_counts);
+      counts_stream(VERBOSE, compress_output, CPG_ONLY, names, seqs,
+                    counts_hdr, in, outfile);
+    }));
+    for (auto &&s : steps)
+      s.join();
+
+    if (!errors.msg.empty())
+      throw dnmt_error(errors.msg);
+  }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
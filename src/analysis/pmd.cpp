@@ -34,7 +34,9 @@
 #include "bsutils.hpp"
 
 #include "TwoStateHMM_PMD.hpp"
+#include "sample_segments.hpp"
 #include "MSite.hpp"
+#include "SiteTable.hpp"
 
 using std::string;
 using std::vector;
@@ -835,7 +837,7 @@ load_array_data(const size_t bin_size,
 
 
 static void
-load_wgbs_data(const size_t bin_size, const string &cpgs_file,
+load_wgbs_data(const size_t bin_size, const SiteTable &sites,
                vector<SimpleGenomicRegion> &bins,
                vector<pair<double, double> > &meth,
                vector<size_t> &reads) {
@@ -843,36 +845,30 @@ load_wgbs_data(const size_t bin_size, const string &cpgs_file,
   meth.clear();
   bins.clear();
 
-  // ADS: loading data each iteration should be put outside loop
-  bgzf_file in(cpgs_file, "r");
-  if (!in) throw runtime_error("bad sites file: " + cpgs_file);
-
   // keep track of the chroms we've seen
-  string curr_chrom;
-  std::unordered_set<string> chroms_seen;
+  std::unordered_set<uint32_t> chroms_seen;
 
-  MSite site;
-  while (read_site(in, site)) {
-    if (curr_chrom != site.chrom) { // handle change of chrom
-      if (chroms_seen.find(site.chrom) != end(chroms_seen))
-        throw runtime_error("sites not sorted");
-      chroms_seen.insert(site.chrom);
-      curr_chrom = site.chrom;
-      reads.push_back(0);
-      meth.push_back(make_pair(0.0, 0.0));
-      bins.push_back(SimpleGenomicRegion(site.chrom, 0, bin_size));
-    }
-    if (site.pos < bins.back().get_start())
+  for (size_t r = 0; r < sites.n_runs(); ++r) { // each run is a new chrom
+    if (!chroms_seen.insert(sites.run_chrom_id(r)).second)
       throw runtime_error("sites not sorted");
-    while (bins.back().get_end() < site.pos) {
-      reads.push_back(0);
-      meth.push_back(make_pair(0.0, 0.0));
-      bins.push_back(SimpleGenomicRegion(site.chrom, bins.back().get_end(),
-                                         bins.back().get_end() + bin_size));
+    const string &chrom = sites.run_chrom_name(r);
+    reads.push_back(0);
+    meth.push_back(make_pair(0.0, 0.0));
+    bins.push_back(SimpleGenomicRegion(chrom, 0, bin_size));
+    for (size_t i = sites.run_begin(r); i < sites.run_end(r); ++i) {
+      const size_t pos = sites.pos[i];
+      if (pos < bins.back().get_start())
+        throw runtime_error("sites not sorted");
+      while (bins.back().get_end() < pos) {
+        reads.push_back(0);
+        meth.push_back(make_pair(0.0, 0.0));
+        bins.push_back(SimpleGenomicRegion(chrom, bins.back().get_end(),
+                                           bins.back().get_end() + bin_size));
+      }
+      reads.back() += sites.n_reads(i);
+      meth.back().first += sites.n_meth[i];
+      meth.back().second += sites.n_unmeth[i];
     }
-    reads.back() += site.n_reads;
-    meth.back().first += site.n_meth();
-    meth.back().second += site.n_unmeth();
   }
 }
 
@@ -905,34 +901,26 @@ remove_empty_bins_at_chrom_start(vector<SimpleGenomicRegion> &bins,
 
 
 static void
-load_read_counts(const string &cpgs_file, const size_t bin_size,
+load_read_counts(const SiteTable &sites, const size_t bin_size,
                  vector<size_t> &reads) {
   reads.clear(); // for safety
 
-  // ADS: loading data each iteration should be put outside loop
-  bgzf_file in(cpgs_file, "r");
-  if (!in) throw runtime_error("bad methcounts file: " + cpgs_file);
-
-  // keep track of where we are and what we've seen
-  size_t bin_start = 0ul;
-  string curr_chrom;
-  std::unordered_set<string> chroms_seen;
+  // keep track of the chroms we've seen
+  std::unordered_set<uint32_t> chroms_seen;
 
-  MSite site;
-  while (read_site(in, site)) {
-    if (curr_chrom != site.chrom) { // handle change of chrom
-      if (chroms_seen.find(site.chrom) != end(chroms_seen))
+  for (size_t r = 0; r < sites.n_runs(); ++r) { // each run is a new chrom
+    if (!chroms_seen.insert(sites.run_chrom_id(r)).second)
+      throw runtime_error("sites not sorted");
+    size_t bin_start = 0;
+    reads.push_back(0);
+    for (size_t i = sites.run_begin(r); i < sites.run_end(r); ++i) {
+      const size_t pos = sites.pos[i];
+      if (pos < bin_start)
         throw runtime_error("sites not sorted");
-      chroms_seen.insert(site.chrom);
-      bin_start = 0;
-      curr_chrom = site.chrom;
-      reads.push_back(0);
+      for (; bin_start + bin_size < pos; bin_start += bin_size)
+        reads.push_back(0);
+      reads.back() += sites.n_reads(i);
     }
-    if (site.pos < bin_start)
-      throw runtime_error("sites not sorted");
-    for (; bin_start + bin_size < site.pos; bin_start += bin_size)
-      reads.push_back(0);
-    reads.back() += site.n_reads;
   }
 }
 
@@ -991,12 +979,12 @@ static size_t
 binsize_selection(const bool &VERBOSE, const size_t resolution,
                   const size_t min_bin_sz, const size_t max_bin_sz,
                   const double conf_level, const double min_frac_passed,
-                  const string &cpgs_file) {
+                  const SiteTable &sites) {
 
   const size_t min_cov_to_pass = get_min_reads_for_confidence(conf_level);
 
   vector<size_t> reads;
-  load_read_counts(cpgs_file, resolution, reads);
+  load_read_counts(sites, resolution, reads);
 
   std::partial_sum(begin(reads), end(reads), begin(reads));
 
@@ -1013,9 +1001,10 @@ binsize_selection(const bool &VERBOSE, const size_t resolution,
 }
 
 
+// sites is empty unless it was loaded to select the bin size
 static void
 load_bins(const size_t bin_size,
-          const string &cpgs_file,
+          const string &cpgs_file, SiteTable &sites,
           vector<SimpleGenomicRegion> &bins,
           vector<pair<double, double> > &meth,
           vector<size_t> &reads, vector<bool> &array_status) {
@@ -1027,7 +1016,9 @@ load_bins(const size_t bin_size,
   if (is_array_data)
     load_array_data(bin_size, cpgs_file, bins, meth, reads);
   else {
-    load_wgbs_data(bin_size, cpgs_file, bins, meth, reads);
+    if (sites.empty()) load_site_table(cpgs_file, sites);
+    load_wgbs_data(bin_size, sites, bins, meth, reads);
+    sites.clear();
     remove_empty_bins_at_chrom_start(bins, meth, reads);
   }
 }
@@ -1091,13 +1082,16 @@ main_pmd(int argc, const char **argv) {
     string outfile;
 
     size_t rng_seed = 408;
+    size_t train_bins = 0;
 
     bool DEBUG = false;
     size_t desert_size = 5000;
     size_t bin_size = 1000;
     size_t max_iterations = 10;
+    size_t n_threads = 1;
     // run mode flags
     bool VERBOSE = false;
+    bool ACCELERATE = false;
     bool ARRAY_MODE = false;
     bool fixed_bin_size = false;
 
@@ -1130,6 +1124,9 @@ main_pmd(int argc, const char **argv) {
     opt_parse.add_opt("arraymode",'a', "All samples are array",
                       false, ARRAY_MODE);
     opt_parse.add_opt("itr", 'i', "max iterations", false, max_iterations);
+    opt_parse.add_opt("accelerate", '\0', "accelerate training with "
+                      "SQUAREM (fewer iterations)", false, ACCELERATE);
+    opt_parse.add_opt("threads", 't', "number of threads", false, n_threads);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     opt_parse.add_opt("debug", 'D', "print more run info", false, DEBUG);
     opt_parse.add_opt("params-in", 'P', "HMM parameter files for "
@@ -1142,6 +1139,9 @@ main_pmd(int argc, const char **argv) {
                       false, params_out_file);
     opt_parse.add_opt("seed", 's', "specify random seed",
                       false, rng_seed);
+    opt_parse.add_opt("train-bins", '\0', "train on random parts of the "
+                      "genome with at least this many bins, then decode "
+                      "all (default: all)", false, train_bins);
 
     vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -1175,6 +1175,11 @@ main_pmd(int argc, const char **argv) {
 
     size_t n_replicates = cpgs_file.size();
 
+    // ADS: with one WGBS file its sites are read once and kept until
+    // they are put in bins; with more, each is read again for binning
+    // so only one file of sites is in memory at a time
+    vector<SiteTable> sites(n_replicates);
+
     bool insufficient_data = false; // ADS: this is used now to detect
                                     // when the counts files have
                                     // lines for CpG sites, but no
@@ -1190,10 +1195,12 @@ main_pmd(int argc, const char **argv) {
       for (size_t i = 0; i < n_replicates && !insufficient_data; ++i) {
         const bool arrayData = check_if_array_data(cpgs_file[i]);
         if (!arrayData) {
+          load_site_table(cpgs_file[i], sites[i]);
           bin_size = binsize_selection(VERBOSE, resolution,
                                        min_bin_size, max_bin_size,
                                        confidence_interval, prop_accept,
-                                       cpgs_file[i]);
+                                       sites[i]);
+          if (n_replicates > 1) sites[i].clear();
           if (bin_size == std::numeric_limits<size_t>::max())
             insufficient_data = true;
           desert_size = 5*bin_size; // TODO: explore extrapolation number
@@ -1235,7 +1242,7 @@ main_pmd(int argc, const char **argv) {
       if (VERBOSE)
         cerr << "[READING CPGS AND METH PROPS] from " << cpgs_file[i] << endl;
 
-      load_bins(bin_size, cpgs_file[i], bins[i], meth[i],
+      load_bins(bin_size, cpgs_file[i], sites[i], bins[i], meth[i],
                 reads[i], array_status);
       const double total_observations =
         accumulate(begin(reads[i]), end(reads[i]), 0);
@@ -1282,7 +1289,8 @@ main_pmd(int argc, const char **argv) {
     vector<double> start_trans(2, 0.5), end_trans(2, 1e-10);
     vector<vector<double> > trans(2, vector<double>(2, 0.01));
     trans[0][0] = trans[1][1] = 0.99;
-    const TwoStateHMM hmm(min_prob, tolerance, max_iterations, VERBOSE, DEBUG);
+    const TwoStateHMM hmm(min_prob, tolerance, max_iterations, VERBOSE, DEBUG,
+                          n_threads, ACCELERATE);
     vector<double> reps_fg_alpha(n_replicates, 0.05);
     vector<double> reps_fg_beta(n_replicates, 0.95);
     vector<double> reps_bg_alpha(n_replicates, 0.95);
@@ -1298,7 +1306,22 @@ main_pmd(int argc, const char **argv) {
     }
 
     // train model (default behavior; not done when params supplied)
-    if (max_iterations > 0)
+    if (max_iterations > 0 && train_bins > 0 &&
+        train_bins < meth.front().size()) {
+      vector<size_t> train_idx, train_reset_points;
+      sample_segments(reset_points, train_bins, rng_seed,
+                      train_idx, train_reset_points);
+      vector<vector<pair<double, double> > > train_meth(n_replicates);
+      for (size_t i = 0; i < n_replicates; ++i)
+        select_sites(train_idx, meth[i], train_meth[i]);
+      if (VERBOSE)
+        cerr << "[TRAINING ON " << train_idx.size() << " BINS]" << endl;
+      hmm.BaumWelchTraining_rep(train_meth, train_reset_points,
+                                start_trans, trans, end_trans,
+                                reps_fg_alpha, reps_fg_beta,
+                                reps_bg_alpha, reps_bg_beta, array_status);
+    }
+    else if (max_iterations > 0)
       hmm.BaumWelchTraining_rep(meth, reset_points,
                                 start_trans, trans, end_trans,
                                 reps_fg_alpha, reps_fg_beta,
@@ -34,6 +34,7 @@
 #include "GenomicRegion.hpp"
 
 #include "MSite.hpp"
+#include "BinaryMethylome.hpp"
 
 #include "bsutils.hpp"
 
@@ -319,16 +320,47 @@ get_cpg_stats(ifstream &cpg_in, const GenomicRegion region,
 }
 
 
+// same as above, but the index of the binary methylome finds the sites
 static void
+get_cpg_stats(const BinaryMethylome &cpgs, const GenomicRegion region,
+              size_t &total_meth, size_t &total_reads,
+              size_t &total_cpgs, size_t &cpgs_with_reads,
+              size_t &called_total, size_t &called_meth,
+              double &mean_meth) {
+
+  auto sites = cpgs.query(region.get_chrom(), region.get_start(),
+                          region.get_end());
+  const BinaryMethylome::site_record *cpg = nullptr, *cpgs_end = nullptr;
+  while (sites.next(cpg, cpgs_end))
+    for (; cpg != cpgs_end; ++cpg) {
+      ++total_cpgs;
+      if (cpg->n_reads() > 0) {
+
+        total_meth += cpg->n_meth;
+        total_reads += cpg->n_reads();
+        ++cpgs_with_reads;
+
+        auto calls = meth_unmeth_calls(cpg->n_meth, cpg->n_unmeth);
+        called_total += (calls.first || calls.second);
+        called_meth += calls.first;
+
+        mean_meth += cpg->meth();
+      }
+    }
+}
+
+
+/* The sites are from an ifstream for a counts file, or from a binary
+   methylome, depending on how get_cpg_stats is called for T */
+template<class T> static void
 process_with_cpgs_on_disk(const bool PRINT_NUMERIC_ONLY,
                           const bool report_more_information,
                           const char level_code,
-                          const string &cpgs_file,
+                          T &in,
                           vector<GenomicRegion> &regions,
                           std::ostream &out) {
 
-  ifstream in(cpgs_file);
-  for (size_t i = 0; i < regions.size() && in; ++i) {
+  for (size_t i = 0; i < regions.size(); ++i) {
 
     size_t total_meth = 0, total_reads = 0;
     size_t cpgs_with_reads = 0;
@@ -483,7 +515,8 @@ Columns (beyond the first 6) in the BED format output:
       throw runtime_error("The file seems to be a methylation file: " +
           regions_file + "\nCheck the order of the input arguments");
     }
-    if (!is_msite_file(cpgs_file)) {
+    const bool is_binary = BinaryMethylome::is_binary_methylome(cpgs_file);
+    if (!is_binary && !is_msite_file(cpgs_file)) {
       cerr << opt_parse.help_message() << endl;
       throw runtime_error("The file is not a methylation file: " + cpgs_file);
     }
@@ -515,17 +548,28 @@ Columns (beyond the first 6) in the BED format output:
     }
     std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
 
-    if (load_entire_file)
+    if (is_binary) {
+      // ADS: the binary methylome is always searched with its index
+      const BinaryMethylome cpgs(cpgs_file);
+      process_with_cpgs_on_disk(PRINT_NUMERIC_ONLY,
+                                report_more_information,
+                                level_code[0],
+                                cpgs, regions, out);
+    }
+    else if (load_entire_file)
       process_with_cpgs_loaded(VERBOSE, sort_data_if_needed,
                                PRINT_NUMERIC_ONLY,
                                report_more_information,
                                level_code[0],
                                cpgs_file, regions, out);
-    else
+    else {
+      ifstream in(cpgs_file);
+      if (!in) throw runtime_error("cannot open file: " + cpgs_file);
       process_with_cpgs_on_disk(PRINT_NUMERIC_ONLY,
                                 report_more_information,
                                 level_code[0],
-                                cpgs_file, regions, out);
+                                in, regions, out);
+    }
   }
   catch (const std::exception &e) {
     cerr << e.what() << endl;
@@ -0,0 +1,260 @@
+/* bench_count_states: time counting the bases of reads by decoding
+ * one base at a time with bam_seqi, as counts did before, against
+ * for_each_base, which decodes a byte at a time through a table.
+ *
+ * Copyright (C) 2026 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/* This is not part of dnmtools and is not built by default. Build and
+   run it with:
+
+   $ make bench_count_states
+   $ ./bench_count_states [n-reads] [n-rounds]
+
+   The reads are made in memory, with random bases and cigars that
+   have insertions and deletions, half of them on each strand. Both
+   ways of counting must give the same counts, and the time for each
+   is reported per base. */
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "bam_record_utils.hpp"
+
+using std::array;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using bamxx::bam_rec;
+
+static const size_t read_length = 150;
+static const size_t genome_size = 1 << 20;
+
+static inline bool
+eats_ref(const uint32_t c) {return bam_cigar_type(bam_cigar_op(c)) & 2;}
+
+static inline bool
+eats_query(const uint32_t c) {return bam_cigar_type(bam_cigar_op(c)) & 1;}
+
+// the counts of A, C, G and T on each strand at each position, in the
+// same order as base_code, with the negative strand after
+struct base_counts {
+  base_counts() : counts(genome_size) {}
+
+  // as counts did with a character for each base
+  void add_count_pos(const size_t pos, const char x) {
+    array<uint32_t, 8> &c = counts[pos];
+    if (x == 'T') ++c[base_t];
+    else if (x == 'C') ++c[base_c];
+    else if (x == 'G') ++c[base_g];
+    else if (x == 'A') ++c[base_a];
+  }
+  void add_count_neg(const size_t pos, const char x) {
+    array<uint32_t, 8> &c = counts[pos];
+    if (x == 'T') ++c[4 + base_t];
+    else if (x == 'C') ++c[4 + base_c];
+    else if (x == 'G') ++c[4 + base_g];
+    else if (x == 'A') ++c[4 + base_a];
+  }
+
+  // as counts does with a base_code
+  void add_code_pos(const size_t pos, const uint8_t code) {
+    if (code <= base_t) ++counts[pos][code];
+  }
+  void add_code_neg(const size_t pos, const uint8_t code) {
+    if (code <= base_t) ++counts[pos][4 + code];
+  }
+
+  vector<array<uint32_t, 8>> counts;
+};
+
+static void
+count_states_pos_old(const bam_rec &aln, base_counts &counts) {
+  const auto seq = bam_get_seq(aln);
+  const auto beg_cig = bam_get_cigar(aln);
+  const auto end_cig = beg_cig + get_n_cigar(aln);
+  auto rpos = get_pos(aln);
+  auto qpos = 0;
+  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
+    const char op = bam_cigar_op(*c_itr);
+    const uint32_t n = bam_cigar_oplen(*c_itr);
+    if (eats_ref(op) && eats_query(op)) {
+      const decltype(qpos) end_qpos = qpos + n;
+      for (; qpos < end_qpos; ++qpos)
+        counts.add_count_pos(rpos++, seq_nt16_str[bam_seqi(seq, qpos)]);
+    }
+    else if (eats_query(op)) qpos += n;
+    else if (eats_ref(op)) rpos += n;
+  }
+}
+
+static void
+count_states_neg_old(const bam_rec &aln, base_counts &counts) {
+  const auto seq = bam_get_seq(aln);
+  const auto beg_cig = bam_get_cigar(aln);
+  const auto end_cig = beg_cig + get_n_cigar(aln);
+  size_t rpos = get_pos(aln);
+  size_t qpos = get_l_qseq(aln);
+  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
+    const char op = bam_cigar_op(*c_itr);
+    const uint32_t n = bam_cigar_oplen(*c_itr);
+    if (eats_ref(op) && eats_query(op)) {
+      const size_t end_qpos = qpos - n;
+      for (; qpos > end_qpos; --qpos)
+        counts.add_count_neg(rpos++, seq_nt16_str[bam_seqi(seq, qpos-1)]);
+    }
+    else if (eats_query(op)) qpos -= n;
+    else if (eats_ref(op)) rpos += n;
+  }
+}
+
+static void
+count_states_pos_new(const bam_rec &aln, base_counts &counts) {
+  const auto seq = bam_get_seq(aln);
+  const auto beg_cig = bam_get_cigar(aln);
+  const auto end_cig = beg_cig + get_n_cigar(aln);
+  auto rpos = get_pos(aln);
+  size_t qpos = 0;
+  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
+    const char op = bam_cigar_op(*c_itr);
+    const uint32_t n = bam_cigar_oplen(*c_itr);
+    if (eats_ref(op) && eats_query(op)) {
+      for_each_base(seq, qpos, n, [&](const uint8_t code) {
+        counts.add_code_pos(rpos++, code);
+      });
+      qpos += n;
+    }
+    else if (eats_query(op)) qpos += n;
+    else if (eats_ref(op)) rpos += n;
+  }
+}
+
+static void
+count_states_neg_new(const bam_rec &aln, base_counts &counts) {
+  const auto seq = bam_get_seq(aln);
+  const auto beg_cig = bam_get_cigar(aln);
+  const auto end_cig = beg_cig + get_n_cigar(aln);
+  size_t rpos = get_pos(aln);
+  size_t qpos = get_l_qseq(aln);
+  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
+    const char op = bam_cigar_op(*c_itr);
+    const uint32_t n = bam_cigar_oplen(*c_itr);
+    if (eats_ref(op) && eats_query(op)) {
+      for_each_base_rev(seq, qpos, n, [&](const uint8_t code) {
+        counts.add_code_neg(rpos++, code);
+      });
+      qpos -= n;
+    }
+    else if (eats_query(op)) qpos -= n;
+    else if (eats_ref(op)) rpos += n;
+  }
+}
+
+/* Reads with random bases, a few of them N, and a cigar that is all M
+   for most reads, or has an insertion or deletion in the middle. */
+static void
+make_reads(const size_t n_reads, vector<bam_rec> &reads) {
+  static const char bases[] = "ACGTACGTACGTACGTACGTN";
+  std::mt19937 rng(408);
+  std::uniform_int_distribution<size_t> base_dist(0, sizeof(bases) - 2);
+  std::uniform_int_distribution<size_t> pos_dist(0, genome_size -
+                                                 2*read_length);
+  std::uniform_int_distribution<uint32_t> kind_dist(0, 3);
+
+  string seq(read_length, 'N');
+  const string qual(read_length, 'I');
+  reads.resize(n_reads);
+  for (size_t i = 0; i < n_reads; ++i) {
+    for (auto &&c : seq) c = bases[base_dist(rng)];
+    vector<uint32_t> cigar;
+    const uint32_t kind = kind_dist(rng);
+    if (kind == 0)  // an insertion
+      cigar = {bam_cigar_gen(70, BAM_CMATCH), bam_cigar_gen(3, BAM_CINS),
+               bam_cigar_gen(77, BAM_CMATCH)};
+    else if (kind == 1)  // a deletion
+      cigar = {bam_cigar_gen(71, BAM_CMATCH), bam_cigar_gen(2, BAM_CDEL),
+               bam_cigar_gen(79, BAM_CMATCH)};
+    else
+      cigar = {bam_cigar_gen(read_length, BAM_CMATCH)};
+    const string name("read" + std::to_string(i));
+    const uint16_t flag = (i & 1) ? BAM_FREVERSE : 0;
+    if (bam_set1(reads[i].b, name.size(), name.data(), flag, 0,
+                 pos_dist(rng), 255, cigar.size(), cigar.data(), -1, -1, 0,
+                 seq.size(), seq.data(), qual.data(), 0) < 0)
+      throw std::runtime_error("failed to make read");
+  }
+}
+
+template<class F> static double
+time_counting(const vector<bam_rec> &reads, const size_t n_rounds,
+              base_counts &counts, F count_read) {
+  const auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n_rounds; ++i)
+    for (auto &&aln : reads)
+      count_read(aln, counts);
+  const auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+int
+main(int argc, const char **argv) {
+  try {
+    const size_t n_reads = argc > 1 ? std::stoul(argv[1]) : 1000000;
+    const size_t n_rounds = argc > 2 ? std::stoul(argv[2]) : 5;
+
+    vector<bam_rec> reads;
+    make_reads(n_reads, reads);
+    size_t n_bases = 0;
+    for (auto &&aln : reads) n_bases += get_l_qseq(aln);
+    n_bases *= n_rounds;
+
+    base_counts old_counts, new_counts;
+    const double old_time =
+      time_counting(reads, n_rounds, old_counts,
+                    [](const bam_rec &aln, base_counts &c) {
+                      if (bam_is_rev(aln)) count_states_neg_old(aln, c);
+                      else count_states_pos_old(aln, c);
+                    });
+    const double new_time =
+      time_counting(reads, n_rounds, new_counts,
+                    [](const bam_rec &aln, base_counts &c) {
+                      if (bam_is_rev(aln)) count_states_neg_new(aln, c);
+                      else count_states_pos_new(aln, c);
+                    });
+    if (old_counts.counts != new_counts.counts)
+      throw std::runtime_error("counts differ");
+
+    cout << "reads: " << n_reads << endl
+         << "rounds: " << n_rounds << endl
+         << "bam_seqi (ns/base): " << 1e9*old_time/n_bases << endl
+         << "for_each_base (ns/base): " << 1e9*new_time/n_bases << endl
+         << "speedup: " << old_time/new_time << endl;
+  }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -73,20 +73,24 @@ betabin::tostring() const {
 }
 
 
-double
-betabin::operator()(const pair<double, double> &val) const {
+static inline double
+betabin_log_likelihood(const double alpha, const double beta,
+                       const double lnbeta_helper,
+                       const pair<double, double> &val) {
   const size_t x = static_cast<size_t>(val.first);
   const size_t n = static_cast<size_t>(x + val.second);
   return gsl_sf_lnchoose(n, x) +
     gsl_sf_lnbeta(alpha + x, beta + val.second) - lnbeta_helper;
 }
 
+double
+betabin::operator()(const pair<double, double> &val) const {
+  return betabin_log_likelihood(alpha, beta, lnbeta_helper, val);
+}
+
 double
 betabin::log_likelihood(const pair<double, double> &val) const {
-  const size_t x = static_cast<size_t>(val.first);
-  const size_t n = static_cast<size_t>(x + val.second);
-  return gsl_sf_lnchoose(n, x) +
-    gsl_sf_lnbeta(alpha + x, beta + val.second) - lnbeta_helper;
+  return betabin_log_likelihood(alpha, beta, lnbeta_helper, val);
 }
 
 double
@@ -128,3 +132,46 @@ betabin::fit(const vector<double> &vals_a, const vector<double> &vals_b,
   }
   lnbeta_helper = gsl_sf_lnbeta(alpha, beta);
 }
+
+
+//////////////////////////////////////////////
+//////       class betabin_table        //////
+//////////////////////////////////////////////
+
+betabin_table::betabin_table(const vector<pair<double, double> > &values,
+                             const size_t max_dense_n) {
+  for (auto &&v : values) {
+    uint32_t x = 0, n = 0;
+    if (get_counts(v, x, n)) {
+      if (n <= max_dense_n)
+        dense_lim = max(dense_lim, static_cast<size_t>(n) + 1);
+      else if (tail_idx.emplace(tail_key(x, n), tail_vals.size()).second)
+        tail_vals.push_back(v);
+    }
+  }
+  dense.resize(dense_lim*(dense_lim + 1)/2);
+  tail.resize(tail_vals.size());
+}
+
+
+void
+betabin_table::set_params(const double a, const double b) {
+  if (has_params(a, b)) return;
+  alpha = a;
+  beta = b;
+  lnbeta_helper = gsl_sf_lnbeta(alpha, beta);
+  // ADS: each value is computed just as betabin does, to give the same bits
+  for (size_t n = 0; n < dense_lim; ++n)
+    for (size_t x = 0; x <= n; ++x)
+      dense[n*(n + 1)/2 + x] =
+        betabin_log_likelihood(alpha, beta, lnbeta_helper,
+                               pair<double, double>(x, n - x));
+  for (size_t i = 0; i < tail_vals.size(); ++i)
+    tail[i] = betabin_log_likelihood(alpha, beta, lnbeta_helper, tail_vals[i]);
+}
+
+
+double
+betabin_table::direct(const pair<double, double> &val) const {
+  return betabin_log_likelihood(alpha, beta, lnbeta_helper, val);
+}
@@ -21,6 +21,8 @@
 #include <utility>
 #include <string>
 #include <vector>
+#include <cstdint>
+#include <unordered_map>
 
 struct betabin {
   betabin();
@@ -42,4 +44,68 @@ struct betabin {
   static const double tolerance;
 };
 
+/* betabin_table has the log likelihoods from betabin(alpha, beta) for
+   the (meth, unmeth) counts in some data. These are small whole
+   numbers that repeat at many sites, so with the table each one is
+   computed once for each alpha and beta instead of once for each site.
+   Counts with total up to "max_dense_n" have a place for each (x, n)
+   and the rest, usually few, are found through a hash table made from
+   the data. Values that are not whole numbers, or are not in the data,
+   are computed directly. The table must be set for the parameters with
+   set_params before use and again each time they change; after that
+   it is only read, so threads can share it. */
+class betabin_table {
+public:
+  static const size_t default_max_dense_n = 256;
+
+  betabin_table() {}
+  explicit betabin_table(const std::vector<std::pair<double, double> > &values,
+                         const size_t max_dense_n = default_max_dense_n);
+
+  void set_params(const double a, const double b);
+  bool has_params(const double a, const double b) const {
+    return a == alpha && b == beta;
+  }
+
+  // the same value as from betabin(alpha, beta)
+  double operator()(const std::pair<double, double> &val) const {
+    uint32_t x = 0, n = 0;
+    if (get_counts(val, x, n)) {
+      if (n < dense_lim)
+        return dense[n*(n + 1ul)/2 + x];
+      const auto itr = tail_idx.find(tail_key(x, n));
+      if (itr != end(tail_idx))
+        return tail[itr->second];
+    }
+    return direct(val);
+  }
+
+private:
+  static bool
+  get_counts(const std::pair<double, double> &val, uint32_t &x, uint32_t &n) {
+    static const double lim = 1u << 30;
+    if (!(val.first >= 0.0 && val.second >= 0.0 &&
+          val.first < lim && val.second < lim))
+      return false;
+    x = static_cast<uint32_t>(val.first);
+    const uint32_t y = static_cast<uint32_t>(val.second);
+    n = x + y;
+    return x == val.first && y == val.second;
+  }
+  static uint64_t
+  tail_key(const uint32_t x, const uint32_t n) {
+    return (static_cast<uint64_t>(n) << 32) | x;
+  }
+  double direct(const std::pair<double, double> &val) const;
+
+  size_t dense_lim{0};  // one more than the largest n in "dense"
+  std::vector<double> dense;
+  std::unordered_map<uint64_t, size_t> tail_idx;
+  std::vector<std::pair<double, double> > tail_vals;
+  std::vector<double> tail;
+  double alpha{-1.0};
+  double beta{-1.0};
+  double lnbeta_helper{0.0};
+};
+
 #endif
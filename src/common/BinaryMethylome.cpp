@@ -0,0 +1,344 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "BinaryMethylome.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <cstring>
+
+#include <zlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "smithlab_os.hpp"
+#include "dnmt_error.hpp"
+
+using std::string;
+using std::vector;
+
+typedef BinaryMethylome::site_record site_record;
+typedef BinaryMethylome::chrom_entry chrom_entry;
+typedef BinaryMethylome::block_entry block_entry;
+
+static_assert(sizeof(site_record) == 16, "site_record must be 16 bytes");
+static_assert(sizeof(block_entry) == 24, "block_entry must be 24 bytes");
+
+static const char binary_methylome_magic[] = "DNMTMETH";
+static const size_t magic_size = 8;
+static const uint64_t binary_methylome_version = 2;
+static const size_t header_size = magic_size + sizeof(uint64_t);
+static const size_t footer_size = sizeof(uint64_t) + magic_size;
+static const size_t max_record_value = std::numeric_limits<uint32_t>::max();
+
+// the contexts as written for an MSite, without the "x" if mutated
+static const char *context_names[] = {"CpG", "CHH", "CXG", "CCG", "N", "N"};
+
+
+bool
+BinaryMethylome::interval::next(const site_record *&first,
+                                const site_record *&last) {
+  while (block < block_end) {
+    const block_entry &b = methylome->blocks[block++];
+    if (b.first_pos >= end) {
+      block = block_end;
+      return false;
+    }
+    methylome->decompress(&b - methylome->blocks, buf);
+    const auto cmp = [](const site_record &r, const size_t p) {
+      return r.pos < p;
+    };
+    const site_record *buf_begin = buf.data();
+    const site_record *buf_end = buf_begin + buf.size();
+    first = std::lower_bound(buf_begin, buf_end, start, cmp);
+    last = std::lower_bound(first, buf_end, end, cmp);
+    if (first != last) return true;
+  }
+  return false;
+}
+
+
+BinaryMethylome::BinaryMethylome(const string &filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) throw dnmt_error("failed to open binary methylome: " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw dnmt_error("failed to stat binary methylome: " + filename);
+  }
+  file_size = st.st_size;
+  if (file_size < header_size + footer_size + 2*sizeof(uint64_t)) {
+    close(fd);
+    throw dnmt_error("bad binary methylome file: " + filename);
+  }
+  void *m = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (m == MAP_FAILED)
+    throw dnmt_error("failed to map binary methylome: " + filename);
+  data = static_cast<const uint8_t*>(m);
+
+  const auto bad_file = [&] {
+    munmap(const_cast<uint8_t*>(data), file_size);
+    data = nullptr;
+    throw dnmt_error("bad binary methylome file: " + filename);
+  };
+
+  uint64_t version = 0, index_offset = 0;
+  std::memcpy(&version, data + magic_size, sizeof(uint64_t));
+  const uint8_t *footer = data + file_size - footer_size;
+  std::memcpy(&index_offset, footer, sizeof(uint64_t));
+  if (std::memcmp(data, binary_methylome_magic, magic_size) != 0 ||
+      std::memcmp(footer + sizeof(uint64_t), binary_methylome_magic,
+                  magic_size) != 0 ||
+      version != binary_methylome_version ||
+      index_offset % sizeof(uint64_t) != 0 ||
+      index_offset + 2*sizeof(uint64_t) > file_size - footer_size)
+    bad_file();
+
+  uint64_t n_chroms = 0, n_blocks = 0;
+  std::memcpy(&n_chroms, data + index_offset, sizeof(uint64_t));
+  std::memcpy(&n_blocks, data + index_offset + sizeof(uint64_t),
+              sizeof(uint64_t));
+  const size_t chroms_offset = index_offset + 2*sizeof(uint64_t);
+  const size_t blocks_offset = chroms_offset + n_chroms*sizeof(chrom_entry);
+  if (blocks_offset + n_blocks*sizeof(block_entry) > file_size - footer_size)
+    bad_file();
+  chroms = reinterpret_cast<const chrom_entry*>(data + chroms_offset);
+  blocks = reinterpret_cast<const block_entry*>(data + blocks_offset);
+
+  for (size_t i = 0; i < n_chroms; ++i) {
+    const chrom_entry &c = chroms[i];
+    if (c.name_offset + c.name_size > file_size - footer_size ||
+        c.first_block + c.n_blocks > n_blocks)
+      bad_file();
+    names.emplace_back(reinterpret_cast<const char*>(data + c.name_offset),
+                       c.name_size);
+    name_to_idx[names.back()] = i;
+  }
+  for (size_t i = 0; i < n_blocks; ++i)
+    if (blocks[i].offset + blocks[i].compressed_size > index_offset ||
+        blocks[i].n_sites > block_size)
+      bad_file();
+}
+
+
+BinaryMethylome::~BinaryMethylome() {
+  if (data) munmap(const_cast<uint8_t*>(data), file_size);
+}
+
+
+void
+BinaryMethylome::decompress(const size_t block_idx,
+                            vector<site_record> &buf) const {
+  const block_entry &b = blocks[block_idx];
+  buf.resize(b.n_sites);
+  uLongf n_bytes = b.n_sites*sizeof(site_record);
+  const int ret = uncompress(reinterpret_cast<Bytef*>(buf.data()), &n_bytes,
+                             data + b.offset, b.compressed_size);
+  if (ret != Z_OK || n_bytes != b.n_sites*sizeof(site_record))
+    throw dnmt_error(ret, "failed to decompress block in binary methylome");
+}
+
+
+BinaryMethylome::interval
+BinaryMethylome::query(const string &chrom, const size_t start,
+                       const size_t end) const {
+  const auto itr = name_to_idx.find(chrom);
+  if (itr == std::end(name_to_idx) || start >= end)
+    return interval(*this, 0, 0, start, end);
+  const chrom_entry &c = chroms[itr->second];
+  // ADS: the first block that ends at or after start
+  const block_entry *first = blocks + c.first_block;
+  const block_entry *last = first + c.n_blocks;
+  first = std::lower_bound(first, last, start,
+                           [](const block_entry &b, const size_t p) {
+                             return b.last_pos < p;
+                           });
+  return interval(*this, first - blocks, last - blocks, start, end);
+}
+
+
+BinaryMethylome::interval
+BinaryMethylome::query(const size_t chrom_idx) const {
+  const chrom_entry &c = chroms[chrom_idx];
+  return interval(*this, c.first_block, c.first_block + c.n_blocks,
+                  0, std::numeric_limits<size_t>::max());
+}
+
+
+MSite
+BinaryMethylome::get_site(const string &chrom, const site_record &r) {
+  string context(context_names[static_cast<size_t>(r.context)]);
+  if (r.mutated) context += 'x';
+  return MSite(chrom, r.pos, r.strand, context, r.meth(), r.n_reads());
+}
+
+
+bool
+BinaryMethylome::is_binary_methylome(const string &filename) {
+  if (isdir(filename.c_str())) return false;
+  std::ifstream in(filename, std::ios::binary);
+  char buf[magic_size];
+  return in.read(buf, magic_size) &&
+    std::memcmp(buf, binary_methylome_magic, magic_size) == 0;
+}
+
+
+/* Everything below is for making a binary methylome */
+
+BinaryMethylomeWriter::BinaryMethylomeWriter(const string &fn) :
+  out(fn, std::ios::binary), filename{fn} {
+  if (!out) throw dnmt_error("failed to open output file: " + filename);
+  out.write(binary_methylome_magic, magic_size);
+  out.write(reinterpret_cast<const char*>(&binary_methylome_version),
+            sizeof(uint64_t));
+  offset = header_size;
+  buf.reserve(BinaryMethylome::block_size);
+}
+
+
+BinaryMethylomeWriter::~BinaryMethylomeWriter() {
+  // ADS: destructors can't throw, so errors here are not reported
+  if (!closed) {
+    try {close();}
+    catch (...) {}
+  }
+}
+
+
+void
+BinaryMethylomeWriter::write_block() {
+  if (buf.empty()) return;
+  const uLong n_bytes = buf.size()*sizeof(site_record);
+  uLongf n_compressed = compressBound(n_bytes);
+  compressed.resize(n_compressed);
+  const int ret = compress(compressed.data(), &n_compressed,
+                           reinterpret_cast<const Bytef*>(buf.data()),
+                           n_bytes);
+  if (ret != Z_OK)
+    throw dnmt_error(ret, "failed to compress block for: " + filename);
+
+  block_entry b;
+  b.offset = offset;
+  b.compressed_size = n_compressed;
+  b.n_sites = buf.size();
+  b.first_pos = buf.front().pos;
+  b.last_pos = buf.back().pos;
+  blocks.push_back(b);
+  ++chroms.back().n_blocks;
+
+  out.write(reinterpret_cast<const char*>(compressed.data()), n_compressed);
+  if (!out) throw dnmt_error("failed writing output file: " + filename);
+  offset += n_compressed;
+  buf.clear();
+}
+
+
+void
+BinaryMethylomeWriter::write(const string &the_chrom, const size_t pos,
+                             const char strand, const msite_context context,
+                             const bool mutated, const size_t n_meth,
+                             const size_t n_unmeth) {
+  if (pos > max_record_value || n_meth + n_unmeth > max_record_value)
+    throw dnmt_error("site too large for binary methylome: " +
+                     the_chrom + ":" + std::to_string(pos));
+
+  if (chroms.empty() || the_chrom != chrom) {
+    write_block();
+    if (name_to_idx.find(the_chrom) != std::end(name_to_idx))
+      throw dnmt_error("sites not grouped by chrom at: " + the_chrom);
+    name_to_idx[the_chrom] = names.size();
+    names.push_back(the_chrom);
+    chrom = the_chrom;
+    chrom_entry c;
+    c.name_offset = 0; // known when the index is written
+    c.name_size = the_chrom.size();
+    c.first_block = blocks.size();
+    c.n_blocks = 0;
+    chroms.push_back(c);
+  }
+  else if (pos < (buf.empty() ? blocks.back().last_pos : buf.back().pos))
+    throw dnmt_error("sites not sorted at: " + the_chrom + ":" +
+                     std::to_string(pos));
+
+  site_record r;
+  r.pos = pos;
+  r.n_meth = n_meth;
+  r.n_unmeth = n_unmeth;
+  r.strand = strand;
+  r.context = context;
+  r.mutated = mutated;
+  r.unused = 0;
+  buf.push_back(r);
+  if (buf.size() == BinaryMethylome::block_size)
+    write_block();
+}
+
+
+void
+BinaryMethylomeWriter::write(const MSite &s) {
+  msite_context context = msite_context::other;
+  if (s.is_cpg()) context = msite_context::cpg;
+  else if (s.is_chh()) context = msite_context::chh;
+  else if (s.is_cxg()) context = msite_context::cxg;
+  else if (s.is_ccg()) context = msite_context::ccg;
+  else if (!s.context.empty() && s.context[0] == 'N')
+    context = msite_context::n;
+  write(s.chrom, s.pos, s.strand, context, s.is_mutated(),
+        s.n_meth(), s.n_unmeth());
+}
+
+
+void
+BinaryMethylomeWriter::close() {
+  closed = true;
+  write_block();
+
+  // ADS: the index is used in place from the mapped file, so its
+  // entries must be aligned like the uint64_t values in them
+  static const char padding[sizeof(uint64_t)] = {};
+  const size_t n_pad = (sizeof(uint64_t) - offset % sizeof(uint64_t)) %
+    sizeof(uint64_t);
+  out.write(padding, n_pad);
+  offset += n_pad;
+
+  const uint64_t index_offset = offset;
+  const uint64_t n_chroms = chroms.size();
+  const uint64_t n_blocks = blocks.size();
+  uint64_t name_offset = index_offset + 2*sizeof(uint64_t) +
+    n_chroms*sizeof(chrom_entry) + n_blocks*sizeof(block_entry);
+  for (auto &&c: chroms) {
+    c.name_offset = name_offset;
+    name_offset += c.name_size;
+  }
+
+  out.write(reinterpret_cast<const char*>(&n_chroms), sizeof(uint64_t));
+  out.write(reinterpret_cast<const char*>(&n_blocks), sizeof(uint64_t));
+  out.write(reinterpret_cast<const char*>(chroms.data()),
+            n_chroms*sizeof(chrom_entry));
+  out.write(reinterpret_cast<const char*>(blocks.data()),
+            n_blocks*sizeof(block_entry));
+  for (auto &&i: names)
+    out.write(i.data(), i.size());
+  out.write(reinterpret_cast<const char*>(&index_offset), sizeof(uint64_t));
+  out.write(binary_methylome_magic, magic_size);
+  out.close();
+  if (!out) throw dnmt_error("failed writing output file: " + filename);
+}
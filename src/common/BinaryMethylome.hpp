@@ -0,0 +1,186 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef BINARY_METHYLOME_HPP
+#define BINARY_METHYLOME_HPP
+
+/* A binary methylome holds the same sites as a counts file, but as
+   fixed size records in blocks that are compressed separately with
+   zlib, and with an index giving the chrom and the first and last
+   position of each block. To get the sites in an interval, a binary
+   search in the index finds the first block, and the blocks are
+   decompressed one at a time into a buffer that is used directly as
+   an array of records, so nothing is parsed or copied.
+
+   Sites must be sorted by position within each chrom, and all sites
+   for a chrom must be together, but chroms can be in any order. A
+   block only has sites from one chrom.
+
+   All integers are in the byte order of the machine that made the
+   file, and the layout is:
+
+   header:   magic, version
+   blocks:   zlib compressed arrays of site_record, then zeros up to
+             a multiple of 8 bytes
+   index:    n_chroms, n_blocks, a chrom_entry for each chrom, a
+             block_entry for each block, then the chrom names
+   footer:   offset of the index, magic
+*/
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <unordered_map>
+
+#include "MSite.hpp"
+
+class BinaryMethylome {
+public:
+  struct site_record {
+    uint32_t pos;
+    uint32_t n_meth;
+    uint32_t n_unmeth;
+    char strand;
+    msite_context context;
+    uint8_t mutated;
+    uint8_t unused;
+
+    uint32_t n_reads() const {return n_meth + n_unmeth;}
+    double meth() const {
+      const uint32_t n = n_reads();
+      return n > 0 ? static_cast<double>(n_meth)/n : 0.0;
+    }
+  };
+
+  struct chrom_entry {
+    uint64_t name_offset;
+    uint64_t name_size;
+    uint64_t first_block;
+    uint64_t n_blocks;
+  };
+
+  struct block_entry {
+    uint64_t offset;
+    uint32_t compressed_size;
+    uint32_t n_sites;
+    uint32_t first_pos;
+    uint32_t last_pos;
+  };
+
+  // maximum number of sites in a block
+  static const size_t block_size = 4096;
+
+  /* An interval gives the sites in [start, end) on one chrom as a
+     sequence of ranges, each inside one block. The records are in a
+     buffer owned by the interval, which is reused for each block. */
+  class interval {
+  public:
+    // false when there are no more sites in the interval
+    bool next(const site_record *&first, const site_record *&last);
+
+  private:
+    friend class BinaryMethylome;
+    interval(const BinaryMethylome &m, const size_t b, const size_t b_end,
+             const size_t s, const size_t e) :
+      methylome{&m}, block{b}, block_end{b_end}, start{s}, end{e} {}
+
+    const BinaryMethylome *methylome;
+    size_t block;
+    size_t block_end;
+    size_t start;
+    size_t end;
+    std::vector<site_record> buf;
+  };
+
+  explicit BinaryMethylome(const std::string &filename);
+  ~BinaryMethylome();
+  BinaryMethylome(const BinaryMethylome &) = delete;
+  BinaryMethylome &operator=(const BinaryMethylome &) = delete;
+
+  size_t n_chroms() const {return names.size();}
+  const std::vector<std::string> &chrom_names() const {return names;}
+  bool has_chrom(const std::string &name) const {
+    return name_to_idx.find(name) != std::end(name_to_idx);
+  }
+
+  // the sites in [start, end) on chrom; none if chrom is not there
+  interval query(const std::string &chrom, const size_t start,
+                 const size_t end) const;
+
+  // all the sites on the chrom with index chrom_idx
+  interval query(const size_t chrom_idx) const;
+
+  // the site as an MSite; meth is from the counts
+  static MSite get_site(const std::string &chrom, const site_record &r);
+
+  // true if the file starts like a binary methylome
+  static bool is_binary_methylome(const std::string &filename);
+
+private:
+  void decompress(const size_t block_idx, std::vector<site_record> &buf) const;
+
+  const uint8_t *data{nullptr};
+  size_t file_size{0};
+  const chrom_entry *chroms{nullptr};
+  const block_entry *blocks{nullptr};
+  std::vector<std::string> names;
+  std::unordered_map<std::string, size_t> name_to_idx;
+};
+
+
+/* BinaryMethylomeWriter makes a binary methylome from sites given in
+   order. It throws if sites are not sorted within a chrom or if the
+   sites for a chrom are not together. The file is complete only after
+   "close", which the destructor does if needed but without reporting
+   errors. */
+class BinaryMethylomeWriter {
+public:
+  explicit BinaryMethylomeWriter(const std::string &filename);
+  ~BinaryMethylomeWriter();
+  BinaryMethylomeWriter(const BinaryMethylomeWriter &) = delete;
+  BinaryMethylomeWriter &operator=(const BinaryMethylomeWriter &) = delete;
+
+  void write(const std::string &chrom, const size_t pos, const char strand,
+             const msite_context context, const bool mutated,
+             const size_t n_meth, const size_t n_unmeth);
+  void write(const MSite &s);
+
+  void close();
+
+private:
+  void write_block();
+
+  std::ofstream out;
+  std::string filename;
+  uint64_t offset{0};
+  bool closed{false};
+
+  std::string chrom;
+  std::vector<BinaryMethylome::site_record> buf;
+  std::vector<BinaryMethylome::chrom_entry> chroms;
+  std::vector<BinaryMethylome::block_entry> blocks;
+  std::vector<std::string> names;
+  std::unordered_map<std::string, size_t> name_to_idx;
+  std::vector<uint8_t> compressed;
+};
+
+inline BinaryMethylomeWriter &
+write_site(BinaryMethylomeWriter &out, const MSite &s) {
+  out.write(s);
+  return out;
+}
+
+#endif
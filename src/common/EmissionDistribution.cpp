@@ -105,6 +105,13 @@ EmissionDistribution::fit(const vector<double> &vals_a,
     lnbeta_helper = gsl_sf_lnbeta(alpha, beta);
 }
 
+void
+EmissionDistribution::set_params(const double a, const double b) {
+    alpha = a;
+    beta = b;
+    lnbeta_helper = gsl_sf_lnbeta(alpha, beta);
+}
+
 Beta::Beta() : EmissionDistribution() {}
 Beta::Beta(const double a, const double b) : EmissionDistribution(a,b) {}
 Beta::Beta(const std::string &str) : EmissionDistribution(str) {}
@@ -126,19 +133,39 @@ BetaBinomial::BetaBinomial(const double a, const double b)
                              : EmissionDistribution(a,b) {}
 BetaBinomial::BetaBinomial(const std::string &str)
                              : EmissionDistribution(str) {}
+BetaBinomial::BetaBinomial(const double a, const double b,
+                           const vector<pair<double, double> > &vals)
+    : EmissionDistribution(a, b), table(new betabin_table(vals)) {
+    table->set_params(alpha, beta);
+}
 
 double
-BetaBinomial::operator()(const pair<double, double> &val) const {
+BetaBinomial::direct(const pair<double, double> &val) const {
     const size_t x = static_cast<size_t>(val.first);
     const size_t n = static_cast<size_t>(x + val.second);
     return gsl_sf_lnchoose(n, x) +
         gsl_sf_lnbeta(alpha + x, beta + val.second) - lnbeta_helper;
 }
 
+double
+BetaBinomial::operator()(const pair<double, double> &val) const {
+    return table ? (*table)(val) : direct(val);
+}
+
 double
 BetaBinomial::log_likelihood(const pair<double, double> &val) const {
-    const size_t x = static_cast<size_t>(val.first);
-    const size_t n = static_cast<size_t>(x + val.second);
-    return gsl_sf_lnchoose(n, x) +
-        gsl_sf_lnbeta(alpha + x, beta + val.second) - lnbeta_helper;
+    return table ? (*table)(val) : direct(val);
+}
+
+void
+BetaBinomial::fit(const vector<double> &vals_a,
+                  const vector<double> &vals_b, const vector<double> &p) {
+    EmissionDistribution::fit(vals_a, vals_b, p);
+    if (table) table->set_params(alpha, beta);
+}
+
+void
+BetaBinomial::set_params(const double a, const double b) {
+    EmissionDistribution::set_params(a, b);
+    if (table) table->set_params(alpha, beta);
 }
@@ -29,6 +29,9 @@
 #include <utility>
 #include <string>
 #include <vector>
+#include <memory>
+
+#include "BetaBin.hpp"
 
 /** Emission distributions for methylation should be modeled either as
  * Beta or Beta Binomial. Since they will be used simultaneously, it is
@@ -47,9 +50,10 @@ class EmissionDistribution
     std::string tostring() const;
     double getalpha() { return alpha; };
     double getbeta() { return beta; };
-    void fit(const std::vector<double> &vals_a,
-             const std::vector<double> &vals_b,
-             const std::vector<double> &p);
+    virtual void fit(const std::vector<double> &vals_a,
+                     const std::vector<double> &vals_b,
+                     const std::vector<double> &p);
+    virtual void set_params(const double a, const double b);
 
   protected:
     double sign(const double x);
@@ -78,8 +82,19 @@ class BetaBinomial : public EmissionDistribution
     BetaBinomial();
     BetaBinomial(const double a, const double b);
     BetaBinomial(const std::string &str);
+    // values from a table made for "vals", kept up to date by fit
+    BetaBinomial(const double a, const double b,
+                 const std::vector<std::pair<double, double> > &vals);
     double operator()(const std::pair<double, double> &val) const;
     double log_likelihood(const std::pair<double, double> &val) const;
+    void fit(const std::vector<double> &vals_a,
+             const std::vector<double> &vals_b,
+             const std::vector<double> &p);
+    void set_params(const double a, const double b);
+
+  private:
+    double direct(const std::pair<double, double> &val) const;
+    std::unique_ptr<betabin_table> table;
 };
 
 #endif
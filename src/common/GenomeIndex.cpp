@@ -0,0 +1,310 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "GenomeIndex.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "smithlab_os.hpp"
+#include "bsutils.hpp"
+#include "dnmt_error.hpp"
+
+using std::string;
+using std::vector;
+
+static const char genome_index_magic[] = "DNMTGIDX";
+static const size_t magic_size = 8;
+static const uint64_t genome_index_version = 1;
+static const size_t header_size = magic_size + 2*sizeof(uint64_t);
+
+static inline size_t
+align8(const size_t x) {return (x + 7) & ~static_cast<size_t>(7);}
+
+static inline uint8_t
+base_to_code(const char c) {
+  switch (c) {
+  case 'C': return 1;
+  case 'G': return 2;
+  case 'T': return 3;
+  default: return 0; // 'A' and anything in a non-ACGT run
+  }
+}
+
+static inline bool
+is_acgt(const char c) {
+  return c == 'A' || c == 'C' || c == 'G' || c == 'T';
+}
+
+static inline int
+popcount64(const uint64_t x) {return __builtin_popcountll(x);}
+
+
+size_t
+GenomeIndex::chrom_view::cpg_rank(const size_t pos) const {
+  if (pos >= entry->size) return entry->n_cpgs;
+  const uint64_t *bits = cpg_bits();
+  const uint64_t *samples =
+    reinterpret_cast<const uint64_t*>(data + entry->cpg_rank_offset);
+  const size_t word = pos/64;
+  size_t r = samples[pos/rank_block];
+  for (size_t i = (pos/rank_block)*(rank_block/64); i < word; ++i)
+    r += popcount64(bits[i]);
+  const size_t offset = pos % 64;
+  if (offset > 0)
+    r += popcount64(bits[word] & ((1ull << offset) - 1));
+  return r;
+}
+
+
+void
+GenomeIndex::chrom_view::get_cpgs(vector<size_t> &cpgs) const {
+  const uint64_t *p = cpg_pos();
+  cpgs.assign(p, p + entry->n_cpgs);
+}
+
+
+void
+GenomeIndex::chrom_view::get_sequence(string &seq) const {
+  static const char code_to_base[] = {'A', 'C', 'G', 'T'};
+  const uint8_t *packed = data + entry->seq_offset;
+  seq.resize(entry->size);
+  for (size_t i = 0; i < entry->size; ++i)
+    seq[i] = code_to_base[(packed[i/4] >> (2*(i % 4))) & 3u];
+  const uint64_t *runs =
+    reinterpret_cast<const uint64_t*>(data + entry->runs_offset);
+  for (size_t i = 0; i < entry->n_runs; ++i)
+    std::fill(begin(seq) + runs[2*i], begin(seq) + runs[2*i + 1], 'N');
+}
+
+
+GenomeIndex::GenomeIndex(const string &filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) throw dnmt_error("failed to open genome index: " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw dnmt_error("failed to stat genome index: " + filename);
+  }
+  file_size = st.st_size;
+  if (file_size < header_size) {
+    close(fd);
+    throw dnmt_error("bad genome index file: " + filename);
+  }
+  void *m = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (m == MAP_FAILED)
+    throw dnmt_error("failed to map genome index: " + filename);
+  data = static_cast<const uint8_t*>(m);
+
+  uint64_t version = 0, n = 0;
+  std::memcpy(&version, data + magic_size, sizeof(uint64_t));
+  std::memcpy(&n, data + magic_size + sizeof(uint64_t), sizeof(uint64_t));
+  if (std::memcmp(data, genome_index_magic, magic_size) != 0 ||
+      version != genome_index_version ||
+      header_size + n*sizeof(chrom_entry) > file_size) {
+    munmap(const_cast<uint8_t*>(data), file_size);
+    throw dnmt_error("bad genome index file: " + filename);
+  }
+
+  entries = reinterpret_cast<const chrom_entry*>(data + header_size);
+  for (size_t i = 0; i < n; ++i) {
+    const chrom_entry &e = entries[i];
+    const size_t n_pos_bytes = e.n_cpgs*sizeof(uint64_t);
+    if (e.name_offset >= file_size ||
+        e.cpg_pos_offset + n_pos_bytes > file_size) {
+      munmap(const_cast<uint8_t*>(data), file_size);
+      throw dnmt_error("bad genome index file: " + filename);
+    }
+    names.push_back(reinterpret_cast<const char*>(data + e.name_offset));
+    name_to_idx[names.back()] = i;
+  }
+}
+
+
+GenomeIndex::~GenomeIndex() {
+  if (data) munmap(const_cast<uint8_t*>(data), file_size);
+}
+
+
+size_t
+GenomeIndex::chrom_idx(const string &name) const {
+  const auto itr = name_to_idx.find(name);
+  if (itr == end(name_to_idx))
+    throw dnmt_error("chrom not found in genome index: " + name);
+  return itr->second;
+}
+
+
+bool
+GenomeIndex::is_genome_index(const string &filename) {
+  if (isdir(filename.c_str())) return false;
+  std::ifstream in(filename, std::ios::binary);
+  char buf[magic_size];
+  return in.read(buf, magic_size) &&
+    std::memcmp(buf, genome_index_magic, magic_size) == 0;
+}
+
+
+/* Everything below is for making the index */
+
+template<class T> static void
+write_array(std::ofstream &out, const vector<T> &v) {
+  const size_t n_bytes = v.size()*sizeof(T);
+  static const char padding[8] = {};
+  out.write(reinterpret_cast<const char*>(v.data()), n_bytes);
+  out.write(padding, align8(n_bytes) - n_bytes);
+}
+
+
+// the non-ACGT runs, as pairs of start and end
+static void
+get_runs(const string &s, vector<uint64_t> &runs) {
+  runs.clear();
+  for (size_t i = 0; i < s.size();) {
+    if (!is_acgt(s[i])) {
+      const size_t start = i;
+      while (i < s.size() && !is_acgt(s[i])) ++i;
+      runs.push_back(start);
+      runs.push_back(i);
+    }
+    else ++i;
+  }
+}
+
+
+static size_t
+count_cpgs(const string &s) {
+  size_t n = 0;
+  for (size_t i = 0; i + 1 < s.size(); ++i)
+    n += (s[i] == 'C' && s[i + 1] == 'G');
+  return n;
+}
+
+
+static void
+write_chrom(std::ofstream &out, const string &s) {
+  const size_t n = s.size();
+
+  vector<uint8_t> packed((n + 3)/4, 0);
+  for (size_t i = 0; i < n; ++i)
+    packed[i/4] |= base_to_code(s[i]) << (2*(i % 4));
+  write_array(out, packed);
+
+  vector<uint64_t> runs;
+  get_runs(s, runs);
+  write_array(out, runs);
+
+  vector<uint8_t> context((n + 1)/2, 0);
+  for (size_t i = 0; i < n; ++i) {
+    uint8_t x = GenomeIndex::context_other;
+    if (is_cytosine(s[i]))
+      x = GenomeIndex::context_cytosine + get_tag_from_genome(s, i);
+    else if (is_guanine(s[i]))
+      x = GenomeIndex::context_guanine + get_tag_from_genome(s, i);
+    context[i/2] |= x << (4*(i % 2));
+  }
+  write_array(out, context);
+
+  vector<uint64_t> bits((n + 63)/64, 0);
+  vector<uint64_t> cpg_pos;
+  for (size_t i = 0; i + 1 < n; ++i)
+    if (s[i] == 'C' && s[i + 1] == 'G') {
+      bits[i/64] |= 1ull << (i % 64);
+      cpg_pos.push_back(i);
+    }
+  write_array(out, bits);
+
+  const size_t words_per_block = GenomeIndex::rank_block/64;
+  vector<uint64_t> samples(n/GenomeIndex::rank_block + 1, 0);
+  uint64_t total = 0;
+  for (size_t i = 0; i < bits.size(); ++i) {
+    if (i % words_per_block == 0) samples[i/words_per_block] = total;
+    total += popcount64(bits[i]);
+  }
+  write_array(out, samples);
+  write_array(out, cpg_pos);
+}
+
+
+void
+GenomeIndex::build(const string &fasta_file, const string &outfile) {
+  vector<string> chroms, chrom_names;
+  read_fasta_file_short_names(fasta_file, chrom_names, chroms);
+  for (auto &&i: chroms)
+    transform(begin(i), end(i), begin(i),
+              [](const char c) { return std::toupper(c); });
+
+  const size_t n_chroms = chroms.size();
+
+  // get the sizes of everything so the offsets are known
+  vector<chrom_entry> e(n_chroms);
+  size_t offset = header_size + n_chroms*sizeof(chrom_entry);
+  for (size_t i = 0; i < n_chroms; ++i) {
+    e[i].name_offset = offset;
+    offset += chrom_names[i].size() + 1;
+  }
+  offset = align8(offset);
+  vector<uint64_t> runs;
+  for (size_t i = 0; i < n_chroms; ++i) {
+    const size_t n = chroms[i].size();
+    get_runs(chroms[i], runs);
+    e[i].size = n;
+    e[i].n_cpgs = count_cpgs(chroms[i]);
+    e[i].n_runs = runs.size()/2;
+    e[i].seq_offset = offset;
+    offset += align8((n + 3)/4);
+    e[i].runs_offset = offset;
+    offset += runs.size()*sizeof(uint64_t);
+    e[i].context_offset = offset;
+    offset += align8((n + 1)/2);
+    e[i].cpg_bits_offset = offset;
+    offset += ((n + 63)/64)*sizeof(uint64_t);
+    e[i].cpg_rank_offset = offset;
+    offset += (n/rank_block + 1)*sizeof(uint64_t);
+    e[i].cpg_pos_offset = offset;
+    offset += e[i].n_cpgs*sizeof(uint64_t);
+  }
+
+  std::ofstream out(outfile, std::ios::binary);
+  if (!out) throw dnmt_error("failed to open output file: " + outfile);
+
+  const uint64_t n_chroms_out = n_chroms;
+  out.write(genome_index_magic, magic_size);
+  out.write(reinterpret_cast<const char*>(&genome_index_version),
+            sizeof(uint64_t));
+  out.write(reinterpret_cast<const char*>(&n_chroms_out), sizeof(uint64_t));
+  write_array(out, e);
+  vector<char> name_bytes;
+  for (auto &&i: chrom_names) {
+    name_bytes.insert(end(name_bytes), begin(i), end(i));
+    name_bytes.push_back('\0');
+  }
+  write_array(out, name_bytes);
+
+  for (size_t i = 0; i < n_chroms; ++i) {
+    write_chrom(out, chroms[i]);
+    string().swap(chroms[i]); // done with this one
+  }
+  if (!out) throw dnmt_error("failed writing genome index: " + outfile);
+}
@@ -0,0 +1,159 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef GENOME_INDEX_HPP
+#define GENOME_INDEX_HPP
+
+/* GenomeIndex is a binary file made from a reference genome in FASTA
+   format by "dnmtools genome-index". It holds, for each chromosome,
+   the sequence packed as 2 bits per base (with the runs of non-ACGT
+   bases kept separately), the context tag of each base as 4 bits and
+   the positions of CpG sites as a bit vector with samples for rank
+   queries and a list of positions for select queries. The file is
+   mapped into memory when opened, so nothing is parsed, and pages
+   are only read from disk when they are used.
+
+   All integers in the file are 64 bits in the byte order of the
+   machine that made the file, and each section starts on an 8 byte
+   boundary. The layout is:
+
+   header:   magic, version, n_chroms
+   chroms:   one "chrom_entry" for each chromosome
+   names:    chromosome names, each terminated by '\0'
+   data:     for each chromosome, the sections listed in chrom_entry
+*/
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+class GenomeIndex {
+public:
+  /* These are the values in the context array for each base. The C
+     and G values are the tag from "get_tag_from_genome" added to the
+     first value for that base. */
+  enum : uint8_t {
+    context_other = 0,
+    context_cytosine = 1, // 1, 2, 3, 4 for CpG, CHH, CXG, CCG
+    context_guanine = 5,  // 5, 6, 7, 8 for CpG, CHH, CXG, CCG
+  };
+
+  struct chrom_entry {
+    uint64_t name_offset;
+    uint64_t size;
+    uint64_t n_cpgs;
+    uint64_t n_runs;        // runs of non-ACGT bases
+    uint64_t seq_offset;    // 2 bits per base
+    uint64_t runs_offset;   // pairs of [start, end) for non-ACGT runs
+    uint64_t context_offset;// 4 bits per base
+    uint64_t cpg_bits_offset;  // 1 bit per base, set at the C of a CpG
+    uint64_t cpg_rank_offset;  // CpGs before each block of rank_block bits
+    uint64_t cpg_pos_offset;   // position of each CpG
+  };
+
+  // number of bits between samples used for rank queries
+  static const uint64_t rank_block = 512;
+
+  /* A chrom_view gives fast access to one chromosome, and is what
+     programs should use when they need to go over the bases. */
+  class chrom_view {
+  public:
+    chrom_view(const uint8_t *d, const chrom_entry &e) :
+      data{d}, entry{&e} {}
+
+    size_t size() const {return entry->size;}
+    size_t n_cpgs() const {return entry->n_cpgs;}
+
+    // the values in the context enum above
+    uint8_t context(const size_t pos) const {
+      const uint8_t x = data[entry->context_offset + pos/2];
+      return (pos & 1) ? (x >> 4) : (x & 15u);
+    }
+    bool is_c(const size_t pos) const {
+      const uint8_t x = context(pos);
+      return x >= context_cytosine && x < context_guanine;
+    }
+    bool is_g(const size_t pos) const {
+      return context(pos) >= context_guanine;
+    }
+    // same as "get_tag_from_genome"
+    uint32_t tag(const size_t pos) const {
+      const uint8_t x = context(pos);
+      return x >= context_guanine ? x - context_guanine :
+        (x >= context_cytosine ? x - context_cytosine : 4);
+    }
+
+    // true if pos is the C of a CpG
+    bool is_cpg(const size_t pos) const {
+      return (cpg_bits()[pos/64] >> (pos % 64)) & 1ull;
+    }
+    // number of CpGs before pos
+    size_t cpg_rank(const size_t pos) const;
+    // position of the CpG with index k
+    size_t cpg_select(const size_t k) const {return cpg_pos()[k];}
+    // all CpG positions in increasing order
+    void get_cpgs(std::vector<size_t> &cpgs) const;
+
+    // the upper case sequence, including non-ACGT bases
+    void get_sequence(std::string &seq) const;
+
+  private:
+    const uint64_t *cpg_bits() const {
+      return reinterpret_cast<const uint64_t*>(data + entry->cpg_bits_offset);
+    }
+    const uint64_t *cpg_pos() const {
+      return reinterpret_cast<const uint64_t*>(data + entry->cpg_pos_offset);
+    }
+    const uint8_t *data;
+    const chrom_entry *entry;
+  };
+
+  explicit GenomeIndex(const std::string &filename);
+  ~GenomeIndex();
+  GenomeIndex(const GenomeIndex &) = delete;
+  GenomeIndex &operator=(const GenomeIndex &) = delete;
+
+  size_t n_chroms() const {return names.size();}
+  const std::vector<std::string> &chrom_names() const {return names;}
+  bool has_chrom(const std::string &name) const {
+    return name_to_idx.find(name) != end(name_to_idx);
+  }
+  // throws if the chrom is not in the index
+  size_t chrom_idx(const std::string &name) const;
+
+  chrom_view chrom(const size_t idx) const {
+    return chrom_view(data, entries[idx]);
+  }
+  chrom_view chrom(const std::string &name) const {
+    return chrom(chrom_idx(name));
+  }
+
+  // true if the file starts like a genome index
+  static bool is_genome_index(const std::string &filename);
+
+  // make the index for a FASTA file and write it to outfile
+  static void build(const std::string &fasta_file,
+                    const std::string &outfile);
+
+private:
+  const uint8_t *data{nullptr};
+  size_t file_size{0};
+  const chrom_entry *entries{nullptr};
+  std::vector<std::string> names;
+  std::unordered_map<std::string, size_t> name_to_idx;
+};
+
+#endif
@@ -21,6 +21,8 @@
 #include <sstream>
 #include <stdexcept>
 #include <regex>
+#include <algorithm>
+#include <cstdlib>
 
 #include "smithlab_utils.hpp"
 
@@ -28,32 +30,144 @@ using std::string;
 using std::runtime_error;
 using std::regex_match;
 
+// same as isspace in the "C" locale, which is what istream uses
+static inline bool
+is_field_sep(const char c) {return c == ' ' || (c >= '\t' && c <= '\r');}
+
+
+// skip separators then get the next field in [b, e)
+static inline bool
+next_field(const char *&b, const char *e, const char *&field_end) {
+  while (b != e && is_field_sep(*b)) ++b;
+  field_end = b;
+  while (field_end != e && !is_field_sep(*field_end)) ++field_end;
+  return field_end != b;
+}
+
+
+static inline bool
+parse_unsigned(const char *b, const char *e, size_t &x) {
+  x = 0;
+  for (; b != e; ++b) {
+    if (*b < '0' || *b > '9') return false;
+    x = x*10 + (*b - '0');
+  }
+  return true;
+}
+
+
+/* ADS: a number with up to 15 digits and no exponent can be exactly
+   represented as an integer divided by an exact power of 10, and the
+   division gives the same correctly rounded result as strtod. Other
+   numbers are rare here and go to strtod. */
+static inline bool
+parse_double(const char *b, const char *e, double &x) {
+  static const double pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+    1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+  };
+  static const size_t max_digits = 15;
+  const char *c = b;
+  const bool neg = (c != e && *c == '-');
+  if (neg) ++c;
+  uint64_t mantissa = 0;
+  size_t n_digits = 0, n_frac = 0;
+  bool seen_point = false, fast = (c != e);
+  for (; c != e && fast; ++c) {
+    if (*c >= '0' && *c <= '9') {
+      mantissa = mantissa*10 + (*c - '0');
+      n_frac += seen_point;
+      fast = (++n_digits <= max_digits);
+    }
+    else if (*c == '.' && !seen_point) seen_point = true;
+    else fast = false;
+  }
+  if (fast && n_digits > 0) {
+    x = mantissa/pow10[n_frac];
+    if (neg) x = -x;
+    return true;
+  }
+  char buf[64];
+  const size_t n = e - b;
+  if (n >= sizeof(buf)) return false;
+  std::copy(b, e, buf);
+  buf[n] = '\0';
+  char *end_ptr = nullptr;
+  x = std::strtod(buf, &end_ptr);
+  return end_ptr == buf + n;
+}
+
+
+bool
+parse_msite(const char *b, const char *e, msite_fields &f) {
+  const char *field_end = nullptr;
+
+  if (!next_field(b, e, field_end)) return false;
+  f.chrom = b;
+  f.chrom_size = field_end - b;
+  b = field_end;
+
+  if (!next_field(b, e, field_end) ||
+      !parse_unsigned(b, field_end, f.pos)) return false;
+  b = field_end;
+
+  if (!next_field(b, e, field_end)) return false;
+  f.strand = *b;
+  if (f.strand != '-' && f.strand != '+') return false;
+  b = field_end;
+
+  if (!next_field(b, e, field_end)) return false;
+  f.context = b;
+  f.context_size = field_end - b;
+  b = field_end;
+
+  if (!next_field(b, e, field_end) ||
+      !parse_double(b, field_end, f.meth)) return false;
+  b = field_end;
+
+  return next_field(b, e, field_end) &&
+    parse_unsigned(b, field_end, f.n_reads);
+}
+
+
+msite_context
+msite_fields::get_context() const {
+  const char *c = context;
+  if (context_size > 0 && c[0] == 'N') return msite_context::n;
+  if (context_size < 3) return msite_context::other;
+  if (c[0] == 'C' && c[1] == 'p' && c[2] == 'G') return msite_context::cpg;
+  if (c[0] == 'C' && c[1] == 'H' && c[2] == 'H') return msite_context::chh;
+  if (c[0] == 'C' && c[1] == 'X' && c[2] == 'G') return msite_context::cxg;
+  if (c[0] == 'C' && c[1] == 'C' && c[2] == 'G') return msite_context::ccg;
+  return msite_context::other;
+}
+
+
+bool
+MSite::initialize(const char *line, const char *line_end) {
+  msite_fields f;
+  if (!parse_msite(line, line_end, f)) return false;
+  chrom.assign(f.chrom, f.chrom_size);
+  pos = f.pos;
+  strand = f.strand;
+  context.assign(f.context, f.context_size);
+  meth = f.meth;
+  n_reads = f.n_reads;
+  return true;
+}
+
+
 MSite::MSite(const string &line) {
-  /* GS: this is faster but seems to be genenerating issues when
-   * compiled with clang
-  std::istringstream iss;
-  iss.rdbuf()->pubsetbuf(const_cast<char*>(line.c_str()), line.length());
-  */
-  std::istringstream iss(line);
-  string strand_tmp;
-  if (!(iss >> chrom >> pos >> strand_tmp >> context >> meth >> n_reads))
-    throw std::runtime_error("bad line: \"" + line + "\"");
-  strand = strand_tmp[0];
-  if (strand != '-' && strand != '+')
+  if (!initialize(line))
     throw std::runtime_error("bad line: \"" + line + "\"");
 }
 
 
 string
 MSite::tostring() const {
-  std::ostringstream oss;
-  oss << chrom << '\t'
-      << pos << '\t'
-      << strand << '\t'
-      << context << '\t'
-      << meth << '\t'
-      << n_reads;
-  return oss.str();
+  line_buffer buf;
+  buf << *this;
+  return string(buf.data(), buf.size());
 }
 
 
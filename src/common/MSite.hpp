@@ -19,8 +19,72 @@
 #define MSITE_HPP
 
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdexcept>
+#include <cstdint>
 #include <cmath>
 
+#include "line_buffer.hpp"
+
+/* The contexts of sites, in the same order as the tags in the output
+   of counts. An "x" at the end of a context, for a mutated site, is
+   not part of this. */
+enum class msite_context : uint8_t {cpg, chh, cxg, ccg, n, other};
+
+/* msite_fields has the fields of a site parsed from a line without
+   making any strings: the chrom and context point into the line, so
+   they are only valid as long as the line is. */
+struct msite_fields {
+  const char *chrom{nullptr};
+  size_t chrom_size{0};
+  size_t pos{0};
+  char strand{'+'};
+  const char *context{nullptr};
+  size_t context_size{0};
+  double meth{0.0};
+  size_t n_reads{0};
+
+  msite_context get_context() const;
+  bool is_mutated() const {
+    return context_size == 4 && context[3] == 'x';
+  }
+};
+
+// parse a site from [line, line_end) and return false if it is bad
+bool
+parse_msite(const char *line, const char *line_end, msite_fields &f);
+
+/* ChromIds gives each chromosome name a small integer id, in the order
+   they are first seen. Sites come in runs on the same chrom, so the
+   most recent name is checked before looking it up. */
+class ChromIds {
+public:
+  uint32_t get_id(const char *name, const size_t name_size) {
+    if (!names.empty() && names[last_id].size() == name_size &&
+        names[last_id].compare(0, name_size, name, name_size) == 0)
+      return last_id;
+    tmp.assign(name, name_size);
+    const auto itr = ids.find(tmp);
+    if (itr != end(ids)) return last_id = itr->second;
+    last_id = names.size();
+    names.push_back(tmp);
+    ids.emplace(tmp, last_id);
+    return last_id;
+  }
+  uint32_t get_id(const std::string &name) {
+    return get_id(name.data(), name.size());
+  }
+  const std::string &name(const uint32_t id) const {return names[id];}
+  size_t size() const {return names.size();}
+
+private:
+  std::vector<std::string> names;
+  std::unordered_map<std::string, uint32_t> ids;
+  std::string tmp;
+  uint32_t last_id{0};
+};
+
 struct MSite {
 
   MSite() {}
@@ -34,6 +98,13 @@ struct MSite {
     context(_context), meth(_meth), n_reads(_n_reads) {}
   explicit MSite(const std::string &line);
 
+  // parse the line into this site, reusing the space of its strings,
+  // and return false if the line is bad
+  bool initialize(const char *line, const char *line_end);
+  bool initialize(const std::string &line) {
+    return initialize(line.data(), line.data() + line.size());
+  }
+
   std::string chrom;
   size_t pos;
   char strand;
@@ -115,9 +186,9 @@ struct MSite {
 
 template <class T> T &
 operator>>(T &in, MSite &s) {
-  std::string line;
-  if (getline(in, line))
-    s = MSite(line);
+  thread_local std::string line; // ADS: keep the space between lines
+  if (getline(in, line) && !s.initialize(line))
+    throw std::runtime_error("bad line: \"" + line + "\"");
   return in;
 }
 
@@ -127,6 +198,16 @@ operator<<(T &out, const MSite &s) {
   return out;
 }
 
+inline line_buffer &
+operator<<(line_buffer &buf, const MSite &s) {
+  return buf << s.chrom << '\t'
+             << s.pos << '\t'
+             << s.strand << '\t'
+             << s.context << '\t'
+             << s.meth << '\t'
+             << s.n_reads;
+}
+
 size_t
 distance(const MSite &a, const MSite &b);
 
@@ -149,23 +230,27 @@ find_offset_for_msite(const std::string &chrom,
 
 inline bamxx::bgzf_file &
 write_site(bamxx::bgzf_file &f, const MSite &s) {
-  // ADS: to slow??
-  std::ostringstream oss;
-  oss << s.tostring() << '\n';
-  f.write(oss.str());
+  // ADS: the buffer is kept so each site needs no allocation
+  thread_local line_buffer buf;
+  buf.clear();
+  buf << s << '\n';
+  f.write(buf.data(), buf.size());
   return f;
 }
 
 inline std::ostream &
 write_site(std::ostream &out, const MSite &s) {
-  return out << s << '\n';
+  thread_local line_buffer buf;
+  buf.clear();
+  buf << s << '\n';
+  return out.write(buf.data(), buf.size());
 }
 
 inline bamxx::bgzf_file &
 read_site(bamxx::bgzf_file &f, MSite &s) {
-  std::string line;
-  if (getline(f, line))
-    s = MSite(line);
+  thread_local std::string line; // ADS: keep the space between lines
+  if (getline(f, line) && !s.initialize(line))
+    throw std::runtime_error("bad line: \"" + line + "\"");
   return f;
 }
 
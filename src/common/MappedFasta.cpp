@@ -0,0 +1,167 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "MappedFasta.hpp"
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "smithlab_os.hpp"
+#include "dnmt_error.hpp"
+
+using std::string;
+using std::vector;
+
+static inline bool
+is_line_end(const char c) {return c == '\n' || c == '\r';}
+
+
+MappedFasta::MappedFasta(const string &filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) throw dnmt_error("failed to open FASTA file: " + filename);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw dnmt_error("failed to stat FASTA file: " + filename);
+  }
+  file_size = st.st_size;
+  if (file_size == 0) {
+    close(fd);
+    throw dnmt_error("empty FASTA file: " + filename);
+  }
+  void *m = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // the mapping stays valid
+  if (m == MAP_FAILED)
+    throw dnmt_error("failed to map FASTA file: " + filename);
+  data = static_cast<const char*>(m);
+
+  try {
+    const string fai_file(filename + ".fai");
+    struct stat fai_st;
+    // ADS: an index older than the FASTA file might not match it
+    if (stat(fai_file.c_str(), &fai_st) == 0 &&
+        fai_st.st_mtime >= st.st_mtime)
+      load_fai(fai_file);
+    else
+      find_chroms();
+  }
+  catch (...) {
+    munmap(const_cast<char*>(data), file_size);
+    throw;
+  }
+  for (size_t i = 0; i < names.size(); ++i)
+    name_to_idx[names[i]] = i;
+}
+
+
+MappedFasta::~MappedFasta() {
+  if (data) munmap(const_cast<char*>(data), file_size);
+}
+
+
+/* Each line of the ".fai" file is: name, length, offset of the first
+   base, bases per line and bytes per line. Only the first three are
+   needed since line ends are skipped when copying. */
+void
+MappedFasta::load_fai(const string &fai_file) {
+  std::ifstream in(fai_file);
+  if (!in) throw dnmt_error("failed to open FASTA index: " + fai_file);
+  string line;
+  while (getline(in, line)) {
+    std::istringstream iss(line);
+    string name;
+    chrom_entry e;
+    if (!(iss >> name >> e.size >> e.offset) || e.offset > file_size)
+      throw dnmt_error("bad line in FASTA index: " + line);
+    names.push_back(name);
+    entries.push_back(e);
+  }
+}
+
+
+/* Without an index, the chroms are found by going once over the file,
+   which is much faster than reading the sequences into memory. */
+void
+MappedFasta::find_chroms() {
+  const char *p = data;
+  const char *lim = data + file_size;
+  if (*p != '>') throw dnmt_error("FASTA file must start with '>'");
+  while (p < lim) {
+    // the name line, with the name up to the first space
+    const char *line_end = std::find(p, lim, '\n');
+    const char *name_end = std::find_if(p + 1, line_end, [](const char c) {
+      return std::isspace(static_cast<unsigned char>(c));
+    });
+    names.emplace_back(p + 1, name_end);
+    chrom_entry e;
+    e.offset = (line_end == lim ? lim : line_end + 1) - data;
+    e.size = 0;
+    // the sequence lines, up to the next name line
+    p = data + e.offset;
+    while (p < lim && *p != '>') {
+      const char *q = static_cast<const char*>(std::memchr(p, '\n', lim - p));
+      if (!q) q = lim;
+      e.size += q - p - (q > p && *(q - 1) == '\r');
+      p = (q == lim) ? lim : q + 1;
+    }
+    entries.push_back(e);
+  }
+}
+
+
+size_t
+MappedFasta::chrom_idx(const string &name) const {
+  const auto itr = name_to_idx.find(name);
+  if (itr == end(name_to_idx))
+    throw dnmt_error("chrom not found in FASTA file: " + name);
+  return itr->second;
+}
+
+
+void
+MappedFasta::get_sequence(const size_t idx, string &seq) const {
+  const chrom_entry &e = entries[idx];
+  seq.resize(e.size);
+  const char *p = data + e.offset;
+  const char *lim = data + file_size;
+  size_t i = 0;
+  while (i < e.size && p < lim) {
+    if (!is_line_end(*p))
+      seq[i++] = std::toupper(static_cast<unsigned char>(*p));
+    ++p;
+  }
+  if (i < e.size)
+    throw dnmt_error("FASTA file shorter than its index says for: " +
+                     names[idx]);
+}
+
+
+bool
+MappedFasta::can_map(const string &filename) {
+  if (isdir(filename.c_str())) return false;
+  std::ifstream in(filename, std::ios::binary);
+  // ADS: anything else, like gzip, goes through read_fasta_file
+  return in && in.peek() == '>';
+}
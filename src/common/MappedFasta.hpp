@@ -0,0 +1,68 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef MAPPED_FASTA_HPP
+#define MAPPED_FASTA_HPP
+
+/* MappedFasta gives the chromosomes of a FASTA file one at a time,
+   without reading the whole genome into memory first. The file is
+   mapped into memory, and where each chromosome starts is taken from
+   the ".fai" index next to it (as made by "samtools faidx"), or found
+   by going over the file once if there is no index. A chromosome is
+   only copied out, without line ends and in upper case, when it is
+   needed, so a program working on one chromosome at a time needs
+   memory for only one. Names are up to the first space, the same as
+   from read_fasta_file_short_names. */
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+
+class MappedFasta {
+public:
+  explicit MappedFasta(const std::string &filename);
+  ~MappedFasta();
+  MappedFasta(const MappedFasta &) = delete;
+  MappedFasta &operator=(const MappedFasta &) = delete;
+
+  size_t n_chroms() const {return names.size();}
+  const std::vector<std::string> &chrom_names() const {return names;}
+  size_t chrom_size(const size_t idx) const {return entries[idx].size;}
+  // throws if the chrom is not in the file
+  size_t chrom_idx(const std::string &name) const;
+
+  // the upper case sequence of chrom "idx", replacing "seq"
+  void get_sequence(const size_t idx, std::string &seq) const;
+
+  // true if the file is a single uncompressed FASTA file
+  static bool can_map(const std::string &filename);
+
+private:
+  struct chrom_entry {
+    uint64_t size;
+    uint64_t offset;  // first base in the file
+  };
+  void load_fai(const std::string &fai_file);
+  void find_chroms();
+
+  const char *data{nullptr};
+  size_t file_size{0};
+  std::vector<chrom_entry> entries;
+  std::vector<std::string> names;
+  std::unordered_map<std::string, size_t> name_to_idx;
+};
+
+#endif
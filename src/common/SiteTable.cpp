@@ -0,0 +1,102 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "SiteTable.hpp"
+
+#include <string>
+#include <vector>
+#include <limits>
+#include <stdexcept>
+#include <cmath>
+
+#include <bamxx.hpp>
+
+using std::string;
+using std::vector;
+using std::pair;
+using std::runtime_error;
+
+// ADS: these are the contexts made by counts; any other context is
+// kept as "N", which is only seen if the site is written
+static const char *context_names[] = {"CpG", "CHH", "CXG", "CCG", "N", "N"};
+
+static const size_t max_table_value = std::numeric_limits<uint32_t>::max();
+
+MSite
+SiteTable::get_site(const size_t i) const {
+  string ctx(context_names[static_cast<size_t>(context[i])]);
+  if (mutated[i]) ctx += 'x';
+  return MSite(chrom(i), pos[i], strand[i], ctx, meth(i), n_reads(i));
+}
+
+
+void
+SiteTable::push_back(const msite_fields &f) {
+  if (f.pos > max_table_value || f.n_reads > max_table_value)
+    throw runtime_error("site too large for site table: " +
+                        string(f.chrom, f.chrom_size) + ":" +
+                        std::to_string(f.pos));
+  const uint32_t id = chrom_ids.get_id(f.chrom, f.chrom_size);
+  if (run_chrom.empty() || run_chrom.back() != id) {
+    run_start.push_back(pos.size());
+    run_chrom.push_back(id);
+  }
+  // ADS: same as MSite::n_meth
+  const uint32_t m = std::round(f.meth*f.n_reads);
+  pos.push_back(f.pos);
+  strand.push_back(f.strand);
+  context.push_back(f.get_context());
+  mutated.push_back(f.is_mutated());
+  n_meth.push_back(m);
+  n_unmeth.push_back(f.n_reads - m);
+}
+
+
+void
+SiteTable::clear() {
+  // ADS: assign an empty table to release the memory, not just the sites
+  *this = SiteTable();
+}
+
+
+void
+SiteTable::get_meth(vector<pair<double, double> > &meth) const {
+  meth.resize(size());
+  for (size_t i = 0; i < size(); ++i)
+    meth[i] = std::make_pair(n_meth[i], n_unmeth[i]);
+}
+
+
+void
+SiteTable::get_reads(vector<uint32_t> &reads) const {
+  reads.resize(size());
+  for (size_t i = 0; i < size(); ++i)
+    reads[i] = n_reads(i);
+}
+
+
+void
+load_site_table(const string &filename, SiteTable &sites) {
+  bamxx::bgzf_file in(filename, "r");
+  if (!in) throw runtime_error("failed opening file: " + filename);
+
+  string line;
+  msite_fields f;
+  while (getline(in, line)) {
+    if (!parse_msite(line.data(), line.data() + line.size(), f))
+      throw runtime_error("bad line: \"" + line + "\"");
+    sites.push_back(f);
+  }
+}
@@ -0,0 +1,137 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef SITE_TABLE_HPP
+#define SITE_TABLE_HPP
+
+/* SiteTable holds all the sites of a methcounts file in a form that
+   takes much less space than a vector of MSite. Each field is in its
+   own array, the chrom is kept once for each run of consecutive sites
+   on the same chrom, and the methylation level and number of reads
+   are kept as counts of methylated and unmethylated reads. This is
+   about 14 bytes for each site, and nothing is allocated per site.
+
+   The runs are in the order of the file. If a chrom appears in more
+   than one place, for example in a file not sorted by chrom, it will
+   have more than one run. */
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+
+#include "MSite.hpp"
+
+struct SiteTable {
+
+  size_t size() const {return pos.size();}
+  bool empty() const {return pos.empty();}
+
+  // the runs of sites on the same chrom; run r is sites
+  // [run_begin(r), run_end(r))
+  size_t n_runs() const {return run_start.size();}
+  size_t run_begin(const size_t r) const {return run_start[r];}
+  size_t run_end(const size_t r) const {
+    return r + 1 < run_start.size() ? run_start[r + 1] : pos.size();
+  }
+  uint32_t run_chrom_id(const size_t r) const {return run_chrom[r];}
+  const std::string &run_chrom_name(const size_t r) const {
+    return chrom_ids.name(run_chrom[r]);
+  }
+
+  // the run that has site i
+  size_t run_of(const size_t i) const {
+    return std::upper_bound(begin(run_start), end(run_start), i) -
+      begin(run_start) - 1;
+  }
+  const std::string &chrom(const size_t i) const {
+    return run_chrom_name(run_of(i));
+  }
+
+  uint32_t n_reads(const size_t i) const {return n_meth[i] + n_unmeth[i];}
+  double meth(const size_t i) const {
+    const uint32_t n = n_reads(i);
+    return n > 0 ? static_cast<double>(n_meth[i])/n : 0.0;
+  }
+
+  // the site as an MSite, for output; the meth is from the counts
+  MSite get_site(const size_t i) const;
+
+  // add a site at the end, and throw if it doesn't fit in the table
+  void push_back(const msite_fields &f);
+
+  // keep only the sites i for which keep(i) is true
+  template<class Pred> void filter(Pred keep);
+
+  void clear();
+
+  /* The methylated and unmethylated counts as doubles, and the number
+     of reads, which is how the HMM based programs want them */
+  void get_meth(std::vector<std::pair<double, double> > &meth) const;
+  void get_reads(std::vector<uint32_t> &reads) const;
+
+  ChromIds chrom_ids;
+  std::vector<size_t> run_start;
+  std::vector<uint32_t> run_chrom;
+
+  std::vector<uint32_t> pos;
+  std::vector<char> strand;
+  std::vector<msite_context> context;
+  std::vector<bool> mutated;
+  std::vector<uint32_t> n_meth;
+  std::vector<uint32_t> n_unmeth;
+};
+
+template<class Pred> void
+SiteTable::filter(Pred keep) {
+  std::vector<size_t> new_run_start;
+  std::vector<uint32_t> new_run_chrom;
+  size_t j = 0;
+  for (size_t r = 0; r < n_runs(); ++r) {
+    const size_t run_j = j;
+    for (size_t i = run_begin(r); i < run_end(r); ++i)
+      if (keep(i)) {
+        pos[j] = pos[i];
+        strand[j] = strand[i];
+        context[j] = context[i];
+        mutated[j] = mutated[i];
+        n_meth[j] = n_meth[i];
+        n_unmeth[j] = n_unmeth[i];
+        ++j;
+      }
+    // ADS: an empty run is removed, and if that puts two runs for
+    // the same chrom together they become one run
+    if (j > run_j && (new_run_chrom.empty() ||
+                      new_run_chrom.back() != run_chrom[r])) {
+      new_run_start.push_back(run_j);
+      new_run_chrom.push_back(run_chrom[r]);
+    }
+  }
+  pos.resize(j);
+  strand.resize(j);
+  context.resize(j);
+  mutated.resize(j);
+  n_meth.resize(j);
+  n_unmeth.resize(j);
+  swap(run_start, new_run_start);
+  swap(run_chrom, new_run_chrom);
+}
+
+// read all the sites in a methcounts file, throwing for a bad line
+void
+load_site_table(const std::string &filename, SiteTable &sites);
+
+#endif
@@ -24,6 +24,7 @@
 #include "ThreeStateHMM.hpp"
 #include "BetaBin.hpp"
 #include "numerical_utils.hpp"
+#include "squarem.hpp"
 
 #include <cmath>
 #include <iomanip>
@@ -69,7 +70,7 @@ max_value(const Triplet &likelihoods) {
 ThreeStateHMM::ThreeStateHMM(vector<pair<double, double>> &_observations,
                              const vector<size_t> &_reset_points,
                              const double tol, const size_t max_itr,
-                             const bool v)
+                             const bool v, const bool acc)
     : reset_points(_reset_points),
       meth_lp(_observations.size()),
       unmeth_lp(_observations.size()),
@@ -90,9 +91,10 @@ ThreeStateHMM::ThreeStateHMM(vector<pair<double, double>> &_observations,
       HYPO_HYPO(_observations.size()),
       classes(_observations.size()),
       state_posteriors(_observations.size()),
-      tolerance(tol), max_iterations(max_itr), VERBOSE(v) {
+      tolerance(tol), max_iterations(max_itr), VERBOSE(v), ACCELERATE(acc) {
 
   std::swap(observations, _observations);
+  emission_table = betabin_table(observations);
 
   for (size_t i = 0; i < observations.size(); ++i) {
     const double m = observations[i].first;
@@ -136,20 +138,25 @@ ThreeStateHMM::get_parameters(betabin &_hypo_emission, betabin &_HYPER_emission,
 //////////////////////////////////////////////
 ////// forward and backward algorithms  //////
 //////////////////////////////////////////////
+// cumulative log likelihoods of the observations under "em"
+static void
+cumulative_log_likelihood(const vector<pair<double, double>> &observations,
+                          const betabin &em, betabin_table &table,
+                          vector<double> &log_likelihood) {
+  table.set_params(em.alpha, em.beta);
+  log_likelihood.front() = table(observations.front());
+  for (size_t i = 1; i < observations.size(); ++i)
+    log_likelihood[i] = log_likelihood[i - 1] + table(observations[i]);
+}
+
 void
 ThreeStateHMM::update_observation_likelihood() {
-  hypo_log_likelihood.front() = hypo_emission(observations.front());
-  HYPER_log_likelihood.front() = HYPER_emission(observations.front());
-  HYPO_log_likelihood.front() = HYPO_emission(observations.front());
-
-  for (size_t i = 1; i < observations.size(); ++i) {
-    hypo_log_likelihood[i] =
-      hypo_log_likelihood[i - 1] + hypo_emission(observations[i]);
-    HYPER_log_likelihood[i] =
-      HYPER_log_likelihood[i - 1] + HYPER_emission(observations[i]);
-    HYPO_log_likelihood[i] =
-      HYPO_log_likelihood[i - 1] + HYPO_emission(observations[i]);
-  }
+  cumulative_log_likelihood(observations, hypo_emission, emission_table,
+                            hypo_log_likelihood);
+  cumulative_log_likelihood(observations, HYPER_emission, emission_table,
+                            HYPER_log_likelihood);
+  cumulative_log_likelihood(observations, HYPO_emission, emission_table,
+                            HYPO_log_likelihood);
 }
 
 double
@@ -421,11 +428,78 @@ ThreeStateHMM::single_iteration() {
   return total_score;
 }
 
+/* Training with SQUAREM (squarem.hpp). The free parameters are the
+   logs of the transitions that are not zero, which are scaled to sum
+   to one for each state, and the logs of alpha and beta for each
+   emission. */
+double
+ThreeStateHMM::accelerated_training() {
+  vector<pair<size_t, size_t>> free_trans;
+  for (size_t i = 0; i < trans.size(); ++i)
+    for (size_t j = 0; j < trans[i].size(); ++j)
+      if (trans[i][j] > 0.0)
+        free_trans.emplace_back(i, j);
+
+  const auto pack = [&](vector<double> &x) {
+    x.clear();
+    for (auto &&t : free_trans)
+      x.push_back(log(trans[t.first][t.second]));
+    for (auto &&em : {&hypo_emission, &HYPER_emission, &HYPO_emission}) {
+      x.push_back(log(em->alpha));
+      x.push_back(log(em->beta));
+    }
+  };
+  const auto unpack = [&](const vector<double> &x) {
+    vector<vector<double>> tr(trans.size(), vector<double>(trans.size(), 0.0));
+    for (size_t k = 0; k < free_trans.size(); ++k)
+      tr[free_trans[k].first][free_trans[k].second] = exp(x[k]);
+    for (auto &&row : tr) {
+      const double total = accumulate(begin(row), end(row), 0.0);
+      for (auto &&t : row) t /= total;
+    }
+    const size_t k = free_trans.size();
+    set_parameters(betabin(exp(x[k]), exp(x[k + 1])),
+                   betabin(exp(x[k + 2]), exp(x[k + 3])),
+                   betabin(exp(x[k + 4]), exp(x[k + 5])), tr);
+  };
+
+  double prev_total = -numeric_limits<double>::max();
+  size_t itr = 0;
+  const auto em_step = [&](const vector<double> &x, vector<double> &x_next,
+                           bool &converged) {
+    unpack(x);
+    const double total = single_iteration();
+    const double delta = (total - prev_total)/fabs(total);
+    if (VERBOSE)
+      cerr << "Iteration: " << setw(2) << ++itr << ";\t"
+           << "Log-Likelihood: " << total << ";\t"
+           << "Delta: " << delta << endl;
+    converged = fabs(delta) < tolerance;
+    prev_total = total;
+    pack(x_next);
+    return total;
+  };
+
+  vector<double> x;
+  pack(x);
+  squarem_stats stats;
+  const double total = squarem(em_step, max_iterations, x, stats);
+  unpack(x);
+
+  if (VERBOSE)
+    cerr << "SQUAREM: " << stats.passes << " passes, "
+         << stats.accepted << " jumps kept, "
+         << stats.rejected << " rejected" << endl << endl;
+  return total;
+}
+
 double
 ThreeStateHMM::BaumWelchTraining() {
 
   if (VERBOSE) cerr << "Baum-Welch Training" << endl;
 
+  if (ACCELERATE) return accelerated_training();
+
   double prev_total = -numeric_limits<double>::max();
 
   for (size_t i = 0; i < max_iterations; ++i) {
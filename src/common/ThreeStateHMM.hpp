@@ -37,7 +37,8 @@ public:
 
   ThreeStateHMM(std::vector<std::pair<double, double>> &obs,
                 const std::vector<size_t> &res,
-                const double tol, const size_t max_itr, const bool v);
+                const double tol, const size_t max_itr, const bool v,
+                const bool acc = false);
 
   void
   set_parameters(const betabin & hypo_em,
@@ -86,6 +87,8 @@ public:
 
   //  HMM internal data
   betabin hypo_emission, HYPER_emission, HYPO_emission;
+  // each count in the observations is computed once per emission
+  betabin_table emission_table;
 
   Triplet lp_start, lp_end;
   std::vector<std::vector<double> > trans;
@@ -105,6 +108,10 @@ public:
   double tolerance;
   size_t max_iterations;
   bool VERBOSE;
+  bool ACCELERATE; // training with SQUAREM, see squarem.hpp
+
+private:
+  double accelerated_training();
 };
 
 #endif
@@ -20,11 +20,14 @@
 #include <numeric>
 #include <limits>
 #include <cmath>
+#include <array>
 
 #include <gsl/gsl_sf_psi.h>
 #include <gsl/gsl_sf_gamma.h>
 
 #include "smithlab_utils.hpp"
+#include "BetaBin.hpp"
+#include "squarem.hpp"
 
 using std::vector;
 using std::pair;
@@ -139,8 +142,10 @@ log_sum_log_vec(const vector<double> &vals, size_t a, size_t b) {
 }
 
 static double
-log_sum_log_vec(const vector<double> &vals, const vector<size_t> &resets) {
+log_sum_log_vec(const size_t n_threads,
+                const vector<double> &vals, const vector<size_t> &resets) {
   vector<double> w(resets.size() - 1);
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
   for (size_t i = 0; i < resets.size() - 1; ++i)
     w[i] = log_sum_log_vec(vals, resets[i], resets[i+1] - 1);
   return log_sum_log_vec(w, w.size());
@@ -223,12 +228,18 @@ TwoStateHMM::BaumWelchTraining(const std::vector<pair<double, double> > &values,
 /////////// INTERNAL FUNCTIONS
 ////////////////////////////////////////////////////////////////////////
 
+/* The emissions are taken from "table", made for the values, which is
+   set for the parameters of "distr" first. The values from the table
+   are the same as from "distr", but each repeated count is computed
+   only once. */
 static void
-get_emissions(vector<pair<double, double> >::const_iterator v,
-              const vector<pair<double, double> >::const_iterator v_end,
-              vector<double>::iterator emit, const TwoStateBetaBin &distr) {
-  while (v != v_end)
-    *emit++ = distr(*v++);
+get_emissions(const size_t n_threads, const vector<pair<double, double> > &v,
+              vector<double> &emit, const TwoStateBetaBin &distr,
+              betabin_table &table) {
+  table.set_params(distr.alpha, distr.beta);
+#pragma omp parallel for num_threads(n_threads)
+  for (size_t i = 0; i < v.size(); ++i)
+    emit[i] = table(v[i]);
 }
 
 
@@ -273,6 +284,42 @@ backward_algorithm(const size_t start, const size_t end,
 }
 
 
+/* Forward and backward over each segment between reset points. The
+   segments are independent and each one only writes its own part of
+   "f" and "b", so they are done in parallel. The score of each segment
+   is kept in "scores" and the total is added in the order of the
+   segments, so results are the same for any number of threads. */
+static double
+forward_backward(const size_t n_threads, const vector<size_t> &reset_points,
+                 const double lp_sf, const double lp_sb,
+                 const double lp_ff, const double lp_fb,
+                 const double lp_bf, const double lp_bb,
+                 const vector<double> &fg_emit, const vector<double> &bg_emit,
+                 vector<pair<double, double> > &f,
+                 vector<pair<double, double> > &b,
+                 vector<double> &scores) {
+  const size_t n_segs = reset_points.size() - 1;
+  scores.resize(n_segs);
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
+  for (size_t i = 0; i < n_segs; ++i) {
+    const double score =
+      forward_algorithm(reset_points[i], reset_points[i + 1],
+                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                        fg_emit, bg_emit, f);
+
+    const double backward_score =
+      backward_algorithm(reset_points[i], reset_points[i + 1],
+                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                         fg_emit, bg_emit, b);
+
+    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
+
+    scores[i] = score;
+  }
+  return std::accumulate(begin(scores), end(scores), 0.0);
+}
+
+
 template <class T> static void
 one_minus(T a, const T a_end, T b) {
   while (a != a_end)
@@ -286,10 +333,12 @@ get_posterior(const pair<double, double> &f, const pair<double, double> &b) {
 }
 
 inline static void
-get_posteriors(const vector<pair<double, double> > &forward,
+get_posteriors(const size_t n_threads,
+               const vector<pair<double, double> > &forward,
                const vector<pair<double, double> > &backward,
                vector<double> &posteriors) {
   posteriors.resize(forward.size());
+#pragma omp parallel for num_threads(n_threads)
   for (size_t i = 0; i < forward.size(); ++i)
     posteriors[i] = get_posterior(forward[i], backward[i]);
 }
@@ -323,17 +372,222 @@ summarize_transitions(const size_t start, const size_t end,
 }
 
 
+// the expected transitions for all segments, in parallel
+static void
+summarize_transitions(const size_t n_threads,
+                      const vector<size_t> &reset_points,
+                      const vector<pair<double, double> > &f,
+                      const vector<pair<double, double> > &b,
+                      const vector<double> &scores,
+                      const vector<double> &fg_emit, const vector<double> &bg_emit,
+                      const double lp_ff, const double lp_fb,
+                      const double lp_bf, const double lp_bb,
+                      vector<double> &ff_vals, vector<double> &fb_vals,
+                      vector<double> &bf_vals, vector<double> &bb_vals) {
+  const size_t n_segs = reset_points.size() - 1;
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
+  for (size_t i = 0; i < n_segs; ++i)
+    summarize_transitions(reset_points[i], reset_points[i + 1],
+                          f, b, scores[i], fg_emit, bg_emit,
+                          lp_ff, lp_fb, lp_bf, lp_bb,
+                          ff_vals, fb_vals, bf_vals, bb_vals);
+}
+
+
+////////////////////////////////////////////////////////////////////////
+/////////// SCALED PROBABILITIES
+////////////////////////////////////////////////////////////////////////
+
+/* Forward and backward can also be done with probabilities instead of
+   logs, scaling the forward values at each position to sum to one and
+   dividing the backward values by the same "scale" (Rabiner, 1989).
+   Then the recursions have only products and sums, and the only calls
+   to exp and log are in flat loops over all positions: one to turn the
+   emissions into probabilities and one for the log of each scale. The
+   posteriors and expected transitions come from the scaled values
+   directly. Results agree with the log-space functions up to rounding.
+
+   The emissions are taken relative to the larger of the two at each
+   position, so large counts do not underflow. "fg_emit" and "bg_emit"
+   are replaced by these, and "scale" must be the size of the data. */
+static void
+scale_emissions(const size_t n_threads,
+                vector<double> &fg_emit, vector<double> &bg_emit,
+                vector<double> &offset) {
+#pragma omp parallel for num_threads(n_threads)
+  for (size_t i = 0; i < fg_emit.size(); ++i) {
+    const double m = max(fg_emit[i], bg_emit[i]);
+    fg_emit[i] = exp(fg_emit[i] - m);
+    bg_emit[i] = exp(bg_emit[i] - m);
+    offset[i] = m;
+  }
+}
+
 static double
-single_iteration(const vector<pair<double, double> > &values,
-                 const vector<double> &vals_a, const vector<double> &vals_b,
-                 const vector<size_t> &reset_points,
-                 vector<pair<double, double> > &forward,
-                 vector<pair<double, double> > &backward,
-                 double &p_fb, double &p_bf,
-                 TwoStateBetaBin &fg_distro, TwoStateBetaBin &bg_distro,
-                 vector<double> &fg_emit, vector<double> &bg_emit,
-                 vector<double> &ff_vals, vector<double> &fb_vals,
-                 vector<double> &bf_vals, vector<double> &bb_vals) {
+forward_scaled(const size_t start, const size_t end,
+               const double p_fb, const double p_bf,
+               const vector<double> &fg_emit, const vector<double> &bg_emit,
+               vector<double> &scale, vector<pair<double, double> > &f) {
+  const double p_ff = 1.0 - p_fb;
+  const double p_bb = 1.0 - p_bf;
+  // ADS: "scale" has the emission offsets coming in
+  double total_offset = 0.0;
+  double fg = fg_emit[start]*p_bf/(p_bf + p_fb);
+  double bg = bg_emit[start]*p_fb/(p_bf + p_fb);
+  for (size_t i = start; i < end; ++i) {
+    if (i > start) {
+      const pair<double, double> &prev = f[i - 1];
+      fg = fg_emit[i]*(prev.first*p_ff + prev.second*p_bf);
+      bg = bg_emit[i]*(prev.first*p_fb + prev.second*p_bb);
+    }
+    total_offset += scale[i];
+    scale[i] = fg + bg;
+    f[i].first = fg/scale[i];
+    f[i].second = bg/scale[i];
+  }
+  double total = total_offset;
+  for (size_t i = start; i < end; ++i)
+    total += log(scale[i]);
+  return total;
+}
+
+static void
+backward_scaled(const size_t start, const size_t end,
+                const double p_fb, const double p_bf,
+                const vector<double> &fg_emit, const vector<double> &bg_emit,
+                const vector<double> &scale,
+                vector<pair<double, double> > &b) {
+  const double p_ff = 1.0 - p_fb;
+  const double p_bb = 1.0 - p_bf;
+  b[end - 1].first = 1.0;
+  b[end - 1].second = 1.0;
+  for (size_t k = end - 1; k > start; --k) {
+    const double fg_a = fg_emit[k]*b[k].first/scale[k];
+    const double bg_a = bg_emit[k]*b[k].second/scale[k];
+    b[k - 1].first = p_ff*fg_a + p_fb*bg_a;
+    b[k - 1].second = p_bf*fg_a + p_bb*bg_a;
+  }
+}
+
+/* The same as forward_backward, but with scaled probabilities in "f"
+   and "b", and the emissions replaced as in scale_emissions. */
+static double
+forward_backward_scaled(const size_t n_threads,
+                        const vector<size_t> &reset_points,
+                        const double p_fb, const double p_bf,
+                        vector<double> &fg_emit, vector<double> &bg_emit,
+                        vector<double> &scale,
+                        vector<pair<double, double> > &f,
+                        vector<pair<double, double> > &b,
+                        vector<double> &scores) {
+  scale_emissions(n_threads, fg_emit, bg_emit, scale);
+  const size_t n_segs = reset_points.size() - 1;
+  scores.resize(n_segs);
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
+  for (size_t i = 0; i < n_segs; ++i) {
+    scores[i] = forward_scaled(reset_points[i], reset_points[i + 1],
+                               p_fb, p_bf, fg_emit, bg_emit, scale, f);
+    backward_scaled(reset_points[i], reset_points[i + 1],
+                    p_fb, p_bf, fg_emit, bg_emit, scale, b);
+  }
+  return std::accumulate(begin(scores), end(scores), 0.0);
+}
+
+inline static void
+get_posteriors_scaled(const size_t n_threads,
+                      const vector<pair<double, double> > &forward,
+                      const vector<pair<double, double> > &backward,
+                      vector<double> &posteriors) {
+  posteriors.resize(forward.size());
+#pragma omp parallel for num_threads(n_threads)
+  for (size_t i = 0; i < forward.size(); ++i) {
+    const double fg = forward[i].first*backward[i].first;
+    posteriors[i] = fg/(fg + forward[i].second*backward[i].second);
+  }
+}
+
+/* The expected number of each transition, added over each segment and
+   then over the segments in order, so the same for any threads. */
+static void
+expected_transitions_scaled(const size_t n_threads,
+                            const vector<size_t> &reset_points,
+                            const vector<pair<double, double> > &f,
+                            const vector<pair<double, double> > &b,
+                            const vector<double> &fg_emit,
+                            const vector<double> &bg_emit,
+                            const vector<double> &scale,
+                            const double p_fb, const double p_bf,
+                            double &ff, double &fb, double &bf, double &bb) {
+  const double p_ff = 1.0 - p_fb;
+  const double p_bb = 1.0 - p_bf;
+  const size_t n_segs = reset_points.size() - 1;
+  vector<std::array<double, 4> > seg_trans(n_segs);
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
+  for (size_t j = 0; j < n_segs; ++j) {
+    std::array<double, 4> &t = seg_trans[j];
+    /* ADS: in log space a segment with one site has nothing written
+       to its place in "ff_vals", etc., which stay at log(1); so count
+       one of each transition here too, to agree with that */
+    t.fill(reset_points[j + 1] - reset_points[j] == 1 ? 1.0 : 0.0);
+    for (size_t i = reset_points[j] + 1; i < reset_points[j + 1]; ++i) {
+      const double fg_a = fg_emit[i]*b[i].first/scale[i];
+      const double bg_a = bg_emit[i]*b[i].second/scale[i];
+      const pair<double, double> &prev = f[i - 1];
+      t[0] += prev.first*p_ff*fg_a;
+      t[1] += prev.first*p_fb*bg_a;
+      t[2] += prev.second*p_bf*fg_a;
+      t[3] += prev.second*p_bb*bg_a;
+    }
+  }
+  ff = fb = bf = bb = 0.0;
+  for (size_t j = 0; j < n_segs; ++j) {
+    ff += seg_trans[j][0];
+    fb += seg_trans[j][1];
+    bf += seg_trans[j][2];
+    bb += seg_trans[j][3];
+  }
+}
+
+/* The same as "expectation" but with scaled probabilities; "scale"
+   must be the size of the data, and the emissions are replaced. */
+static double
+expectation_scaled(const size_t n_threads, const vector<size_t> &reset_points,
+                   vector<pair<double, double> > &forward,
+                   vector<pair<double, double> > &backward,
+                   vector<double> &fg_emit, vector<double> &bg_emit,
+                   vector<double> &scale,
+                   double &p_fb, double &p_bf, vector<double> &posteriors) {
+  vector<double> scores;
+  const double total_loglik =
+    forward_backward_scaled(n_threads, reset_points, p_fb, p_bf,
+                            fg_emit, bg_emit, scale, forward, backward, scores);
+
+  double ff = 0.0, fb = 0.0, bf = 0.0, bb = 0.0;
+  expected_transitions_scaled(n_threads, reset_points, forward, backward,
+                              fg_emit, bg_emit, scale, p_fb, p_bf,
+                              ff, fb, bf, bb);
+  assert(fb/(ff + fb) > tolerance);
+  p_fb = fb/(ff + fb);
+  assert(bf/(bf + bb) > tolerance);
+  p_bf = bf/(bf + bb);
+
+  get_posteriors_scaled(n_threads, forward, backward, posteriors);
+
+  return total_loglik;
+}
+
+
+/* The expected transitions and the posteriors from forward/backward
+   in log space, giving the new transition probabilities in "p_fb" and
+   "p_bf". The "*_vals" are for the transitions at each position. */
+static double
+expectation(const size_t n_threads, const vector<size_t> &reset_points,
+            vector<pair<double, double> > &forward,
+            vector<pair<double, double> > &backward,
+            const vector<double> &fg_emit, const vector<double> &bg_emit,
+            vector<double> &ff_vals, vector<double> &fb_vals,
+            vector<double> &bf_vals, vector<double> &bb_vals,
+            double &p_fb, double &p_bf, vector<double> &posteriors) {
 
   const double lp_sf = log(p_bf/(p_bf + p_fb));
   const double lp_sb = log(p_fb/(p_bf + p_fb));
@@ -344,46 +598,62 @@ single_iteration(const vector<pair<double, double> > &values,
   assert(isfinite(lp_sf) && isfinite(lp_sb) && isfinite(lp_ff) &&
          isfinite(lp_fb) && isfinite(lp_bf) && isfinite(lp_bb));
 
-  get_emissions(begin(values), end(values), begin(fg_emit), fg_distro);
-  get_emissions(begin(values), end(values), begin(bg_emit), bg_distro);
-
-  double total_loglik = 0;
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-
-    const double score =
-      forward_algorithm(reset_points[i], reset_points[i + 1],
-                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                        fg_emit, bg_emit, forward);
-
-    const double backward_score =
-      backward_algorithm(reset_points[i], reset_points[i + 1],
-                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                         fg_emit, bg_emit, backward);
-
-    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
-
-    summarize_transitions(reset_points[i], reset_points[i + 1],
-                          forward, backward, score, fg_emit, bg_emit,
-                          lp_ff, lp_fb, lp_bf, lp_bb,
-                          ff_vals, fb_vals, bf_vals, bb_vals);
+  vector<double> scores;
+  const double total_loglik =
+    forward_backward(n_threads, reset_points,
+                     lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                     fg_emit, bg_emit, forward, backward, scores);
 
-    total_loglik += score;
-  }
+  summarize_transitions(n_threads, reset_points, forward, backward, scores,
+                        fg_emit, bg_emit, lp_ff, lp_fb, lp_bf, lp_bb,
+                        ff_vals, fb_vals, bf_vals, bb_vals);
 
-  const double p_ff_update = exp(log_sum_log_vec(ff_vals, reset_points));
-  const double p_fb_update = exp(log_sum_log_vec(fb_vals, reset_points));
+  const double p_ff_update =
+    exp(log_sum_log_vec(n_threads, ff_vals, reset_points));
+  const double p_fb_update =
+    exp(log_sum_log_vec(n_threads, fb_vals, reset_points));
   const double f_denom = p_ff_update + p_fb_update;
   assert(p_fb_update/f_denom > tolerance);
   p_fb = p_fb_update/f_denom;
 
-  const double p_bf_update = exp(log_sum_log_vec(bf_vals, reset_points));
-  const double p_bb_update = exp(log_sum_log_vec(bb_vals, reset_points));
+  const double p_bf_update =
+    exp(log_sum_log_vec(n_threads, bf_vals, reset_points));
+  const double p_bb_update =
+    exp(log_sum_log_vec(n_threads, bb_vals, reset_points));
   const double b_denom = p_bb_update + p_bf_update;
   assert(p_bf_update/b_denom > tolerance);
   p_bf = p_bf_update/b_denom;
 
+  get_posteriors(n_threads, forward, backward, posteriors);
+
+  return total_loglik;
+}
+
+static double
+single_iteration(const size_t n_threads,
+                 const vector<pair<double, double> > &values,
+                 const vector<double> &vals_a, const vector<double> &vals_b,
+                 const vector<size_t> &reset_points,
+                 vector<pair<double, double> > &forward,
+                 vector<pair<double, double> > &backward,
+                 double &p_fb, double &p_bf,
+                 TwoStateBetaBin &fg_distro, TwoStateBetaBin &bg_distro,
+                 betabin_table &table,
+                 vector<double> &fg_emit, vector<double> &bg_emit,
+                 vector<double> &ff_vals, vector<double> &fb_vals,
+                 vector<double> &bf_vals, vector<double> &bb_vals,
+                 const bool SCALED) {
+
+  get_emissions(n_threads, values, fg_emit, fg_distro, table);
+  get_emissions(n_threads, values, bg_emit, bg_distro, table);
+
   vector<double> posteriors;
-  get_posteriors(forward, backward, posteriors);
+  const double total_loglik = SCALED ?
+    expectation_scaled(n_threads, reset_points, forward, backward,
+                       fg_emit, bg_emit, ff_vals, p_fb, p_bf, posteriors) :
+    expectation(n_threads, reset_points, forward, backward, fg_emit, bg_emit,
+                ff_vals, fb_vals, bf_vals, bb_vals, p_fb, p_bf, posteriors);
+
   fg_distro.fit(vals_a, vals_b, posteriors);
 
   one_minus(begin(posteriors), end(posteriors), begin(posteriors));
@@ -432,6 +702,71 @@ report_params_for_verbose(const size_t i,
 }
 
 
+/* Training with SQUAREM (squarem.hpp). The free parameters are the
+   logits of the transitions and the logs of alpha and beta for each
+   distribution. "iteration" does one iteration of Baum-Welch from the
+   transitions it is given, and the distributions in "fg" and "bg". */
+template<class T> static double
+accelerated_training(T iteration, const size_t max_iterations,
+                     const double tolerance, const bool VERBOSE,
+                     double &p_fb, double &p_bf,
+                     vector<TwoStateBetaBin> &fg, vector<TwoStateBetaBin> &bg) {
+  const size_t n_distros = fg.size();
+  const auto pack = [&](const double fb, const double bf, vector<double> &x) {
+    x.resize(2 + 4*n_distros);
+    x[0] = squarem_logit(fb);
+    x[1] = squarem_logit(bf);
+    for (size_t r = 0; r < n_distros; ++r) {
+      x[2 + 4*r] = log(fg[r].alpha);
+      x[3 + 4*r] = log(fg[r].beta);
+      x[4 + 4*r] = log(bg[r].alpha);
+      x[5 + 4*r] = log(bg[r].beta);
+    }
+  };
+  const auto unpack = [&](const vector<double> &x, double &fb, double &bf) {
+    fb = squarem_expit(x[0]);
+    bf = squarem_expit(x[1]);
+    for (size_t r = 0; r < n_distros; ++r) {
+      fg[r] = TwoStateBetaBin(exp(x[2 + 4*r]), exp(x[3 + 4*r]));
+      bg[r] = TwoStateBetaBin(exp(x[4 + 4*r]), exp(x[5 + 4*r]));
+    }
+  };
+
+  if (VERBOSE)
+    report_param_header_for_verbose();
+
+  double prev_total = -std::numeric_limits<double>::max();
+  size_t itr = 0;
+  const auto em_step = [&](const vector<double> &x, vector<double> &x_next,
+                           bool &converged) {
+    double p_fb_est = 0.0, p_bf_est = 0.0;
+    unpack(x, p_fb_est, p_bf_est);
+    const double p_fb_prev = p_fb_est, p_bf_prev = p_bf_est;
+    const double total = iteration(p_fb_est, p_bf_est);
+    if (VERBOSE) // reporting for first replicate
+      report_params_for_verbose(itr++, p_fb_est, p_bf_est,
+                                fg[0], bg[0], total, prev_total);
+    converged = (abs(get_delta(p_fb_prev, p_fb_est)) < tolerance &&
+                 abs(get_delta(p_bf_prev, p_bf_est)) < tolerance);
+    prev_total = total;
+    pack(p_fb_est, p_bf_est, x_next);
+    return total;
+  };
+
+  vector<double> x;
+  pack(p_fb, p_bf, x);
+  squarem_stats stats;
+  const double total = squarem(em_step, max_iterations, x, stats);
+  unpack(x, p_fb, p_bf);
+
+  if (VERBOSE)
+    cerr << "SQUAREM: " << stats.passes << " passes, "
+         << stats.accepted << " jumps kept, "
+         << stats.rejected << " rejected" << endl;
+  return total;
+}
+
+
 static void
 extract_fractional_values(const vector<pair<double, double> > &values,
                           vector<double> &vals_a, vector<double> &vals_b) {
@@ -467,9 +802,28 @@ TwoStateHMM::BaumWelchTraining(const vector<pair<double, double> > &values,
   vector<pair<double, double> > forward(n_vals, make_pair(0.0, 0.0));
   vector<pair<double, double> > backward(n_vals, make_pair(0.0, 0.0));
 
-  vector<double> ff_vals(n_vals), fb_vals(n_vals); // for estimating transitions
-  vector<double> bf_vals(n_vals), bb_vals(n_vals);
+  // for estimating transitions, or the scales if SCALED
+  vector<double> ff_vals(n_vals), fb_vals(SCALED ? 0 : n_vals);
+  vector<double> bf_vals(SCALED ? 0 : n_vals), bb_vals(SCALED ? 0 : n_vals);
   vector<double> fg_emit(n_vals), bg_emit(n_vals); // avoid recomp of emissions
+  betabin_table table(values); // the emission for each count only once
+
+  if (ACCELERATE) {
+    vector<TwoStateBetaBin> fg(1, fg_distro), bg(1, bg_distro);
+    const auto iteration = [&](double &p_fb_est, double &p_bf_est) {
+      return single_iteration(n_threads, values, vals_a, vals_b, reset_points,
+                              forward, backward, p_fb_est, p_bf_est,
+                              fg[0], bg[0], table,
+                              fg_emit, bg_emit, ff_vals, fb_vals, bf_vals,
+                              bb_vals, SCALED);
+    };
+    const double total =
+      accelerated_training(iteration, max_iterations, tolerance, VERBOSE,
+                           p_fb, p_bf, fg, bg);
+    fg_distro = fg[0];
+    bg_distro = bg[0];
+    return total;
+  }
 
   if (VERBOSE)
     report_param_header_for_verbose();
@@ -481,9 +835,10 @@ TwoStateHMM::BaumWelchTraining(const vector<pair<double, double> > &values,
     double p_fb_est = p_fb, p_bf_est = p_bf;
 
     const double total =
-      single_iteration(values, vals_a, vals_b, reset_points, forward, backward,
-                       p_fb_est, p_bf_est, fg_distro, bg_distro,
-                       ff_vals, fb_vals, bf_vals, bb_vals, fg_emit, bg_emit);
+      single_iteration(n_threads, values, vals_a, vals_b, reset_points, forward, backward,
+                       p_fb_est, p_bf_est, fg_distro, bg_distro, table,
+                       fg_emit, bg_emit, ff_vals, fb_vals, bf_vals, bb_vals,
+                       SCALED);
 
     if (VERBOSE)
       report_params_for_verbose(i, p_fb_est, p_bf_est,
@@ -532,27 +887,23 @@ TwoStateHMM::PosteriorScores(const vector<pair<double, double> > &values,
   vector<pair<double, double> > backward(n_vals, make_pair(0.0, 0.0));
 
   vector<double> fg_emit(n_vals), bg_emit(n_vals);
-  get_emissions(begin(values), end(values), begin(fg_emit), fg_distro);
-  get_emissions(begin(values), end(values), begin(bg_emit), bg_distro);
-
-  double total_loglik = 0;
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm(reset_points[i], reset_points[i + 1],
-                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                        fg_emit, bg_emit, forward);
-
-    const double backward_score =
-      backward_algorithm(reset_points[i], reset_points[i + 1],
-                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                         fg_emit, bg_emit, backward);
-
-    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
-
-    total_loglik += score;
+  betabin_table table(values);
+  get_emissions(n_threads, values, fg_emit, fg_distro, table);
+  get_emissions(n_threads, values, bg_emit, bg_distro, table);
+
+  vector<double> scores;
+  if (SCALED) {
+    vector<double> scale(n_vals);
+    forward_backward_scaled(n_threads, reset_points, p_fb, p_bf,
+                            fg_emit, bg_emit, scale, forward, backward, scores);
+    get_posteriors_scaled(n_threads, forward, backward, posteriors);
+  }
+  else {
+    forward_backward(n_threads, reset_points,
+                     lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                     fg_emit, bg_emit, forward, backward, scores);
+    get_posteriors(n_threads, forward, backward, posteriors);
   }
-
-  get_posteriors(forward, backward, posteriors);
   if (!fg_class)
     one_minus(begin(posteriors), end(posteriors), begin(posteriors));
 }
@@ -613,25 +964,21 @@ TwoStateHMM::TransitionPosteriors(const vector<pair<double, double> > &values,
   vector<pair<double, double> > backward(n_vals, make_pair(0.0, 0.0));
 
   vector<double> fg_emit(n_vals), bg_emit(n_vals);
-  get_emissions(begin(values), end(values), begin(fg_emit), fg_distro);
-  get_emissions(begin(values), end(values), begin(bg_emit), bg_distro);
-
-  double total_loglik = 0;
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm(reset_points[i], reset_points[i + 1],
-                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                        fg_emit, bg_emit, forward);
-
-    const double backward_score =
-      backward_algorithm(reset_points[i], reset_points[i + 1],
-                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                         fg_emit, bg_emit, backward);
-
-    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
-
-    total_loglik += score;
+  betabin_table table(values);
+  get_emissions(n_threads, values, fg_emit, fg_distro, table);
+  get_emissions(n_threads, values, bg_emit, bg_distro, table);
+
+  vector<double> seg_scores;
+  if (SCALED) {
+    vector<double> scale(n_vals);
+    forward_backward_scaled(n_threads, reset_points, p_fb, p_bf,
+                            fg_emit, bg_emit, scale, forward, backward,
+                            seg_scores);
   }
+  else
+    forward_backward(n_threads, reset_points,
+                     lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                     fg_emit, bg_emit, forward, backward, seg_scores);
 
   scores.clear();
   scores.resize(n_vals, 0.0);
@@ -639,6 +986,18 @@ TwoStateHMM::TransitionPosteriors(const vector<pair<double, double> > &values,
   for (size_t i = 0; i < n_vals; ++i) {
     if (i == reset_points[j])
       ++j;
+    else if (SCALED) {
+      // ADS: the scale at i is the same for all four, so it cancels
+      const double fg_a = fg_emit[i]*backward[i].first;
+      const double bg_a = bg_emit[i]*backward[i].second;
+      const double trans[] = {
+        forward[i - 1].first*(1.0 - p_fb)*fg_a,
+        forward[i - 1].first*p_fb*bg_a,
+        forward[i - 1].second*p_bf*fg_a,
+        forward[i - 1].second*(1.0 - p_bf)*bg_a
+      };
+      scores[i] = trans[transition]/(trans[0] + trans[1] + trans[2] + trans[3]);
+    }
     else {
       double ff_c, fb_c, bf_c, bb_c;
       get_joint_posteriors(forward[i - 1], backward[i], fg_emit[i], bg_emit[i],
@@ -676,27 +1035,27 @@ TwoStateHMM::PosteriorDecoding(const vector<pair<double, double> > &values,
   vector<pair<double, double> > backward(n_vals, make_pair(0.0, 0.0));
 
   vector<double> fg_emit(n_vals), bg_emit(n_vals);
-  get_emissions(begin(values), end(values), begin(fg_emit), fg_distro);
-  get_emissions(begin(values), end(values), begin(bg_emit), bg_distro);
-
-  double total_loglik = 0;
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm(reset_points[i], reset_points[i + 1],
-                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                        fg_emit, bg_emit, forward);
-
-    const double backward_score =
-      backward_algorithm(reset_points[i], reset_points[i + 1],
-                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                         fg_emit, bg_emit, backward);
-
-    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
-
-    total_loglik += score;
+  betabin_table table(values);
+  get_emissions(n_threads, values, fg_emit, fg_distro, table);
+  get_emissions(n_threads, values, bg_emit, bg_distro, table);
+
+  vector<double> scores;
+  double total_loglik = 0.0;
+  if (SCALED) {
+    vector<double> scale(n_vals);
+    total_loglik =
+      forward_backward_scaled(n_threads, reset_points, p_fb, p_bf,
+                              fg_emit, bg_emit, scale, forward, backward,
+                              scores);
+    get_posteriors_scaled(n_threads, forward, backward, posteriors);
+  }
+  else {
+    total_loglik =
+      forward_backward(n_threads, reset_points,
+                       lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                       fg_emit, bg_emit, forward, backward, scores);
+    get_posteriors(n_threads, forward, backward, posteriors);
   }
-
-  get_posteriors(forward, backward, posteriors);
 
   classes.resize(n_vals);
   for (size_t i = 0; i < n_vals; ++i)
@@ -870,14 +1229,31 @@ has_data(const pair<double, double> &p) {
   return p.first + p.second >= 1.0;
 }
 
+// ADS: for each site the replicates are added in order, as before
 static void
-get_emissions_rep(const vector<vector<pair<double, double> > > &v,
-                  vector<double> &emit, const vector<TwoStateBetaBin> &distr) {
-  fill(begin(emit), end(emit), 0.0);
+get_emissions_rep(const size_t n_threads,
+                  const vector<vector<pair<double, double> > > &v,
+                  vector<double> &emit, const vector<TwoStateBetaBin> &distr,
+                  vector<betabin_table> &tables) {
   for (size_t r = 0; r < v.size(); ++r)
-    for (size_t i = 0; i < v[r].size(); ++i)
+    tables[r].set_params(distr[r].alpha, distr[r].beta);
+#pragma omp parallel for num_threads(n_threads)
+  for (size_t i = 0; i < emit.size(); ++i) {
+    emit[i] = 0.0;
+    for (size_t r = 0; r < v.size(); ++r)
       if (has_data(v[r][i]))
-        emit[i] += distr[r](v[r][i]);
+        emit[i] += tables[r](v[r][i]);
+  }
+}
+
+
+// a table of emissions for the values of each replicate
+static void
+make_tables(const vector<vector<pair<double, double> > > &values,
+            vector<betabin_table> &tables) {
+  tables.clear();
+  for (size_t r = 0; r < values.size(); ++r)
+    tables.push_back(betabin_table(values[r]));
 }
 
 
@@ -901,7 +1277,8 @@ fit_distro_rep(TwoStateBetaBin &distro, const vector<pair<double, double> > &val
 
 
 static double
-single_iteration_rep(const vector<vector<pair<double, double> > > &values,
+single_iteration_rep(const size_t n_threads,
+                     const vector<vector<pair<double, double> > > &values,
                      const vector<vector<double> > &vals_a,
                      const vector<vector<double> > &vals_b,
                      const vector<size_t> &reset_points,
@@ -909,56 +1286,21 @@ single_iteration_rep(const vector<vector<pair<double, double> > > &values,
                      vector<pair<double, double> > &backward,
                      double &p_fb, double &p_bf,
                      vector<TwoStateBetaBin> &fg_distro, vector<TwoStateBetaBin> &bg_distro,
+                     vector<betabin_table> &tables,
                      vector<double> &fg_emit, vector<double> &bg_emit,
                      vector<double> &ff_vals, vector<double> &fb_vals,
-                     vector<double> &bf_vals, vector<double> &bb_vals) {
+                     vector<double> &bf_vals, vector<double> &bb_vals,
+                     const bool SCALED) {
 
-  const double lp_sf = log(p_bf/(p_bf + p_fb));
-  const double lp_sb = log(p_fb/(p_bf + p_fb));
-  const double lp_ff = log(1.0 - p_fb);
-  const double lp_fb = log(p_fb);
-  const double lp_bf = log(p_bf);
-  const double lp_bb = log(1.0 - p_bf);
-
-  get_emissions_rep(values, fg_emit, fg_distro);
-  get_emissions_rep(values, bg_emit, bg_distro);
-
-  double total_loglik = 0;
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm(reset_points[i], reset_points[i + 1],
-                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                        fg_emit, bg_emit, forward);
-
-    const double backward_score =
-      backward_algorithm(reset_points[i], reset_points[i + 1],
-                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                         fg_emit, bg_emit, backward);
-
-    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
-
-    summarize_transitions(reset_points[i], reset_points[i + 1],
-                          forward, backward, score, fg_emit, bg_emit,
-                          lp_ff, lp_fb, lp_bf, lp_bb,
-                          ff_vals, fb_vals, bf_vals, bb_vals);
-
-    total_loglik += score;
-  }
-
-  const double p_ff_update = exp(log_sum_log_vec(ff_vals, reset_points));
-  const double p_fb_update = exp(log_sum_log_vec(fb_vals, reset_points));
-  const double f_denom = p_ff_update + p_fb_update;
-  assert(p_fb_update/f_denom > tolerance);
-  p_fb = p_fb_update/f_denom;
-
-  const double p_bf_update = exp(log_sum_log_vec(bf_vals, reset_points));
-  const double p_bb_update = exp(log_sum_log_vec(bb_vals, reset_points));
-  const double b_denom = p_bb_update + p_bf_update;
-  assert(p_bf_update/b_denom > tolerance);
-  p_bf = p_bf_update/b_denom;
+  get_emissions_rep(n_threads, values, fg_emit, fg_distro, tables);
+  get_emissions_rep(n_threads, values, bg_emit, bg_distro, tables);
 
   vector<double> posteriors;
-  get_posteriors(forward, backward, posteriors);
+  const double total_loglik = SCALED ?
+    expectation_scaled(n_threads, reset_points, forward, backward,
+                       fg_emit, bg_emit, ff_vals, p_fb, p_bf, posteriors) :
+    expectation(n_threads, reset_points, forward, backward, fg_emit, bg_emit,
+                ff_vals, fb_vals, bf_vals, bb_vals, p_fb, p_bf, posteriors);
 
   const size_t n_reps = values.size();
   const size_t n_vals = values[0].size();
@@ -998,9 +1340,24 @@ TwoStateHMM::BaumWelchTraining(const vector<vector<pair<double, double> > > &val
   vector<pair<double, double> > forward(n_vals, make_pair(0.0, 0.0));
   vector<pair<double, double> > backward(n_vals, make_pair(0.0, 0.0));
 
-  vector<double> ff_vals(n_vals), fb_vals(n_vals); // for estimating transitions
-  vector<double> bf_vals(n_vals), bb_vals(n_vals);
+  // for estimating transitions, or the scales if SCALED
+  vector<double> ff_vals(n_vals), fb_vals(SCALED ? 0 : n_vals);
+  vector<double> bf_vals(SCALED ? 0 : n_vals), bb_vals(SCALED ? 0 : n_vals);
   vector<double> fg_emit(n_vals), bg_emit(n_vals); // avoid recomp of emissions
+  vector<betabin_table> tables; // the emission for each count only once
+  make_tables(values, tables);
+
+  if (ACCELERATE) {
+    const auto iteration = [&](double &p_fb_est, double &p_bf_est) {
+      return single_iteration_rep(n_threads, values, vals_a, vals_b,
+                                  reset_points, forward, backward,
+                                  p_fb_est, p_bf_est, fg_distro, bg_distro,
+                                  tables, fg_emit, bg_emit, ff_vals, fb_vals,
+                                  bf_vals, bb_vals, SCALED);
+    };
+    return accelerated_training(iteration, max_iterations, tolerance, VERBOSE,
+                                p_fb, p_bf, fg_distro, bg_distro);
+  }
 
   if (VERBOSE)
     report_param_header_for_verbose();
@@ -1012,9 +1369,10 @@ TwoStateHMM::BaumWelchTraining(const vector<vector<pair<double, double> > > &val
     double p_fb_est = p_fb, p_bf_est = p_bf;
 
     const double total =
-      single_iteration_rep(values, vals_a, vals_b, reset_points, forward, backward,
-                           p_fb_est, p_bf_est, fg_distro, bg_distro,
-                           ff_vals, fb_vals, bf_vals, bb_vals, fg_emit, bg_emit);
+      single_iteration_rep(n_threads, values, vals_a, vals_b, reset_points, forward, backward,
+                           p_fb_est, p_bf_est, fg_distro, bg_distro, tables,
+                           fg_emit, bg_emit, ff_vals, fb_vals, bf_vals, bb_vals,
+                           SCALED);
 
     if (VERBOSE) // reporting for first replicate
       report_params_for_verbose(i, p_fb_est, p_bf_est,
@@ -1061,27 +1419,24 @@ TwoStateHMM::PosteriorScores(const vector<vector<pair<double, double> > > &value
   vector<pair<double, double> > backward(n_vals, make_pair(0.0, 0.0));
 
   vector<double> fg_emit(n_vals), bg_emit(n_vals);
-  get_emissions_rep(values, fg_emit, fg_distro);
-  get_emissions_rep(values, bg_emit, bg_distro);
-
-  double total_loglik = 0;
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm(reset_points[i], reset_points[i + 1],
-                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                        fg_emit, bg_emit, forward);
-
-    const double backward_score =
-      backward_algorithm(reset_points[i], reset_points[i + 1],
-                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                         fg_emit, bg_emit, backward);
-
-    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
-
-    total_loglik += score;
+  vector<betabin_table> tables;
+  make_tables(values, tables);
+  get_emissions_rep(n_threads, values, fg_emit, fg_distro, tables);
+  get_emissions_rep(n_threads, values, bg_emit, bg_distro, tables);
+
+  vector<double> scores;
+  if (SCALED) {
+    vector<double> scale(n_vals);
+    forward_backward_scaled(n_threads, reset_points, p_fb, p_bf,
+                            fg_emit, bg_emit, scale, forward, backward, scores);
+    get_posteriors_scaled(n_threads, forward, backward, posteriors);
+  }
+  else {
+    forward_backward(n_threads, reset_points,
+                     lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                     fg_emit, bg_emit, forward, backward, scores);
+    get_posteriors(n_threads, forward, backward, posteriors);
   }
-
-  get_posteriors(forward, backward, posteriors);
   if (!fg_class)
     one_minus(begin(posteriors), end(posteriors), begin(posteriors));
 }
@@ -1108,28 +1463,28 @@ TwoStateHMM::PosteriorDecoding(const vector<vector<pair<double, double> > > &val
   vector<pair<double, double> > backward(n_vals, make_pair(0.0, 0.0));
 
   vector<double> fg_emit(n_vals), bg_emit(n_vals);
-  get_emissions_rep(values, fg_emit, fg_distro);
-  get_emissions_rep(values, bg_emit, bg_distro);
-
-  double total_loglik = 0;
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-
-    const double score =
-      forward_algorithm(reset_points[i], reset_points[i + 1],
-                        lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                        fg_emit, bg_emit, forward);
-
-    const double backward_score =
-      backward_algorithm(reset_points[i], reset_points[i + 1],
-                         lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
-                         fg_emit, bg_emit, backward);
-
-    assert(fabs(score - backward_score)/max(score, backward_score) < tolerance);
-
-    total_loglik += score;
+  vector<betabin_table> tables;
+  make_tables(values, tables);
+  get_emissions_rep(n_threads, values, fg_emit, fg_distro, tables);
+  get_emissions_rep(n_threads, values, bg_emit, bg_distro, tables);
+
+  vector<double> scores;
+  double total_loglik = 0.0;
+  if (SCALED) {
+    vector<double> scale(n_vals);
+    total_loglik =
+      forward_backward_scaled(n_threads, reset_points, p_fb, p_bf,
+                              fg_emit, bg_emit, scale, forward, backward,
+                              scores);
+    get_posteriors_scaled(n_threads, forward, backward, posteriors);
+  }
+  else {
+    total_loglik =
+      forward_backward(n_threads, reset_points,
+                       lp_sf, lp_sb, lp_ff, lp_fb, lp_bf, lp_bb,
+                       fg_emit, bg_emit, forward, backward, scores);
+    get_posteriors(n_threads, forward, backward, posteriors);
   }
-
-  get_posteriors(forward, backward, posteriors);
 
   classes.resize(n_vals);
   for (size_t i = 0; i < n_vals; ++i)
@@ -24,8 +24,11 @@ struct TwoStateBetaBin;
 class TwoStateHMM {
 public:
 
-  TwoStateHMM(const double tol, const size_t max_itr, const bool v) :
-    tolerance(tol), max_iterations(max_itr), VERBOSE(v) {}
+  TwoStateHMM(const double tol, const size_t max_itr, const bool v,
+              const size_t nt = 1, const bool sc = false,
+              const bool acc = false) :
+    tolerance(tol), max_iterations(max_itr), VERBOSE(v), n_threads(nt),
+    SCALED(sc), ACCELERATE(acc) {}
 
   double
   ViterbiDecoding(const std::vector<std::pair<double, double> > &values,
@@ -174,6 +177,9 @@ private:
   double tolerance;
   size_t max_iterations;
   bool VERBOSE;
+  size_t n_threads; // segments between reset points are done in parallel
+  bool SCALED; // forward/backward with scaled probabilities, not logs
+  bool ACCELERATE; // training with SQUAREM, see squarem.hpp
 };
 
 #endif
@@ -17,6 +17,7 @@
 */
 
 #include "TwoStateHMM_PMD.hpp"
+#include "squarem.hpp"
 
 // #pragma omp <rest of pragma>
 
@@ -101,8 +102,8 @@ TwoStateHMM::TransitionPosteriors_rep(
       bg_distro.emplace_back(new Beta(bg_alpha[i], bg_beta[i]));
     }
     else {
-      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i]));
-      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i]));
+      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i], values[i]));
+      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i], values[i]));
     }
   }
 
@@ -208,6 +209,51 @@ TwoStateHMM::backward_algorithm_rep(
 }
 
 
+double
+TwoStateHMM::forward_backward_rep(
+              const vector<vector<pair<double, double> > > &vals,
+                                   const vector<size_t> &reset_points,
+                                   const double lp_sf, const double lp_sb,
+                                   const double lp_ff, const double lp_fb,
+                                   const double lp_ft, const double lp_bf,
+                                   const double lp_bb, const double lp_bt,
+                                   const vector<unique_ptr<EmissionDistribution> > &fg_distro,
+                                   const vector<unique_ptr<EmissionDistribution> > &bg_distro,
+                                   vector<pair<double, double> > &f,
+                                   vector<pair<double, double> > &b,
+                                   vector<double> &scores,
+              const vector<bool> &array_status) const {
+  // ADS: each segment only writes its own part of "f" and "b"
+  const size_t n_segs = reset_points.size() - 1;
+  scores.resize(n_segs);
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
+  for (size_t i = 0; i < n_segs; ++i) {
+    const double score =
+      forward_algorithm_rep(vals, reset_points[i], reset_points[i + 1],
+                            lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
+                            lp_bf, lp_bb, lp_bt,
+                            fg_distro, bg_distro, f, array_status);
+
+    const double backward_score =
+      backward_algorithm_rep(vals, reset_points[i], reset_points[i + 1],
+                             lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
+                             lp_bf, lp_bb, lp_bt,
+                             fg_distro, bg_distro, b, array_status);
+
+    if (DEBUG && (fabs(score - backward_score)/
+                  max(score, backward_score)) > 1e-10) {
+#pragma omp critical
+      cerr << "fabs(score - backward_score)/"
+           << "max(score, backward_score) > 1e-10" << endl;
+    }
+
+    scores[i] = score;
+  }
+  // the total does not depend on the number of threads
+  return std::accumulate(begin(scores), end(scores), 0.0);
+}
+
+
 //ff_vals: ksi_t(1,1), where 1 is the S_1, i.e. posterior prob of transitions
 void
 TwoStateHMM::estimate_transitions_rep(
@@ -289,42 +335,21 @@ TwoStateHMM::single_iteration_rep(const vector<vector<pair<double, double> > > &
   vector<double> bf_vals(values[0].size(), 0);
   vector<double> bb_vals(values[0].size(), 0);
 
-  // #pragma omp parallel
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score =
-      forward_algorithm_rep(values,
-                            reset_points[i],
-                            reset_points[i + 1],
-                            lp_sf, lp_sb,
-                            lp_ff, lp_fb, lp_ft,
-                            lp_bf, lp_bb, lp_bt,
-                            fg_distro, bg_distro,
-                            forward, array_status);
-
-    const double backward_score =
-      backward_algorithm_rep(values,
-                             reset_points[i],
-                             reset_points[i + 1],
-                             lp_sf, lp_sb,
-                             lp_ff, lp_fb, lp_ft,
-                             lp_bf, lp_bb, lp_bt,
-                             fg_distro, bg_distro,
-                             backward, array_status);
-
-    if (DEBUG && (fabs(score - backward_score)/
-                  max(score, backward_score)) > 1e-10) {
-      cerr << "fabs(score - backward_score)/"
-           << "max(score, backward_score) > 1e-10" << endl;
-    }
+  vector<double> seg_scores;
+  total_score =
+    forward_backward_rep(values, reset_points,
+                         lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
+                         lp_bf, lp_bb, lp_bt, fg_distro, bg_distro,
+                         forward, backward, seg_scores, array_status);
 
+#pragma omp parallel for num_threads(n_threads) schedule(dynamic, 16)
+  for (size_t i = 0; i < reset_points.size() - 1; ++i)
     estimate_transitions_rep(values, reset_points[i], reset_points[i + 1],
-                             forward, backward, score, fg_distro, bg_distro,
+                             forward, backward, seg_scores[i],
+                             fg_distro, bg_distro,
                              lp_ff, lp_fb, lp_bf, lp_bb, lp_ft, lp_bt,
                              ff_vals, fb_vals, bf_vals, bb_vals, array_status);
 
-    total_score += score;
-  }
-
   // Subtracting 1 from the limit of the summation
   // to eliminate the last term in the last block
   // And subtracting  (#blocks-1) from the sum
@@ -424,8 +449,8 @@ TwoStateHMM::BaumWelchTraining_rep(
       bg_distro.emplace_back(new Beta(bg_alpha[i], bg_beta[i]));
     }
     else {
-      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i]));
-      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i]));
+      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i], values[i]));
+      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i], values[i]));
     }
   }
 
@@ -513,6 +538,83 @@ TwoStateHMM::BaumWelchTraining_rep(
     }
   }
 
+  if (ACCELERATE) {
+    /* The free parameters for SQUAREM (squarem.hpp) are the logs of the
+       start probabilities, the logits of leaving each state as a share
+       of staying or leaving, and the logs of alpha and beta for each
+       replicate. The transitions to the end state are not trained. */
+    const auto pack = [&](const double sf, const double sb,
+                          const double ff, const double fb,
+                          const double bf, const double bb,
+                          vector<double> &x) {
+      x.clear();
+      x.push_back(log(sf));
+      x.push_back(log(sb));
+      x.push_back(squarem_logit(fb/(ff + fb)));
+      x.push_back(squarem_logit(bf/(bf + bb)));
+      for (size_t r = 0; r < NREP; ++r) {
+        x.push_back(log(fg_distro[r]->getalpha()));
+        x.push_back(log(fg_distro[r]->getbeta()));
+        x.push_back(log(bg_distro[r]->getalpha()));
+        x.push_back(log(bg_distro[r]->getbeta()));
+      }
+    };
+    const auto unpack = [&](const vector<double> &x,
+                            double &sf, double &sb, double &ff, double &fb,
+                            double &bf, double &bb) {
+      sf = exp(x[0]);
+      sb = exp(x[1]);
+      fb = squarem_expit(x[2])*(1.0 - p_ft);
+      ff = 1.0 - p_ft - fb;
+      bf = squarem_expit(x[3])*(1.0 - p_bt);
+      bb = 1.0 - p_bt - bf;
+      for (size_t r = 0; r < NREP; ++r) {
+        fg_distro[r]->set_params(exp(x[4 + 4*r]), exp(x[5 + 4*r]));
+        bg_distro[r]->set_params(exp(x[6 + 4*r]), exp(x[7 + 4*r]));
+      }
+    };
+
+    size_t itr = 0;
+    const auto em_step = [&](const vector<double> &x, vector<double> &x_next,
+                             bool &converged) {
+      double p_sf_est, p_sb_est, p_ff_est, p_fb_est, p_bf_est, p_bb_est;
+      unpack(x, p_sf_est, p_sb_est, p_ff_est, p_fb_est, p_bf_est, p_bb_est);
+      double p_ft_est = p_ft;
+      double p_bt_est = p_bt;
+      const double total =
+        single_iteration_rep(values, vals_a_reps, vals_b_reps, reset_points,
+                             forward, backward,
+                             p_sf_est, p_sb_est,
+                             p_ff_est, p_fb_est, p_ft_est,
+                             p_bf_est, p_bb_est, p_bt_est,
+                             fg_distro, bg_distro, array_status);
+      if (VERBOSE)
+        cerr << setw(5) << ++itr
+             << setw(10) << 1/p_fb_est
+             << setw(10) << 1/p_bf_est
+             << setw(14) << total
+             << setw(14) << prev_total
+             << setw(14) << total - prev_total
+             << setw(14) << (total - prev_total)/std::fabs(total)
+             << endl;
+      converged = std::abs(total - prev_total) < tolerance;
+      prev_total = total;
+      pack(p_sf_est, p_sb_est, p_ff_est, p_fb_est, p_bf_est, p_bb_est, x_next);
+      return total;
+    };
+
+    vector<double> x;
+    pack(p_sf, p_sb, p_ff, p_fb, p_bf, p_bb, x);
+    squarem_stats stats;
+    const double total = squarem(em_step, max_iterations, x, stats);
+    unpack(x, p_sf, p_sb, p_ff, p_fb, p_bf, p_bb);
+    if (VERBOSE)
+      cerr << "SQUAREM: " << stats.passes << " passes, "
+           << stats.accepted << " jumps kept, "
+           << stats.rejected << " rejected" << endl << endl;
+    return total;
+  }
+
   for (size_t i = 0; i < max_iterations; ++i) {
 
     double p_sf_est = p_sf;
@@ -604,8 +706,8 @@ TwoStateHMM::PosteriorScores_rep(
       bg_distro.emplace_back(new Beta(bg_alpha[i], bg_beta[i]));
     }
     else {
-      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i]));
-      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i]));
+      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i], values[i]));
+      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i], values[i]));
     }
   }
 
@@ -636,7 +738,6 @@ TwoStateHMM::PosteriorScores_rep(
                                   vector<double> &llr_scores,
           const vector<bool> &array_status) const {
 
-  double total_score = 0;
 
   const double lp_sf = log(p_sf);
   const double lp_sb = log(p_sb);
@@ -656,33 +757,11 @@ TwoStateHMM::PosteriorScores_rep(
   vector<pair<double, double> > backward(values[0].size(),
                                          pair<double, double>(0, 0));
 
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm_rep(values,
-                                               reset_points[i],
-                                               reset_points[i + 1],
-                                               lp_sf, lp_sb,
-                                               lp_ff, lp_fb, lp_ft,
-                                               lp_bf, lp_bb, lp_bt,
-                                               fg_distro, bg_distro,
-                                               forward, array_status);
-
-    const double backward_score =
-      backward_algorithm_rep(values,
-                             reset_points[i],
-                             reset_points[i + 1],
-                             lp_sf, lp_sb,
-                             lp_ff, lp_fb, lp_ft,
-                             lp_bf, lp_bb, lp_bt,
-                             fg_distro, bg_distro,
-                             backward,array_status);
-
-    if (DEBUG && (fabs(score - backward_score)/
-                  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-           << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  vector<double> seg_scores;
+  forward_backward_rep(values, reset_points,
+                       lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
+                       lp_bf, lp_bb, lp_bt, fg_distro, bg_distro,
+                       forward, backward, seg_scores, array_status);
 
   llr_scores.resize(values[0].size());
   for (size_t i = 0; i < values[0].size(); ++i) {
@@ -719,8 +798,8 @@ TwoStateHMM::PosteriorDecoding_rep(
       bg_distro.emplace_back(new Beta(bg_alpha[i], bg_beta[i]));
     }
     else {
-      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i]));
-      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i]));
+      fg_distro.emplace_back(new BetaBinomial(fg_alpha[i], fg_beta[i], values[i]));
+      bg_distro.emplace_back(new BetaBinomial(bg_alpha[i], bg_beta[i], values[i]));
     }
   }
 
@@ -750,7 +829,6 @@ TwoStateHMM::TransitionPosteriors_rep(
       const size_t transition, const vector<bool> &array_status,
       vector<double> &scores) const {
 
-  double total_score = 0;
   size_t NREP = values.size();
   const double lp_sf = log(p_sf);
   const double lp_sb = log(p_sb);
@@ -769,27 +847,11 @@ TwoStateHMM::TransitionPosteriors_rep(
                                         pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values[0].size(),
                                          pair<double, double>(0, 0));
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm_rep(values,
-                       reset_points[i],
-                       reset_points[i + 1],
-                       lp_sf, lp_sb,
-                       lp_ff, lp_fb, lp_ft,
-                       lp_bf, lp_bb, lp_bt,
-                       fg_distro, bg_distro, forward, array_status);
-    const double backward_score =
-      backward_algorithm_rep(values, reset_points[i], reset_points[i + 1],
-             lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
-             lp_bf, lp_bb, lp_bt,
-             fg_distro, bg_distro, backward, array_status);
-
-    if (DEBUG && (fabs(score - backward_score)/
-          max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-       << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  vector<double> seg_scores;
+  forward_backward_rep(values, reset_points,
+                       lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
+                       lp_bf, lp_bb, lp_bt, fg_distro, bg_distro,
+                       forward, backward, seg_scores, array_status);
   scores.resize(values[0].size());
   size_t j = 0;
   for (size_t i = 0; i < values[0].size(); ++i) {
@@ -862,33 +924,12 @@ TwoStateHMM::PosteriorDecoding_rep(
                                         pair<double, double>(0, 0));
   vector<pair<double, double> > backward(values[0].size(),
                                          pair<double, double>(0, 0));
-  for (size_t i = 0; i < reset_points.size() - 1; ++i) {
-    const double score = forward_algorithm_rep(values,
-                                               reset_points[i],
-                                               reset_points[i + 1],
-                                               lp_sf, lp_sb,
-                                               lp_ff, lp_fb, lp_ft,
-                                               lp_bf, lp_bb, lp_bt,
-                                               fg_distro, bg_distro,
-                                               forward,array_status);
-
-    const double backward_score =
-      backward_algorithm_rep(values,
-                             reset_points[i],
-                             reset_points[i + 1],
-                             lp_sf, lp_sb,
-                             lp_ff, lp_fb, lp_ft,
-                             lp_bf, lp_bb, lp_bt,
-                             fg_distro, bg_distro,
-                             backward,array_status);
-
-    if (DEBUG && (fabs(score - backward_score)/
-                  max(score, backward_score)) > 1e-10)
-      cerr << "fabs(score - backward_score)/"
-           << "max(score, backward_score) > 1e-10" << endl;
-
-    total_score += score;
-  }
+  vector<double> seg_scores;
+  total_score =
+    forward_backward_rep(values, reset_points,
+                         lp_sf, lp_sb, lp_ff, lp_fb, lp_ft,
+                         lp_bf, lp_bb, lp_bt, fg_distro, bg_distro,
+                         forward, backward, seg_scores, array_status);
 
   classes.resize(values[0].size());
 
@@ -33,9 +33,10 @@ class TwoStateHMM {
 public:
 
   TwoStateHMM(const double mp, const double tol,
-               const size_t max_itr, const bool v, bool d = false) :
+               const size_t max_itr, const bool v, bool d = false,
+               const size_t nt = 1, const bool acc = false) :
     MIN_PROB(mp), tolerance(tol), max_iterations(max_itr),
-    VERBOSE(v), DEBUG(d) {}
+    VERBOSE(v), DEBUG(d), n_threads(nt), ACCELERATE(acc) {}
 
   /***************************/
   /* for multiple replicates */
@@ -153,6 +154,23 @@ private:
                          std::vector<std::pair<double, double> > &b,
        const std::vector<bool> &array_status) const;
 
+  /* forward and backward over the segments between reset points, in
+     parallel; the score of each segment is kept in "scores" and the
+     total is added in the order of the segments */
+  double
+  forward_backward_rep(
+       const std::vector<std::vector<std::pair<double, double> > > &vals,
+                       const std::vector<size_t> &reset_points,
+                       const double lp_sf, const double lp_sb,
+                       const double lp_ff, const double lp_fb, const double lp_ft,
+                       const double lp_bf, const double lp_bb, const double lp_bt,
+                       const std::vector<std::unique_ptr<EmissionDistribution> > &fg_distro,
+                       const std::vector<std::unique_ptr<EmissionDistribution> > &bg_distro,
+                       std::vector<std::pair<double, double> > &f,
+                       std::vector<std::pair<double, double> > &b,
+                       std::vector<double> &scores,
+       const std::vector<bool> &array_status) const;
+
   void
   estimate_transitions_rep(
          const std::vector<std::vector<std::pair<double, double> > > &vals,
@@ -248,6 +266,8 @@ private:
   size_t max_iterations;
   bool VERBOSE;
   bool DEBUG;
+  size_t n_threads;
+  bool ACCELERATE; // training with SQUAREM, see squarem.hpp
 
   mutable size_t emission_correction_count;
 };
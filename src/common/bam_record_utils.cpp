@@ -936,6 +936,44 @@ get_seq_str(const bam_rec &aln, string &seq_str) {
   }
 }
 
+// the base_code for each 4-bit base in "=ACMGRSVTWYHKDBN"
+static const uint8_t nt16_to_code[] = {
+  base_other, base_a, base_c, base_other, base_g, base_other, base_other,
+  base_other, base_t, base_other, base_other, base_other, base_other,
+  base_other, base_other, base_n
+};
+
+// the codes for both bases in each byte of a packed sequence
+struct base_pair_table {
+  base_pair_table() {
+    for (size_t i = 0; i < 256; ++i) {
+      codes[i][0] = nt16_to_code[i >> 4];
+      codes[i][1] = nt16_to_code[i & 15];
+    }
+  }
+  uint8_t codes[256][2];
+};
+static const base_pair_table base_pairs;
+
+void
+decode_bases(const uint8_t *seq, const size_t qpos, size_t n,
+             uint8_t *codes) {
+  if (n == 0) return;
+  seq += qpos/2;
+  // a base in the low 4 bits is the second of its byte
+  if (qpos & 1) {
+    *codes++ = nt16_to_code[*seq++ & 15];
+    --n;
+  }
+  for (; n >= 2; n -= 2) {
+    const uint8_t *pair = base_pairs.codes[*seq++];
+    *codes++ = pair[0];
+    *codes++ = pair[1];
+  }
+  if (n > 0)
+    *codes = nt16_to_code[*seq >> 4];
+}
+
 string
 to_string(const bam_header &hdr, const bam_rec &aln) {
   kstring_t ks = {0, 0, NULL};
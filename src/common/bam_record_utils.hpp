@@ -30,6 +30,8 @@
 #include <bamxx.hpp>
 
 #include <string>
+#include <algorithm>
+#include <cstdint>
 
 #ifdef bam_is_rev
 #undef bam_is_rev
@@ -170,6 +172,57 @@ apply_cigar(const bamxx::bam_rec &aln, std::string &to_inflate,
 void
 get_seq_str(const bamxx::bam_rec &aln, std::string &seq_str);
 
+/* Codes for the bases of reads, so that counts can be kept in arrays
+   indexed by the base. Any base in the read that is not A, C, G, T or
+   N gets base_other. */
+enum base_code : uint8_t {
+  base_a = 0,
+  base_c = 1,
+  base_g = 2,
+  base_t = 3,
+  base_n = 4,
+  base_other = 5
+};
+
+/* Decode "n" bases of the packed read sequence "seq", starting at
+   "qpos", into "codes". This goes a byte, so two bases, at a time
+   through a table, instead of one base at a time with bam_seqi. */
+void
+decode_bases(const uint8_t *seq, const size_t qpos, size_t n,
+             uint8_t *codes);
+
+// bases decoded at a time by for_each_base and for_each_base_rev
+static const size_t decode_chunk_size = 256;
+
+/* Call "f" with the code of each of the "n" bases of the read starting
+   at "qpos". This is how the bases of an M operation in the cigar
+   should be visited. */
+template<class F> inline void
+for_each_base(const uint8_t *seq, size_t qpos, size_t n, F f) {
+  uint8_t codes[decode_chunk_size];
+  while (n > 0) {
+    const size_t k = std::min(n, decode_chunk_size);
+    decode_bases(seq, qpos, k, codes);
+    for (size_t i = 0; i < k; ++i) f(codes[i]);
+    qpos += k;
+    n -= k;
+  }
+}
+
+/* Same as for_each_base, but backward starting from the base before
+   "qpos", for reads where the query is visited from its end. */
+template<class F> inline void
+for_each_base_rev(const uint8_t *seq, size_t qpos, size_t n, F f) {
+  uint8_t codes[decode_chunk_size];
+  while (n > 0) {
+    const size_t k = std::min(n, decode_chunk_size);
+    qpos -= k;
+    decode_bases(seq, qpos, k, codes);
+    for (size_t i = k; i > 0; --i) f(codes[i - 1]);
+    n -= k;
+  }
+}
+
 inline bool
 are_mates(const bamxx::bam_rec &one, const bamxx::bam_rec &two) {
   return one.b->core.mtid == two.b->core.tid &&
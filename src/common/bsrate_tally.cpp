@@ -0,0 +1,163 @@
+/* Copyright (C) 2014-2023 University of Southern California and
+ *                         Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith and Guilherme Sena
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "bsrate_tally.hpp"
+#include "dnmt_error.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <numeric>
+
+using std::accumulate;
+using std::cerr;
+using std::endl;
+using std::max;
+using std::string;
+using std::vector;
+
+bsrate_tally &
+bsrate_tally::operator+=(const bsrate_tally &rhs) {
+  const auto add_to = [](vector<size_t> &a, const vector<size_t> &b) {
+    std::transform(begin(a), end(a), begin(b), begin(a),
+                   std::plus<size_t>());
+  };
+  add_to(unconv_pos, rhs.unconv_pos);
+  add_to(conv_pos, rhs.conv_pos);
+  add_to(unconv_neg, rhs.unconv_neg);
+  add_to(conv_neg, rhs.conv_neg);
+  add_to(err_pos, rhs.err_pos);
+  add_to(err_neg, rhs.err_neg);
+  hanging += rhs.hanging;
+  n_reads += rhs.n_reads;
+  return *this;
+}
+
+bool
+bsrate_tally::converged(const double precision) const {
+  const double cvt = accumulate(begin(conv_pos), end(conv_pos), 0ul) +
+                     accumulate(begin(conv_neg), end(conv_neg), 0ul);
+  const double total =
+    cvt + accumulate(begin(unconv_pos), end(unconv_pos), 0ul) +
+    accumulate(begin(unconv_neg), end(unconv_neg), 0ul);
+  if (total == 0.0) return false;
+  static const double z = 1.96;
+  const double rate = cvt / total;
+  return z * std::sqrt(rate * (1.0 - rate) / total) < precision;
+}
+
+void
+bsrate_tally::write(const string &outfile) const {
+  const vector<size_t> &ucvt_count_p = unconv_pos;
+  const vector<size_t> &cvt_count_p = conv_pos;
+  const vector<size_t> &ucvt_count_n = unconv_neg;
+  const vector<size_t> &cvt_count_n = conv_neg;
+  const vector<size_t> &err_p = err_pos;
+  const vector<size_t> &err_n = err_neg;
+
+  // Get some totals first
+  const size_t pos_cvt = accumulate(begin(cvt_count_p), end(cvt_count_p), 0ul);
+  const size_t neg_cvt = accumulate(begin(cvt_count_n), end(cvt_count_n), 0ul);
+  const size_t total_cvt = pos_cvt + neg_cvt;
+
+  const size_t pos_ucvt =
+    accumulate(begin(ucvt_count_p), end(ucvt_count_p), 0ul);
+  const size_t neg_ucvt =
+    accumulate(begin(ucvt_count_n), end(ucvt_count_n), 0ul);
+  const size_t total_ucvt = pos_ucvt + neg_ucvt;
+
+  std::ofstream of;
+  if (!outfile.empty()) of.open(outfile.c_str());
+  std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
+  if (!out) throw dnmt_error("failed to open output file");
+
+  out << "OVERALL CONVERSION RATE = "
+      << static_cast<double>(total_cvt) / (total_cvt + total_ucvt) << endl
+      << "POS CONVERSION RATE = "
+      << static_cast<double>(pos_cvt) / (pos_cvt + pos_ucvt) << '\t'
+      << std::fixed << static_cast<size_t>(pos_cvt + pos_ucvt) << endl
+      << "NEG CONVERSION RATE = "
+      << static_cast<double>(neg_cvt) / (neg_cvt + neg_ucvt) << '\t'
+      << std::fixed << static_cast<size_t>(neg_cvt + neg_ucvt) << endl;
+
+  // clang-format off
+  out << "BASE" << '\t'
+      << "PTOT" << '\t'
+      << "PCONV" << '\t'
+      << "PRATE" << '\t'
+      << "NTOT" << '\t'
+      << "NCONV" << '\t'
+      << "NRATE" << '\t'
+      << "BTHTOT" << '\t'
+      << "BTHCONV" << '\t'
+      << "BTHRATE" << '\t'
+      << "ERR" << '\t'
+      << "ALL" << '\t'
+      << "ERRRATE"  << endl;
+  // clang-format on
+
+  // Figure out how many positions to print in the output, capped at 1000
+  size_t output_len = (ucvt_count_p.size() > 1000) ? 1000 : ucvt_count_p.size();
+
+  while (output_len > 0 &&
+         (ucvt_count_p[output_len - 1] + cvt_count_p[output_len - 1] +
+            ucvt_count_n[output_len - 1] + cvt_count_n[output_len - 1] ==
+          0))
+    --output_len;
+
+  // Now actually output the results
+  static const size_t precision_val = 5;
+  for (size_t i = 0; i < output_len; ++i) {
+    const size_t total_p = ucvt_count_p[i] + cvt_count_p[i];
+    const size_t total_n = ucvt_count_n[i] + cvt_count_n[i];
+    const size_t total_valid = total_p + total_n;
+    out << (i + 1) << "\t";
+
+    out.precision(precision_val);
+    out << total_p << '\t' << cvt_count_p[i] << '\t'
+        << static_cast<double>(cvt_count_p[i]) / max(size_t(1ul), total_p)
+        << '\t';
+
+    out.precision(precision_val);
+    out << total_n << '\t' << cvt_count_n[i] << '\t'
+        << static_cast<double>(cvt_count_n[i]) / max(size_t(1ul), total_n)
+        << '\t';
+
+    const double total_cvt = cvt_count_p[i] + cvt_count_n[i];
+    out.precision(precision_val);
+    out << static_cast<size_t>(total_valid) << '\t'
+        << cvt_count_p[i] + cvt_count_n[i] << '\t'
+        << total_cvt / max(1ul, total_valid) << '\t';
+
+    const double total_err = err_p[i] + err_n[i];
+    out.precision(precision_val);
+    const size_t total = total_valid + err_p[i] + err_n[i];
+    out << err_p[i] + err_n[i] << '\t' << static_cast<size_t>(total) << '\t'
+        << total_err / max(1ul, total) << endl;
+  }
+}
+
+void
+bsrate_tally::warn_hanging() const {
+  if (hanging > 0)  // some overhanging reads
+    cerr << "Warning: hanging reads detected at chrom ends "
+         << "(N=" << hanging << ")" << endl
+         << "High numbers of hanging reads suggest mismatch "
+         << "between assembly provided here and that used for mapping"
+         << endl;
+}
@@ -0,0 +1,175 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef BSRATE_TALLY_HPP
+#define BSRATE_TALLY_HPP
+
+/* bsrate_tally has the counts that "bsrate" reports: at each position
+   in the fragments, for each strand, the number of reads converted and
+   unconverted at genomic cytosines, and the number with neither C nor
+   T. Tallies for different parts of the genome can be added together,
+   in any order. Reads are added through any chrom type that gives
+   size(), is_c(pos) and is_g(pos), like fasta_chrom (bsutils.hpp) or
+   GenomeIndex::chrom_view, so "counts" can make the same tally while it
+   goes over the reads. */
+
+#include "bam_record_utils.hpp"
+
+#include <bamxx.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+struct bsrate_tally {
+  // ASSUMED MAXIMUM LENGTH OF A FRAGMENT
+  static const size_t default_size = 10000;
+
+  explicit bsrate_tally(const size_t n = default_size) :
+    unconv_pos(n, 0ul), conv_pos(n, 0ul), unconv_neg(n, 0ul),
+    conv_neg(n, 0ul), err_pos(n, 0ul), err_neg(n, 0ul) {}
+
+  // the read must be T-rich; "chrom" is the one the read maps to
+  template<class C> void
+  add(const bool INCLUDE_CPGS, const C &chrom, const bamxx::bam_rec &aln) {
+    if (bam_is_rev(aln))
+      add_neg(INCLUDE_CPGS, chrom, aln);
+    else
+      add_pos(INCLUDE_CPGS, chrom, aln);
+    ++n_reads;
+  }
+
+  bsrate_tally &operator+=(const bsrate_tally &rhs);
+
+  /* True if the half width of the 95% confidence interval for the
+     overall conversion rate is below "precision". This uses the
+     normal approximation, which is fine with the number of bases
+     available after even a few thousand reads. */
+  bool converged(const double precision) const;
+
+  // write the report in the format of "bsrate"
+  void write(const std::string &outfile) const;
+
+  // warn on stderr if any reads hang off the end of a chrom
+  void warn_hanging() const;
+
+  std::vector<size_t> unconv_pos;
+  std::vector<size_t> conv_pos;
+  std::vector<size_t> unconv_neg;
+  std::vector<size_t> conv_neg;
+  std::vector<size_t> err_pos;
+  std::vector<size_t> err_neg;
+  size_t hanging{0};
+  size_t n_reads{0};
+
+private:
+  template<class C> void
+  add_pos(const bool INCLUDE_CPGS, const C &chrom, const bamxx::bam_rec &aln);
+  template<class C> void
+  add_neg(const bool INCLUDE_CPGS, const C &chrom, const bamxx::bam_rec &aln);
+
+  // "code" is a base_code
+  static void
+  count_base(const uint8_t code, const size_t fpos,
+             std::vector<size_t> &unconv, std::vector<size_t> &conv,
+             std::vector<size_t> &err) {
+    if (code == base_c)
+      ++unconv[fpos];
+    else if (code == base_t)
+      ++conv[fpos];
+    else if (code != base_n)
+      ++err[fpos];
+  }
+};
+
+template<class C> void
+bsrate_tally::add_pos(const bool INCLUDE_CPGS, const C &chrom,
+                      const bamxx::bam_rec &aln) {
+  /* iterate through reference, query/read and fragment */
+  const auto seq = bam_get_seq(aln);
+  const auto beg_cig = bam_get_cigar(aln);
+  const auto end_cig = beg_cig + get_n_cigar(aln);
+  auto rpos = get_pos(aln);
+  auto qpos = 0;
+  auto fpos = 0;
+
+  const decltype(rpos) chrom_lim = chrom.size() - 1;
+
+  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
+    const auto op = bam_cigar_op(*c_itr);
+    const auto n = bam_cigar_oplen(*c_itr);
+    if (cigar_eats_ref(op) && cigar_eats_query(op)) {
+      for_each_base(seq, qpos, n, [&](const uint8_t code) {
+        // ADS: past the end of the chrom there is no base to check
+        if (rpos > chrom_lim)
+          ++hanging;
+        else if (chrom.is_c(rpos) &&
+                 (rpos >= chrom_lim || !chrom.is_g(rpos + 1) || INCLUDE_CPGS))
+          count_base(code, fpos, unconv_pos, conv_pos, err_pos);
+        ++rpos;
+        ++fpos;
+      });
+      qpos += n;
+    }
+    else {
+      if (cigar_eats_query(op)) qpos += n;
+      if (cigar_eats_ref(op)) rpos += n;
+      if (cigar_eats_frag(op)) fpos += n;
+    }
+  }
+
+  assert(qpos == get_l_qseq(aln));
+}
+
+template<class C> void
+bsrate_tally::add_neg(const bool INCLUDE_CPGS, const C &chrom,
+                      const bamxx::bam_rec &aln) {
+  /* iterate backward over query/read positions but forward over
+     reference and fragment positions */
+  const auto seq = bam_get_seq(aln);
+  const auto beg_cig = bam_get_cigar(aln);
+  const auto end_cig = beg_cig + get_n_cigar(aln);
+  auto rpos = get_pos(aln);
+  auto qpos = get_l_qseq(aln);
+  auto fpos = 0;
+
+  const decltype(rpos) chrom_lim = chrom.size() - 1;
+
+  for (auto c_itr = beg_cig; c_itr != end_cig; ++c_itr) {
+    const auto op = bam_cigar_op(*c_itr);
+    const auto n = bam_cigar_oplen(*c_itr);
+    if (cigar_eats_ref(op) && cigar_eats_query(op)) {
+      for_each_base_rev(seq, qpos, n, [&](const uint8_t code) {
+        if (rpos > chrom_lim)
+          ++hanging;
+        else if (chrom.is_g(rpos) &&
+                 (rpos == 0 || !chrom.is_c(rpos - 1) || INCLUDE_CPGS))
+          count_base(code, fpos, unconv_neg, conv_neg, err_neg);
+        ++rpos;
+        ++fpos;
+      });
+      qpos -= n;
+    }
+    else {
+      if (cigar_eats_query(op)) qpos -= n;
+      if (cigar_eats_ref(op)) rpos += n;
+      if (cigar_eats_frag(op)) fpos += n;
+    }
+  }
+  assert(qpos == 0);
+}
+
+#endif
@@ -21,6 +21,7 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <cstdint>
 
 #include <GenomicRegion.hpp>
 #include <smithlab_utils.hpp>
@@ -51,6 +52,79 @@ is_cpg(const std::string &s, size_t i) {
 }
 
 
+/* The three functions below are used to determine the sequence
+   context of a cytosine. I am not sure if the DDG function is needed,
+   but it seems like if one considers strand, and the CHH is not
+   symmetric, then one needs this. Also, Qiang should be consulted on
+   this because he spent much time thinking about it in the context of
+   plants. */
+inline bool
+is_chh(const std::string &s, size_t i) {
+  return (i < (s.length() - 2)) &&
+    is_cytosine(s[i]) &&
+    !is_guanine(s[i + 1]) &&
+    !is_guanine(s[i + 2]);
+}
+
+
+inline bool
+is_ddg(const std::string &s, size_t i) {
+  return (i < (s.length() - 2)) &&
+    !is_cytosine(s[i]) &&
+    !is_cytosine(s[i + 1]) &&
+    is_guanine(s[i + 2]);
+}
+
+
+inline bool
+is_c_at_g(const std::string &s, size_t i) {
+  return (i < (s.length() - 2)) &&
+    is_cytosine(s[i]) &&
+    !is_cytosine(s[i + 1]) &&
+    !is_guanine(s[i + 1]) &&
+    is_guanine(s[i + 2]);
+}
+
+
+/* The "tag" returned by this function should be exclusive, so that
+ * the order of checking conditions doesn't matter: 0 for CpG, 1 for
+ * CHH, 2 for CXG, 3 for CCG and 4 if the base is not C or G. There is
+ * also a bit of a hack in that the unsigned "pos" could wrap, but this
+ * still works as long as the chromosome size is not the maximum size
+ * of a size_t.
+ */
+inline uint32_t
+get_tag_from_genome(const std::string &s, const size_t pos) {
+  if (is_cytosine(s[pos])) {
+    if (is_cpg(s, pos)) return 0;
+    else if (is_chh(s, pos)) return 1;
+    else if (is_c_at_g(s, pos)) return 2;
+    else return 3;
+  }
+  if (is_guanine(s[pos])) {
+    if (is_cpg(s, pos - 1)) return 0;
+    else if (is_ddg(s, pos - 2)) return 1;
+    else if (is_c_at_g(s, pos - 2)) return 2;
+    else return 3;
+  }
+  return 4; // shouldn't be used for anything
+}
+
+/* fasta_chrom gives the same access to a chromosome sequence from a
+   FASTA file as GenomeIndex::chrom_view gives for a genome index, so
+   code that goes over the bases can use either one. The sequence must
+   be upper case. */
+struct fasta_chrom {
+  explicit fasta_chrom(const std::string &s) : seq{&s} {}
+  size_t size() const {return seq->size();}
+  bool is_c(const size_t pos) const {return is_cytosine((*seq)[pos]);}
+  bool is_g(const size_t pos) const {return is_guanine((*seq)[pos]);}
+  uint32_t tag(const size_t pos) const {
+    return get_tag_from_genome(*seq, pos);
+  }
+  const std::string *seq;
+};
+
 void
 adjust_region_ends(const std::vector<std::vector<GenomicRegion> > &clusters,
                    std::vector<GenomicRegion> &regions);
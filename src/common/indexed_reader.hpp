@@ -0,0 +1,110 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef INDEXED_READER_HPP
+#define INDEXED_READER_HPP
+
+/* For programs that give each thread parts of the genome, reading
+   them through the index of a BAM file. Each thread has its own
+   indexed_reader, since reading moves the position in the file, and
+   gets the reads of a region with an index_query. Exceptions can't
+   leave an OpenMP parallel region, so errors in threads go to a
+   first_error, which keeps the first one to throw after the region. */
+
+#include "dnmt_error.hpp"
+
+#include <bamxx.hpp>
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+class indexed_reader {
+public:
+  explicit indexed_reader(const std::string &filename) :
+    hts{filename}, hdr{hts} {
+    if (hts && hdr) idx = sam_index_load(hts.f, filename.c_str());
+  }
+  ~indexed_reader() {if (idx) hts_idx_destroy(idx);}
+  indexed_reader(const indexed_reader &) = delete;
+  indexed_reader &operator=(const indexed_reader &) = delete;
+
+  // false if the file, its header or its index could not be read
+  explicit operator bool() const {return idx != nullptr;}
+
+  /* Throws if "filename" has no index. This is done before the
+     parallel region, so the reason is clear and threads don't all
+     fail on it. */
+  static void check_index(const std::string &filename) {
+    if (!indexed_reader(filename))
+      throw dnmt_error("failed to load index for: " + filename);
+  }
+
+  bamxx::bam_in hts;
+  bamxx::bam_header hdr;
+  hts_idx_t *idx{};
+};
+
+
+// the reads overlapping [beg, end) on chrom "tid"
+class index_query {
+public:
+  index_query(indexed_reader &in, const int32_t tid, const hts_pos_t beg,
+              const hts_pos_t end) :
+    hts{in.hts}, itr{sam_itr_queryi(in.idx, tid, beg, end)} {
+    if (!itr) throw dnmt_error("failed to query index for tid: " +
+                               std::to_string(tid));
+  }
+  ~index_query() {hts_itr_destroy(itr);}
+  index_query(const index_query &) = delete;
+  index_query &operator=(const index_query &) = delete;
+
+  // false after the last read; throws if reading fails
+  bool next(bamxx::bam_rec &aln) {
+    const int ret = sam_itr_next(hts.f, itr, aln.b);
+    if (ret < -1) throw dnmt_error(ret, "failed reading from index iterator");
+    return ret >= 0;
+  }
+
+private:
+  bamxx::bam_in &hts;
+  hts_itr_t *itr;
+};
+
+
+/* Any thread can "set" an error and check if one has been set with
+   "failed", including in an ordered part of a loop, which is not
+   exclusive of the unordered part. Only the first message is kept, and
+   "check" throws it after the parallel region. */
+class first_error {
+public:
+  void set(const std::string &msg) {
+#pragma omp critical(first_error)
+    {
+      if (!error) {
+        the_msg = msg;
+        error = true;
+      }
+    }
+  }
+  bool failed() const {return error;}
+  void check() const {if (error) throw dnmt_error(the_msg);}
+
+private:
+  std::atomic<bool> error{false};
+  std::string the_msg;
+};
+
+#endif
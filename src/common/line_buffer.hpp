@@ -0,0 +1,106 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef LINE_BUFFER_HPP
+#define LINE_BUFFER_HPP
+
+/* line_buffer is for formatting lines of output without iostreams.
+   The text is put in a buffer that is reused after "clear", so once
+   it has grown to the size of the largest output nothing is
+   allocated. Numbers are formatted exactly as std::ostream formats
+   them by default: integers in decimal and floating point values as
+   "%g" with precision 6. Several lines can be collected before they
+   are written, and "full" says when it's time to write them. */
+
+#include <string>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <type_traits>
+
+class line_buffer {
+public:
+  // when the buffer is this size, it should be written
+  static const size_t flush_size = 1 << 16;
+
+  const char *data() const {return buf.data();}
+  size_t size() const {return buf.size();}
+  bool empty() const {return buf.empty();}
+  bool full() const {return buf.size() >= flush_size;}
+  void clear() {buf.clear();}
+
+  line_buffer &operator<<(const char c) {
+    buf.push_back(c);
+    return *this;
+  }
+  line_buffer &operator<<(const char *s) {
+    buf.append(s);
+    return *this;
+  }
+  line_buffer &operator<<(const std::string &s) {
+    buf.append(s);
+    return *this;
+  }
+
+  template<class T> typename
+  std::enable_if<std::is_integral<T>::value, line_buffer &>::type
+  operator<<(const T x) {
+    append_integer(x, std::is_signed<T>());
+    return *this;
+  }
+
+  line_buffer &operator<<(const double x) {
+    // ADS: "%g" with precision 6 prints integers below 1e6 the same
+    // as integers, and those are the most common values, so printf
+    // is only needed for the others (and for negative zero)
+    if (std::abs(x) < 1e6 && x == std::trunc(x) &&
+        !(x == 0.0 && std::signbit(x)))
+      append_integer(static_cast<int64_t>(x), std::true_type());
+    else {
+      char tmp[32];
+      const int n = std::snprintf(tmp, sizeof(tmp), "%g", x);
+      buf.append(tmp, n);
+    }
+    return *this;
+  }
+
+private:
+  template<class T> void
+  append_integer(const T x, std::true_type /* signed */) {
+    if (x < 0) {
+      buf.push_back('-');
+      // ADS: avoid overflow negating the smallest value
+      append_integer(0ull - static_cast<unsigned long long>(x),
+                     std::false_type());
+    }
+    else append_integer(static_cast<unsigned long long>(x),
+                        std::false_type());
+  }
+
+  void
+  append_integer(unsigned long long x, std::false_type /* unsigned */) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    do {
+      *--p = '0' + (x % 10);
+      x /= 10;
+    } while (x > 0);
+    buf.append(p, tmp + sizeof(tmp) - p);
+  }
+
+  std::string buf;
+};
+
+#endif
@@ -0,0 +1,74 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef READ_ARENA_HPP
+#define READ_ARENA_HPP
+
+/* read_arena holds a buffer of reads in records that are allocated
+   once and used again each time the buffer is emptied. A read is put
+   directly into the next free record, by reading or copying into
+   next(), and then counted with push(). Sorting is done on "order",
+   so the records are never copied or moved. The records are in a
+   deque so growing does not copy them. Once the arena is as large as
+   the largest buffer, nothing more is allocated. */
+
+#include <bamxx.hpp>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+struct read_arena {
+  size_t size() const {return n;}
+  bool empty() const {return n == 0;}
+  bamxx::bam_rec &operator[](const size_t i) {return recs[i];}
+
+  // the record to put the next read into
+  bamxx::bam_rec &next() {
+    if (n == recs.size()) recs.emplace_back();
+    return recs[n];
+  }
+  // the read in next() is now in the buffer
+  void push() {++n;}
+
+  /* Empty the buffer, keeping the records. A read already in next()
+     stays there, so it can be pushed as the first read of the new
+     buffer. */
+  void clear() {
+    if (n < recs.size()) std::swap(recs[0].b, recs[n].b);
+    n = 0;
+  }
+
+  // empty the buffer except for its last read, which becomes the first
+  void keep_last() {
+    if (n > 0) std::swap(recs[0].b, recs[n - 1].b);
+    n = std::min<size_t>(n, 1);
+  }
+
+  // free the records, for when the memory is needed for something else
+  void release() {
+    std::deque<bamxx::bam_rec>().swap(recs);
+    std::vector<uint32_t>().swap(order);
+    n = 0;
+  }
+
+  std::deque<bamxx::bam_rec> recs;
+  size_t n{};
+  std::vector<uint32_t> order;
+};
+
+#endif
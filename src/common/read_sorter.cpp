@@ -0,0 +1,183 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "read_sorter.hpp"
+#include "bam_record_utils.hpp"
+#include "dnmt_error.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <queue>
+
+using std::string;
+using std::vector;
+using std::unique_ptr;
+
+using bamxx::bam_rec;
+
+read_sorter::read_sorter(const bamxx::bam_header &hdr,
+                         const string &tmp_prefix, const size_t max_mem,
+                         bamxx::bam_tpool *tp) :
+  hdr{hdr}, tmp_prefix{tmp_prefix}, max_mem{max_mem}, tp{tp} {}
+
+
+read_sorter::~read_sorter() {remove_runs();}
+
+
+bool
+read_sorter::precedes(const bam_rec &a, const bam_rec &b) {
+  // ADS: unsigned so unmapped reads, with tid -1, go last
+  const uint32_t tid_a = get_tid(a), tid_b = get_tid(b);
+  if (tid_a != tid_b) return tid_a < tid_b;
+  if (get_pos(a) != get_pos(b)) return get_pos(a) < get_pos(b);
+  return bam_is_rev(a) < bam_is_rev(b);
+}
+
+
+void
+read_sorter::set_sorted(bamxx::bam_header &hdr) {
+  if (sam_hdr_update_hd(hdr.h, "SO", "coordinate") < 0 &&
+      sam_hdr_add_line(hdr.h, "HD", "VN", SAM_FORMAT_VERSION,
+                       "SO", "coordinate", nullptr) < 0)
+    throw dnmt_error("failed to set sort order in header");
+}
+
+
+bool
+read_sorter::write(const bam_rec &aln) {
+  // ADS: bam_copy1 reuses the memory already in the record
+  if (!bam_copy1(recs.next().b, aln.b)) return false;
+  recs.push();
+  mem += sizeof(bam1_t) + aln.b->l_data;
+  if (mem >= max_mem) spill();
+  return true;
+}
+
+
+void
+read_sorter::sort_records() {
+  auto &order = recs.order;
+  order.resize(recs.size());
+  for (uint32_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  std::stable_sort(begin(order), end(order),
+                   [this](const uint32_t a, const uint32_t b) {
+                     return precedes(recs[a], recs[b]);
+                   });
+}
+
+
+string
+read_sorter::next_run_name() {
+  return tmp_prefix + ".sort." + std::to_string(n_files++) + ".bam";
+}
+
+
+void
+read_sorter::spill() {
+  if (recs.empty()) return;
+  sort_records();
+  const string name = next_run_name();
+  runs.push_back(name);
+  bamxx::bam_out out(name, true);
+  if (!out || !out.write(hdr))
+    throw dnmt_error("failed to open temporary file: " + name);
+  if (tp) tp->set_io(out);
+  for (auto i : recs.order)
+    if (!out.write(hdr, recs[i]))
+      throw dnmt_error("failed writing temporary file: " + name);
+  recs.clear();
+  mem = 0;
+}
+
+
+void
+read_sorter::remove_runs() {
+  for (auto &&name : runs)
+    std::remove(name.c_str());
+  runs.clear();
+}
+
+
+void
+read_sorter::finish(read_sink &out) {
+  static const dnmt_error write_err{"failed writing sorted reads"};
+
+  if (runs.empty()) {  // all reads are in memory
+    sort_records();
+    for (auto i : recs.order)
+      if (!out.write(recs[i])) throw write_err;
+    recs.clear();
+    mem = 0;
+    return;
+  }
+  spill();
+  recs.release();  // memory is now for the runs
+
+  /* ADS: too many runs are merged in groups; a group has reads from
+     before any later run, so its merged run goes first to keep the
+     order of equal reads */
+  while (runs.size() > max_open_runs) {
+    const vector<string> group(begin(runs), begin(runs) + max_open_runs);
+    const string name = next_run_name();
+    {
+      bamxx::bam_out merged(name, true);
+      if (!merged || !merged.write(hdr))
+        throw dnmt_error("failed to open temporary file: " + name);
+      if (tp) tp->set_io(merged);
+      bam_file_sink merged_sink(merged, hdr);
+      merge(group, merged_sink);
+    }
+    for (auto &&g : group)
+      std::remove(g.c_str());
+    runs.erase(begin(runs), begin(runs) + max_open_runs);
+    runs.insert(begin(runs), name);
+  }
+  merge(runs, out);
+  remove_runs();
+}
+
+
+void
+read_sorter::merge(const vector<string> &names, read_sink &out) {
+  static const dnmt_error write_err{"failed writing sorted reads"};
+
+  // one read from each run; ties go to the earlier run
+  const size_t n_runs = names.size();
+  vector<unique_ptr<bamxx::bam_in>> ins;
+  vector<unique_ptr<bamxx::bam_header>> hdrs;
+  vector<bam_rec> heads(n_runs);
+  auto later = [&heads](const size_t a, const size_t b) {
+    return precedes(heads[b], heads[a]) ||
+      (!precedes(heads[a], heads[b]) && a > b);
+  };
+  std::priority_queue<size_t, vector<size_t>, decltype(later)> pq(later);
+  for (size_t i = 0; i < n_runs; ++i) {
+    ins.emplace_back(new bamxx::bam_in(names[i]));
+    if (!*ins[i])
+      throw dnmt_error("failed to open temporary file: " + names[i]);
+    hdrs.emplace_back(new bamxx::bam_header(*ins[i]));
+    if (!*hdrs[i]) throw dnmt_error("failed to read header: " + names[i]);
+    if (tp) tp->set_io(*ins[i]);
+    if (ins[i]->read(*hdrs[i], heads[i])) pq.push(i);
+  }
+  while (!pq.empty()) {
+    const size_t i = pq.top();
+    pq.pop();
+    if (!out.write(heads[i])) throw write_err;
+    if (ins[i]->read(*hdrs[i], heads[i])) pq.push(i);
+  }
+}
@@ -0,0 +1,88 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef READ_SORTER_HPP
+#define READ_SORTER_HPP
+
+/* read_sorter sorts reads by position using bounded memory. Reads
+   written to it are copied into records that are reused, and when they
+   take more than the memory limit they are sorted and written as a
+   "run" to a temporary BAM file. At the end, the runs are merged, so
+   each read is written once to a temporary file and read once from it,
+   unless there are so many runs that they must be merged in more than
+   one pass. If all the reads fit in memory, no temporary files are
+   made.
+
+   The order is the same as for "samtools sort": by chrom in the order
+   of the header, with unmapped reads last, then by position, then with
+   forward strand first, and otherwise in the order the reads came. */
+
+#include "read_arena.hpp"
+#include "read_stream.hpp"
+
+#include <bamxx.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+class read_sorter : public read_sink {
+public:
+  // default memory for records, as for "samtools sort -m"
+  static const size_t default_max_mem = 768ul << 20;
+  // runs merged at once, so the number of open files is limited
+  static const size_t max_open_runs = 256;
+
+  /* The header is used for the temporary files, which are named with
+     the prefix. The thread pool, if given, is used to compress and
+     decompress them. */
+  read_sorter(const bamxx::bam_header &hdr, const std::string &tmp_prefix,
+              const size_t max_mem = default_max_mem,
+              bamxx::bam_tpool *tp = nullptr);
+  ~read_sorter();
+  read_sorter(const read_sorter &) = delete;
+  read_sorter &operator=(const read_sorter &) = delete;
+
+  bool write(const bamxx::bam_rec &aln) override;
+
+  // write all the reads, sorted, to "out"; nothing more can be added
+  void finish(read_sink &out);
+
+  size_t n_runs() const {return runs.size();}
+
+  static bool precedes(const bamxx::bam_rec &a, const bamxx::bam_rec &b);
+
+  // mark the header as sorted by coordinate, as "samtools sort" does
+  static void set_sorted(bamxx::bam_header &hdr);
+
+private:
+  void sort_records();
+  std::string next_run_name();
+  void spill();
+  void merge(const std::vector<std::string> &names, read_sink &out);
+  void remove_runs();
+
+  const bamxx::bam_header &hdr;
+  std::string tmp_prefix;
+  size_t max_mem;
+  bamxx::bam_tpool *tp;
+
+  read_arena recs;
+  size_t mem{0};
+  std::vector<std::string> runs;
+  size_t n_files{0};
+};
+
+#endif
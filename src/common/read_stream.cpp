@@ -0,0 +1,97 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "read_stream.hpp"
+
+#include <utility>
+
+using std::unique_lock;
+using std::mutex;
+
+bool
+read_queue::push(read_batch &batch) {
+  unique_lock<mutex> lock(mtx);
+  cv.wait(lock, [&] {return closed || full.size() < max_batches;});
+  if (closed) return false;
+  full.push_back(std::move(batch));
+  if (!empty.empty()) {
+    batch = std::move(empty.back());
+    empty.pop_back();
+  }
+  else batch = read_batch();
+  batch.n = 0;
+  cv.notify_all();
+  return true;
+}
+
+
+bool
+read_queue::pop(read_batch &batch) {
+  unique_lock<mutex> lock(mtx);
+  if (!batch.recs.empty()) {
+    batch.n = 0;
+    empty.push_back(std::move(batch));
+    batch = read_batch();
+  }
+  cv.wait(lock, [&] {return closed || !full.empty();});
+  if (full.empty()) return false;
+  batch = std::move(full.front());
+  full.pop_front();
+  cv.notify_all();
+  return true;
+}
+
+
+void
+read_queue::close() {
+  unique_lock<mutex> lock(mtx);
+  closed = true;
+  cv.notify_all();
+}
+
+
+bool
+queue_sink::write(const bamxx::bam_rec &aln) {
+  if (closed) return false;
+  if (batch.n == batch.recs.size()) {
+    if (batch.recs.empty()) batch.recs.reserve(read_queue::batch_size);
+    batch.recs.emplace_back();
+  }
+  // ADS: this copies into memory the record already has, if enough
+  if (!bam_copy1(batch.recs[batch.n].b, aln.b)) return false;
+  return ++batch.n < read_queue::batch_size || q.push(batch);
+}
+
+
+void
+queue_sink::close() {
+  if (closed) return;
+  closed = true;
+  if (batch.n > 0) q.push(batch);
+  q.close();
+}
+
+
+bool
+queue_source::read(bamxx::bam_rec &aln) {
+  while (idx == batch.n) {
+    if (!q.pop(batch)) return false;
+    idx = 0;
+  }
+  // the record given up by "aln" is overwritten when the batch is used
+  // again, so nothing is copied here
+  std::swap(aln.b, batch.recs[idx++].b);
+  return true;
+}
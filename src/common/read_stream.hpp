@@ -0,0 +1,161 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef READ_STREAM_HPP
+#define READ_STREAM_HPP
+
+/* read_source and read_sink are where programs that work on mapped
+   reads get their reads and put them. These can be files, or another
+   program running in the same process, so that several steps like
+   format, uniq and counts can be done without writing the reads in
+   between.
+
+   For reads going between threads, read_queue holds them in batches.
+   The thread putting reads in the queue waits if too many batches are
+   waiting, so memory is bounded, and batches are used again after
+   they are read, so the records are not allocated again. */
+
+#include <bamxx.hpp>
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+class read_source {
+public:
+  virtual ~read_source() {}
+  // false if there are no more reads
+  virtual bool read(bamxx::bam_rec &aln) = 0;
+};
+
+
+class read_sink {
+public:
+  virtual ~read_sink() {}
+  // false if the read could not be written
+  virtual bool write(const bamxx::bam_rec &aln) = 0;
+};
+
+
+// reads from a SAM/BAM file, after the header has been read
+class bam_file_source : public read_source {
+public:
+  bam_file_source(bamxx::bam_in &hts, bamxx::bam_header &hdr) :
+    hts{hts}, hdr{hdr} {}
+  bool read(bamxx::bam_rec &aln) override {return hts.read(hdr, aln);}
+
+private:
+  bamxx::bam_in &hts;
+  bamxx::bam_header &hdr;
+};
+
+
+// writes to a SAM/BAM file, after the header has been written
+class bam_file_sink : public read_sink {
+public:
+  bam_file_sink(bamxx::bam_out &out, const bamxx::bam_header &hdr) :
+    out{out}, hdr{hdr} {}
+  bool write(const bamxx::bam_rec &aln) override {return out.write(hdr, aln);}
+
+private:
+  bamxx::bam_out &out;
+  const bamxx::bam_header &hdr;
+};
+
+
+// writes each read to two other sinks
+class read_tee : public read_sink {
+public:
+  read_tee(read_sink &a, read_sink &b) : a{a}, b{b} {}
+  bool write(const bamxx::bam_rec &aln) override {
+    return a.write(aln) && b.write(aln);
+  }
+
+private:
+  read_sink &a;
+  read_sink &b;
+};
+
+
+/* A batch has records that are allocated once and then overwritten;
+   only the first "n" are reads. */
+struct read_batch {
+  std::vector<bamxx::bam_rec> recs;
+  size_t n{0};
+};
+
+
+class read_queue {
+public:
+  static const size_t default_max_batches = 16;
+  static const size_t batch_size = 4096;
+
+  explicit read_queue(const size_t max_batches = default_max_batches) :
+    max_batches{max_batches} {}
+
+  /* Give a full batch to the queue and get an empty one in its place.
+     Returns false if the queue was closed, which means no more reads
+     will be taken from it. */
+  bool push(read_batch &batch);
+
+  /* Get the next batch, giving back the previous one so it can be
+     used again. Returns false when the queue is closed and empty. */
+  bool pop(read_batch &batch);
+
+  /* Nothing more goes in the queue. This is done by the thread putting
+     reads in when it is done, and by the thread taking reads out if
+     it stops early, so the other does not wait forever. */
+  void close();
+
+private:
+  const size_t max_batches;
+  bool closed{false};
+  std::deque<read_batch> full;
+  std::vector<read_batch> empty;
+  std::mutex mtx;
+  std::condition_variable cv;
+};
+
+
+// puts reads in a queue; "close" must be called after the last read
+class queue_sink : public read_sink {
+public:
+  explicit queue_sink(read_queue &q) : q{q} {}
+  ~queue_sink() {close();}
+  bool write(const bamxx::bam_rec &aln) override;
+  void close();
+
+private:
+  read_queue &q;
+  read_batch batch;
+  bool closed{false};
+};
+
+
+// takes reads from a queue, and closes it if stopped before the end
+class queue_source : public read_source {
+public:
+  explicit queue_source(read_queue &q) : q{q} {}
+  ~queue_source() {q.close();}
+  bool read(bamxx::bam_rec &aln) override;
+
+private:
+  read_queue &q;
+  read_batch batch;
+  size_t idx{0};
+};
+
+#endif
@@ -0,0 +1,65 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef SAMPLE_SEGMENTS_HPP
+#define SAMPLE_SEGMENTS_HPP
+
+/* For training an HMM on part of the genome and then decoding all of
+   it. sample_segments takes whole segments between reset points, in a
+   random order from "rng_seed", until they have at least "n_sites"
+   sites. The segments taken are kept in the order of the genome, so
+   the same seed and data always give the same training set. "sites"
+   gets the index of each site taken, and "sub_reset_points" the reset
+   points for the sites taken, to use with select_sites. */
+
+#include <vector>
+#include <random>
+#include <algorithm>
+
+inline void
+sample_segments(const std::vector<size_t> &reset_points, const size_t n_sites,
+                const size_t rng_seed, std::vector<size_t> &sites,
+                std::vector<size_t> &sub_reset_points) {
+  const size_t n_segments = reset_points.size() - 1;
+  std::vector<size_t> order(n_segments);
+  for (size_t i = 0; i < n_segments; ++i) order[i] = i;
+  auto eng = std::default_random_engine(rng_seed);
+  std::shuffle(begin(order), end(order), eng);
+
+  size_t total = 0, n_taken = 0;
+  while (n_taken < n_segments && total < n_sites) {
+    const size_t i = order[n_taken++];
+    total += reset_points[i + 1] - reset_points[i];
+  }
+  order.resize(n_taken);
+  std::sort(begin(order), end(order));
+
+  sites.clear();
+  sub_reset_points = {0};
+  for (auto &&i : order) {
+    for (size_t j = reset_points[i]; j < reset_points[i + 1]; ++j)
+      sites.push_back(j);
+    sub_reset_points.push_back(sites.size());
+  }
+}
+
+template<class T> void
+select_sites(const std::vector<size_t> &sites, const std::vector<T> &from,
+             std::vector<T> &to) {
+  to.resize(sites.size());
+  for (size_t i = 0; i < sites.size(); ++i) to[i] = from[sites[i]];
+}
+
+#endif
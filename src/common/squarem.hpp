@@ -0,0 +1,132 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef SQUAREM_HPP
+#define SQUAREM_HPP
+
+/* squarem runs EM with the SQUAREM extrapolation (Varadhan and Roland,
+   Scand J Stat 35:335-353, 2008; scheme S3). After two EM steps from x
+   it jumps along the path they took, with a step length from how much
+   the path bends, then does one more EM step from there. Each EM step
+   is one pass over the data.
+
+   The M-steps for the beta-binomials fit to methylation levels, not
+   the exact maximum, so the likelihood can go down a little even with
+   plain EM and cannot tell if a jump went wrong. Instead a jump is
+   only kept if one EM step from it moves the parameters less than the
+   second EM step moved them (the fixed point residual goes down).
+   Otherwise it goes on from the second EM step, as plain EM would,
+   having lost one pass, and the next jumps are shorter.
+
+   The parameters in "x" must be free to take any real value, like logs
+   of rates or logits of probabilities, so any jump gives parameters
+   that make sense. "em_step(x, x_next, converged)" must do one EM step
+   from "x", putting the new parameters in "x_next", and return the log
+   likelihood of "x". It sets "converged" by the test of the model,
+   and then "x" is the result. The return value is the log likelihood
+   of the result, or of the parameters before it when there are no
+   passes left, as in the plain EM loops. */
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+struct squarem_stats {
+  size_t passes{0};
+  size_t accepted{0};  // jumps kept
+  size_t rejected{0};  // jumps that moved away from the fixed point
+};
+
+template<class T> double
+squarem(T em_step, const size_t max_passes, std::vector<double> &x,
+        squarem_stats &stats) {
+  static const double step_factor = 4.0;
+
+  const size_t n = x.size();
+  std::vector<double> x1(n), x2(n), x_jump(n), x_next(n);
+  double step_max = 1.0;
+  double loglik = -std::numeric_limits<double>::max();
+  bool converged = false;
+
+  const auto dist_sq = [&](const std::vector<double> &a,
+                           const std::vector<double> &b) {
+    double d = 0.0;
+    for (size_t i = 0; i < n; ++i) d += (a[i] - b[i])*(a[i] - b[i]);
+    return d;
+  };
+
+  while (stats.passes < max_passes) {
+    loglik = em_step(x, x1, converged);
+    ++stats.passes;
+    if (converged) return loglik;
+    if (stats.passes == max_passes) {x.swap(x1); return loglik;}
+
+    loglik = em_step(x1, x2, converged);
+    ++stats.passes;
+    if (converged) {x.swap(x1); return loglik;}
+    if (stats.passes == max_passes) {x.swap(x2); return loglik;}
+
+    // r is the first step and v how the second differs from it
+    double r_sq = 0.0, v_sq = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+      const double r = x1[i] - x[i];
+      const double v = x2[i] - 2.0*x1[i] + x[i];
+      r_sq += r*r;
+      v_sq += v*v;
+    }
+    if (v_sq == 0.0) {x.swap(x2); continue;}
+    const double alpha =
+      std::max(-step_max, std::min(-1.0, -std::sqrt(r_sq/v_sq)));
+    for (size_t i = 0; i < n; ++i) {
+      const double r = x1[i] - x[i];
+      const double v = x2[i] - 2.0*x1[i] + x[i];
+      x_jump[i] = x[i] - 2.0*alpha*r + alpha*alpha*v;
+    }
+
+    const double loglik_jump = em_step(x_jump, x_next, converged);
+    ++stats.passes;
+    const bool closer = std::isfinite(loglik_jump) &&
+      dist_sq(x_next, x_jump) <= dist_sq(x2, x1);
+    // ADS: with alpha = -1 there was no jump, only the next EM step
+    if (closer || alpha == -1.0) {
+      if (alpha != -1.0) ++stats.accepted;
+      if (closer && alpha == -step_max) step_max *= step_factor;
+      loglik = loglik_jump;
+      if (converged) {x.swap(x_jump); return loglik;}
+      x.swap(x_next);
+    }
+    else {
+      ++stats.rejected;
+      step_max = std::max(1.0, step_max/step_factor);
+      converged = false;
+      x.swap(x2);
+    }
+  }
+  return loglik;
+}
+
+// to and from the free parameters for probabilities
+inline double
+squarem_logit(const double p) {return std::log(p/(1.0 - p));}
+
+inline double
+squarem_expit(const double x) {
+  // ADS: keeps jumps away from 0 and 1, where the HMMs would give up
+  static const double lim = 20.0;
+  return 1.0/(1.0 + std::exp(-std::max(-lim, std::min(lim, x))));
+}
+
+#endif
@@ -0,0 +1,67 @@
+/* Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef STREAM_STEPS_HPP
+#define STREAM_STEPS_HPP
+
+/* The steps of format, uniq, bsrate and counts that work on any
+   read_source or read_sink, so pipeline can run them one after
+   another without writing the reads in between. Each is defined with
+   its command. */
+
+#include "read_stream.hpp"
+
+#include <bamxx.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+// format-reads.cpp
+void
+check_format_input(const bool VERBOSE, const std::string &input_format,
+                   const std::string &infile);
+size_t
+get_read_name_suff_len(const bool VERBOSE, const std::string &infile,
+                       size_t suff_len, const size_t n_reads_to_check);
+void
+format_stream(read_source &in, read_sink &out,
+              const std::string &input_format, const size_t suff_len,
+              const int32_t max_frag_len, const size_t n_threads);
+
+// uniq.cpp
+void
+uniq_stream(const size_t the_seed, const bool add_dup_count,
+            const size_t n_targets, read_source &in, read_sink &out,
+            const std::string &statfile, const std::string &histfile);
+
+// bsrate.cpp
+void
+bsrate_stream(const bool VERBOSE, const bool INCLUDE_CPGS,
+              const bool reads_are_a_rich, const std::string &seq_to_use,
+              const std::vector<std::string> &names,
+              const std::vector<std::string> &chroms,
+              const bamxx::bam_header &hdr, read_source &in,
+              const std::string &outfile);
+
+// methcounts.cpp
+void
+counts_stream(const bool VERBOSE, const bool compress_output,
+              const bool CPG_ONLY, const std::vector<std::string> &names,
+              const std::vector<std::string> &seqs,
+              const bamxx::bam_header &hdr, read_source &in,
+              const std::string &outfile);
+
+#endif
@@ -86,6 +86,8 @@ main_methstates(int argc, const char **argv);
 int
 main_multimethstat(int argc, const char **argv);
 int
+main_pipeline(int argc, const char **argv);
+int
 main_pmd(int argc, const char **argv);
 int
 main_roimethstat(int argc, const char **argv);
@@ -110,6 +112,8 @@ main_fast_liftover(int argc, const char **argv);
 int
 main_format(int argc, const char **argv);
 int
+main_genome_index(int argc, const char **argv);
+int
 main_guessprotocol(int argc, const char **argv);
 int
 main_lc_approx(int argc, const char **argv);
@@ -154,7 +158,8 @@ main(int argc, const char **argv) {
    {"bsrate",    "compute the BS conversion rate from BS-seq reads mapped to a genome",  main_bsrate},
    {"counts",    "get methylation levels from mapped WGBS reads",             main_counts},
    {"sym",       "get CpG sites and make methylation levels symmetric",       main_symmetric_cpgs},
-   {"levels",    "compute methylation summary statistics from a counts file", main_levels}}}},
+   {"levels",    "compute methylation summary statistics from a counts file", main_levels},
+   {"pipeline",  "run format, uniq, bsrate and counts in one process",       main_pipeline}}}},
 
 {"methylome analysis",
  {{{"hmr",       "identify hypomethylated regions", main_hmr},
@@ -185,6 +190,7 @@ main(int argc, const char **argv) {
 
 {"utilities",
  {{{"cleanhp",       "fix and stat invdup/hairping reads", main_clean_hairpins},
+   {"genome-index",  "make a binary index of a reference genome for fast loading", main_genome_index},
    {"guessprotocol", "guess whether protocol is ordinary, pbat or random", main_guessprotocol},
    {"lc",            "approximate line counts in a file", main_lc_approx},
    {"merge-bsrate",  "merge bisulfite conversion rates files from bsrate", main_merge_bsrate},
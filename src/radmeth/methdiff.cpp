@@ -30,6 +30,7 @@
 #include "smithlab_utils.hpp"
 
 #include "MSite.hpp"
+#include "line_buffer.hpp"
 
 using std::cerr;
 using std::cout;
@@ -80,12 +81,12 @@ test_greater_population(const size_t meth_a, const size_t unmeth_a,
   return exp(p);
 }
 
-template<class T> T &
-write_methdiff_site(T &out, const MSite &a, const MSite &b,
-                    const double diffscore) {
-  std::ostringstream oss;
+static void
+format_methdiff_site(line_buffer &buf, const MSite &a, const MSite &b,
+                     const double diffscore) {
+  buf.clear();
   // clang-format off
-  oss << a.chrom << '\t'
+  buf << a.chrom << '\t'
       << a.pos << '\t'
       << a.strand << '\t'
       << a.context << '\t'
@@ -95,25 +96,14 @@ write_methdiff_site(T &out, const MSite &a, const MSite &b,
       << b.n_meth() << '\t'
       << b.n_unmeth() << '\n';
   // clang-format on
-  return out << oss.str();
 }
 
-bgzf_file &
-write_methdiff_site(bgzf_file &out, const MSite &a, const MSite &b,
+template<class T> T &
+write_methdiff_site(T &out, const MSite &a, const MSite &b,
                     const double diffscore) {
-  std::ostringstream oss;
-  // clang-format off
-  oss << a.chrom << '\t'
-      << a.pos << '\t'
-      << a.strand << '\t'
-      << a.context << '\t'
-      << diffscore << '\t'
-      << a.n_meth() << '\t'
-      << a.n_unmeth() << '\t'
-      << b.n_meth() << '\t'
-      << b.n_unmeth() << '\n';
-  // clang-format on
-  out.write(oss.str());
+  thread_local line_buffer buf;
+  format_methdiff_site(buf, a, b, diffscore);
+  out.write(buf.data(), buf.size());
   return out;
 }
 
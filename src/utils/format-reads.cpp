@@ -48,6 +48,10 @@
 // from dnmtools
 #include "bam_record_utils.hpp"
 #include "dnmt_error.hpp"
+#include "read_arena.hpp"
+#include "read_sorter.hpp"
+#include "read_stream.hpp"
+#include "stream_steps.hpp"
 
 using std::cerr;
 using std::endl;
@@ -301,17 +305,144 @@ same_name(const bamxx::bam_rec &a, const bam_rec &b, const size_t suff_len) {
   return !std::strncmp(bam_get_qname(a), bam_get_qname(b), a_l - suff_len);
 }
 
-static inline void
-swap(bam_rec &a, bam_rec &b) {
-  std::swap(a.b, b.b);
+/* A chunk is a range of reads in a batch that starts and ends where
+   the read name changes, so mates are never in different chunks and
+   chunks can be formatted in any order. The formatted reads are copied
+   into records that are used again for the next batch. */
+struct format_chunk {
+  size_t first{0};
+  size_t last{0};
+  read_arena out;
+};
+
+static void
+format_chunk_reads(const string &input_format, const size_t suff_len,
+                   const int32_t max_frag_len, read_arena &recs,
+                   format_chunk &c) {
+  static const dnmt_error bam_copy_err{"error copying bam record"};
+  const auto emit = [&c](bam_rec &aln) {
+    if (is_a_rich(aln)) flip_conversion(aln);
+    if (!bam_copy1(c.out.next().b, aln.b)) throw bam_copy_err;
+    c.out.push();
+  };
+
+  c.out.clear();
+  if (c.first == c.last) return;
+  for (size_t i = c.first; i < c.last; ++i)
+    standardize_format(input_format, recs[i]);
+
+  // ADS: same steps as reading one at a time, with "prev" and "curr"
+  // the indexes of the records that would be in prev_aln and aln
+  bool previous_was_merged = false;
+  size_t prev = c.first;
+  for (size_t i = c.first + 1; i < c.last; ++i) {
+    size_t curr = i;
+    if (same_name(recs[prev], recs[curr], suff_len)) {
+      // below: essentially check for dovetail
+      if (!bam_is_rev(recs[curr])) std::swap(prev, curr);
+      bam_rec &merged = c.out.next();
+      const auto frag_len =
+        merge_mates(max_frag_len, recs[prev], recs[curr], merged);
+      if (frag_len > 0 && frag_len < max_frag_len) {
+        if (is_a_rich(merged)) flip_conversion(merged);
+        c.out.push();
+      }
+      else {
+        emit(recs[prev]);
+        emit(recs[curr]);
+      }
+      previous_was_merged = true;
+    }
+    else {
+      if (!previous_was_merged) emit(recs[prev]);
+      previous_was_merged = false;
+    }
+    prev = curr;
+  }
+  if (!previous_was_merged) emit(recs[prev]);
+}
+
+/* Format the reads from "in" and write them to "out". This is the
+   part of format that can also be done on reads in memory (see
+   pipeline.cpp), so the input must already be checked.
+
+   Reads are taken in batches, and each batch is cut into chunks that
+   are formatted by different threads. The chunks are written in order,
+   so the output does not depend on the number of threads. */
+void
+format_stream(read_source &in, read_sink &out, const string &input_format,
+              const size_t suff_len, const int32_t max_frag_len,
+              const size_t n_threads) {
+  static const dnmt_error bam_write_err{"error writing bam"};
+  static const size_t batch_size = 1ul << 16;
+  // ADS: more chunks than threads, as chunks take different time
+  static const size_t chunks_per_thread = 4;
+
+  const size_t n_workers = std::max<size_t>(n_threads, 1);
+  const size_t n_chunks = n_workers * chunks_per_thread;
+  vector<format_chunk> chunks(n_chunks);
+  read_arena recs;
+  bool more_reads = true;
+  while (more_reads) {
+    // after the batch is full, read until the name changes
+    while (true) {
+      if (!in.read(recs.next())) {
+        more_reads = false;
+        break;
+      }
+      recs.push();
+      const size_t n = recs.size();
+      if (n > batch_size && !same_name(recs[n - 2], recs[n - 1], suff_len))
+        break;
+    }
+    const size_t n = recs.size();
+    if (n == 0) break;
+    // the last read is kept for the next batch, as its mate might not
+    // have been read yet
+    const size_t end = more_reads ? n - 1 : n;
+
+    // chunks of about the same size, each ending where the name changes
+    const size_t chunk_size = (end + n_chunks - 1) / n_chunks;
+    size_t start = 0;
+    for (auto &c : chunks) {
+      c.first = start;
+      start = std::min(start + chunk_size, end);
+      while (start < end && same_name(recs[start - 1], recs[start], suff_len))
+        ++start;
+      c.last = start;
+    }
+
+    string error_msg;
+#pragma omp parallel for schedule(dynamic, 1) num_threads(n_workers)
+    for (size_t i = 0; i < n_chunks; ++i) {
+      try {
+        format_chunk_reads(input_format, suff_len, max_frag_len, recs,
+                           chunks[i]);
+      }
+      catch (const std::exception &e) {
+#pragma omp critical
+        {
+          if (error_msg.empty()) error_msg = e.what();
+        }
+      }
+    }
+    if (!error_msg.empty()) throw dnmt_error(error_msg);
+
+    for (auto &c : chunks)
+      for (size_t i = 0; i < c.out.size(); ++i)
+        if (!out.write(c.out[i])) throw bam_write_err;
+
+    if (more_reads) recs.keep_last();
+  }
 }
 
+/* With "sort_mem" > 0 the output is sorted by position, using at most
+   about that much memory for reads and temporary files for the rest */
 static void
 format(const string &cmd, const size_t n_threads, const string &inputfile,
        const string &outfile, const bool bam_format, const string &input_format,
-       const size_t suff_len, const int32_t max_frag_len) {
-  static const dnmt_error bam_write_err{"error writing bam"};
-
+       const size_t suff_len, const int32_t max_frag_len,
+       const size_t sort_mem, const string &tmp_prefix) {
   bamxx::bam_tpool tp(n_threads);
 
   bamxx::bam_in hts(inputfile);  // assume already checked
@@ -323,6 +454,7 @@ format(const string &cmd, const size_t n_threads, const string &inputfile,
   bamxx::bam_header hdr_out(hdr);
   if (!hdr_out) throw dnmt_error("failed create header");
   hdr_out.add_pg_line(cmd, "DNMTOOLS", VERSION);
+  if (sort_mem > 0) read_sorter::set_sorted(hdr_out);
   if (!out.write(hdr_out)) throw dnmt_error("failed to write header");
 
   if (n_threads > 1) {
@@ -330,48 +462,55 @@ format(const string &cmd, const size_t n_threads, const string &inputfile,
     tp.set_io(out);
   }
 
-  bam_rec aln, prev_aln, merged;
-  bool previous_was_merged = false;
-
-  const bool empty_reads_file = !hts.read(hdr, aln);
-
-  if (!empty_reads_file) {
-    standardize_format(input_format, aln);
-
-    swap(aln, prev_aln);  // start with prev_aln being first read
+  bam_file_source in(hts, hdr);
+  bam_file_sink formatted(out, hdr);
+  if (sort_mem > 0) {
+    read_sorter sorter(hdr, tmp_prefix, sort_mem,
+                       n_threads > 1 ? &tp : nullptr);
+    format_stream(in, sorter, input_format, suff_len, max_frag_len,
+                  n_threads);
+    sorter.finish(formatted);
+  }
+  else
+    format_stream(in, formatted, input_format, suff_len, max_frag_len,
+                  n_threads);
+}
 
-    while (hts.read(hdr, aln)) {
-      standardize_format(input_format, aln);
-      if (same_name(prev_aln, aln, suff_len)) {
-        // below: essentially check for dovetail
-        if (!bam_is_rev(aln)) swap(prev_aln, aln);
-        const auto frag_len = merge_mates(max_frag_len, prev_aln, aln, merged);
-        if (frag_len > 0 && frag_len < max_frag_len) {
-          if (is_a_rich(merged)) flip_conversion(merged);
-          if (!out.write(hdr, merged)) throw bam_write_err;
-        }
-        else {
-          if (is_a_rich(prev_aln)) flip_conversion(prev_aln);
-          if (!out.write(hdr, prev_aln)) throw bam_write_err;
-          if (is_a_rich(aln)) flip_conversion(aln);
-          if (!out.write(hdr, aln)) throw bam_write_err;
-        }
-        previous_was_merged = true;
-      }
-      else {
-        if (!previous_was_merged) {
-          if (is_a_rich(prev_aln)) flip_conversion(prev_aln);
-          if (!out.write(hdr, prev_aln)) throw bam_write_err;
-        }
-        previous_was_merged = false;
-      }
-      swap(prev_aln, aln);
-    }
-    if (!previous_was_merged) {
-      if (is_a_rich(prev_aln)) flip_conversion(prev_aln);
-      if (!out.write(hdr, prev_aln)) throw bam_write_err;
-    }
+/* Check that the input can be formatted as paired-end, and get the
+   length of the read name suffix that identifies mates: the given
+   one is checked, or if it is 0 a value is guessed. */
+size_t
+get_read_name_suff_len(const bool VERBOSE, const string &infile,
+                       size_t suff_len, const size_t n_reads_to_check) {
+  if (suff_len == 0) {
+    size_t repeat_count = 0;
+    suff_len = guess_suff_len(infile, n_reads_to_check, repeat_count);
+    if (repeat_count > 1)
+      throw dnmt_error(
+        "failed to identify read name suffix length\n"
+        "verify reads are not single-end\n"
+        "specify read name suffix length directly");
+    if (VERBOSE)
+      cerr << "[read name suffix length guess: " << suff_len << "]" << endl;
   }
+  else if (!check_suff_len(infile, suff_len, n_reads_to_check))
+    throw dnmt_error("wrong read name suffix length [" +
+                     std::to_string(suff_len) + "] in: " + infile);
+  if (!check_sorted(infile, suff_len, n_reads_to_check))
+    throw dnmt_error("mates not consecutive in: " + infile);
+  return suff_len;
+}
+
+/* Make sure the input is SAM/BAM, and with VERBOSE warn if the header
+   does not mention the input format */
+void
+check_format_input(const bool VERBOSE, const string &input_format,
+                   const string &infile) {
+  check_input_file(infile);
+  if (VERBOSE)
+    if (!check_format_in_header(input_format, infile))
+      cerr << "[warning: input format not found in header "
+           << "(" << input_format << ", " << infile << ")]" << endl;
 }
 
 int
@@ -390,6 +529,9 @@ main_format(int argc, const char **argv) {
     bool VERBOSE = false;
     bool force = false;
     size_t n_threads = 1;
+    bool sort_output = false;
+    size_t sort_mem_mb = read_sorter::default_max_mem >> 20;
+    string tmp_prefix;
 
     const string description =
       "convert SAM/BAM mapped bs-seq reads "
@@ -417,6 +559,12 @@ main_format(int argc, const char **argv) {
                       "force formatting for "
                       "mixed single and paired reads",
                       false, force);
+    opt_parse.add_opt("sort", '\0', "sort output by position", false,
+                      sort_output);
+    opt_parse.add_opt("sort-mem", '\0', "memory for reads in MB when sorting "
+                      "before using temporary files", false, sort_mem_mb);
+    opt_parse.add_opt("tmp", 'T', "prefix for temporary files when sorting "
+                      "(default: output file)", false, tmp_prefix);
     opt_parse.add_opt("verbose", 'v', "print more information", false, VERBOSE);
     opt_parse.set_show_defaults();
     vector<string> leftover_args;
@@ -448,11 +596,17 @@ main_format(int argc, const char **argv) {
            << opt_parse.about_message() << endl;
       return EXIT_FAILURE;
     }
+    if (sort_output && sort_mem_mb == 0) {
+      cerr << "memory for sorting must be positive" << endl;
+      return EXIT_FAILURE;
+    }
     const string infile(leftover_args.front());
     if (leftover_args.size() == 2 && !use_stdout)
       outfile = leftover_args.back();
     else
       outfile = string("-");  // so htslib can write to stdout
+    if (tmp_prefix.empty())
+      tmp_prefix = use_stdout ? "format" : outfile;
     /****************** END COMMAND LINE OPTIONS *****************/
 
     std::ostringstream cmd;
@@ -466,39 +620,21 @@ main_format(int argc, const char **argv) {
            << "[output type: " << (bam_format ? "B" : "S") << "AM]" << endl
            << "[force formatting: " << (force ? "yes" : "no") << "]" << endl
            << "[threads requested: " << n_threads << "]" << endl
+           << "[sort output: " << (sort_output ? "yes" : "no") << "]" << endl
            << "[command line: \"" << cmd.str() << "\"]" << endl;
 
-    check_input_file(infile);
+    check_format_input(VERBOSE, input_format, infile);
 
-    if (VERBOSE)
-      if (!check_format_in_header(input_format, infile))
-        cerr << "[warning: input format not found in header "
-             << "(" << input_format << ", " << infile << ")]" << endl;
-
-    if (!single_end && !force) {
-      if (suff_len == 0) {
-        size_t repeat_count = 0;
-        suff_len = guess_suff_len(infile, n_reads_to_check, repeat_count);
-        if (repeat_count > 1)
-          throw dnmt_error(
-            "failed to identify read name suffix length\n"
-            "verify reads are not single-end\n"
-            "specify read name suffix length directly");
-        if (VERBOSE)
-          cerr << "[read name suffix length guess: " << suff_len << "]" << endl;
-      }
-      else if (!check_suff_len(infile, suff_len, n_reads_to_check))
-        throw dnmt_error("wrong read name suffix length [" +
-                         std::to_string(suff_len) + "] in: " + infile);
-      if (!check_sorted(infile, suff_len, n_reads_to_check))
-        throw dnmt_error("mates not consecutive in: " + infile);
-    }
+    if (!single_end && !force)
+      suff_len = get_read_name_suff_len(VERBOSE, infile, suff_len,
+                                        n_reads_to_check);
 
     if (VERBOSE && !single_end)
       cerr << "[readname suffix length: " << suff_len << "]" << endl;
 
     format(cmd.str(), n_threads, infile, outfile, bam_format, input_format,
-           suff_len, max_frag_len);
+           suff_len, max_frag_len, sort_output ? (sort_mem_mb << 20) : 0,
+           tmp_prefix);
   }
   catch (const std::exception &e) {
     cerr << e.what() << endl;
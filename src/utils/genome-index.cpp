@@ -0,0 +1,100 @@
+/* genome-index: make a binary index of a reference genome with the
+ *               sequence context of each base and the CpG positions
+ *
+ * Copyright (C) 2023 Andrew D. Smith
+ *
+ * Authors: Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "OptionParser.hpp"
+#include "smithlab_utils.hpp"
+#include "smithlab_os.hpp"
+
+#include "GenomeIndex.hpp"
+#include "dnmt_error.hpp"
+
+using std::string;
+using std::vector;
+using std::cerr;
+using std::endl;
+
+
+int
+main_genome_index(int argc, const char **argv) {
+
+  try {
+
+    static const string description =
+      "make a binary index of a reference genome that can be given in \
+       place of the FASTA file to counts, states, entropy, allelic, \
+       amrfinder and amrtester. The index holds the sequence, the \
+       context of each cytosine and the CpG positions, and is used \
+       directly from disk without parsing.";
+
+    bool VERBOSE = false;
+    string outfile;
+
+    /****************** COMMAND LINE OPTIONS ********************/
+    OptionParser opt_parse(strip_path(argv[0]), description,
+                           "<genome-fasta>");
+    opt_parse.add_opt("output", 'o', "output index file", true, outfile);
+    opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
+    vector<string> leftover_args;
+    opt_parse.parse(argc, argv, leftover_args);
+    if (argc == 1 || opt_parse.help_requested()) {
+      cerr << opt_parse.help_message() << endl
+           << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.about_requested()) {
+      cerr << opt_parse.about_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (opt_parse.option_missing()) {
+      cerr << opt_parse.option_missing_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    if (leftover_args.size() != 1) {
+      cerr << opt_parse.help_message() << endl;
+      return EXIT_SUCCESS;
+    }
+    const string genome_file = leftover_args.front();
+    /****************** END COMMAND LINE OPTIONS *****************/
+
+    if (VERBOSE)
+      cerr << "[making genome index for: " << genome_file << "]" << endl;
+
+    GenomeIndex::build(genome_file, outfile);
+
+    if (VERBOSE) {
+      const GenomeIndex index(outfile);
+      size_t total_size = 0, total_cpgs = 0;
+      for (size_t i = 0; i < index.n_chroms(); ++i) {
+        total_size += index.chrom(i).size();
+        total_cpgs += index.chrom(i).n_cpgs();
+      }
+      cerr << "[n chroms: " << index.n_chroms() << "]" << endl
+           << "[total size: " << total_size << "]" << endl
+           << "[total CpGs: " << total_cpgs << "]" << endl;
+    }
+  }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -33,6 +33,7 @@
 #include "smithlab_os.hpp"
 #include "GenomicRegion.hpp"
 #include "MSite.hpp"
+#include "BinaryMethylome.hpp"
 
 using std::string;
 using std::vector;
@@ -146,6 +147,22 @@ process_with_sites_on_disk(const string &sites_file,
 }
 
 
+template <class T>
+static void
+process_binary_sites(const string &sites_file,
+                     const vector<GenomicRegion> &regions, T &out) {
+  const BinaryMethylome sites(sites_file);
+  const BinaryMethylome::site_record *first = nullptr, *last = nullptr;
+  for (auto &&r: regions) {
+    const string chrom(r.get_chrom());
+    auto in_region = sites.query(chrom, r.get_start(), r.get_end());
+    while (in_region.next(first, last))
+      for (; first != last; ++first)
+        write_site(out, BinaryMethylome::get_site(chrom, *first));
+  }
+}
+
+
 static void
 regions_by_chrom(vector<GenomicRegion> &regions,
                  unordered_map<string, vector<GenomicRegion> > &lookup) {
@@ -226,6 +243,23 @@ main_selectsites(int argc, const char **argv) {
       cerr << "[number of regions merged due to overlap: "
            << n_orig_regions - regions.size() << "]" << endl;
 
+    // ADS: a binary methylome is always searched with its index
+    if (BinaryMethylome::is_binary_methylome(sites_file)) {
+      if (outfile.empty() || !has_gz_ext(outfile)) {
+        std::ofstream of;
+        if (!outfile.empty()) of.open(outfile);
+        std::ostream out(outfile.empty() ? cout.rdbuf() : of.rdbuf());
+        if (!outfile.empty() && !out)
+          throw runtime_error("failed to open output file: " + outfile);
+        process_binary_sites(sites_file, regions, out);
+      }
+      else {
+        bgzf_file out(outfile, "w");
+        process_binary_sites(sites_file, regions, out);
+      }
+      return EXIT_SUCCESS;
+    }
+
     unordered_map<string, vector<GenomicRegion>> regions_lookup;
     if ((outfile.empty() || !has_gz_ext(outfile)) && LOAD_ENTIRE_FILE)
       regions_by_chrom(regions, regions_lookup);
@@ -256,5 +290,9 @@ main_selectsites(int argc, const char **argv) {
     cerr << "ERROR: could not allocate memory" << endl;
     return EXIT_FAILURE;
   }
+  catch (const std::exception &e) {
+    cerr << e.what() << endl;
+    return EXIT_FAILURE;
+  }
   return EXIT_SUCCESS;
 }
@@ -31,6 +31,7 @@
 #include "smithlab_os.hpp"
 
 #include "MSite.hpp"
+#include "BinaryMethylome.hpp"
 
 using std::string;
 using std::cout;
@@ -76,6 +77,7 @@ main_symmetric_cpgs(int argc, const char **argv) {
   try {
 
     string outfile;
+    bool binary_output = false;
     // (not used) bool VERBOSE = false;
 
     const string description =
@@ -86,6 +88,8 @@ main_symmetric_cpgs(int argc, const char **argv) {
                            description, "<methcounts-file>");
     opt_parse.add_opt("output", 'o', "output file (default: stdout)",
                       false, outfile);
+    opt_parse.add_opt("binary", 'B', "output binary methylome format "
+                      "(requires -o)", false, binary_output);
     // opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     std::vector<string> leftover_args;
     opt_parse.parse(argc, argv, leftover_args);
@@ -112,7 +116,14 @@ main_symmetric_cpgs(int argc, const char **argv) {
     bgzf_file in(filename, "r");
     if (!in) throw std::runtime_error("could not open file: " + filename);
 
-    if (outfile.empty() || !has_gz_ext(outfile)) {
+    if (binary_output) {
+      if (outfile.empty())
+        throw std::runtime_error("binary output requires an output file");
+      BinaryMethylomeWriter out(outfile);
+      process_sites(in, out);
+      out.close();
+    }
+    else if (outfile.empty() || !has_gz_ext(outfile)) {
       std::ofstream of;
       if (!outfile.empty()) of.open(outfile.c_str());
       std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
@@ -123,7 +134,7 @@ main_symmetric_cpgs(int argc, const char **argv) {
       process_sites(in, out);
     }
   }
-  catch (const std::runtime_error &e)  {
+  catch (const std::exception &e)  {
     cerr << e.what() << endl;
     return EXIT_FAILURE;
   }
@@ -19,7 +19,9 @@
  */
 
 #include <cstdint>  // for [u]int[0-9]+_t
+#include <cstdio>
 #include <iostream>
+#include <memory>
 #include <random>
 #include <stdexcept>
 #include <string>
@@ -35,6 +37,10 @@
 #include "smithlab_os.hpp"
 #include "smithlab_utils.hpp"
 #include "bam_record_utils.hpp"
+#include "indexed_reader.hpp"
+#include "read_arena.hpp"
+#include "read_stream.hpp"
+#include "stream_steps.hpp"
 
 using std::cerr;
 using std::endl;
@@ -55,16 +61,24 @@ namespace uniq_random {
   // ADS: (TODO) refactor this
   bool initialized = false;
   std::default_random_engine e;
-  std::uniform_int_distribution<int> di;
   void initialize(const size_t the_seed) {
     e = std::default_random_engine(the_seed);
     initialized = true;
   }
-  int rand() {
+  int rand(std::default_random_engine &eng) {
     // ADS: should have same range as ordinary rand() by properties of
     // std::uniform_int_distribution default constructor.
-    // assert(initialized);
-    return di(e);
+    std::uniform_int_distribution<int> di;
+    return di(eng);
+  }
+  /* Each chrom gets its own engine when chroms are done in parallel,
+     seeded from the seed and the chrom so the reads kept do not
+     depend on the number of threads */
+  std::default_random_engine
+  chrom_engine(const size_t the_seed, const int32_t tid) {
+    std::seed_seq seq{static_cast<uint32_t>(the_seed),
+                      static_cast<uint32_t>(tid)};
+    return std::default_random_engine(seq);
   }
 }  // namespace uniq_random
 
@@ -75,8 +89,21 @@ struct rd_stats {  // keep track of good bases/reads in and out
     bases += get_l_qseq(b);
     ++reads;
   }
+  rd_stats &operator+=(const rd_stats &rhs) {
+    bases += rhs.bases;
+    reads += rhs.reads;
+    return *this;
+  }
 };
 
+// combine the histogram for one part of the input with the total
+static void
+add_hist(const vector<size_t> &part, vector<size_t> &hist) {
+  if (hist.size() < part.size()) hist.resize(part.size());
+  for (size_t i = 0; i < part.size(); ++i)
+    hist[i] += part[i];
+}
+
 static void
 write_stats_output(const rd_stats &rs_in, const rd_stats &rs_out,
                    const size_t reads_duped, const string &statfile) {
@@ -113,57 +140,118 @@ write_hist_output(const vector<size_t> &hist, const string &histfile) {
    end and strand, and is a contiguous subset of the "outer" buffer
    that shares the same end and strand. */
 static void
-process_inner_buffer(const bool add_dup_count,
-                     const vector<bam_rec>::iterator it,
-                     const vector<bam_rec>::iterator jt, bamxx::bam_header &hdr,
-                     bamxx::bam_out &out, rd_stats &rs_out, size_t &reads_duped,
+process_inner_buffer(const bool add_dup_count, std::default_random_engine &e,
+                     read_arena &buffer,
+                     const vector<uint32_t>::const_iterator it,
+                     const vector<uint32_t>::const_iterator jt, read_sink &out,
+                     rd_stats &rs_out, size_t &reads_duped,
                      vector<size_t> &hist) {
   constexpr char du_tag[2] = {'D', 'U'};
   const size_t n_reads = std::distance(it, jt);
-  const size_t selected = uniq_random::rand() % n_reads;
+  const size_t selected = uniq_random::rand(e) % n_reads;
+  bam_rec &aln = buffer[*(it + selected)];
 
   if (add_dup_count) {
-    const int ret = bam_aux_update_int(*(it + selected), du_tag, n_reads);
+    const int ret = bam_aux_update_int(aln, du_tag, n_reads);
     if (ret < 0) throw dnmt_error("error adding duplicate count aux field");
   }
 
-  if (!out.write(hdr, *(it + selected)))
+  if (!out.write(aln))
     throw runtime_error("failed writing bam record");
   if (hist.size() <= n_reads) hist.resize(n_reads + 1);
   hist[n_reads]++;
-  rs_out.update(*(it + selected));
+  rs_out.update(aln);
   reads_duped += (n_reads > 1);
 }
 
 /* The buffer corresponds to reads sharing the same mapping chromosome
    and start position. These are gathered and then processed together. */
 static void
-process_buffer(const bool add_dup_count, rd_stats &rs_out, size_t &reads_duped,
-               vector<size_t> &hist, vector<bam_rec> &buffer, bamxx::bam_header &hdr,
-               bamxx::bam_out &out) {
-  sort(begin(buffer), end(buffer), precedes_by_end_and_strand);
-  auto it(begin(buffer));
+process_buffer(const bool add_dup_count, std::default_random_engine &e,
+               rd_stats &rs_out, size_t &reads_duped,
+               vector<size_t> &hist, read_arena &buffer, read_sink &out) {
+  auto &order = buffer.order;
+  order.resize(buffer.size());
+  for (uint32_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  // ADS: same comparisons as sorting the reads, so the same order
+  sort(begin(order), end(order), [&buffer](const uint32_t a, const uint32_t b) {
+    return precedes_by_end_and_strand(buffer[a], buffer[b]);
+  });
+  auto it(begin(order));
   auto jt = it + 1;
-  for (; jt != end(buffer); ++jt)
-    if (!equivalent_end_and_strand(*it, *jt)) {
-      process_inner_buffer(add_dup_count, it, jt, hdr, out, rs_out, reads_duped,
-                           hist);
+  for (; jt != end(order); ++jt)
+    if (!equivalent_end_and_strand(buffer[*it], buffer[*jt])) {
+      process_inner_buffer(add_dup_count, e, buffer, it, jt, out, rs_out,
+                           reads_duped, hist);
       it = jt;
     }
-  process_inner_buffer(add_dup_count, it, jt, hdr, out, rs_out, reads_duped,
-                       hist);
+  process_inner_buffer(add_dup_count, e, buffer, it, jt, out, rs_out,
+                       reads_duped, hist);
   buffer.clear();
 }
 
-static void
-uniq(const bool VERBOSE, const bool add_dup_count, const size_t n_threads,
-     const string &cmd, const string &infile, const string &statfile,
-     const string &histfile, const bool bam_format, const string &outfile) {
+/* Remove duplicates from the reads in "in", which must be sorted, and
+   write the rest to "out". This is the part of uniq that can also be
+   done on reads in memory (see pipeline.cpp). */
+void
+uniq_stream(const size_t the_seed, const bool add_dup_count,
+            const size_t n_targets, read_source &in, read_sink &out,
+            const string &statfile, const string &histfile) {
+  // ADS: Random here is because we choose randomly when keeping one
+  // among duplicate reads.
+  uniq_random::initialize(the_seed);
+
   // values to tabulate stats; no real cost
   rd_stats rs_in, rs_out;
   size_t reads_duped = 0;
   vector<size_t> hist;
 
+  read_arena buffer;  // select output from this buffer
+  if (in.read(buffer.next())) {  // valid SAM/BAM can have 0 reads
+
+    rs_in.update(buffer.next());  // update stats for input we just got
+    buffer.push();
+
+    // to check that reads are sorted properly
+    vector<bool> chroms_seen(n_targets, false);
+    int32_t cur_chrom = get_tid(buffer[0]);
+
+    while (in.read(buffer.next())) {
+      const bam_rec &aln = buffer.next();
+      rs_in.update(aln);
+
+      // below works because buffer reset at every new chrom
+      if (precedes_by_start(aln, buffer[0]))
+        throw runtime_error("not sorted: " + get_qname(buffer[0]) + " " +
+                            get_qname(aln));
+
+      const int32_t chrom = get_tid(aln);
+      if (chrom != cur_chrom) {
+        if (chroms_seen[chrom]) throw runtime_error("input not sorted");
+        chroms_seen[chrom] = true;
+        cur_chrom = chrom;
+      }
+
+      // ADS: this keeps the new read, but "aln" is not valid after
+      if (!equivalent_chrom_and_start(buffer[0], aln))
+        process_buffer(add_dup_count, uniq_random::e, rs_out, reads_duped,
+                       hist, buffer, out);
+      buffer.push();
+    }
+    process_buffer(add_dup_count, uniq_random::e, rs_out, reads_duped, hist,
+                   buffer, out);
+  }
+  // write any additional output requested
+  write_stats_output(rs_in, rs_out, reads_duped, statfile);
+  write_hist_output(hist, histfile);
+}
+
+static void
+uniq(const bool VERBOSE, const size_t the_seed, const bool add_dup_count,
+     const size_t n_threads, const string &cmd, const string &infile,
+     const string &statfile, const string &histfile, const bool bam_format,
+     const string &outfile) {
   bamxx::bam_tpool tpool(n_threads);  // outer scope: must be destroyed last
 
   bamxx::bam_in hts(infile);
@@ -184,39 +272,319 @@ uniq(const bool VERBOSE, const bool add_dup_count, const size_t n_threads,
     tpool.set_io(out);
   }
 
-  bam_rec aln;
-  if (hts.read(hdr, aln)) {  // valid SAM/BAM can have 0 reads
-
-    rs_in.update(aln);  // update stats for input we just got
+  bam_file_source reads_in(hts, hdr);
+  bam_file_sink reads_out(out, hdr);
+  uniq_stream(the_seed, add_dup_count, get_n_targets(hdr), reads_in, reads_out,
+              statfile, histfile);
+}
 
-    vector<bam_rec> buffer(1, aln);  // select output from this buffer
+static string
+get_chrom_file_name(const string &tmp_prefix, const int32_t tid) {
+  return tmp_prefix + ".uniq.chrom." + std::to_string(tid) + ".bam";
+}
 
-    // to check that reads are sorted properly
-    vector<bool> chroms_seen(get_n_targets(hdr), false);
-    int32_t cur_chrom = get_tid(aln);
+/* Writes the reads kept from one chrom to a temporary BAM file, which
+   is only made if a read is kept, so chroms without reads do not make
+   files. */
+class chrom_file_sink : public read_sink {
+public:
+  chrom_file_sink(const string &name, const bamxx::bam_header &hdr) :
+    name{name}, hdr{hdr} {}
+  bool write(const bam_rec &aln) override {
+    if (!out) {
+      out.reset(new bamxx::bam_out(name, true));
+      if (!*out || !out->write(hdr)) return false;
+    }
+    return out->write(hdr, aln);
+  }
+  // true if the file was made, and so must be copied and removed
+  bool made() const {return out != nullptr;}
 
-    while (hts.read(hdr, aln)) {
-      rs_in.update(aln);
+private:
+  const string name;
+  const bamxx::bam_header &hdr;
+  std::unique_ptr<bamxx::bam_out> out;
+};
 
-      // below works because buffer reset at every new chrom
+/* Remove duplicates from the reads on chromosome "tid", getting them
+   through the index, and with the random choices made by an engine
+   that depends only on the seed and the chromosome. */
+static void
+uniq_chrom(const size_t the_seed, const bool add_dup_count,
+           indexed_reader &in, const int32_t tid, read_sink &out,
+           rd_stats &rs_in, rd_stats &rs_out, size_t &reads_duped,
+           vector<size_t> &hist) {
+  index_query reads(in, tid, 0, HTS_POS_MAX);
+  auto e = uniq_random::chrom_engine(the_seed, tid);
+  read_arena buffer;
+  while (reads.next(buffer.next())) {
+    const bam_rec &aln = buffer.next();
+    rs_in.update(aln);
+    if (!buffer.empty()) {
       if (precedes_by_start(aln, buffer[0]))
         throw runtime_error("not sorted: " + get_qname(buffer[0]) + " " +
                             get_qname(aln));
+      if (!equivalent_chrom_and_start(buffer[0], aln))
+        process_buffer(add_dup_count, e, rs_out, reads_duped, hist, buffer,
+                       out);
+    }
+    buffer.push();
+  }
+  if (!buffer.empty())
+    process_buffer(add_dup_count, e, rs_out, reads_duped, hist, buffer, out);
+}
 
-      const int32_t chrom = get_tid(aln);
-      if (chrom != cur_chrom) {
-        if (chroms_seen[chrom]) throw runtime_error("input not sorted");
-        chroms_seen[chrom] = true;
-        cur_chrom = chrom;
+/* This version of uniq gives each thread whole chromosomes, using the
+   index of the input BAM file. The reads kept for each chromosome go
+   to a temporary BAM file, so a thread can start on the next chrom
+   without waiting for the chroms before it to be written. When all
+   are done, the temporary files are copied to the output in the
+   order of the header, so the output is sorted, and is the same for
+   any number of threads. The stats and histogram are added up over
+   chromosomes. Memory does not depend on the number of reads, but
+   the disk needs room for the kept reads twice: once in the
+   temporary files and once in the output. */
+static void
+uniq_by_chrom(const bool VERBOSE, const size_t the_seed,
+              const bool add_dup_count, const size_t n_threads,
+              const string &cmd, const string &infile,
+              const string &statfile, const string &histfile,
+              const bool bam_format, const string &outfile,
+              const string &tmp_prefix) {
+  rd_stats rs_in, rs_out;
+  size_t reads_duped = 0;
+  vector<size_t> hist;
+
+  bamxx::bam_tpool tpool(n_threads);  // for copying the temporary files
+
+  bamxx::bam_in hts(infile);
+  if (!hts) throw dnmt_error("failed to open input file: " + infile);
+  bamxx::bam_header hdr(hts);
+  if (!hdr) throw dnmt_error("failed to read header");
+  indexed_reader::check_index(infile);
+
+  bamxx::bam_out out(outfile, bam_format);
+  {
+    bamxx::bam_header hdr_out(hdr);
+    if (!hdr_out) throw dnmt_error("failed create header");
+    hdr_out.add_pg_line(cmd, "DNMTOOLS", VERSION);
+    if (!out.write(hdr_out)) throw dnmt_error("failed to write header");
+  }
+  if (n_threads > 1) tpool.set_io(out);
+
+  const int32_t n_targets = get_n_targets(hdr);
+
+  // ADS: chars not bools, so threads can set them at the same time
+  vector<char> made_file(n_targets, 0);
+
+  first_error errors;
+
+#pragma omp parallel num_threads(n_threads)
+  {
+    indexed_reader in(infile);
+    if (!in) errors.set("failed to load index: " + infile);
+
+#pragma omp for schedule(dynamic, 1)
+    for (int32_t tid = 0; tid < n_targets; ++tid) {
+      rd_stats chrom_in, chrom_out;
+      size_t chrom_duped = 0;
+      vector<size_t> chrom_hist;
+      if (in && !errors.failed()) {
+        chrom_file_sink kept(get_chrom_file_name(tmp_prefix, tid), in.hdr);
+        try {
+          uniq_chrom(the_seed, add_dup_count, in, tid, kept, chrom_in,
+                     chrom_out, chrom_duped, chrom_hist);
+        }
+        catch (const std::exception &e) {
+          errors.set(e.what());
+        }
+        made_file[tid] = kept.made();
       }
+#pragma omp critical
+      {
+        rs_in += chrom_in;
+        rs_out += chrom_out;
+        reads_duped += chrom_duped;
+        add_hist(chrom_hist, hist);
+      }
+    }
+  }
 
-      if (!equivalent_chrom_and_start(buffer[0], aln))
-        process_buffer(add_dup_count, rs_out, reads_duped, hist, buffer, hdr,
-                       out);
-      buffer.push_back(aln);
+  try {
+    errors.check();
+    bam_rec aln;
+    for (int32_t tid = 0; tid < n_targets; ++tid) {
+      if (!made_file[tid]) continue;
+      if (VERBOSE)
+        cerr << "writing " << sam_hdr_tid2name(hdr, tid) << endl;
+      const string name(get_chrom_file_name(tmp_prefix, tid));
+      bamxx::bam_in part(name);
+      if (!part) throw dnmt_error("failed to open temporary file: " + name);
+      bamxx::bam_header part_hdr(part);
+      if (!part_hdr) throw dnmt_error("failed to read header: " + name);
+      if (n_threads > 1) tpool.set_io(part);
+      while (part.read(part_hdr, aln))
+        if (!out.write(hdr, aln))
+          throw dnmt_error("failed writing bam record");
+      std::remove(name.c_str());
+    }
+  }
+  catch (...) {
+    for (int32_t tid = 0; tid < n_targets; ++tid)
+      if (made_file[tid])
+        std::remove(get_chrom_file_name(tmp_prefix, tid).c_str());
+    throw;
+  }
+
+  // write any additional output requested
+  write_stats_output(rs_in, rs_out, reads_duped, statfile);
+  write_hist_output(hist, histfile);
+}
+
+/* The partition for a read when the input is not sorted: reads that
+   could be duplicates, with the same chrom, start, end and strand,
+   always go to the same partition. */
+static inline size_t
+get_partition(const bam_rec &aln, const size_t n_parts) {
+  uint64_t h = static_cast<uint32_t>(get_tid(aln));
+  h = (h << 32) ^ static_cast<uint64_t>(get_pos(aln));
+  h = h * 0x9e3779b97f4a7c15ull ^ static_cast<uint64_t>(bam_endpos(aln.b));
+  h = h * 0x9e3779b97f4a7c15ull ^ bam_is_rev(aln);
+  // ADS: final mixing as in splitmix64, so low bits depend on all
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return (h ^ (h >> 31)) % n_parts;
+}
+
+static inline bool
+precedes_by_start_end_and_strand(const bam_rec &a, const bam_rec &b) {
+  // ADS: unsigned so any unmapped reads go last, as in sorted input
+  const uint32_t tid_a = get_tid(a), tid_b = get_tid(b);
+  if (tid_a != tid_b) return tid_a < tid_b;
+  if (get_pos(a) != get_pos(b)) return get_pos(a) < get_pos(b);
+  return precedes_by_end_and_strand(a, b);
+}
+
+/* Remove duplicates from the reads in one partition. They are all read
+   into the arena and an order is sorted to bring duplicates together;
+   then each group of duplicates is handled the same way as for sorted
+   input. */
+static void
+process_partition(const bool add_dup_count, bamxx::bam_in &hts,
+                  bamxx::bam_header &hdr, read_arena &buffer, read_sink &out,
+                  rd_stats &rs_out, size_t &reads_duped,
+                  vector<size_t> &hist) {
+  buffer.clear();
+  while (hts.read(hdr, buffer.next()))
+    buffer.push();
+  if (buffer.empty()) return;
+
+  auto &order = buffer.order;
+  order.resize(buffer.size());
+  for (uint32_t i = 0; i < order.size(); ++i)
+    order[i] = i;
+  // ADS: stable, so equal reads keep the order they had in the input
+  std::stable_sort(begin(order), end(order),
+                   [&buffer](const uint32_t a, const uint32_t b) {
+                     return precedes_by_start_end_and_strand(buffer[a],
+                                                             buffer[b]);
+                   });
+  auto it(begin(order));
+  auto jt = it + 1;
+  for (; jt != end(order); ++jt)
+    if (!equivalent_chrom_and_start(buffer[*it], buffer[*jt]) ||
+        !equivalent_end_and_strand(buffer[*it], buffer[*jt])) {
+      process_inner_buffer(add_dup_count, uniq_random::e, buffer, it, jt, out,
+                           rs_out, reads_duped, hist);
+      it = jt;
+    }
+  process_inner_buffer(add_dup_count, uniq_random::e, buffer, it, jt, out,
+                       rs_out, reads_duped, hist);
+}
+
+static string
+get_partition_name(const string &tmp_prefix, const size_t i) {
+  return tmp_prefix + ".uniq." + std::to_string(i) + ".bam";
+}
+
+/* This version of uniq does not need sorted input. The reads are
+   written to temporary BAM files, "partitions", chosen by hashing the
+   chrom, start, end and strand, so all duplicates of a read are in the
+   same partition. Then each partition is read into memory and its
+   duplicates removed, so memory is about one partition of reads. The
+   kept reads are written in the order of the partitions, so the output
+   is not sorted, but it will be smaller to sort than the input. */
+static void
+uniq_unsorted(const bool VERBOSE, const size_t the_seed,
+              const bool add_dup_count, const size_t n_threads,
+              const string &cmd, const string &infile,
+              const string &statfile, const string &histfile,
+              const bool bam_format, const string &outfile,
+              const size_t n_parts, const string &tmp_prefix) {
+  uniq_random::initialize(the_seed);
+
+  rd_stats rs_in, rs_out;
+  size_t reads_duped = 0;
+  vector<size_t> hist;
+
+  bamxx::bam_tpool tpool(n_threads);  // outer scope: must be destroyed last
+
+  bamxx::bam_in hts(infile);
+  if (!hts) throw dnmt_error("failed to open input file: " + infile);
+  bamxx::bam_header hdr(hts);
+  if (!hdr) throw dnmt_error("failed to read header");
+  if (n_threads > 1) tpool.set_io(hts);
+
+  vector<string> part_names;
+  for (size_t i = 0; i < n_parts; ++i)
+    part_names.push_back(get_partition_name(tmp_prefix, i));
+
+  try {
+    {
+      vector<std::unique_ptr<bamxx::bam_out>> parts;
+      for (auto &&name : part_names) {
+        parts.emplace_back(new bamxx::bam_out(name, true));
+        if (!*parts.back() || !parts.back()->write(hdr))
+          throw dnmt_error("failed to open temporary file: " + name);
+      }
+      if (VERBOSE)
+        cerr << "[writing reads to " << n_parts << " partitions]" << endl;
+      bam_rec aln;
+      while (hts.read(hdr, aln)) {
+        rs_in.update(aln);
+        if (!parts[get_partition(aln, n_parts)]->write(hdr, aln))
+          throw dnmt_error("failed writing to temporary file");
+      }
+    }  // partitions closed here
+
+    bamxx::bam_out out(outfile, bam_format);
+    {
+      bamxx::bam_header hdr_out(hdr);
+      if (!hdr_out) throw dnmt_error("failed create header");
+      hdr_out.add_pg_line(cmd, "DNMTOOLS", VERSION);
+      if (!out.write(hdr_out)) throw dnmt_error("failed to write header");
+    }
+    if (n_threads > 1) tpool.set_io(out);
+    bam_file_sink reads_out(out, hdr);
+
+    read_arena buffer;
+    for (auto &&name : part_names) {
+      bamxx::bam_in part(name);
+      if (!part) throw dnmt_error("failed to open temporary file: " + name);
+      bamxx::bam_header part_hdr(part);
+      if (!part_hdr) throw dnmt_error("failed to read header: " + name);
+      if (n_threads > 1) tpool.set_io(part);
+      process_partition(add_dup_count, part, part_hdr, buffer, reads_out,
+                        rs_out, reads_duped, hist);
+      std::remove(name.c_str());
     }
-    process_buffer(add_dup_count, rs_out, reads_duped, hist, buffer, hdr, out);
   }
+  catch (...) {
+    for (auto &&name : part_names)
+      std::remove(name.c_str());
+    throw;
+  }
+
   // write any additional output requested
   write_stats_output(rs_in, rs_out, reads_duped, statfile);
   write_hist_output(hist, histfile);
@@ -230,6 +598,10 @@ main_uniq(int argc, const char **argv) {
     bool bam_format = false;
     bool add_dup_count = false;
     bool use_stdout = false;
+    bool by_chrom = false;
+    bool unsorted = false;
+    size_t n_parts = 64;
+    string tmp_prefix;
 
     // ADS: Not recommended to change this seed. It shouldn't matter
     // at all, and we want results to behave as deterministic.
@@ -256,6 +628,15 @@ main_uniq(int argc, const char **argv) {
     opt_parse.add_opt("stdout", '\0', "write to standard output", false,
                       use_stdout);
     opt_parse.add_opt("seed", 's', "random seed", false, the_seed);
+    opt_parse.add_opt("by-chrom", '\0', "process chromosomes in parallel "
+                      "(requires indexed BAM input)", false, by_chrom);
+    opt_parse.add_opt("unsorted", 'U', "input need not be sorted "
+                      "(uses temporary files)", false, unsorted);
+    opt_parse.add_opt("parts", '\0', "number of temporary files with "
+                      "-unsorted", false, n_parts);
+    opt_parse.add_opt("tmp", 'T', "prefix for temporary files with -unsorted "
+                      "or -by-chrom (default: output file)", false,
+                      tmp_prefix);
     opt_parse.add_opt("verbose", 'v', "print more run info", false, VERBOSE);
     opt_parse.set_show_defaults();
     vector<string> leftover_args;
@@ -276,17 +657,23 @@ main_uniq(int argc, const char **argv) {
            << opt_parse.about_message() << endl;
       return EXIT_SUCCESS;
     }
+    if (unsorted && by_chrom) {
+      cerr << "-unsorted and -by-chrom cannot be used together" << endl;
+      return EXIT_FAILURE;
+    }
+    if (unsorted && n_parts == 0) {
+      cerr << "number of temporary files must be positive" << endl;
+      return EXIT_FAILURE;
+    }
     const string infile(leftover_args.front());
     if (leftover_args.size() == 2 && !use_stdout)
       outfile = leftover_args.back();
     else
       outfile = string("-");  // so htslib can write to stdout
+    if (tmp_prefix.empty())
+      tmp_prefix = use_stdout ? "uniq" : outfile;
     /****************** END COMMAND LINE OPTIONS *****************/
 
-    // ADS: Random here is because we choose randomly when keeping one
-    // among duplicate reads.
-    uniq_random::initialize(the_seed);
-
     std::ostringstream cmd;
     copy(argv, argv + argc, std::ostream_iterator<const char *>(cmd, " "));
 
@@ -300,13 +687,24 @@ main_uniq(int argc, const char **argv) {
            << "[add duplicate count: " << (add_dup_count ? "yes" : "no") << "]"
            << endl
            << "[threads requested: " << n_threads << "]" << endl
+           << "[parallel by chrom: " << (by_chrom ? "yes" : "no") << "]" << endl
+           << "[unsorted input: " << (unsorted ? "yes" : "no") << "]" << endl
            << "[command line: \"" << cmd.str() << "\"]" << endl
            << "[random number seed: " << the_seed << "]" << endl;
 
-    uniq(VERBOSE, add_dup_count, n_threads, cmd.str(), infile, statfile,
-         histfile, bam_format, outfile);
+    if (unsorted)
+      uniq_unsorted(VERBOSE, the_seed, add_dup_count, n_threads, cmd.str(),
+                    infile, statfile, histfile, bam_format, outfile, n_parts,
+                    tmp_prefix);
+    else if (by_chrom)
+      uniq_by_chrom(VERBOSE, the_seed, add_dup_count, n_threads, cmd.str(),
+                    infile, statfile, histfile, bam_format, outfile,
+                    tmp_prefix);
+    else
+      uniq(VERBOSE, the_seed, add_dup_count, n_threads, cmd.str(), infile,
+           statfile, histfile, bam_format, outfile);
   }
-  catch (const runtime_error &e) {
+  catch (const std::exception &e) {
     cerr << e.what() << endl;
     return EXIT_FAILURE;
   }